@@ -13,6 +13,7 @@ LOCAL_SRC_FILES:= common/file_util.cc \
                   common/hdr_util.cc \
                   mkvparser/mkvparser.cc \
                   mkvparser/mkvreader.cc \
+                  mkvparser/prefetchingmkvreader.cc \
                   mkvmuxer/mkvmuxer.cc \
                   mkvmuxer/mkvmuxerutil.cc \
                   mkvmuxer/mkvwriter.cc
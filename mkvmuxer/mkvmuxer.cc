@@ -165,6 +165,35 @@ bool ChunkedCopy(mkvparser::IMkvReader* source, mkvmuxer::IMkvWriter* dst,
   return true;
 }
 
+///////////////////////////////////////////////////////////////
+//
+// FrameBuffer Class
+
+FrameBuffer::FrameBuffer(const uint8_t* data, uint64_t length,
+                         ReleaseFunction release, void* opaque)
+    : data_(data),
+      length_(length),
+      release_(release),
+      opaque_(opaque),
+      ref_count_(1) {}
+
+FrameBuffer* FrameBuffer::Create(const uint8_t* data, uint64_t length,
+                                 ReleaseFunction release, void* opaque) {
+  if (!data || length == 0)
+    return NULL;
+  return new (std::nothrow) FrameBuffer(data, length, release, opaque);
+}
+
+void FrameBuffer::AddRef() { ref_count_.fetch_add(1); }
+
+void FrameBuffer::Release() {
+  if (ref_count_.fetch_sub(1) != 1)
+    return;
+  if (release_)
+    release_(opaque_, data_);
+  delete this;
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // Frame Class
@@ -172,10 +201,15 @@ bool ChunkedCopy(mkvparser::IMkvReader* source, mkvmuxer::IMkvWriter* dst,
 Frame::Frame()
     : add_id_(0),
       additional_(NULL),
+      additional_storage_(NULL),
+      additional_storage_size_(0),
       additional_length_(0),
       duration_(0),
       duration_set_(false),
       frame_(NULL),
+      frame_storage_(NULL),
+      frame_storage_size_(0),
+      frame_buffer_(NULL),
       is_key_(false),
       length_(0),
       track_number_(0),
@@ -185,22 +219,23 @@ Frame::Frame()
       reference_block_timestamp_set_(false) {}
 
 Frame::~Frame() {
-  delete[] frame_;
-  delete[] additional_;
+  ReleaseFrame();
+  delete[] frame_storage_;
+  delete[] additional_storage_;
 }
 
 bool Frame::CopyFrom(const Frame& frame) {
-  delete[] frame_;
-  frame_ = NULL;
-  length_ = 0;
-  if (frame.length() > 0 && frame.frame() != NULL &&
-      !Init(frame.frame(), frame.length())) {
+  ReleaseFrame();
+  if (frame.frame_buffer_) {
+    frame.frame_buffer_->AddRef();
+    frame_buffer_ = frame.frame_buffer_;
+    frame_ = frame.frame_;
+    length_ = frame.length_;
+  } else if (frame.length() > 0 && frame.frame() != NULL &&
+             !Init(frame.frame(), frame.length())) {
     return false;
   }
-  add_id_ = 0;
-  delete[] additional_;
-  additional_ = NULL;
-  additional_length_ = 0;
+  ReleaseAdditional();
   if (frame.additional_length() > 0 && frame.additional() != NULL &&
       !AddAdditionalData(frame.additional(), frame.additional_length(),
                          frame.add_id())) {
@@ -217,33 +252,85 @@ bool Frame::CopyFrom(const Frame& frame) {
   return true;
 }
 
+void Frame::BorrowFrom(const Frame& frame) {
+  ReleaseFrame();
+  frame_ = frame.frame();
+  length_ = frame.length();
+  ReleaseAdditional();
+  additional_ = frame.additional();
+  additional_length_ = frame.additional_length();
+  add_id_ = frame.add_id();
+  duration_ = frame.duration();
+  duration_set_ = frame.duration_set();
+  is_key_ = frame.is_key();
+  track_number_ = frame.track_number();
+  timestamp_ = frame.timestamp();
+  discard_padding_ = frame.discard_padding();
+  reference_block_timestamp_ = frame.reference_block_timestamp();
+  reference_block_timestamp_set_ = frame.reference_block_timestamp_set();
+}
+
 bool Frame::Init(const uint8_t* frame, uint64_t length) {
-  uint8_t* const data =
-      new (std::nothrow) uint8_t[static_cast<size_t>(length)];  // NOLINT
-  if (!data)
+  if (!frame_storage_ || frame_storage_size_ < length) {
+    uint8_t* const data =
+        new (std::nothrow) uint8_t[static_cast<size_t>(length)];  // NOLINT
+    if (!data)
+      return false;
+
+    delete[] frame_storage_;
+    frame_storage_ = data;
+    frame_storage_size_ = length;
+  }
+
+  // Copy before dropping a shared buffer |frame| may point into.
+  memcpy(frame_storage_, frame, static_cast<size_t>(length));
+
+  ReleaseFrame();
+  frame_ = frame_storage_;
+  length_ = length;
+  return true;
+}
+
+bool Frame::InitBorrowed(const uint8_t* frame, uint64_t length) {
+  if (!frame || length == 0)
     return false;
 
-  delete[] frame_;
-  frame_ = data;
+  ReleaseFrame();
+  frame_ = frame;
   length_ = length;
+  return true;
+}
+
+bool Frame::InitShared(FrameBuffer* buffer) {
+  if (!buffer)
+    return false;
 
-  memcpy(frame_, frame, static_cast<size_t>(length_));
+  buffer->AddRef();
+  ReleaseFrame();
+  frame_buffer_ = buffer;
+  frame_ = buffer->data();
+  length_ = buffer->length();
   return true;
 }
 
 bool Frame::AddAdditionalData(const uint8_t* additional, uint64_t length,
                               uint64_t add_id) {
-  uint8_t* const data =
-      new (std::nothrow) uint8_t[static_cast<size_t>(length)];  // NOLINT
-  if (!data)
-    return false;
+  if (!additional_storage_ || additional_storage_size_ < length) {
+    uint8_t* const data =
+        new (std::nothrow) uint8_t[static_cast<size_t>(length)];  // NOLINT
+    if (!data)
+      return false;
+
+    delete[] additional_storage_;
+    additional_storage_ = data;
+    additional_storage_size_ = length;
+  }
+
+  memcpy(additional_storage_, additional, static_cast<size_t>(length));
 
-  delete[] additional_;
-  additional_ = data;
+  additional_ = additional_storage_;
   additional_length_ = length;
   add_id_ = add_id;
-
-  memcpy(additional_, additional, static_cast<size_t>(additional_length_));
   return true;
 }
 
@@ -278,6 +365,33 @@ void Frame::set_reference_block_timestamp(int64_t reference_block_timestamp) {
   reference_block_timestamp_set_ = true;
 }
 
+void Frame::Clear() {
+  ReleaseFrame();
+  ReleaseAdditional();
+  duration_ = 0;
+  duration_set_ = false;
+  is_key_ = false;
+  track_number_ = 0;
+  timestamp_ = 0;
+  discard_padding_ = 0;
+  reference_block_timestamp_ = 0;
+  reference_block_timestamp_set_ = false;
+}
+
+void Frame::ReleaseFrame() {
+  if (frame_buffer_)
+    frame_buffer_->Release();
+  frame_ = NULL;
+  frame_buffer_ = NULL;
+  length_ = 0;
+}
+
+void Frame::ReleaseAdditional() {
+  additional_ = NULL;
+  additional_length_ = 0;
+  add_id_ = 0;
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // CuePoint Class
@@ -2472,13 +2586,13 @@ Cluster::Cluster(uint64_t timecode, int64_t cues_pos, uint64_t timecode_scale,
 Cluster::~Cluster() {
   // Delete any stored frames that are left behind. This will happen if the
   // Cluster was not Finalized for whatever reason.
-  while (!stored_frames_.empty()) {
-    while (!stored_frames_.begin()->second.empty()) {
-      delete stored_frames_.begin()->second.front();
-      stored_frames_.begin()->second.pop_front();
-    }
-    stored_frames_.erase(stored_frames_.begin()->first);
+  for (size_t i = 0; i < stored_frames_.size(); ++i) {
+    std::deque<Frame*>& frames = stored_frames_[i].frames;
+    for (size_t j = 0; j < frames.size(); ++j)
+      delete frames[j];
   }
+  for (size_t i = 0; i < free_frames_.size(); ++i)
+    delete free_frames_[i];
 }
 
 bool Cluster::Init(IMkvWriter* ptr_writer) {
@@ -2497,7 +2611,7 @@ bool Cluster::AddFrame(const uint8_t* data, uint64_t length,
                        uint64_t track_number, uint64_t abs_timecode,
                        bool is_key) {
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.InitBorrowed(data, length))
     return false;
   frame.set_track_number(track_number);
   frame.set_timestamp(abs_timecode);
@@ -2514,7 +2628,7 @@ bool Cluster::AddFrameWithAdditional(const uint8_t* data, uint64_t length,
     return false;
   }
   Frame frame;
-  if (!frame.Init(data, length) ||
+  if (!frame.InitBorrowed(data, length) ||
       !frame.AddAdditionalData(additional, additional_length, add_id)) {
     return false;
   }
@@ -2529,7 +2643,7 @@ bool Cluster::AddFrameWithDiscardPadding(const uint8_t* data, uint64_t length,
                                          uint64_t track_number,
                                          uint64_t abs_timecode, bool is_key) {
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.InitBorrowed(data, length))
     return false;
   frame.set_discard_padding(discard_padding);
   frame.set_track_number(track_number);
@@ -2542,7 +2656,7 @@ bool Cluster::AddMetadata(const uint8_t* data, uint64_t length,
                           uint64_t track_number, uint64_t abs_timecode,
                           uint64_t duration_timecode) {
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.InitBorrowed(data, length))
     return false;
   frame.set_track_number(track_number);
   frame.set_timestamp(abs_timecode);
@@ -2564,21 +2678,15 @@ bool Cluster::Finalize(bool set_last_frame_duration, uint64_t duration) {
   if (write_last_frame_with_duration_) {
     // Write out held back Frames. This essentially performs a k-way merge
     // across all tracks in the increasing order of timestamps.
-    while (!stored_frames_.empty()) {
-      Frame* frame = stored_frames_.begin()->second.front();
-
+    while (!stored_frames_heap_.empty()) {
       // Get the next frame to write (frame with least timestamp across all
       // tracks).
-      for (FrameMapIterator frames_iterator = ++stored_frames_.begin();
-           frames_iterator != stored_frames_.end(); ++frames_iterator) {
-        if (frames_iterator->second.front()->timestamp() < frame->timestamp()) {
-          frame = frames_iterator->second.front();
-        }
-      }
+      const uint64_t track_number = stored_frames_heap_[0];
+      Frame* const frame = stored_frames_[track_number].frames.front();
 
       // Set the duration if it's the last frame for the track.
       if (set_last_frame_duration &&
-          stored_frames_[frame->track_number()].size() == 1 &&
+          stored_frames_[track_number].frames.size() == 1 &&
           !frame->duration_set()) {
         frame->set_duration(duration - frame->timestamp());
         if (!frame->is_key() && !frame->reference_block_timestamp_set()) {
@@ -2589,11 +2697,7 @@ bool Cluster::Finalize(bool set_last_frame_duration, uint64_t duration) {
 
       // Write the frame and remove it from |stored_frames_|.
       const bool wrote_frame = DoWriteFrame(frame);
-      stored_frames_[frame->track_number()].pop_front();
-      if (stored_frames_[frame->track_number()].empty()) {
-        stored_frames_.erase(frame->track_number());
-      }
-      delete frame;
+      PopStoredFrame(track_number);
       if (!wrote_frame)
         return false;
     }
@@ -2682,48 +2786,116 @@ bool Cluster::QueueOrWriteFrame(const Frame* const frame) {
   }
 
   // Queue the current frame.
-  uint64_t track_number = frame->track_number();
-  Frame* const frame_to_store = new Frame();
-  frame_to_store->CopyFrom(*frame);
-  stored_frames_[track_number].push_back(frame_to_store);
-
-  // Iterate through all queued frames in the current track except the last one
-  // and write it if it is okay to do so (i.e.) no other track has an held back
-  // frame with timestamp <= the timestamp of the frame in question.
-  std::vector<std::list<Frame*>::iterator> frames_to_erase;
-  for (std::list<Frame*>::iterator
-           current_track_iterator = stored_frames_[track_number].begin(),
-           end = --stored_frames_[track_number].end();
-       current_track_iterator != end; ++current_track_iterator) {
-    const Frame* const frame_to_write = *current_track_iterator;
-    bool okay_to_write = true;
-    for (FrameMapIterator track_iterator = stored_frames_.begin();
-         track_iterator != stored_frames_.end(); ++track_iterator) {
-      if (track_iterator->first == track_number) {
-        continue;
-      }
-      if (track_iterator->second.front()->timestamp() <
-          frame_to_write->timestamp()) {
-        okay_to_write = false;
-        break;
-      }
-    }
-    if (okay_to_write) {
-      const bool wrote_frame = DoWriteFrame(frame_to_write);
-      delete frame_to_write;
-      if (!wrote_frame)
-        return false;
-      frames_to_erase.push_back(current_track_iterator);
-    } else {
+  const uint64_t track_number = frame->track_number();
+  Frame* frame_to_store = NULL;
+  if (free_frames_.empty()) {
+    frame_to_store = new (std::nothrow) Frame();  // NOLINT
+    if (!frame_to_store)
+      return false;
+  } else {
+    frame_to_store = free_frames_.back();
+    free_frames_.pop_back();
+  }
+  if (!frame_to_store->CopyFrom(*frame)) {
+    delete frame_to_store;
+    return false;
+  }
+  if (track_number >= stored_frames_.size())
+    stored_frames_.resize(static_cast<size_t>(track_number) + 1);
+  std::deque<Frame*>& track_frames = stored_frames_[track_number].frames;
+  track_frames.push_back(frame_to_store);
+  if (track_frames.size() == 1)
+    UpdateStoredFramesHeap(track_number);
+
+  // Write the queued frames in the current track except the last one, as long
+  // as no other track has a held back frame with an earlier timestamp. The
+  // first frame of this track is in the heap too, so that is the case while
+  // the earliest frame of all has the same timestamp.
+  while (track_frames.size() > 1) {
+    const Frame* const frame_to_write = track_frames.front();
+    const uint64_t earliest_timestamp =
+        stored_frames_[stored_frames_heap_[0]].frames.front()->timestamp();
+    if (earliest_timestamp < frame_to_write->timestamp())
       break;
+    const bool wrote_frame = DoWriteFrame(frame_to_write);
+    PopStoredFrame(track_number);
+    if (!wrote_frame)
+      return false;
+  }
+  return true;
+}
+
+bool Cluster::StoredFramesBefore(uint64_t track_a, uint64_t track_b) const {
+  const uint64_t timestamp_a =
+      stored_frames_[track_a].frames.front()->timestamp();
+  const uint64_t timestamp_b =
+      stored_frames_[track_b].frames.front()->timestamp();
+  return timestamp_a < timestamp_b ||
+         (timestamp_a == timestamp_b && track_a < track_b);
+}
+
+void Cluster::UpdateStoredFramesHeap(uint64_t track_number) {
+  StoredFrames& track = stored_frames_[track_number];
+  int32_t index = track.heap_index;
+  if (!track.frames.empty()) {
+    if (index < 0) {
+      index = static_cast<int32_t>(stored_frames_heap_.size());
+      stored_frames_heap_.push_back(track_number);
     }
+  } else {
+    if (index < 0)
+      return;
+    track.heap_index = -1;
+
+    // Move the last track into the hole.
+    const uint64_t last = stored_frames_heap_.back();
+    stored_frames_heap_.pop_back();
+    if (last == track_number)
+      return;
+    stored_frames_heap_[index] = last;
   }
-  for (std::vector<std::list<Frame*>::iterator>::iterator iterator =
-           frames_to_erase.begin();
-       iterator != frames_to_erase.end(); ++iterator) {
-    stored_frames_[track_number].erase(*iterator);
+  SiftStoredFramesHeap(index);
+}
+
+void Cluster::SiftStoredFramesHeap(int32_t index) {
+  const uint64_t track_number = stored_frames_heap_[index];
+  const int32_t size = static_cast<int32_t>(stored_frames_heap_.size());
+
+  while (index > 0) {
+    const int32_t parent = (index - 1) / 2;
+    if (!StoredFramesBefore(track_number, stored_frames_heap_[parent]))
+      break;
+    stored_frames_heap_[index] = stored_frames_heap_[parent];
+    stored_frames_[stored_frames_heap_[index]].heap_index = index;
+    index = parent;
   }
-  return true;
+
+  for (;;) {
+    int32_t child = 2 * index + 1;
+    if (child >= size)
+      break;
+    if (child + 1 < size && StoredFramesBefore(stored_frames_heap_[child + 1],
+                                               stored_frames_heap_[child])) {
+      ++child;
+    }
+    if (!StoredFramesBefore(stored_frames_heap_[child], track_number))
+      break;
+    stored_frames_heap_[index] = stored_frames_heap_[child];
+    stored_frames_[stored_frames_heap_[index]].heap_index = index;
+    index = child;
+  }
+
+  stored_frames_heap_[index] = track_number;
+  stored_frames_[track_number].heap_index = index;
+}
+
+void Cluster::PopStoredFrame(uint64_t track_number) {
+  std::deque<Frame*>& frames = stored_frames_[track_number].frames;
+  Frame* const frame = frames.front();
+  frames.pop_front();
+  frame->Clear();
+  free_frames_.push_back(frame);
+  UpdateStoredFramesHeap(track_number);
 }
 
 bool Cluster::WriteClusterHeader() {
@@ -3071,7 +3243,11 @@ Segment::Segment()
       force_new_cluster_(false),
       frames_(NULL),
       frames_capacity_(0),
+      frames_head_(0),
       frames_size_(0),
+      max_frames_size_(0),
+      free_frames_(NULL),
+      free_frames_size_(0),
       has_video_(false),
       header_written_(false),
       last_block_duration_(0),
@@ -3111,12 +3287,20 @@ Segment::~Segment() {
 
   if (frames_) {
     for (int32_t i = 0; i < frames_size_; ++i) {
-      Frame* const frame = frames_[i];
+      Frame* const frame = QueuedFrame(i);
       delete frame;
     }
     delete[] frames_;
   }
 
+  if (free_frames_) {
+    for (int32_t i = 0; i < free_frames_size_; ++i) {
+      Frame* const frame = free_frames_[i];
+      delete frame;
+    }
+    delete[] free_frames_;
+  }
+
   delete[] chunk_name_;
   delete[] chunking_base_name_;
 
@@ -3134,42 +3318,26 @@ Segment::~Segment() {
   }
 }
 
-void Segment::MoveCuesBeforeClustersHelper(uint64_t diff, int32_t index,
-                                           uint64_t* cues_size) {
-  CuePoint* const cue_point = cues_.GetCueByIndex(index);
-  if (cue_point == NULL)
-    return;
-  const uint64_t old_cue_point_size = cue_point->Size();
-  const uint64_t cluster_pos = cue_point->cluster_pos() + diff;
-  cue_point->set_cluster_pos(cluster_pos);  // update the new cluster position
-  // New size of the cue is computed as follows
-  //    Let a = current sum of size of all CuePoints
-  //    Let b = Increase in Cue Point's size due to this iteration
-  //    Let c = Increase in size of Cues Element's length due to this iteration
-  //            (This is computed as CodedSize(a + b) - CodedSize(a))
-  //    Let d = b + c. Now d is the |diff| passed to the next recursive call.
-  //    Let e = a + b. Now e is the |cues_size| passed to the next recursive
-  //                   call.
-  const uint64_t cue_point_size_diff = cue_point->Size() - old_cue_point_size;
-  const uint64_t cue_size_diff =
-      GetCodedUIntSize(*cues_size + cue_point_size_diff) -
-      GetCodedUIntSize(*cues_size);
-  *cues_size += cue_point_size_diff;
-  diff = cue_size_diff + cue_point_size_diff;
-  if (diff > 0) {
+void Segment::MoveCuesBeforeClusters() {
+  // Placing the Cues before the Clusters moves every Cluster by the size of
+  // the Cues element, which in turn depends on the Cluster positions it codes.
+  // Shift the cue points by the growth of the Cues element until it stops
+  // growing. Sizes only grow with positions, so this converges on the smallest
+  // consistent layout, usually within a few passes.
+  uint64_t shift = 0;
+  uint64_t cues_size = cues_.Size();
+  while (shift < cues_size) {
+    const uint64_t diff = cues_size - shift;
+    uint64_t payload_size = 0;
     for (int32_t i = 0; i < cues_.cue_entries_size(); ++i) {
-      MoveCuesBeforeClustersHelper(diff, i, cues_size);
+      CuePoint* const cue_point = cues_.GetCueByIndex(i);
+      cue_point->set_cluster_pos(cue_point->cluster_pos() + diff);
+      payload_size += cue_point->Size();
     }
+    shift = cues_size;
+    cues_size =
+        payload_size + EbmlMasterElementSize(libwebm::kMkvCues, payload_size);
   }
-}
-
-void Segment::MoveCuesBeforeClusters() {
-  const uint64_t current_cue_size = cues_.Size();
-  uint64_t cue_size = 0;
-  for (int32_t i = 0; i < cues_.cue_entries_size(); ++i)
-    cue_size += cues_.GetCueByIndex(i)->Size();
-  for (int32_t i = 0; i < cues_.cue_entries_size(); ++i)
-    MoveCuesBeforeClustersHelper(current_cue_size, i, &cue_size);
 
   // Adjust the Seek Entry to reflect the change in position
   // of Cluster and Cues
@@ -3451,7 +3619,7 @@ bool Segment::AddFrame(const uint8_t* data, uint64_t length,
     return false;
 
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.InitBorrowed(data, length))
     return false;
   frame.set_track_number(track_number);
   frame.set_timestamp(timestamp);
@@ -3468,7 +3636,7 @@ bool Segment::AddFrameWithAdditional(const uint8_t* data, uint64_t length,
     return false;
 
   Frame frame;
-  if (!frame.Init(data, length) ||
+  if (!frame.InitBorrowed(data, length) ||
       !frame.AddAdditionalData(additional, additional_length, add_id)) {
     return false;
   }
@@ -3486,7 +3654,7 @@ bool Segment::AddFrameWithDiscardPadding(const uint8_t* data, uint64_t length,
     return false;
 
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.InitBorrowed(data, length))
     return false;
   frame.set_discard_padding(discard_padding);
   frame.set_track_number(track_number);
@@ -3502,7 +3670,7 @@ bool Segment::AddMetadata(const uint8_t* data, uint64_t length,
     return false;
 
   Frame frame;
-  if (!frame.Init(data, length))
+  if (!frame.InitBorrowed(data, length))
     return false;
   frame.set_track_number(track_number);
   frame.set_timestamp(timestamp_ns);
@@ -3547,15 +3715,8 @@ bool Segment::AddGenericFrame(const Frame* frame) {
   // muxed into the same cluster.
   if (has_video_ && tracks_.TrackIsAudio(frame->track_number()) &&
       !force_new_cluster_) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (!new_frame || !new_frame->CopyFrom(*frame)) {
-      delete new_frame;
-      return false;
-    }
-    if (!QueueFrame(new_frame)) {
-      delete new_frame;
+    if (!QueueFrame(*frame))
       return false;
-    }
     track_frames_written_[frame->track_number() - 1]++;
     return true;
   }
@@ -3574,18 +3735,13 @@ bool Segment::AddGenericFrame(const Frame* frame) {
 
   // If the Frame is not a SimpleBlock, then set the reference_block_timestamp
   // if it is not set already.
-  bool frame_created = false;
+  Frame referenced_frame;
   if (!frame->CanBeSimpleBlock() && !frame->is_key() &&
       !frame->reference_block_timestamp_set()) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (!new_frame || !new_frame->CopyFrom(*frame)) {
-      delete new_frame;
-      return false;
-    }
-    new_frame->set_reference_block_timestamp(
+    referenced_frame.BorrowFrom(*frame);
+    referenced_frame.set_reference_block_timestamp(
         last_track_timestamp_[frame->track_number() - 1]);
-    frame = new_frame;
-    frame_created = true;
+    frame = &referenced_frame;
   }
 
   if (!cluster->AddFrame(frame))
@@ -3600,9 +3756,6 @@ bool Segment::AddGenericFrame(const Frame* frame) {
   last_track_timestamp_[frame->track_number() - 1] = frame->timestamp();
   last_block_duration_ = frame->duration();
   track_frames_written_[frame->track_number() - 1]++;
-
-  if (frame_created)
-    delete frame;
   return true;
 }
 
@@ -3909,7 +4062,7 @@ bool Segment::MakeNewCluster(uint64_t frame_timestamp_ns) {
   uint64_t cluster_timecode = frame_timecode;
 
   if (frames_size_ > 0) {
-    const Frame* const f = frames_[0];  // earliest queued frame
+    const Frame* const f = QueuedFrame(0);  // earliest queued frame
     const uint64_t ns = f->timestamp();
     const uint64_t tc = ns / timecode_scale;
 
@@ -4060,30 +4213,80 @@ int64_t Segment::MaxOffset() {
   return offset;
 }
 
-bool Segment::QueueFrame(Frame* frame) {
-  const int32_t new_size = frames_size_ + 1;
-
-  if (new_size > frames_capacity_) {
+bool Segment::QueueFrame(const Frame& frame) {
+  if (frames_size_ == frames_capacity_) {
     // Add more frames.
     const int32_t new_capacity = (!frames_capacity_) ? 2 : frames_capacity_ * 2;
 
-    if (new_capacity < 1)
+    if (new_capacity < 1 || !ReserveQueuedFrames(new_capacity))
       return false;
+  }
 
-    Frame** const frames = new (std::nothrow) Frame*[new_capacity];  // NOLINT
-    if (!frames)
-      return false;
+  Frame* const queued_frame = (free_frames_size_ > 0)
+                                  ? free_frames_[--free_frames_size_]
+                                  : new (std::nothrow) Frame();  // NOLINT
+  if (!queued_frame)
+    return false;
 
-    for (int32_t i = 0; i < frames_size_; ++i) {
-      frames[i] = frames_[i];
-    }
+  if (!queued_frame->CopyFrom(frame)) {
+    queued_frame->Clear();
+    free_frames_[free_frames_size_++] = queued_frame;
+    return false;
+  }
 
-    delete[] frames_;
-    frames_ = frames;
-    frames_capacity_ = new_capacity;
+  frames_[(frames_head_ + frames_size_) % frames_capacity_] = queued_frame;
+  ++frames_size_;
+  if (frames_size_ > max_frames_size_)
+    max_frames_size_ = frames_size_;
+
+  return true;
+}
+
+Frame* Segment::QueuedFrame(int32_t index) const {
+  return frames_[(frames_head_ + index) % frames_capacity_];
+}
+
+void Segment::PopQueuedFrame() {
+  Frame* const frame = frames_[frames_head_];
+  frame->Clear();
+  free_frames_[free_frames_size_++] = frame;
+  frames_head_ = (frames_head_ + 1) % frames_capacity_;
+  --frames_size_;
+}
+
+bool Segment::ReserveQueuedFrames(int32_t count) {
+  if (count <= frames_capacity_)
+    return true;
+
+  Frame** const frames = new (std::nothrow) Frame*[count];  // NOLINT
+  Frame** const free_frames = new (std::nothrow) Frame*[count];  // NOLINT
+  if (!frames || !free_frames) {
+    delete[] frames;
+    delete[] free_frames;
+    return false;
   }
 
-  frames_[frames_size_++] = frame;
+  for (int32_t i = 0; i < frames_size_; ++i) {
+    frames[i] = QueuedFrame(i);
+  }
+
+  for (int32_t i = 0; i < free_frames_size_; ++i) {
+    free_frames[i] = free_frames_[i];
+  }
+
+  delete[] frames_;
+  delete[] free_frames_;
+  frames_ = frames;
+  free_frames_ = free_frames;
+  frames_capacity_ = count;
+  frames_head_ = 0;
+
+  while (frames_size_ + free_frames_size_ < frames_capacity_) {
+    Frame* const frame = new (std::nothrow) Frame();  // NOLINT
+    if (!frame)
+      return false;
+    free_frames_[free_frames_size_++] = frame;
+  }
 
   return true;
 }
@@ -4100,36 +4303,28 @@ int Segment::WriteFramesAll() {
   if (!cluster)
     return -1;
 
-  for (int32_t i = 0; i < frames_size_; ++i) {
-    Frame*& frame = frames_[i];
+  const int result = frames_size_;
+
+  for (; frames_size_ > 0; PopQueuedFrame()) {
+    const Frame* const frame = QueuedFrame(0);
     // TODO(jzern/vigneshv): using Segment::AddGenericFrame here would limit the
     // places where |doc_type_version_| needs to be updated.
     if (frame->discard_padding() != 0)
       doc_type_version_ = 4;
-    if (!cluster->AddFrame(frame)) {
-      delete frame;
+    if (!cluster->AddFrame(frame))
       continue;
-    }
 
     if (new_cuepoint_ && cues_track_ == frame->track_number()) {
-      if (!AddCuePoint(frame->timestamp(), cues_track_)) {
-        delete frame;
+      if (!AddCuePoint(frame->timestamp(), cues_track_))
         continue;
-      }
     }
 
     if (frame->timestamp() > last_timestamp_) {
       last_timestamp_ = frame->timestamp();
       last_track_timestamp_[frame->track_number() - 1] = frame->timestamp();
     }
-
-    delete frame;
-    frame = NULL;
   }
 
-  const int result = frames_size_;
-  frames_size_ = 0;
-
   return result;
 }
 
@@ -4145,51 +4340,26 @@ bool Segment::WriteFramesLessThan(uint64_t timestamp) {
     if (!cluster)
       return false;
 
-    int32_t shift_left = 0;
-
     // TODO(fgalligan): Change this to use the durations of frames instead of
     // the next frame's start time if the duration is accurate.
-    for (int32_t i = 1; i < frames_size_; ++i) {
-      const Frame* const frame_curr = frames_[i];
-
-      if (frame_curr->timestamp() > timestamp)
-        break;
-
-      const Frame* const frame_prev = frames_[i - 1];
+    for (; frames_size_ > 1 && QueuedFrame(1)->timestamp() <= timestamp;
+         PopQueuedFrame()) {
+      const Frame* const frame_prev = QueuedFrame(0);
       if (frame_prev->discard_padding() != 0)
         doc_type_version_ = 4;
-      if (!cluster->AddFrame(frame_prev)) {
-        delete frame_prev;
+      if (!cluster->AddFrame(frame_prev))
         continue;
-      }
 
       if (new_cuepoint_ && cues_track_ == frame_prev->track_number()) {
-        if (!AddCuePoint(frame_prev->timestamp(), cues_track_)) {
-          delete frame_prev;
+        if (!AddCuePoint(frame_prev->timestamp(), cues_track_))
           continue;
-        }
       }
 
-      ++shift_left;
       if (frame_prev->timestamp() > last_timestamp_) {
         last_timestamp_ = frame_prev->timestamp();
         last_track_timestamp_[frame_prev->track_number() - 1] =
             frame_prev->timestamp();
       }
-
-      delete frame_prev;
-    }
-
-    if (shift_left > 0) {
-      if (shift_left >= frames_size_)
-        return false;
-
-      const int32_t new_frames_size = frames_size_ - shift_left;
-      for (int32_t i = 0; i < new_frames_size; ++i) {
-        frames_[i] = frames_[i + shift_left];
-      }
-
-      frames_size_ = new_frames_size;
     }
   }
 
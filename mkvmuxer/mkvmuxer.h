@@ -11,9 +11,11 @@
 
 #include <stdint.h>
 
+#include <atomic>
 #include <cstddef>
-#include <list>
+#include <deque>
 #include <map>
+#include <vector>
 
 #include "common/webmids.h"
 #include "mkvmuxer/mkvmuxertypes.h"
@@ -82,6 +84,44 @@ bool WriteEbmlHeader(IMkvWriter* writer);
 bool ChunkedCopy(mkvparser::IMkvReader* source, IMkvWriter* dst, int64_t start,
                  int64_t size);
 
+///////////////////////////////////////////////////////////////
+// Reference counted frame data owned by the application. A Frame initialized
+// with InitShared() holds a reference instead of a copy, so frames the muxer
+// has to hold on to (e.g. audio waiting for the next video key frame) share
+// the application's buffer. |release| is called with |opaque| and the data
+// once the last reference is dropped.
+class FrameBuffer {
+ public:
+  typedef void (*ReleaseFunction)(void* opaque, const uint8_t* data);
+
+  // Returns a new FrameBuffer holding one reference, which the caller must
+  // drop with Release(), or NULL on error. |release| may be NULL.
+  static FrameBuffer* Create(const uint8_t* data, uint64_t length,
+                             ReleaseFunction release, void* opaque);
+
+  void AddRef();
+  void Release();
+
+  const uint8_t* data() const { return data_; }
+  uint64_t length() const { return length_; }
+
+ private:
+  FrameBuffer(const uint8_t* data, uint64_t length, ReleaseFunction release,
+              void* opaque);
+  ~FrameBuffer() {}
+
+  const uint8_t* const data_;
+  const uint64_t length_;
+  const ReleaseFunction release_;
+  void* const opaque_;
+
+  // Frames may be released on a different thread than the one that created
+  // the buffer.
+  std::atomic<int32_t> ref_count_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(FrameBuffer);
+};
+
 ///////////////////////////////////////////////////////////////
 // Class to hold data the will be written to a block.
 class Frame {
@@ -89,13 +129,31 @@ class Frame {
   Frame();
   ~Frame();
 
-  // Sets this frame's contents based on |frame|. Returns true on success. On
+  // Sets this frame's contents based on |frame|. Data of a shared frame is
+  // referenced, all other data is copied. Returns true on success. On
   // failure, this frame's existing contents may be lost.
   bool CopyFrom(const Frame& frame);
 
+  // Sets this frame's contents based on |frame| without copying any data.
+  // |frame| must outlive this frame.
+  void BorrowFrom(const Frame& frame);
+
   // Copies |frame| data into |frame_|. Returns true on success.
   bool Init(const uint8_t* frame, uint64_t length);
 
+  // Points |frame_| at |frame| without copying it. |frame| must stay valid
+  // until the call passing this frame to the muxer returns; the muxer copies
+  // the data if it has to keep it longer. Returns true on success.
+  bool InitBorrowed(const uint8_t* frame, uint64_t length);
+
+  // Points |frame_| at the data of |buffer| and takes a reference to it.
+  // Returns true on success.
+  bool InitShared(FrameBuffer* buffer);
+
+  // Drops the data and resets all parameters. Buffers allocated by Init() and
+  // AddAdditionalData() are kept, so a frame can be reused without allocating.
+  void Clear();
+
   // Copies |additional| data into |additional_|. Returns true on success.
   bool AddAdditionalData(const uint8_t* additional, uint64_t length,
                          uint64_t add_id);
@@ -137,8 +195,17 @@ class Frame {
   // Id of the Additional data.
   uint64_t add_id_;
 
-  // Pointer to additional data. Owned by this class.
-  uint8_t* additional_;
+  // Drop |frame_| and |additional_|. Buffers owned by this frame are kept
+  // for reuse.
+  void ReleaseFrame();
+  void ReleaseAdditional();
+
+  // Pointer to additional data, either |additional_storage_| or borrowed.
+  const uint8_t* additional_;
+
+  // Buffer AddAdditionalData() copies into. Owned by this class.
+  uint8_t* additional_storage_;
+  uint64_t additional_storage_size_;
 
   // Length of the additional data.
   uint64_t additional_length_;
@@ -151,8 +218,16 @@ class Frame {
   // SimpleBlock.
   bool duration_set_;
 
-  // Pointer to the data. Owned by this class.
-  uint8_t* frame_;
+  // Pointer to the data: |frame_storage_|, borrowed, or held through
+  // |frame_buffer_|.
+  const uint8_t* frame_;
+
+  // Buffer Init() copies into. Owned by this class.
+  uint8_t* frame_storage_;
+  uint64_t frame_storage_size_;
+
+  // Shared buffer |frame_| points into, if any. This frame holds a reference.
+  FrameBuffer* frame_buffer_;
 
   // Flag telling if the data should set the key flag of a block.
   bool is_key_;
@@ -1321,8 +1396,14 @@ class Cluster {
   }
 
  private:
-  // Iterator type for the |stored_frames_| map.
-  typedef std::map<uint64_t, std::list<Frame*> >::iterator FrameMapIterator;
+  // Frames held back for one track, and the track's position in
+  // |stored_frames_heap_|, or -1 if it has no held back frames.
+  struct StoredFrames {
+    StoredFrames() : heap_index(-1) {}
+
+    std::deque<Frame*> frames;
+    int32_t heap_index;
+  };
 
   // Utility method that confirms that blocks can still be added, and that the
   // cluster header has been written. Used by |DoWriteFrame*|. Returns true
@@ -1340,6 +1421,21 @@ class Cluster {
   // not |write_last_frame_with_duration_| is set.
   bool QueueOrWriteFrame(const Frame* const frame);
 
+  // Returns true if the first frame held back for |track_a| has to be written
+  // before that of |track_b|.
+  bool StoredFramesBefore(uint64_t track_a, uint64_t track_b) const;
+
+  // Restores the order of |stored_frames_heap_| after the frames held back for
+  // |track_number| have changed.
+  void UpdateStoredFramesHeap(uint64_t track_number);
+
+  // Moves the track at |index| of |stored_frames_heap_| to its place.
+  void SiftStoredFramesHeap(int32_t index);
+
+  // Removes the first frame held back for |track_number| and keeps it for
+  // reuse.
+  void PopStoredFrame(uint64_t track_number);
+
   // Outputs the Cluster header to |writer_|. Returns true on success.
   bool WriteClusterHeader();
 
@@ -1377,8 +1473,16 @@ class Cluster {
   // finish writing the Cluster.
   bool write_last_frame_with_duration_;
 
-  // Map used to hold back frames, if required. Track number is the key.
-  std::map<uint64_t, std::list<Frame*> > stored_frames_;
+  // Frames held back, if required, indexed by track number.
+  std::vector<StoredFrames> stored_frames_;
+
+  // Numbers of the tracks with held back frames. A min-heap ordered by the
+  // timestamp of the track's first held back frame, then by track number.
+  std::vector<uint64_t> stored_frames_heap_;
+
+  // Frames that have been written out, kept with their payload buffers for
+  // reuse.
+  std::vector<Frame*> free_frames_;
 
   // Map from track number to the timestamp of the last block written for that
   // track.
@@ -1703,6 +1807,18 @@ class Segment {
   // Returns true when codec IDs are valid for WebM.
   bool DocTypeIsWebm() const;
 
+  // Audio frames are held back while the segment has a video track, until the
+  // video frame following them has been added. Preallocates room for |count|
+  // held back frames, across all audio tracks. The frames and their payload
+  // buffers are reused, so no allocations are made while fewer than
+  // |count| frames are held back. Returns true on success.
+  bool ReserveQueuedFrames(int32_t count);
+
+  // Returns the number of frames room is allocated for, and the largest
+  // number that has been held back at once.
+  int32_t queued_frames_capacity() const { return frames_capacity_; }
+  int32_t max_queued_frames() const { return max_frames_size_; }
+
  private:
   // Checks if header information has been output and initialized. If not it
   // will output the Segment element and initialize the SeekHead elment and
@@ -1722,8 +1838,14 @@ class Segment {
   // chunked files. Returns -1 on error.
   int64_t MaxOffset();
 
-  // Adds the frame to our frame array.
-  bool QueueFrame(Frame* frame);
+  // Copies the frame to the end of our frame ring buffer.
+  bool QueueFrame(const Frame& frame);
+
+  // Returns the stored frame at |index|, counting from the earliest one.
+  Frame* QueuedFrame(int32_t index) const;
+
+  // Removes the earliest stored frame and keeps it for reuse.
+  void PopQueuedFrame();
 
   // Output all frames that are queued. Returns -1 on error, otherwise
   // it returns the number of frames written.
@@ -1762,17 +1884,6 @@ class Segment {
   // reflect the correct offsets.
   void MoveCuesBeforeClusters();
 
-  // This function recursively computes the correct cluster offsets (this is
-  // done to move the Cues before Clusters). It recursively updates the change
-  // in size (which indicates a change in cluster offset) until no sizes change.
-  // Parameters:
-  // diff - indicates the difference in size of the Cues element that needs to
-  //        accounted for.
-  // index - index in the list of Cues which is currently being adjusted.
-  // cue_size - sum of size of all the CuePoint elements.
-  void MoveCuesBeforeClustersHelper(uint64_t diff, int index,
-                                    uint64_t* cue_size);
-
   // Seeds the random number generator used to make UIDs.
   unsigned int seed_;
 
@@ -1830,18 +1941,30 @@ class Segment {
   // Tells the muxer to force a new cluster on the next Block.
   bool force_new_cluster_;
 
-  // List of stored audio frames. These variables are used to store frames so
-  // the muxer can follow the guideline "Audio blocks that contain the video
-  // key frame's timecode should be in the same cluster as the video key frame
-  // block."
+  // Ring buffer of stored audio frames, in the order they were added. These
+  // variables are used to store frames so the muxer can follow the guideline
+  // "Audio blocks that contain the video key frame's timecode should be in the
+  // same cluster as the video key frame block."
   Frame** frames_;
 
-  // Number of frame pointers allocated in the frame list.
+  // Number of frame pointers allocated in the ring buffer and in
+  // |free_frames_|.
   int32_t frames_capacity_;
 
-  // Number of frames in the frame list.
+  // Index in |frames_| of the earliest stored frame.
+  int32_t frames_head_;
+
+  // Number of frames in the ring buffer.
   int32_t frames_size_;
 
+  // Largest number of frames that have been in the ring buffer at once.
+  int32_t max_frames_size_;
+
+  // Frames that have been written out. They keep their payload buffers and are
+  // reused for the next stored frames.
+  Frame** free_frames_;
+  int32_t free_frames_size_;
+
   // Flag telling if a video track has been added to the segment.
   bool has_video_;
 
@@ -8,12 +8,25 @@
 
 #include "mkvmuxer/mkvwriter.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
+#include <climits>
+#include <cstring>
+#include <new>
+
 #ifdef _MSC_VER
 #include <share.h>  // for _SH_DENYWR
 #endif
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 namespace mkvmuxer {
 
 MkvWriter::MkvWriter() : file_(NULL), writer_owns_file_(true) {}
@@ -89,4 +102,216 @@ bool MkvWriter::Seekable() const { return true; }
 
 void MkvWriter::ElementStartNotify(uint64, int64) {}
 
+BufferedMkvWriter::BufferedMkvWriter(uint32 buffer_size)
+    : file_(-1),
+      buffer_(NULL),
+      buffer_size_(buffer_size > 0 ? buffer_size : 1),
+      buffer_start_(0),
+      buffer_length_(0),
+      position_(0),
+      failed_(false),
+      flush_count_(0),
+      patch_count_(0),
+      bytes_written_(0) {}
+
+BufferedMkvWriter::~BufferedMkvWriter() { Close(); }
+
+bool BufferedMkvWriter::Open(const char* filename) {
+  if (filename == NULL)
+    return false;
+
+  if (file_ >= 0)
+    return false;
+
+  buffer_ = new (std::nothrow) uint8[buffer_size_];  // NOLINT
+  if (buffer_ == NULL)
+    return false;
+
+#ifdef _MSC_VER
+  if (_sopen_s(&file_, filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+               _SH_DENYWR, _S_IREAD | _S_IWRITE) != 0) {
+    file_ = -1;
+  }
+#elif defined(_WIN32)
+  file_ = _open(filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+                _S_IREAD | _S_IWRITE);
+#else
+  file_ = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+  if (file_ < 0) {
+    delete[] buffer_;
+    buffer_ = NULL;
+    return false;
+  }
+
+  buffer_start_ = 0;
+  buffer_length_ = 0;
+  position_ = 0;
+  failed_ = false;
+  return true;
+}
+
+bool BufferedMkvWriter::Flush() {
+  if (file_ < 0)
+    return false;
+
+  if (buffer_length_ > 0) {
+    if (!WriteAt(buffer_start_, buffer_, buffer_length_))
+      return false;
+
+    ++flush_count_;
+    buffer_start_ += buffer_length_;
+    buffer_length_ = 0;
+  }
+
+  return !failed_;
+}
+
+void BufferedMkvWriter::Close() {
+  if (file_ >= 0) {
+    Flush();
+#ifdef _WIN32
+    _close(file_);
+#else
+    close(file_);
+#endif
+  }
+  file_ = -1;
+
+  delete[] buffer_;
+  buffer_ = NULL;
+}
+
+int32 BufferedMkvWriter::Write(const void* buffer, uint32 length) {
+  if (file_ < 0)
+    return -1;
+
+  if (length == 0)
+    return 0;
+
+  if (buffer == NULL)
+    return -1;
+
+  const uint8* data = static_cast<const uint8*>(buffer);
+  int64 remaining = length;
+
+  // Patch the part that lies before the buffer.
+  if (position_ < buffer_start_) {
+    int64 size = buffer_start_ - position_;
+    if (size > remaining)
+      size = remaining;
+
+    if (!WriteAt(position_, data, size))
+      return -1;
+
+    ++patch_count_;
+    position_ += size;
+    data += size;
+    remaining -= size;
+  }
+
+  if (remaining == 0)
+    return 0;
+
+  int64 end = buffer_start_ + buffer_length_;
+
+  if (position_ > end) {  // beyond the end of the output
+    if (!Flush())
+      return -1;
+
+    buffer_start_ = position_;
+    end = position_;
+  }
+
+  // Patch the part that lies within the buffer.
+  if (position_ < end) {
+    int64 size = end - position_;
+    if (size > remaining)
+      size = remaining;
+
+    memcpy(buffer_ + (position_ - buffer_start_), data,
+           static_cast<size_t>(size));
+    position_ += size;
+    data += size;
+    remaining -= size;
+  }
+
+  // Append the rest.
+  while (remaining > 0) {
+    if (buffer_length_ >= buffer_size_ && !Flush())
+      return -1;
+
+    if (buffer_length_ == 0 && remaining >= buffer_size_) {
+      // Too large to be worth copying.
+      if (!WriteAt(position_, data, remaining))
+        return -1;
+
+      ++flush_count_;
+      position_ += remaining;
+      buffer_start_ = position_;
+      return 0;
+    }
+
+    int64 size = buffer_size_ - buffer_length_;
+    if (size > remaining)
+      size = remaining;
+
+    memcpy(buffer_ + buffer_length_, data, static_cast<size_t>(size));
+    buffer_length_ += static_cast<uint32>(size);
+    position_ += size;
+    data += size;
+    remaining -= size;
+  }
+
+  return 0;
+}
+
+bool BufferedMkvWriter::WriteAt(int64 offset, const uint8* data,
+                                int64 length) {
+#ifdef _WIN32
+  if (_lseeki64(file_, offset, SEEK_SET) != offset) {
+    failed_ = true;
+    return false;
+  }
+#endif
+
+  while (length > 0) {
+#ifdef _WIN32
+    const unsigned int chunk =
+        (length > INT_MAX) ? INT_MAX : static_cast<unsigned int>(length);
+    const int64 written = _write(file_, data, chunk);
+#else
+    const int64 written = pwrite(file_, data, static_cast<size_t>(length),
+                                 static_cast<off_t>(offset));
+    if (written < 0 && errno == EINTR)
+      continue;
+#endif
+    if (written <= 0) {
+      failed_ = true;
+      return false;
+    }
+
+    data += written;
+    offset += written;
+    length -= written;
+    bytes_written_ += written;
+  }
+
+  return true;
+}
+
+int64 BufferedMkvWriter::Position() const { return position_; }
+
+int32 BufferedMkvWriter::Position(int64 position) {
+  if (file_ < 0 || position < 0)
+    return -1;
+
+  position_ = position;
+  return 0;
+}
+
+bool BufferedMkvWriter::Seekable() const { return true; }
+
+void BufferedMkvWriter::ElementStartNotify(uint64, int64) {}
+
 }  // namespace mkvmuxer
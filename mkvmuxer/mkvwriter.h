@@ -46,6 +46,64 @@ class MkvWriter : public IMkvWriter {
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(MkvWriter);
 };
 
+// IMkvWriter that collects the output in a large buffer and writes it to the
+// file in big chunks, rather than making a stdio call for every element ID,
+// size and value. Seeking only moves the logical position: patches that land
+// in the buffer are applied in place, and patches to data that has already
+// been written out are applied with a single positional write, so that the
+// buffer is never flushed early.
+class BufferedMkvWriter : public IMkvWriter {
+ public:
+  static const uint32 kDefaultBufferSize = 4 * 1024 * 1024;
+
+  explicit BufferedMkvWriter(uint32 buffer_size = kDefaultBufferSize);
+  virtual ~BufferedMkvWriter();
+
+  // IMkvWriter interface
+  virtual int64 Position() const;
+  virtual int32 Position(int64 position);
+  virtual bool Seekable() const;
+  virtual int32 Write(const void* buffer, uint32 length);
+  virtual void ElementStartNotify(uint64 element_id, int64 position);
+
+  // Creates and opens a file for writing, overwriting any contents of
+  // |filename|. Returns true on success.
+  bool Open(const char* filename);
+
+  // Writes out the buffer. Returns false if any write to the file failed.
+  bool Flush();
+
+  // Flushes and closes the file.
+  void Close();
+
+  // Number of times the buffer was written out.
+  int64 flush_count() const { return flush_count_; }
+
+  // Number of positional writes made to patch data already written out.
+  int64 patch_count() const { return patch_count_; }
+
+  // Bytes handed to the operating system, patches included.
+  int64 bytes_written() const { return bytes_written_; }
+
+ private:
+  // Writes |length| bytes of |data| to the file at |offset|.
+  bool WriteAt(int64 offset, const uint8* data, int64 length);
+
+  int file_;
+  uint8* buffer_;
+  const uint32 buffer_size_;
+  int64 buffer_start_;  // file offset of buffer_[0]
+  uint32 buffer_length_;
+  int64 position_;
+  bool failed_;  // a write to the file failed
+
+  int64 flush_count_;
+  int64 patch_count_;
+  int64 bytes_written_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(BufferedMkvWriter);
+};
+
 }  // namespace mkvmuxer
 
 #endif  // MKVMUXER_MKVWRITER_H_
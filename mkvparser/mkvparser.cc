@@ -12,16 +12,26 @@
 #define MSC_COMPAT
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cfloat>
 #include <climits>
 #include <cmath>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 #include "common/webmids.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 namespace mkvparser {
 const long long kStringElementSizeLimit = 20 * 1000 * 1000;
 const float MasteringMetadata::kValueNotPresent = FLT_MAX;
@@ -59,11 +69,305 @@ void GetVersion(int& major, int& minor, int& build, int& revision) {
   revision = 0;
 }
 
+namespace {
+// Returns the number of leading zero bits in the non-zero byte |b|, i.e. the
+// number of bytes that follow the first byte of an EBML var-int.
+inline int CountLeadingZeros(unsigned char b) {
+  assert(b != 0);
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_clz(b) - static_cast<int>(8 * (sizeof(unsigned int) - 1));
+#elif defined(_MSC_VER)
+  unsigned long index;
+  _BitScanReverse(&index, b);
+  return 7 - static_cast<int>(index);
+#else
+  int n = 0;
+  while (!(b & 0x80)) {
+    b <<= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+inline unsigned long long LoadBigEndian64(const unsigned char* buf) {
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  unsigned long long value;
+  memcpy(&value, buf, sizeof(value));
+  return __builtin_bswap64(value);
+#else
+  unsigned long long value = 0;
+  for (int i = 0; i < 8; ++i)
+    value = (value << 8) | buf[i];
+  return value;
+#endif
+}
+
+inline unsigned long long LoadBigEndian(const unsigned char* buf, long len) {
+  unsigned long long value = 0;
+  for (long i = 0; i < len; ++i)
+    value = (value << 8) | buf[i];
+  return value;
+}
+
+// Returns a pointer to the 8 bytes at |pos|, either directly from the reader
+// or copied into |buf| with a single read. Returns NULL when fewer than 8
+// bytes are available, in which case callers use the byte-wise path.
+const unsigned char* PeekVarInt(IMkvReader* pReader, long long pos,
+                                unsigned char (&buf)[8]) {
+  const unsigned char* const view = pReader->GetView(pos, 8);
+
+  if (view)
+    return view;
+
+  long long total, available;
+
+  if (pReader->Length(&total, &available) < 0)
+    return NULL;
+
+  if (available < 0 || available - 8 < pos)
+    return NULL;
+
+  if (total >= 0 && total - 8 < pos)
+    return NULL;
+
+  if (pReader->Read(pos, 8, buf) != 0)
+    return NULL;
+
+  return buf;
+}
+
+// Returns the |size| bytes at |pos|, read with a single call or viewed
+// directly in the reader. Returns NULL and sets |status| on failure.
+const unsigned char* ReadBytes(IMkvReader* pReader, long long pos, long size,
+                               unsigned char (&buf)[8], long& status) {
+  assert(size > 0 && size <= 8);
+
+  const unsigned char* const view = pReader->GetView(pos, size);
+
+  if (view)
+    return view;
+
+  status = pReader->Read(pos, size, buf);
+
+  if (status < 0)
+    return NULL;
+
+  if (status > 0) {
+    status = E_BUFFER_NOT_FULL;
+    return NULL;
+  }
+
+  return buf;
+}
+
+// Sidecar index layout, all integers little-endian:
+//   "WMKI", u32 version, i64 file size, u64 file hash,
+//   i64 segment start, i64 segment size,
+//   u32 n, n * { u64 id, i64 element start, i64 element size },
+//   u32 n, n * { i64 element start, i64 element size, i64 timecode,
+//                i64 blocks pos },
+//   u32 n, n * { i64 track, i64 time (ns), u32 cluster, u32 block }.
+const unsigned char kIndexMagic[4] = {'W', 'M', 'K', 'I'};
+const unsigned long kIndexVersion = 1;
+const long long kIndexHeaderSize = 4 + 4 + 8 * 4;
+const long long kIndexHeaderEntrySize = 3 * 8;
+const long long kIndexClusterEntrySize = 4 * 8;
+const long long kIndexKeyframeEntrySize = 2 * 8 + 2 * 4;
+const long long kIndexHashedBytes = 64 * 1024;  // at each end of the file
+
+void PutIndexInt(unsigned char*& p, unsigned long long value, int size) {
+  for (int i = 0; i < size; ++i) {
+    *p++ = static_cast<unsigned char>(value & 0xFF);
+    value >>= 8;
+  }
+}
+
+unsigned long long GetIndexInt(const unsigned char*& p, int size) {
+  unsigned long long value = 0;
+
+  for (int i = size - 1; i >= 0; --i)
+    value = (value << 8) | p[i];
+
+  p += size;
+  return value;
+}
+
+// FNV-1a over the first and last kIndexHashedBytes of the file.
+long HashIndexedFile(IMkvReader* pReader, long long total,
+                     unsigned long long& hash) {
+  hash = 14695981039346656037ULL;
+
+  long long ranges[2][2] = {{0, kIndexHashedBytes},
+                            {total - kIndexHashedBytes, total}};
+
+  if (ranges[0][1] > total)
+    ranges[0][1] = total;
+
+  if (ranges[1][0] < ranges[0][1])
+    ranges[1][0] = ranges[0][1];
+
+  unsigned char buf[4096];
+
+  for (int r = 0; r < 2; ++r) {
+    for (long long pos = ranges[r][0]; pos < ranges[r][1];) {
+      long long len = ranges[r][1] - pos;
+
+      if (len > static_cast<long long>(sizeof(buf)))
+        len = sizeof(buf);
+
+      const long status = pReader->Read(pos, static_cast<long>(len), buf);
+
+      if (status < 0)
+        return status;
+
+      if (status > 0)
+        return E_BUFFER_NOT_FULL;
+
+      for (long long i = 0; i < len; ++i) {
+        hash ^= buf[i];
+        hash *= 1099511628211ULL;
+      }
+
+      pos += len;
+    }
+  }
+
+  return 0;
+}
+
+// Serves the bytes of one cluster from memory to a parsing thread. Anything
+// outside the cluster comes from the shared reader, under its lock.
+class ClusterBufferReader : public IMkvReader {
+ public:
+  ClusterBufferReader(IMkvReader* pReader, std::mutex& mutex)
+      : m_pReader(pReader),
+        m_mutex(mutex),
+        m_buf(NULL),
+        m_buf_size(0),
+        m_data(NULL),
+        m_start(0),
+        m_size(0),
+        m_total(0),
+        m_avail(0) {}
+
+  virtual ~ClusterBufferReader() { delete[] m_buf; }
+
+  // Makes [start, start + size) resident, plus a few bytes of look-ahead
+  // when available.
+  long Fill(long long start, long long size) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    long status = m_pReader->Length(&m_total, &m_avail);
+
+    if (status < 0)
+      return status;
+
+    if (start < 0 || size < 0 || start + size > m_avail)
+      return E_BUFFER_NOT_FULL;
+
+    size += 8;
+
+    if (start + size > m_avail)
+      size = m_avail - start;
+
+    if (size > LONG_MAX)
+      return E_FILE_FORMAT_INVALID;
+
+    m_start = start;
+    m_size = size;
+    m_data = m_pReader->GetView(start, static_cast<long>(size));
+
+    if (m_data)
+      return 0;
+
+    if (size > m_buf_size) {
+      delete[] m_buf;
+
+      m_buf = new (std::nothrow) unsigned char[static_cast<size_t>(size)];
+      m_buf_size = m_buf ? size : 0;
+
+      if (m_buf == NULL)
+        return -1;
+    }
+
+    status = m_pReader->Read(start, static_cast<long>(size), m_buf);
+
+    if (status != 0)
+      return (status < 0) ? status : E_BUFFER_NOT_FULL;
+
+    m_data = m_buf;
+    return 0;
+  }
+
+  virtual int Read(long long pos, long len, unsigned char* buf) {
+    if (pos >= m_start && len >= 0 && pos + len <= m_start + m_size) {
+      memcpy(buf, m_data + (pos - m_start), len);
+      return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pReader->Read(pos, len, buf);
+  }
+
+  virtual int Length(long long* total, long long* avail) {
+    if (total)
+      *total = m_total;
+
+    if (avail)
+      *avail = m_avail;
+
+    return 0;
+  }
+
+  virtual const unsigned char* GetView(long long pos, long len) {
+    if (pos >= m_start && len >= 0 && pos + len <= m_start + m_size)
+      return m_data + (pos - m_start);
+
+    return NULL;
+  }
+
+ private:
+  ClusterBufferReader(const ClusterBufferReader&);
+  ClusterBufferReader& operator=(const ClusterBufferReader&);
+
+  IMkvReader* const m_pReader;
+  std::mutex& m_mutex;
+  unsigned char* m_buf;
+  long long m_buf_size;
+  const unsigned char* m_data;
+  long long m_start;
+  long long m_size;
+  long long m_total;
+  long long m_avail;
+};
+// Bytes held by a string allocated with UnserializeString() or CopyStr().
+long long StringMemoryUsage(const char* str) {
+  return (str == NULL) ? 0 : static_cast<long long>(strlen(str) + 1);
+}
+}  // namespace
+
 long long ReadUInt(IMkvReader* pReader, long long pos, long& len) {
   if (!pReader || pos < 0)
     return E_FILE_FORMAT_INVALID;
 
   len = 1;
+
+  unsigned char buf[8];
+  const unsigned char* const p = PeekVarInt(pReader, pos, buf);
+
+  if (p) {
+    if (p[0] == 0)  // we can't handle u-int values larger than 8 bytes
+      return E_FILE_FORMAT_INVALID;
+
+    const int size = CountLeadingZeros(p[0]) + 1;
+    const unsigned long long value = LoadBigEndian64(p) >> (64 - 8 * size);
+
+    len = size;
+    return static_cast<long long>(value & ((1ULL << (7 * size)) - 1));
+  }
+
   unsigned char b;
   int status = pReader->Read(pos, 1, &b);
 
@@ -119,6 +423,21 @@ long long ReadID(IMkvReader* pReader, long long pos, long& len) {
   if (pReader == NULL || pos < 0)
     return E_FILE_FORMAT_INVALID;
 
+  const int kMaxIdLengthInBytes = 4;
+
+  unsigned char buf[8];
+  const unsigned char* const p = PeekVarInt(pReader, pos, buf);
+
+  if (p) {
+    if (p[0] < (0x80 >> (kMaxIdLengthInBytes - 1)))
+      return E_FILE_FORMAT_INVALID;
+
+    const int id_length = CountLeadingZeros(p[0]) + 1;
+
+    len = id_length;
+    return static_cast<long long>(LoadBigEndian64(p) >> (64 - 8 * id_length));
+  }
+
   // Read the first byte. The length in bytes of the ID is determined by
   // finding the first set bit in the first byte of the ID.
   unsigned char temp_byte = 0;
@@ -133,7 +452,6 @@ long long ReadID(IMkvReader* pReader, long long pos, long& len) {
     return E_FILE_FORMAT_INVALID;
 
   int bit_pos = 0;
-  const int kMaxIdLengthInBytes = 4;
   const int kCheckByte = 0x80;
 
   // Find the first bit that's set.
@@ -194,12 +512,7 @@ long long GetUIntLength(IMkvReader* pReader, long long pos, long& len) {
   if (b == 0)  // we can't handle u-int values larger than 8 bytes
     return E_FILE_FORMAT_INVALID;
 
-  unsigned char m = 0x80;
-
-  while (!(b & m)) {
-    m >>= 1;
-    ++len;
-  }
+  len = CountLeadingZeros(b) + 1;
 
   return 0;  // success
 }
@@ -210,23 +523,15 @@ long long UnserializeUInt(IMkvReader* pReader, long long pos, long long size) {
   if (!pReader || pos < 0 || (size <= 0) || (size > 8))
     return E_FILE_FORMAT_INVALID;
 
-  long long result = 0;
-
-  for (long long i = 0; i < size; ++i) {
-    unsigned char b;
-
-    const long status = pReader->Read(pos, 1, &b);
-
-    if (status < 0)
-      return status;
-
-    result <<= 8;
-    result |= b;
+  unsigned char buf[8];
+  long status = 0;
+  const unsigned char* const p =
+      ReadBytes(pReader, pos, static_cast<long>(size), buf, status);
 
-    ++pos;
-  }
+  if (p == NULL)
+    return status;
 
-  return result;
+  return static_cast<long long>(LoadBigEndian(p, static_cast<long>(size)));
 }
 
 long UnserializeFloat(IMkvReader* pReader, long long pos, long long size_,
@@ -292,28 +597,20 @@ long UnserializeInt(IMkvReader* pReader, long long pos, long long size,
   if (!pReader || pos < 0 || size < 1 || size > 8)
     return E_FILE_FORMAT_INVALID;
 
-  signed char first_byte = 0;
-  const long status = pReader->Read(pos, 1, (unsigned char*)&first_byte);
+  unsigned char buf[8];
+  long status = 0;
+  const unsigned char* const p =
+      ReadBytes(pReader, pos, static_cast<long>(size), buf, status);
 
-  if (status < 0)
+  if (p == NULL)
     return status;
 
-  unsigned long long result = static_cast<unsigned long long>(first_byte);
-  ++pos;
-
-  for (long i = 1; i < size; ++i) {
-    unsigned char b;
-
-    const long status = pReader->Read(pos, 1, &b);
-
-    if (status < 0)
-      return status;
-
-    result <<= 8;
-    result |= b;
+  // Sign-extend from the first byte.
+  unsigned long long result =
+      static_cast<unsigned long long>(static_cast<signed char>(p[0]));
 
-    ++pos;
-  }
+  for (long i = 1; i < size; ++i)
+    result = (result << 8) | p[i];
 
   result_ref = static_cast<long long>(result);
   return 0;
@@ -487,6 +784,152 @@ bool Match(IMkvReader* pReader, long long& pos, unsigned long expected_id,
   return true;
 }
 
+ReadPlan::ReadPlan(long long max_gap)
+    : m_max_gap(max_gap < 0 ? 0 : max_gap),
+      m_ranges(NULL),
+      m_count(0),
+      m_size(0) {}
+
+ReadPlan::~ReadPlan() { delete[] m_ranges; }
+
+bool ReadPlan::Add(long long pos, long long len) {
+  if (pos < 0 || len <= 0)
+    return true;  // nothing to read
+
+  long long stop = pos + len;
+
+  // The ranges in [i, j) are merged with the new one.
+  long i = 0;
+
+  while (i < m_count && m_ranges[i].pos + m_ranges[i].len + m_max_gap < pos)
+    ++i;
+
+  long j = i;
+
+  while (j < m_count && m_ranges[j].pos <= stop + m_max_gap) {
+    const Range& r = m_ranges[j++];
+
+    if (r.pos < pos)
+      pos = r.pos;
+
+    if (r.pos + r.len > stop)
+      stop = r.pos + r.len;
+  }
+
+  if (i == j) {
+    if (m_count >= m_size) {
+      const long size = (m_size <= 0) ? 8 : 2 * m_size;
+
+      Range* const ranges = new (std::nothrow) Range[size];
+
+      if (ranges == NULL)
+        return false;
+
+      for (long k = 0; k < m_count; ++k)
+        ranges[k] = m_ranges[k];
+
+      delete[] m_ranges;
+
+      m_ranges = ranges;
+      m_size = size;
+    }
+
+    for (long k = m_count; k > i; --k)
+      m_ranges[k] = m_ranges[k - 1];
+
+    ++m_count;
+  } else {
+    const long removed = j - i - 1;
+
+    for (long k = i + 1; k + removed < m_count; ++k)
+      m_ranges[k] = m_ranges[k + removed];
+
+    m_count -= removed;
+  }
+
+  m_ranges[i].pos = pos;
+  m_ranges[i].len = stop - pos;
+
+  return true;
+}
+
+void ReadPlan::Clear() { m_count = 0; }
+
+const ReadPlan::Range* ReadPlan::GetRange(long idx) const {
+  if (idx < 0 || idx >= m_count)
+    return NULL;
+
+  return m_ranges + idx;
+}
+
+long long ReadPlan::GetTotalBytes() const {
+  long long total = 0;
+
+  for (long i = 0; i < m_count; ++i)
+    total += m_ranges[i].len;
+
+  return total;
+}
+
+bool ReadPlan::Contains(long long pos, long long len) const {
+  for (long i = 0; i < m_count; ++i) {
+    const Range& r = m_ranges[i];
+
+    if (r.pos <= pos && pos + len <= r.pos + r.len)
+      return true;
+  }
+
+  return false;
+}
+
+FrameBatch::FrameBatch()
+    : m_frames(NULL), m_count(0), m_size(0), m_buf(NULL), m_buf_size(0) {}
+
+FrameBatch::~FrameBatch() {
+  delete[] m_frames;
+  delete[] m_buf;
+}
+
+const FrameBatch::Frame* FrameBatch::GetFrame(long idx) const {
+  if (idx < 0 || idx >= m_count)
+    return NULL;
+
+  return m_frames + idx;
+}
+
+bool FrameBatch::Reserve(long frame_count, long long buf_size) {
+  if (frame_count > m_size) {
+    long size = (m_size <= 0) ? 64 : m_size;
+
+    while (size < frame_count)
+      size *= 2;
+
+    Frame* const frames = new (std::nothrow) Frame[size];
+
+    if (frames == NULL)
+      return false;
+
+    delete[] m_frames;
+
+    m_frames = frames;
+    m_size = size;
+  }
+
+  if (buf_size > m_buf_size) {
+    unsigned char* const buf = new (std::nothrow) unsigned char[buf_size];
+
+    if (buf == NULL)
+      return false;
+
+    delete[] m_buf;
+
+    m_buf = buf;
+    m_buf_size = buf_size;
+  }
+
+  return true;
+}
+
 EBMLHeader::EBMLHeader() : m_docType(NULL) { Init(); }
 
 EBMLHeader::~EBMLHeader() { delete[] m_docType; }
@@ -675,13 +1118,31 @@ Segment::Segment(IMkvReader* pReader, long long elem_start,
       m_clusters(NULL),
       m_clusterCount(0),
       m_clusterPreloadCount(0),
-      m_clusterSize(0) {}
+      m_clusterSize(0),
+      m_preload_chunks(NULL),
+      m_preload_chunk_count(0),
+      m_preload_chunk_size(0),
+      m_max_resident_clusters(0),
+      m_max_resident_bytes(0),
+      m_resident_clusters(NULL),
+      m_resident_clusters_head(0),
+      m_resident_clusters_count(0),
+      m_resident_clusters_size(0),
+      m_cursor_pos(-1),
+      m_evict_blocked_limit(-1),
+      m_evict_blocked_current(NULL),
+      m_evict_blocked_count(-1),
+      m_index_keyframes(NULL),
+      m_index_keyframes_count(0),
+      m_indexed(false),
+      m_parallel_parse(false),
+      m_frozen(false) {
+  memset(&m_cluster_cache_stats, 0, sizeof(m_cluster_cache_stats));
+}
 
 Segment::~Segment() {
-  const long count = m_clusterCount + m_clusterPreloadCount;
-
   Cluster** i = m_clusters;
-  Cluster** j = m_clusters + count;
+  Cluster** j = m_clusters + m_clusterCount;
 
   while (i != j) {
     Cluster* const p = *i++;
@@ -690,6 +1151,19 @@ Segment::~Segment() {
 
   delete[] m_clusters;
 
+  for (long c = 0; c < m_preload_chunk_count; ++c) {
+    PreloadChunk* const pChunk = m_preload_chunks[c];
+
+    for (long k = 0; k < pChunk->count; ++k)
+      delete pChunk->clusters[k];
+
+    delete pChunk;
+  }
+
+  delete[] m_preload_chunks;
+  delete[] m_resident_clusters;
+  delete[] m_index_keyframes;
+
   delete m_pTracks;
   delete m_pInfo;
   delete m_pCues;
@@ -698,933 +1172,2156 @@ Segment::~Segment() {
   delete m_pSeekHead;
 }
 
-long long Segment::CreateInstance(IMkvReader* pReader, long long pos,
-                                  Segment*& pSegment) {
-  if (pReader == NULL || pos < 0)
-    return E_PARSE_FAILED;
+void Segment::SetClusterEvictionPolicy(long max_clusters,
+                                       long long max_bytes) {
+  if (m_frozen)
+    return;
 
-  pSegment = NULL;
+  m_max_resident_clusters = (max_clusters > 0) ? max_clusters : 0;
+  m_max_resident_bytes = (max_bytes > 0) ? max_bytes : 0;
 
-  long long total, available;
+  // Clusters parsed while eviction was off are queued in index order.
+  m_resident_clusters_head = 0;
+  m_resident_clusters_count = 0;
+  m_evict_blocked_count = -1;
 
-  const long status = pReader->Length(&total, &available);
+  if (m_max_resident_clusters <= 0 && m_max_resident_bytes <= 0)
+    return;
 
-  if (status < 0)  // error
-    return status;
+  bool full = false;
 
-  if (available < 0)
-    return -1;
+  for (long i = 0; !full && i < m_clusterCount; ++i) {
+    const Cluster* const pCluster = m_clusters[i];
 
-  if ((total >= 0) && (available > total))
-    return -1;
-
-  // I would assume that in practice this loop would execute
-  // exactly once, but we allow for other elements (e.g. Void)
-  // to immediately follow the EBML header.  This is fine for
-  // the source filter case (since the entire file is available),
-  // but in the splitter case over a network we should probably
-  // just give up early.  We could for example decide only to
-  // execute this loop a maximum of, say, 10 times.
-  // TODO:
-  // There is an implied "give up early" by only parsing up
-  // to the available limit.  We do do that, but only if the
-  // total file size is unknown.  We could decide to always
-  // use what's available as our limit (irrespective of whether
-  // we happen to know the total file length).  This would have
-  // as its sense "parse this much of the file before giving up",
-  // which a slightly different sense from "try to parse up to
-  // 10 EMBL elements before giving up".
+    if (pCluster->m_resident && !AddResidentCluster(pCluster))
+      full = true;
+  }
 
-  for (;;) {
-    if ((total >= 0) && (pos >= total))
-      return E_FILE_FORMAT_INVALID;
+  for (long c = 0; !full && c < m_preload_chunk_count; ++c) {
+    const PreloadChunk* const pChunk = m_preload_chunks[c];
 
-    // Read ID
-    long len;
-    long long result = GetUIntLength(pReader, pos, len);
+    for (long k = 0; !full && k < pChunk->count; ++k) {
+      const Cluster* const pCluster = pChunk->clusters[k];
 
-    if (result)  // error, or too few available bytes
-      return result;
+      if (pCluster->m_resident && !AddResidentCluster(pCluster))
+        full = true;
+    }
+  }
 
-    if ((total >= 0) && ((pos + len) > total))
-      return E_FILE_FORMAT_INVALID;
+  EvictClusters(NULL);
+}
 
-    if ((pos + len) > available)
-      return pos + len;
+const Segment::ClusterCacheStats& Segment::GetClusterCacheStats() const {
+  return m_cluster_cache_stats;
+}
 
-    const long long idpos = pos;
-    const long long id = ReadID(pReader, pos, len);
+void Segment::GetAllocationStats(AllocationStats& stats) const {
+  memset(&stats, 0, sizeof(stats));
 
-    if (id < 0)
-      return E_FILE_FORMAT_INVALID;
+  const long count = m_clusterCount + m_clusterPreloadCount;
+  long chunk = 0;
+  long k = 0;
 
-    pos += len;  // consume ID
+  for (long i = 0; i < count; ++i) {
+    const Cluster* pCluster;
 
-    // Read Size
+    if (i < m_clusterCount) {
+      pCluster = m_clusters[i];
+    } else {
+      pCluster = m_preload_chunks[chunk]->clusters[k];
 
-    result = GetUIntLength(pReader, pos, len);
+      if (++k >= m_preload_chunks[chunk]->count) {
+        ++chunk;
+        k = 0;
+      }
+    }
 
-    if (result)  // error, or too few available bytes
-      return result;
+    assert(pCluster);
 
-    if ((total >= 0) && ((pos + len) > total))
-      return E_FILE_FORMAT_INVALID;
+    stats.heap_allocations += pCluster->m_heap_allocations;
+    stats.arena_allocations += pCluster->m_arena_allocations;
+    stats.arena_allocated_bytes += pCluster->m_arena_allocated_bytes;
+    stats.arena_reserved_bytes += pCluster->m_arena_bytes;
+  }
+}
 
-    if ((pos + len) > available)
-      return pos + len;
+void Segment::GetMemoryUsage(MemoryUsage& usage) const {
+  memset(&usage, 0, sizeof(usage));
 
-    long long size = ReadUInt(pReader, pos, len);
+  usage.segment = sizeof(Segment);
+  usage.segment += m_clusterSize * sizeof(Cluster*);
+  usage.segment += m_preload_chunk_size * sizeof(PreloadChunk*);
+  usage.segment += m_preload_chunk_count * sizeof(PreloadChunk);
+  usage.segment += m_resident_clusters_size * sizeof(const Cluster*);
+  usage.segment += m_index_keyframes_count * sizeof(IndexedKeyframe);
 
-    if (size < 0)  // error
-      return size;
+  for (long i = 0; i < m_clusterCount; ++i)
+    AddClusterMemoryUsage(m_clusters[i], usage);
 
-    pos += len;  // consume length of size of element
+  for (long c = 0; c < m_preload_chunk_count; ++c) {
+    const PreloadChunk* const pChunk = m_preload_chunks[c];
 
-    // Pos now points to start of payload
+    for (long k = 0; k < pChunk->count; ++k)
+      AddClusterMemoryUsage(pChunk->clusters[k], usage);
+  }
 
-    // Handle "unknown size" for live streaming of webm files.
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+  if (m_pTracks)
+    usage.tracks = m_pTracks->GetMemoryUsage();
 
-    if (id == libwebm::kMkvSegment) {
-      if (size == unknown_size)
-        size = -1;
+  if (m_pCues)
+    usage.cues = m_pCues->GetMemoryUsage();
 
-      else if (total < 0)
-        size = -1;
+  if (m_pChapters)
+    usage.chapters = m_pChapters->GetMemoryUsage();
 
-      else if ((pos + size) > total)
-        size = -1;
+  if (m_pTags)
+    usage.tags = m_pTags->GetMemoryUsage();
 
-      pSegment = new (std::nothrow) Segment(pReader, idpos, pos, size);
-      if (pSegment == NULL)
-        return E_PARSE_FAILED;
+  if (m_pInfo)
+    usage.other += m_pInfo->GetMemoryUsage();
 
-      return 0;  // success
-    }
+  if (m_pSeekHead)
+    usage.other += m_pSeekHead->GetMemoryUsage();
 
-    if (size == unknown_size)
-      return E_FILE_FORMAT_INVALID;
+  usage.total = usage.segment + usage.clusters + usage.block_entries +
+                usage.tracks + usage.cues + usage.chapters + usage.tags +
+                usage.other;
+}
 
-    if ((total >= 0) && ((pos + size) > total))
-      return E_FILE_FORMAT_INVALID;
+void Segment::AddClusterMemoryUsage(const Cluster* pCluster,
+                                    MemoryUsage& usage) const {
+  assert(pCluster);
 
-    if ((pos + size) > available)
-      return pos + size;
+  usage.clusters += sizeof(Cluster);
+  usage.clusters += pCluster->m_entries_size * sizeof(BlockEntry*);
+  usage.clusters +=
+      pCluster->m_track_entries_size * sizeof(Cluster::TrackEntries);
 
-    pos += size;  // consume payload
+  for (long i = 0; i < pCluster->m_track_entries_count; ++i) {
+    const Cluster::TrackEntries& entries = pCluster->m_track_entries[i];
+    usage.clusters += entries.size * (sizeof(long) + sizeof(short));
   }
+
+  usage.block_entries += pCluster->m_arena_bytes;
 }
 
-long long Segment::ParseHeaders() {
-  // Outermost (level 0) segment object has been constructed,
-  // and pos designates start of payload.  We need to find the
-  // inner (level 1) elements.
-  long long total, available;
+long Segment::BuildIndex(unsigned char*& buf, long long& size) {
+  buf = NULL;
+  size = 0;
 
-  const int status = m_pReader->Length(&total, &available);
+  if (m_pInfo == NULL || m_pTracks == NULL || !DoneParsing())
+    return E_PARSE_FAILED;
 
-  if (status < 0)  // error
-    return status;
+  long long total, avail;
 
-  if (total > 0 && available > total)
-    return E_FILE_FORMAT_INVALID;
+  long status = m_pReader->Length(&total, &avail);
 
-  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
+  if (status < 0)  // error
+    return status;
 
-  if ((segment_stop >= 0 && total >= 0 && segment_stop > total) ||
-      (segment_stop >= 0 && m_pos > segment_stop)) {
-    return E_FILE_FORMAT_INVALID;
-  }
+  if (total < 0 || avail < total)
+    return E_BUFFER_NOT_FULL;
 
-  for (;;) {
-    if ((total >= 0) && (m_pos >= total))
-      break;
+  unsigned long long hash;
 
-    if ((segment_stop >= 0) && (m_pos >= segment_stop))
-      break;
+  status = HashIndexedFile(m_pReader, total, hash);
 
-    long long pos = m_pos;
-    const long long element_start = pos;
+  if (status < 0)
+    return status;
 
-    // Avoid rolling over pos when very close to LLONG_MAX.
-    unsigned long long rollover_check = pos + 1ULL;
-    if (rollover_check > LLONG_MAX)
-      return E_FILE_FORMAT_INVALID;
+  const long long header_ids[] = {
+      libwebm::kMkvSeekHead, libwebm::kMkvInfo,     libwebm::kMkvTracks,
+      libwebm::kMkvCues,     libwebm::kMkvChapters, libwebm::kMkvTags};
+  const long long header_starts[] = {
+      m_pSeekHead ? m_pSeekHead->m_element_start : -1,
+      m_pInfo->m_element_start,
+      m_pTracks->m_element_start,
+      m_pCues ? m_pCues->m_element_start : -1,
+      m_pChapters ? m_pChapters->m_element_start : -1,
+      m_pTags ? m_pTags->m_element_start : -1};
+  const long long header_sizes[] = {
+      m_pSeekHead ? m_pSeekHead->m_element_size : 0,
+      m_pInfo->m_element_size,
+      m_pTracks->m_element_size,
+      m_pCues ? m_pCues->m_element_size : 0,
+      m_pChapters ? m_pChapters->m_element_size : 0,
+      m_pTags ? m_pTags->m_element_size : 0};
+  const int header_max = sizeof(header_ids) / sizeof(header_ids[0]);
+
+  int header_count = 0;
+
+  for (int i = 0; i < header_max; ++i) {
+    if (header_starts[i] >= 0)
+      ++header_count;
+  }
+
+  IndexedKeyframe* keyframes = NULL;
+  long keyframes_count = 0;
+  long keyframes_size = 0;
+
+  for (long i = 0; i < m_clusterCount; ++i) {
+    const Cluster* const pCluster = m_clusters[i];
+
+    const BlockEntry* pEntry;
+    status = pCluster->GetFirst(pEntry);
+
+    while (status >= 0 && pEntry != NULL && !pEntry->EOS()) {
+      const Block* const pBlock = pEntry->GetBlock();
+      const Track* const pTrack =
+          m_pTracks->GetTrackByNumber(pBlock->GetTrackNumber());
+
+      if (pTrack && pTrack->GetType() == Track::kVideo && pBlock->IsKey()) {
+        if (keyframes_count >= keyframes_size) {
+          const long n = (keyframes_size <= 0) ? 256 : 2 * keyframes_size;
+
+          IndexedKeyframe* const kk = new (std::nothrow) IndexedKeyframe[n];
+
+          if (kk == NULL) {
+            delete[] keyframes;
+            return -1;
+          }
+
+          for (long k = 0; k < keyframes_count; ++k)
+            kk[k] = keyframes[k];
+
+          delete[] keyframes;
+
+          keyframes = kk;
+          keyframes_size = n;
+        }
 
-    if ((pos + 1) > available)
-      return (pos + 1);
+        IndexedKeyframe& k = keyframes[keyframes_count++];
 
-    long len;
-    long long result = GetUIntLength(m_pReader, pos, len);
+        k.track = pBlock->GetTrackNumber();
+        k.time = pBlock->GetTime(pCluster);
+        k.cluster = i;
+        k.block = pEntry->GetIndex();
+      }
 
-    if (result < 0)  // error
-      return result;
+      status = pCluster->GetNext(pEntry, pEntry);
+    }
 
-    if (result > 0) {
-      // MkvReader doesn't have enough data to satisfy this read attempt.
-      return (pos + 1);
+    if (status >= 0 &&
+        (pCluster->m_element_size <= 0 || pCluster->m_blocks_pos < 0)) {
+      status = E_FILE_FORMAT_INVALID;
     }
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+    if (status < 0) {
+      delete[] keyframes;
+      return status;
+    }
+  }
 
-    if ((pos + len) > available)
-      return pos + len;
+  // Keyframes were gathered in file order; sort them by track, then time.
+  std::stable_sort(keyframes, keyframes + keyframes_count,
+                   [](const IndexedKeyframe& a, const IndexedKeyframe& b) {
+                     return a.track < b.track ||
+                            (a.track == b.track && a.time < b.time);
+                   });
 
-    const long long idpos = pos;
-    const long long id = ReadID(m_pReader, idpos, len);
+  size = kIndexHeaderSize + 4 + header_count * kIndexHeaderEntrySize + 4 +
+         m_clusterCount * kIndexClusterEntrySize + 4 +
+         keyframes_count * kIndexKeyframeEntrySize;
 
-    if (id < 0)
-      return E_FILE_FORMAT_INVALID;
+  buf = new (std::nothrow) unsigned char[static_cast<size_t>(size)];
 
-    if (id == libwebm::kMkvCluster)
-      break;
+  if (buf == NULL) {
+    delete[] keyframes;
+    size = 0;
+    return -1;
+  }
 
-    pos += len;  // consume ID
+  unsigned char* p = buf;
 
-    if ((pos + 1) > available)
-      return (pos + 1);
+  memcpy(p, kIndexMagic, sizeof(kIndexMagic));
+  p += sizeof(kIndexMagic);
 
-    // Read Size
-    result = GetUIntLength(m_pReader, pos, len);
+  PutIndexInt(p, kIndexVersion, 4);
+  PutIndexInt(p, total, 8);
+  PutIndexInt(p, hash, 8);
+  PutIndexInt(p, m_start, 8);
+  PutIndexInt(p, m_size, 8);
 
-    if (result < 0)  // error
-      return result;
+  PutIndexInt(p, header_count, 4);
 
-    if (result > 0) {
-      // MkvReader doesn't have enough data to satisfy this read attempt.
-      return (pos + 1);
-    }
+  for (int i = 0; i < header_max; ++i) {
+    if (header_starts[i] < 0)
+      continue;
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+    PutIndexInt(p, header_ids[i], 8);
+    PutIndexInt(p, header_starts[i], 8);
+    PutIndexInt(p, header_sizes[i], 8);
+  }
 
-    if ((pos + len) > available)
-      return pos + len;
+  PutIndexInt(p, m_clusterCount, 4);
 
-    const long long size = ReadUInt(m_pReader, pos, len);
+  for (long i = 0; i < m_clusterCount; ++i) {
+    const Cluster* const pCluster = m_clusters[i];
 
-    if (size < 0 || len < 1 || len > 8) {
-      // TODO(tomfinegan): ReadUInt should return an error when len is < 1 or
-      // len > 8 is true instead of checking this _everywhere_.
-      return size;
-    }
+    PutIndexInt(p, pCluster->m_element_start, 8);
+    PutIndexInt(p, pCluster->m_element_size, 8);
+    PutIndexInt(p, pCluster->m_timecode, 8);
+    PutIndexInt(p, pCluster->m_blocks_pos, 8);
+  }
 
-    pos += len;  // consume length of size of element
+  PutIndexInt(p, keyframes_count, 4);
 
-    // Avoid rolling over pos when very close to LLONG_MAX.
-    rollover_check = static_cast<unsigned long long>(pos) + size;
-    if (rollover_check > LLONG_MAX)
-      return E_FILE_FORMAT_INVALID;
+  for (long i = 0; i < keyframes_count; ++i) {
+    const IndexedKeyframe& k = keyframes[i];
 
-    const long long element_size = size + pos - element_start;
+    PutIndexInt(p, k.track, 8);
+    PutIndexInt(p, k.time, 8);
+    PutIndexInt(p, k.cluster, 4);
+    PutIndexInt(p, k.block, 4);
+  }
 
-    // Pos now points to start of payload
+  delete[] keyframes;
 
-    if ((segment_stop >= 0) && ((pos + size) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+  assert(p == buf + size);
+  return 0;
+}
 
-    // We read EBML elements either in total or nothing at all.
+long Segment::AttachIndex(const unsigned char* buf, long long size) {
+  if (buf == NULL || m_indexed || m_pos != m_start || m_clusters != NULL ||
+      m_clusterPreloadCount != 0 || m_pInfo != NULL || m_pTracks != NULL ||
+      m_pSeekHead != NULL || m_pCues != NULL || m_pChapters != NULL ||
+      m_pTags != NULL) {
+    return E_PARSE_FAILED;
+  }
 
-    if ((pos + size) > available)
-      return pos + size;
+  if (size < kIndexHeaderSize ||
+      memcmp(buf, kIndexMagic, sizeof(kIndexMagic)) != 0) {
+    return E_FILE_FORMAT_INVALID;
+  }
 
-    if (id == libwebm::kMkvInfo) {
-      if (m_pInfo)
-        return E_FILE_FORMAT_INVALID;
+  const unsigned char* const end = buf + size;
+  const unsigned char* p = buf + sizeof(kIndexMagic);
 
-      m_pInfo = new (std::nothrow)
-          SegmentInfo(this, pos, size, element_start, element_size);
+  if (GetIndexInt(p, 4) != kIndexVersion)
+    return E_FILE_FORMAT_INVALID;
 
-      if (m_pInfo == NULL)
-        return -1;
+  const long long file_size = GetIndexInt(p, 8);
+  const unsigned long long file_hash = GetIndexInt(p, 8);
+  const long long segment_start = GetIndexInt(p, 8);
+  const long long segment_size = GetIndexInt(p, 8);
 
-      const long status = m_pInfo->Parse();
+  if (segment_start != m_start || segment_size != m_size)
+    return E_FILE_FORMAT_INVALID;
 
-      if (status)
-        return status;
-    } else if (id == libwebm::kMkvTracks) {
-      if (m_pTracks)
-        return E_FILE_FORMAT_INVALID;
+  long long total, avail;
 
-      m_pTracks = new (std::nothrow)
-          Tracks(this, pos, size, element_start, element_size);
+  long status = m_pReader->Length(&total, &avail);
 
-      if (m_pTracks == NULL)
-        return -1;
+  if (status < 0)  // error
+    return status;
 
-      const long status = m_pTracks->Parse();
+  if (total < 0 || total != file_size)
+    return E_FILE_FORMAT_INVALID;
 
-      if (status)
-        return status;
-    } else if (id == libwebm::kMkvCues) {
-      if (m_pCues == NULL) {
-        m_pCues = new (std::nothrow)
-            Cues(this, pos, size, element_start, element_size);
+  if (avail < total)
+    return E_BUFFER_NOT_FULL;
 
-        if (m_pCues == NULL)
-          return -1;
-      }
-    } else if (id == libwebm::kMkvSeekHead) {
-      if (m_pSeekHead == NULL) {
-        m_pSeekHead = new (std::nothrow)
-            SeekHead(this, pos, size, element_start, element_size);
+  unsigned long long hash;
 
-        if (m_pSeekHead == NULL)
-          return -1;
+  status = HashIndexedFile(m_pReader, total, hash);
 
-        const long status = m_pSeekHead->Parse();
+  if (status < 0)
+    return status;
 
-        if (status)
-          return status;
-      }
-    } else if (id == libwebm::kMkvChapters) {
-      if (m_pChapters == NULL) {
-        m_pChapters = new (std::nothrow)
-            Chapters(this, pos, size, element_start, element_size);
+  if (hash != file_hash)
+    return E_FILE_FORMAT_INVALID;
 
-        if (m_pChapters == NULL)
-          return -1;
+  const long long stop = (m_size >= 0) ? m_start + m_size : total;
 
-        const long status = m_pChapters->Parse();
+  if (stop > total)
+    return E_FILE_FORMAT_INVALID;
 
-        if (status)
-          return status;
-      }
-    } else if (id == libwebm::kMkvTags) {
-      if (m_pTags == NULL) {
-        m_pTags = new (std::nothrow)
-            Tags(this, pos, size, element_start, element_size);
+  // Locate and check the three tables before touching any segment state.
 
-        if (m_pTags == NULL)
-          return -1;
+  if (end - p < 4)
+    return E_FILE_FORMAT_INVALID;
 
-        const long status = m_pTags->Parse();
+  const long long header_count = GetIndexInt(p, 4);
 
-        if (status)
-          return status;
-      }
-    }
+  if (header_count > (end - p) / kIndexHeaderEntrySize)
+    return E_FILE_FORMAT_INVALID;
 
-    m_pos = pos + size;  // consume payload
-  }
+  const unsigned char* const headers = p;
+  p += header_count * kIndexHeaderEntrySize;
 
-  if (segment_stop >= 0 && m_pos > segment_stop)
+  if (end - p < 4)
     return E_FILE_FORMAT_INVALID;
 
-  if (m_pInfo == NULL)  // TODO: liberalize this behavior
-    return E_FILE_FORMAT_INVALID;
+  const long long cluster_count = GetIndexInt(p, 4);
 
-  if (m_pTracks == NULL)
+  if (cluster_count > (end - p) / kIndexClusterEntrySize)
     return E_FILE_FORMAT_INVALID;
 
-  return 0;  // success
-}
+  const unsigned char* const clusters = p;
+  p += cluster_count * kIndexClusterEntrySize;
 
-long Segment::LoadCluster(long long& pos, long& len) {
-  for (;;) {
-    const long result = DoLoadCluster(pos, len);
+  if (end - p < 4)
+    return E_FILE_FORMAT_INVALID;
 
-    if (result <= 1)
-      return result;
+  const long long keyframes_count = GetIndexInt(p, 4);
+
+  if (keyframes_count != (end - p) / kIndexKeyframeEntrySize ||
+      (end - p) % kIndexKeyframeEntrySize != 0) {
+    return E_FILE_FORMAT_INVALID;
   }
-}
 
-long Segment::DoLoadCluster(long long& pos, long& len) {
-  if (m_pos < 0)
-    return DoLoadClusterUnknownSize(pos, len);
+  const unsigned char* const keyframes = p;
 
-  long long total, avail;
+  p = clusters;
 
-  long status = m_pReader->Length(&total, &avail);
+  for (long long i = 0, prev_stop = m_start; i < cluster_count; ++i) {
+    const long long element_start = GetIndexInt(p, 8);
+    const long long element_size = GetIndexInt(p, 8);
+    const long long timecode = GetIndexInt(p, 8);
+    const long long blocks_pos = GetIndexInt(p, 8);
 
-  if (status < 0)  // error
-    return status;
+    if (element_start < prev_stop || element_size <= 0 ||
+        element_size > stop - element_start || timecode < 0 ||
+        blocks_pos <= element_start ||
+        blocks_pos >= element_start + element_size) {
+      return E_FILE_FORMAT_INVALID;
+    }
 
-  if (total >= 0 && avail > total)
-    return E_FILE_FORMAT_INVALID;
+    prev_stop = element_start + element_size;
+  }
 
-  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
+  p = keyframes;
 
-  long long cluster_off = -1;  // offset relative to start of segment
-  long long cluster_size = -1;  // size of cluster payload
+  for (long long i = 0, prev_track = 0, prev_time = 0; i < keyframes_count;
+       ++i) {
+    const long long track = GetIndexInt(p, 8);
+    const long long time = GetIndexInt(p, 8);
+    const long long cluster = GetIndexInt(p, 4);
+    const long long block = GetIndexInt(p, 4);
 
-  for (;;) {
-    if ((total >= 0) && (m_pos >= total))
-      return 1;  // no more clusters
+    if (track <= 0 || cluster < 0 || cluster >= cluster_count || block < 0 ||
+        block > LONG_MAX || track < prev_track ||
+        (track == prev_track && time < prev_time)) {
+      return E_FILE_FORMAT_INVALID;
+    }
 
-    if ((segment_stop >= 0) && (m_pos >= segment_stop))
-      return 1;  // no more clusters
+    prev_track = track;
+    prev_time = time;
+  }
 
-    pos = m_pos;
+  status = RestoreIndex(headers, header_count, clusters, cluster_count,
+                        keyframes, keyframes_count, stop);
 
-    // Read ID
+  if (status != 0) {
+    ClearIndexedLayout();
+    return status;
+  }
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+  m_pos = stop;
+  m_indexed = true;
 
-    long long result = GetUIntLength(m_pReader, pos, len);
+  return 0;
+}
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+long Segment::RestoreIndex(const unsigned char* headers, long long header_count,
+                           const unsigned char* clusters,
+                           long long cluster_count,
+                           const unsigned char* keyframes,
+                           long long keyframes_count, long long stop) {
+  const unsigned char* p = headers;
 
-    if (result > 0)
-      return E_BUFFER_NOT_FULL;
+  for (long long i = 0; i < header_count; ++i) {
+    const long long id = GetIndexInt(p, 8);
+    const long long element_start = GetIndexInt(p, 8);
+    const long long element_size = GetIndexInt(p, 8);
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+    if (element_start < m_start || element_size <= 0 ||
+        element_size > stop - element_start) {
       return E_FILE_FORMAT_INVALID;
+    }
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
-
-    const long long idpos = pos;
-    const long long id = ReadID(m_pReader, idpos, len);
+    long long pos = element_start;
+    long len;
 
-    if (id < 0)
+    if (ReadID(m_pReader, pos, len) != id)
       return E_FILE_FORMAT_INVALID;
 
     pos += len;  // consume ID
 
-    // Read Size
+    const long long payload_size = ReadUInt(m_pReader, pos, len);
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+    if (payload_size < 0)
+      return E_FILE_FORMAT_INVALID;
 
-    result = GetUIntLength(m_pReader, pos, len);
+    pos += len;  // consume size field
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+    if (pos + payload_size != element_start + element_size)
+      return E_FILE_FORMAT_INVALID;
 
-    if (result > 0)
-      return E_BUFFER_NOT_FULL;
+    const long status = ParseHeaderElement(id, pos, payload_size,
+                                           element_start, element_size);
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+    if (status)
+      return status;
+  }
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+  if (m_pInfo == NULL || m_pTracks == NULL)
+    return E_FILE_FORMAT_INVALID;
 
-    const long long size = ReadUInt(m_pReader, pos, len);
+  p = clusters;
 
-    if (size < 0)  // error
-      return static_cast<long>(size);
+  for (long i = 0; i < cluster_count; ++i) {
+    const long long element_start = GetIndexInt(p, 8);
 
-    pos += len;  // consume length of size of element
+    Cluster* const pCluster = Cluster::Create(this, i, element_start - m_start);
 
-    // pos now points to start of payload
+    if (pCluster == NULL)
+      return -1;
 
-    if (size == 0) {
-      // Missing element payload: move on.
-      m_pos = pos;
-      continue;
+    pCluster->m_element_size = GetIndexInt(p, 8);
+    pCluster->m_timecode = GetIndexInt(p, 8);
+    pCluster->m_blocks_pos = GetIndexInt(p, 8);
+    pCluster->m_pos = pCluster->m_blocks_pos;
+
+    if (!AppendCluster(pCluster)) {
+      delete pCluster;
+      return -1;
     }
+  }
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+  if (keyframes_count > 0) {
+    const size_t n = static_cast<size_t>(keyframes_count);
 
-    if ((segment_stop >= 0) && (size != unknown_size) &&
-        ((pos + size) > segment_stop)) {
-      return E_FILE_FORMAT_INVALID;
-    }
+    m_index_keyframes = new (std::nothrow) IndexedKeyframe[n];
 
-    if (id == libwebm::kMkvCues) {
-      if (size == unknown_size) {
-        // Cues element of unknown size: Not supported.
-        return E_FILE_FORMAT_INVALID;
-      }
+    if (m_index_keyframes == NULL)
+      return -1;
 
-      if (m_pCues == NULL) {
-        const long long element_size = (pos - idpos) + size;
+    p = keyframes;
 
-        m_pCues = new (std::nothrow) Cues(this, pos, size, idpos, element_size);
-        if (m_pCues == NULL)
-          return -1;
-      }
+    for (long i = 0; i < keyframes_count; ++i) {
+      IndexedKeyframe& k = m_index_keyframes[i];
 
-      m_pos = pos + size;  // consume payload
-      continue;
+      k.track = GetIndexInt(p, 8);
+      k.time = GetIndexInt(p, 8);
+      k.cluster = static_cast<long>(GetIndexInt(p, 4));
+      k.block = static_cast<long>(GetIndexInt(p, 4));
     }
 
-    if (id != libwebm::kMkvCluster) {
-      // Besides the Segment, Libwebm allows only cluster elements of unknown
-      // size. Fail the parse upon encountering a non-cluster element reporting
-      // unknown size.
-      if (size == unknown_size)
-        return E_FILE_FORMAT_INVALID;
+    m_index_keyframes_count = keyframes_count;
+  }
 
-      m_pos = pos + size;  // consume payload
-      continue;
-    }
+  return 0;
+}
 
-    // We have a cluster.
+void Segment::ClearIndexedLayout() {
+  for (long i = 0; i < m_clusterCount; ++i)
+    delete m_clusters[i];
 
-    cluster_off = idpos - m_start;  // relative pos
+  delete[] m_clusters;
+  m_clusters = NULL;
+  m_clusterCount = 0;
+  m_clusterSize = 0;
 
-    if (size != unknown_size)
-      cluster_size = size;
+  delete[] m_index_keyframes;
+  m_index_keyframes = NULL;
+  m_index_keyframes_count = 0;
 
-    break;
-  }
+  delete m_pInfo;
+  m_pInfo = NULL;
 
-  if (cluster_off < 0) {
-    // No cluster, die.
-    return E_FILE_FORMAT_INVALID;
-  }
+  delete m_pTracks;
+  m_pTracks = NULL;
 
-  long long pos_;
-  long len_;
+  delete m_pSeekHead;
+  m_pSeekHead = NULL;
 
-  status = Cluster::HasBlockEntries(this, cluster_off, pos_, len_);
+  delete m_pCues;
+  m_pCues = NULL;
 
-  if (status < 0) {  // error, or underflow
-    pos = pos_;
-    len = len_;
+  delete m_pChapters;
+  m_pChapters = NULL;
 
-    return status;
-  }
+  delete m_pTags;
+  m_pTags = NULL;
+}
 
-  // status == 0 means "no block entries found"
-  // status > 0 means "found at least one block entry"
+const BlockEntry* Segment::FindIndexedKeyframe(const Track* pTrack,
+                                               long long time_ns) const {
+  if (pTrack == NULL || m_index_keyframes_count <= 0)
+    return NULL;
 
-  // TODO:
-  // The issue here is that the segment increments its own
-  // pos ptr past the most recent cluster parsed, and then
-  // starts from there to parse the next cluster.  If we
-  // don't know the size of the current cluster, then we
-  // must either parse its payload (as we do below), looking
-  // for the cluster (or cues) ID to terminate the parse.
-  // This isn't really what we want: rather, we really need
-  // a way to create the curr cluster object immediately.
-  // The pity is that cluster::parse can determine its own
-  // boundary, and we largely duplicate that same logic here.
-  //
-  // Maybe we need to get rid of our look-ahead preloading
-  // in source::parse???
-  //
-  // As we're parsing the blocks in the curr cluster
-  //(in cluster::parse), we should have some way to signal
-  // to the segment that we have determined the boundary,
-  // so it can adjust its own segment::m_pos member.
-  //
-  // The problem is that we're asserting in asyncreadinit,
-  // because we adjust the pos down to the curr seek pos,
-  // and the resulting adjusted len is > 2GB.  I'm suspicious
-  // that this is even correct, but even if it is, we can't
-  // be loading that much data in the cache anyway.
+  const long long track = pTrack->GetNumber();
 
-  const long idx = m_clusterCount;
+  long lo = 0;
+  long hi = m_index_keyframes_count;
 
-  if (m_clusterPreloadCount > 0) {
-    if (idx >= m_clusterSize)
-      return E_FILE_FORMAT_INVALID;
+  while (lo < hi) {
+    // INVARIANT:
+    //[0, lo) <= (track, time_ns)
+    //[hi, count) > (track, time_ns)
 
-    Cluster* const pCluster = m_clusters[idx];
-    if (pCluster == NULL || pCluster->m_index >= 0)
-      return E_FILE_FORMAT_INVALID;
+    const long mid = lo + (hi - lo) / 2;
+    const IndexedKeyframe& k = m_index_keyframes[mid];
 
-    const long long off = pCluster->GetPosition();
-    if (off < 0)
-      return E_FILE_FORMAT_INVALID;
+    if (k.track < track || (k.track == track && k.time <= time_ns))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
 
-    if (off == cluster_off) {  // preloaded already
-      if (status == 0)  // no entries found
-        return E_FILE_FORMAT_INVALID;
+  long idx = lo - 1;
 
-      if (cluster_size >= 0)
-        pos += cluster_size;
-      else {
-        const long long element_size = pCluster->GetElementSize();
+  if (idx < 0 || m_index_keyframes[idx].track != track) {
+    // time_ns precedes the first keyframe of the track
+    idx = lo;
 
-        if (element_size <= 0)
-          return E_FILE_FORMAT_INVALID;  // TODO: handle this case
+    if (idx >= m_index_keyframes_count ||
+        m_index_keyframes[idx].track != track) {
+      return NULL;
+    }
+  }
 
-        pos = pCluster->m_element_start + element_size;
-      }
+  const IndexedKeyframe& k = m_index_keyframes[idx];
 
-      pCluster->m_index = idx;  // move from preloaded to loaded
-      ++m_clusterCount;
-      --m_clusterPreloadCount;
+  if (k.cluster >= m_clusterCount)
+    return NULL;
 
-      m_pos = pos;  // consume payload
-      if (segment_stop >= 0 && m_pos > segment_stop)
-        return E_FILE_FORMAT_INVALID;
+  const Cluster* const pCluster = m_clusters[k.cluster];
+  const BlockEntry* pEntry = NULL;
 
-      return 0;  // success
-    }
-  }
+  for (;;) {
+    long status = pCluster->GetEntry(k.block, pEntry);
 
-  if (status == 0) {  // no entries found
-    if (cluster_size >= 0)
-      pos += cluster_size;
+    if (status != E_BUFFER_NOT_FULL)
+      break;
 
-    if ((total >= 0) && (pos >= total)) {
-      m_pos = total;
-      return 1;  // no more clusters
-    }
+    long long pos;
+    long len;
 
-    if ((segment_stop >= 0) && (pos >= segment_stop)) {
-      m_pos = segment_stop;
-      return 1;  // no more clusters
-    }
+    status = pCluster->Parse(pos, len);
 
-    m_pos = pos;
-    return 2;  // try again
+    if (status != 0)  // done, or error
+      break;
   }
 
-  // status > 0 means we have an entry
+  if (pEntry == NULL)
+    return NULL;
 
-  Cluster* const pCluster = Cluster::Create(this, idx, cluster_off);
-  if (pCluster == NULL)
-    return -1;
+  const Block* const pBlock = pEntry->GetBlock();
 
-  if (!AppendCluster(pCluster)) {
-    delete pCluster;
-    return -1;
-  }
+  // A stale index falls back to the regular search.
+  if (pBlock == NULL || pBlock->GetTrackNumber() != track || !pBlock->IsKey())
+    return NULL;
 
-  if (cluster_size >= 0) {
-    pos += cluster_size;
+  return pEntry;
+}
 
-    m_pos = pos;
+long Segment::LoadAllClustersParallel(int thread_count) {
+  if (m_pInfo == NULL || m_pTracks == NULL) {
+    const long long status = ParseHeaders();
 
-    if (segment_stop > 0 && m_pos > segment_stop)
-      return E_FILE_FORMAT_INVALID;
+    if (status < 0)  // error
+      return static_cast<long>(status);
 
-    return 0;
+    if (status > 0)  // underflow
+      return E_BUFFER_NOT_FULL;
   }
 
-  m_pUnknownSize = pCluster;
-  m_pos = -pos;
+  for (;;) {
+    const long status = LoadCluster();
 
-  return 0;  // partial success, since we have a new cluster
+    if (status < 0)  // error
+      return status;
 
-  // status == 0 means "no block entries found"
-  // pos designates start of payload
-  // m_pos has NOT been adjusted yet (in case we need to come back here)
-}
+    if (status >= 1)  // no more clusters
+      break;
+  }
 
-long Segment::DoLoadClusterUnknownSize(long long& pos, long& len) {
-  if (m_pos >= 0 || m_pUnknownSize == NULL)
-    return E_PARSE_FAILED;
+  // Clusters of known size that have not been parsed at all go to the
+  // workers. Any others are finished here first.
+  std::vector<Cluster*> pending;
 
-  const long status = m_pUnknownSize->Parse(pos, len);
+  for (long i = 0; i < m_clusterCount; ++i) {
+    Cluster* const pCluster = m_clusters[i];
 
-  if (status < 0)  // error or underflow
-    return status;
+    if (pCluster->m_entries_count < 0 && pCluster->m_element_size >= 0) {
+      pending.push_back(pCluster);
+      continue;
+    }
 
-  if (status == 0)  // parsed a block
-    return 2;  // continue parsing
+    long long pos;
+    long len;
 
-  const long long start = m_pUnknownSize->m_element_start;
-  const long long size = m_pUnknownSize->GetElementSize();
+    long status;
 
-  if (size < 0)
-    return E_FILE_FORMAT_INVALID;
+    do {
+      status = pCluster->Parse(pos, len);
+    } while (status == 0);
 
-  pos = start + size;
-  m_pos = pos;
+    if (status < 0)
+      return status;
+  }
 
-  m_pUnknownSize = 0;
+  std::mutex reader_mutex;
+  std::atomic<size_t> next(0);
+  std::atomic<long> error(0);
 
-  return 2;  // continue parsing
-}
+  const auto worker = [&]() {
+    ClusterBufferReader reader(m_pReader, reader_mutex);
 
-bool Segment::AppendCluster(Cluster* pCluster) {
-  if (pCluster == NULL || pCluster->m_index < 0)
-    return false;
+    for (;;) {
+      const size_t i = next++;
 
-  const long count = m_clusterCount + m_clusterPreloadCount;
+      if (i >= pending.size())
+        break;
 
-  long& size = m_clusterSize;
-  const long idx = pCluster->m_index;
+      const Cluster* const pCluster = pending[i];
 
-  if (size < count || idx != m_clusterCount)
-    return false;
+      long status =
+          reader.Fill(pCluster->m_element_start, pCluster->m_element_size);
 
-  if (count >= size) {
-    const long n = (size <= 0) ? 2048 : 2 * size;
+      if (status == 0) {
+        pCluster->m_pParseReader = &reader;
 
-    Cluster** const qq = new (std::nothrow) Cluster*[n];
-    if (qq == NULL)
-      return false;
+        long long pos;
+        long len;
 
-    Cluster** q = qq;
-    Cluster** p = m_clusters;
-    Cluster** const pp = p + count;
+        do {
+          status = pCluster->Parse(pos, len);
+        } while (status == 0);
 
-    while (p != pp)
-      *q++ = *p++;
+        pCluster->m_pParseReader = NULL;
+      }
 
-    delete[] m_clusters;
+      if (status < 0) {
+        long expected = 0;
+        error.compare_exchange_strong(expected, status);
+      }
+    }
+  };
 
-    m_clusters = qq;
-    size = n;
-  }
+  m_parallel_parse = true;
 
-  if (m_clusterPreloadCount > 0) {
-    Cluster** const p = m_clusters + m_clusterCount;
-    if (*p == NULL || (*p)->m_index >= 0)
-      return false;
+  std::vector<std::thread> threads;
 
-    Cluster** q = p + m_clusterPreloadCount;
-    if (q >= (m_clusters + size))
-      return false;
+  for (int i = 1; i < thread_count && pending.size() > threads.size() + 1;
+       ++i) {
+    try {
+      threads.push_back(std::thread(worker));
+    } catch (const std::system_error&) {
+      break;  // carry on with the threads we have
+    }
+  }
 
-    for (;;) {
-      Cluster** const qq = q - 1;
-      if ((*qq)->m_index >= 0)
-        return false;
+  worker();
 
-      *q = *qq;
-      q = qq;
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
 
-      if (q == p)
-        break;
-    }
+  m_parallel_parse = false;
+
+  for (size_t i = 0; i < pending.size(); ++i) {
+    if (pending[i]->m_entries_count >= 0)
+      OnClusterParsed(pending[i], pending[i]->m_resident_bytes);
   }
 
-  m_clusters[idx] = pCluster;
-  ++m_clusterCount;
-  return true;
+  return error;
 }
 
-bool Segment::PreloadCluster(Cluster* pCluster, ptrdiff_t idx) {
-  if (pCluster == NULL || pCluster->m_index >= 0 || idx < m_clusterCount)
-    return false;
+long Segment::Freeze(int thread_count) {
+  if (m_frozen)
+    return 0;
 
-  const long count = m_clusterCount + m_clusterPreloadCount;
+  SetClusterEvictionPolicy(0, 0);
 
-  long& size = m_clusterSize;
-  if (size < count)
-    return false;
+  long status = LoadAllClustersParallel(thread_count);
 
-  if (count >= size) {
-    const long n = (size <= 0) ? 2048 : 2 * size;
+  if (status < 0)
+    return status;
 
-    Cluster** const qq = new (std::nothrow) Cluster*[n];
-    if (qq == NULL)
-      return false;
-    Cluster** q = qq;
+  if (m_pCues) {
+    while (m_pCues->LoadCuePoint()) {
+    }
 
-    Cluster** p = m_clusters;
-    Cluster** const pp = p + count;
+    if (!m_pCues->DoneParsing())
+      return E_FILE_FORMAT_INVALID;
 
-    while (p != pp)
-      *q++ = *p++;
+    // Resolving every cue point may preload clusters for positions that the
+    // cluster scan did not reach; those are parsed in full below.
+    for (unsigned long i = 0; i < m_pTracks->GetTracksCount(); ++i) {
+      const Track* const pTrack = m_pTracks->GetTrackByIndex(i);
 
-    delete[] m_clusters;
+      if (pTrack == NULL)
+        continue;
 
-    m_clusters = qq;
-    size = n;
-  }
+      for (const CuePoint* pCP = m_pCues->GetFirst(); pCP != NULL;
+           pCP = m_pCues->GetNext(pCP)) {
+        const CuePoint::TrackPosition* const pTP = pCP->Find(pTrack);
 
-  if (m_clusters == NULL)
-    return false;
+        if (pTP)
+          m_pCues->GetBlock(pCP, pTP);
+      }
 
-  Cluster** const p = m_clusters + idx;
+      m_pCues->GetTrackIndex(pTrack->GetNumber());
+    }
+  }
 
-  Cluster** q = m_clusters + count;
-  if (q < p || q >= (m_clusters + size))
-    return false;
+  for (long c = 0; c < m_preload_chunk_count; ++c) {
+    const PreloadChunk* const pChunk = m_preload_chunks[c];
 
-  while (q > p) {
-    Cluster** const qq = q - 1;
+    for (long k = 0; k < pChunk->count; ++k) {
+      const Cluster* const pCluster = pChunk->clusters[k];
 
-    if ((*qq)->m_index >= 0)
-      return false;
+      long long pos;
+      long len;
+
+      do {
+        status = pCluster->Parse(pos, len);
+      } while (status == 0);
 
-    *q = *qq;
-    q = qq;
+      if (status < 0)
+        return status;
+    }
   }
 
-  m_clusters[idx] = pCluster;
-  ++m_clusterPreloadCount;
-  return true;
+  m_frozen = true;
+  return 0;
 }
 
-long Segment::Load() {
-  if (m_clusters != NULL || m_clusterSize != 0 || m_clusterCount != 0)
-    return E_PARSE_FAILED;
+bool Segment::IsFrozen() const { return m_frozen; }
 
-  // Outermost (level 0) segment object has been constructed,
-  // and pos designates start of payload.  We need to find the
-  // inner (level 1) elements.
+bool Segment::AddResidentCluster(const Cluster* pCluster) {
+  if (m_resident_clusters_count >= m_resident_clusters_size) {
+    const long size =
+        (m_resident_clusters_size <= 0) ? 64 : 2 * m_resident_clusters_size;
 
-  const long long header_status = ParseHeaders();
+    const Cluster** const clusters = new (std::nothrow) const Cluster*[size];
+    if (clusters == NULL)
+      return false;
 
-  if (header_status < 0)  // error
-    return static_cast<long>(header_status);
+    for (long i = 0; i < m_resident_clusters_count; ++i) {
+      const long k = (m_resident_clusters_head + i) % m_resident_clusters_size;
+      clusters[i] = m_resident_clusters[k];
+    }
 
-  if (header_status > 0)  // underflow
-    return E_BUFFER_NOT_FULL;
+    delete[] m_resident_clusters;
 
-  if (m_pInfo == NULL || m_pTracks == NULL)
-    return E_FILE_FORMAT_INVALID;
+    m_resident_clusters = clusters;
+    m_resident_clusters_head = 0;
+    m_resident_clusters_size = size;
+  }
 
-  for (;;) {
-    const long status = LoadCluster();
+  const long tail = (m_resident_clusters_head + m_resident_clusters_count) %
+                    m_resident_clusters_size;
 
-    if (status < 0)  // error
-      return status;
+  m_resident_clusters[tail] = pCluster;
+  ++m_resident_clusters_count;
 
-    if (status >= 1)  // no more clusters
-      return 0;
-  }
+  return true;
 }
 
-SeekHead::Entry::Entry() : id(0), pos(0), element_start(0), element_size(0) {}
+void Segment::OnClusterParsed(const Cluster* pCluster, long long bytes_delta) {
+  // LoadAllClustersParallel() accounts for its clusters once parsing is done.
+  if (m_parallel_parse)
+    return;
 
-SeekHead::SeekHead(Segment* pSegment, long long start, long long size_,
-                   long long element_start, long long element_size)
-    : m_pSegment(pSegment),
-      m_start(start),
-      m_size(size_),
-      m_element_start(element_start),
-      m_element_size(element_size),
-      m_entries(0),
-      m_entry_count(0),
-      m_void_elements(0),
-      m_void_element_count(0) {}
+  ClusterCacheStats& stats = m_cluster_cache_stats;
 
-SeekHead::~SeekHead() {
-  delete[] m_entries;
-  delete[] m_void_elements;
-}
+  if (!pCluster->m_resident) {
+    pCluster->m_resident = true;
 
-long SeekHead::Parse() {
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+    if (pCluster->m_evicted)
+      ++stats.reparses;
 
-  long long pos = m_start;
-  const long long stop = m_start + m_size;
+    if (++stats.resident_clusters > stats.peak_resident_clusters)
+      stats.peak_resident_clusters = stats.resident_clusters;
 
-  // first count the seek head entries
+    // If the queue cannot grow the cluster simply stays resident.
+    if (IsEvicting())
+      AddResidentCluster(pCluster);
+  }
 
-  long long entry_count = 0;
-  long long void_element_count = 0;
+  stats.resident_bytes += bytes_delta;
 
-  while (pos < stop) {
-    long long id, size;
+  if (stats.resident_bytes > stats.peak_resident_bytes)
+    stats.peak_resident_bytes = stats.resident_bytes;
 
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+  EvictClusters(pCluster);
+}
 
-    if (status < 0)  // error
-      return status;
+void Segment::OnClusterRead(const Cluster* pCluster) {
+  if (!IsEvicting() || m_parallel_parse)
+    return;
 
-    if (id == libwebm::kMkvSeek) {
-      ++entry_count;
-      if (entry_count > INT_MAX)
-        return E_PARSE_FAILED;
-    } else if (id == libwebm::kMkvVoid) {
-      ++void_element_count;
-      if (void_element_count > INT_MAX)
-        return E_PARSE_FAILED;
-    }
+  if (m_cursor_pos == pCluster->m_element_start)
+    return;
 
-    pos += size;  // consume payload
+  m_cursor_pos = pCluster->m_element_start;
 
-    if (pos > stop)
-      return E_FILE_FORMAT_INVALID;
-  }
+  // Clusters held back for the previous position may be released now.
+  EvictClusters(pCluster);
+}
 
-  if (pos != stop)
-    return E_FILE_FORMAT_INVALID;
+bool Segment::IsEvicting() const {
+  return m_max_resident_clusters > 0 || m_max_resident_bytes > 0;
+}
 
-  if (entry_count > 0) {
-    m_entries = new (std::nothrow) Entry[static_cast<size_t>(entry_count)];
+long long Segment::GetEvictionLimit() const {
+  long long limit = m_cursor_pos;
 
-    if (m_entries == NULL)
-      return -1;
-  }
+  const long count = (m_pTracks == NULL) ? 0 : m_pTracks->GetTracksCount();
 
-  if (void_element_count > 0) {
-    m_void_elements =
-        new (std::nothrow) VoidElement[static_cast<size_t>(void_element_count)];
+  for (long i = 0; i < count; ++i) {
+    const Track* const pTrack = m_pTracks->GetTrackByIndex(i);
 
-    if (m_void_elements == NULL)
-      return -1;
+    if (pTrack == NULL || pTrack->m_cursor_pos < 0)
+      continue;
+
+    if (limit < 0 || pTrack->m_cursor_pos < limit)
+      limit = pTrack->m_cursor_pos;
   }
 
-  // now parse the entries and void elements
+  return limit;
+}
 
-  Entry* pEntry = m_entries;
-  VoidElement* pVoidElement = m_void_elements;
+void Segment::EvictClusters(const Cluster* pCurrent) {
+  ClusterCacheStats& stats = m_cluster_cache_stats;
 
-  pos = m_start;
+  if (m_resident_clusters_count <= 0)
+    return;
 
-  while (pos < stop) {
-    const long long idpos = pos;
+  const long long limit = GetEvictionLimit();
 
-    long long id, size;
+  if (m_evict_blocked_count == m_resident_clusters_count &&
+      m_evict_blocked_limit == limit && m_evict_blocked_current == pCurrent) {
+    return;
+  }
 
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+  // Each queued cluster is looked at once; those that must stay resident go
+  // to the back of the queue.
+  long n = m_resident_clusters_count;
+  bool over;
 
-    if (status < 0)  // error
-      return status;
+  for (;;) {
+    const bool over_count = m_max_resident_clusters > 0 &&
+                            stats.resident_clusters > m_max_resident_clusters;
+    const bool over_bytes = m_max_resident_bytes > 0 &&
+                            stats.resident_bytes > m_max_resident_bytes;
 
-    if (id == libwebm::kMkvSeek && entry_count > 0) {
-      if (ParseEntry(pReader, pos, size, pEntry)) {
-        Entry& e = *pEntry++;
+    over = over_count || over_bytes;
 
-        e.element_start = idpos;
-        e.element_size = (pos + size) - idpos;
-      }
-    } else if (id == libwebm::kMkvVoid && void_element_count > 0) {
-      VoidElement& e = *pVoidElement++;
+    if (!over || n <= 0)
+      break;
 
-      e.element_start = idpos;
-      e.element_size = (pos + size) - idpos;
-    }
+    --n;
 
-    pos += size;  // consume payload
-    if (pos > stop)
-      return E_FILE_FORMAT_INVALID;
-  }
+    const Cluster* const pCluster =
+        m_resident_clusters[m_resident_clusters_head];
 
-  if (pos != stop)
-    return E_FILE_FORMAT_INVALID;
+    m_resident_clusters_head =
+        (m_resident_clusters_head + 1) % m_resident_clusters_size;
 
-  ptrdiff_t count_ = ptrdiff_t(pEntry - m_entries);
-  assert(count_ >= 0);
-  assert(static_cast<long long>(count_) <= entry_count);
+    // The cluster being parsed, an unknown-size cluster whose end is still
+    // being searched for, and clusters at or after a read position stay
+    // resident.
+    if (pCluster == pCurrent || pCluster == m_pUnknownSize ||
+        (limit >= 0 && pCluster->m_element_start >= limit)) {
+      const long tail =
+          (m_resident_clusters_head + m_resident_clusters_count - 1) %
+          m_resident_clusters_size;
 
-  m_entry_count = static_cast<int>(count_);
+      m_resident_clusters[tail] = pCluster;
+      continue;
+    }
 
-  count_ = ptrdiff_t(pVoidElement - m_void_elements);
-  assert(count_ >= 0);
-  assert(static_cast<long long>(count_) <= void_element_count);
+    --m_resident_clusters_count;
 
-  m_void_element_count = static_cast<int>(count_);
+    stats.resident_bytes -= pCluster->m_resident_bytes;
+    --stats.resident_clusters;
+    ++stats.evictions;
 
-  return 0;
-}
+    pCluster->ReleaseEntries();
+  }
 
-int SeekHead::GetCount() const { return m_entry_count; }
+  if (over) {
+    m_evict_blocked_limit = limit;
+    m_evict_blocked_current = pCurrent;
+    m_evict_blocked_count = m_resident_clusters_count;
+  } else {
+    m_evict_blocked_count = -1;
+  }
+}
 
-const SeekHead::Entry* SeekHead::GetEntry(int idx) const {
-  if (idx < 0)
-    return 0;
+long long Segment::CreateInstance(IMkvReader* pReader, long long pos,
+                                  Segment*& pSegment) {
+  if (pReader == NULL || pos < 0)
+    return E_PARSE_FAILED;
 
-  if (idx >= m_entry_count)
-    return 0;
+  pSegment = NULL;
 
-  return m_entries + idx;
-}
+  long long total, available;
 
-int SeekHead::GetVoidElementCount() const { return m_void_element_count; }
+  const long status = pReader->Length(&total, &available);
 
-const SeekHead::VoidElement* SeekHead::GetVoidElement(int idx) const {
-  if (idx < 0)
-    return 0;
+  if (status < 0)  // error
+    return status;
 
-  if (idx >= m_void_element_count)
-    return 0;
+  if (available < 0)
+    return -1;
+
+  if ((total >= 0) && (available > total))
+    return -1;
+
+  // I would assume that in practice this loop would execute
+  // exactly once, but we allow for other elements (e.g. Void)
+  // to immediately follow the EBML header.  This is fine for
+  // the source filter case (since the entire file is available),
+  // but in the splitter case over a network we should probably
+  // just give up early.  We could for example decide only to
+  // execute this loop a maximum of, say, 10 times.
+  // TODO:
+  // There is an implied "give up early" by only parsing up
+  // to the available limit.  We do do that, but only if the
+  // total file size is unknown.  We could decide to always
+  // use what's available as our limit (irrespective of whether
+  // we happen to know the total file length).  This would have
+  // as its sense "parse this much of the file before giving up",
+  // which a slightly different sense from "try to parse up to
+  // 10 EMBL elements before giving up".
+
+  for (;;) {
+    if ((total >= 0) && (pos >= total))
+      return E_FILE_FORMAT_INVALID;
+
+    // Read ID
+    long len;
+    long long result = GetUIntLength(pReader, pos, len);
+
+    if (result)  // error, or too few available bytes
+      return result;
+
+    if ((total >= 0) && ((pos + len) > total))
+      return E_FILE_FORMAT_INVALID;
+
+    if ((pos + len) > available)
+      return pos + len;
+
+    const long long idpos = pos;
+    const long long id = ReadID(pReader, pos, len);
+
+    if (id < 0)
+      return E_FILE_FORMAT_INVALID;
+
+    pos += len;  // consume ID
+
+    // Read Size
+
+    result = GetUIntLength(pReader, pos, len);
+
+    if (result)  // error, or too few available bytes
+      return result;
+
+    if ((total >= 0) && ((pos + len) > total))
+      return E_FILE_FORMAT_INVALID;
+
+    if ((pos + len) > available)
+      return pos + len;
+
+    long long size = ReadUInt(pReader, pos, len);
+
+    if (size < 0)  // error
+      return size;
+
+    pos += len;  // consume length of size of element
+
+    // Pos now points to start of payload
+
+    // Handle "unknown size" for live streaming of webm files.
+    const long long unknown_size = (1LL << (7 * len)) - 1;
+
+    if (id == libwebm::kMkvSegment) {
+      if (size == unknown_size)
+        size = -1;
+
+      else if (total < 0)
+        size = -1;
+
+      else if ((pos + size) > total)
+        size = -1;
+
+      pSegment = new (std::nothrow) Segment(pReader, idpos, pos, size);
+      if (pSegment == NULL)
+        return E_PARSE_FAILED;
+
+      return 0;  // success
+    }
+
+    if (size == unknown_size)
+      return E_FILE_FORMAT_INVALID;
+
+    if ((total >= 0) && ((pos + size) > total))
+      return E_FILE_FORMAT_INVALID;
+
+    if ((pos + size) > available)
+      return pos + size;
+
+    pos += size;  // consume payload
+  }
+}
+
+long long Segment::ParseHeaders() {
+  // Outermost (level 0) segment object has been constructed,
+  // and pos designates start of payload.  We need to find the
+  // inner (level 1) elements.
+  long long total, available;
+
+  const int status = m_pReader->Length(&total, &available);
+
+  if (status < 0)  // error
+    return status;
+
+  if (total > 0 && available > total)
+    return E_FILE_FORMAT_INVALID;
+
+  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
+
+  if ((segment_stop >= 0 && total >= 0 && segment_stop > total) ||
+      (segment_stop >= 0 && m_pos > segment_stop)) {
+    return E_FILE_FORMAT_INVALID;
+  }
+
+  for (;;) {
+    if ((total >= 0) && (m_pos >= total))
+      break;
+
+    if ((segment_stop >= 0) && (m_pos >= segment_stop))
+      break;
+
+    long long pos = m_pos;
+    const long long element_start = pos;
+
+    // Avoid rolling over pos when very close to LLONG_MAX.
+    unsigned long long rollover_check = pos + 1ULL;
+    if (rollover_check > LLONG_MAX)
+      return E_FILE_FORMAT_INVALID;
+
+    if ((pos + 1) > available)
+      return (pos + 1);
+
+    long len;
+    long long result = GetUIntLength(m_pReader, pos, len);
+
+    if (result < 0)  // error
+      return result;
+
+    if (result > 0) {
+      // MkvReader doesn't have enough data to satisfy this read attempt.
+      return (pos + 1);
+    }
+
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
+
+    if ((pos + len) > available)
+      return pos + len;
+
+    const long long idpos = pos;
+    const long long id = ReadID(m_pReader, idpos, len);
+
+    if (id < 0)
+      return E_FILE_FORMAT_INVALID;
+
+    if (id == libwebm::kMkvCluster)
+      break;
+
+    pos += len;  // consume ID
+
+    if ((pos + 1) > available)
+      return (pos + 1);
+
+    // Read Size
+    result = GetUIntLength(m_pReader, pos, len);
+
+    if (result < 0)  // error
+      return result;
+
+    if (result > 0) {
+      // MkvReader doesn't have enough data to satisfy this read attempt.
+      return (pos + 1);
+    }
+
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
+
+    if ((pos + len) > available)
+      return pos + len;
+
+    const long long size = ReadUInt(m_pReader, pos, len);
+
+    if (size < 0 || len < 1 || len > 8) {
+      // TODO(tomfinegan): ReadUInt should return an error when len is < 1 or
+      // len > 8 is true instead of checking this _everywhere_.
+      return size;
+    }
+
+    pos += len;  // consume length of size of element
+
+    // Avoid rolling over pos when very close to LLONG_MAX.
+    rollover_check = static_cast<unsigned long long>(pos) + size;
+    if (rollover_check > LLONG_MAX)
+      return E_FILE_FORMAT_INVALID;
+
+    const long long element_size = size + pos - element_start;
+
+    // Pos now points to start of payload
+
+    if ((segment_stop >= 0) && ((pos + size) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
+
+    // We read EBML elements either in total or nothing at all.
+
+    if ((pos + size) > available)
+      return pos + size;
+
+    const long status =
+        ParseHeaderElement(id, pos, size, element_start, element_size);
+
+    if (status)
+      return status;
+
+    m_pos = pos + size;  // consume payload
+  }
+
+  if (segment_stop >= 0 && m_pos > segment_stop)
+    return E_FILE_FORMAT_INVALID;
+
+  if (m_pInfo == NULL)  // TODO: liberalize this behavior
+    return E_FILE_FORMAT_INVALID;
+
+  if (m_pTracks == NULL)
+    return E_FILE_FORMAT_INVALID;
+
+  return 0;  // success
+}
+
+long Segment::ParseHeaderElement(long long id, long long pos, long long size,
+                                 long long element_start,
+                                 long long element_size) {
+  if (id == libwebm::kMkvInfo) {
+    if (m_pInfo)
+      return E_FILE_FORMAT_INVALID;
+
+    m_pInfo = new (std::nothrow)
+        SegmentInfo(this, pos, size, element_start, element_size);
+
+    if (m_pInfo == NULL)
+      return -1;
+
+    const long status = m_pInfo->Parse();
+
+    if (status)
+      return status;
+  } else if (id == libwebm::kMkvTracks) {
+    if (m_pTracks)
+      return E_FILE_FORMAT_INVALID;
+
+    m_pTracks = new (std::nothrow)
+        Tracks(this, pos, size, element_start, element_size);
+
+    if (m_pTracks == NULL)
+      return -1;
+
+    const long status = m_pTracks->Parse();
+
+    if (status)
+      return status;
+  } else if (id == libwebm::kMkvCues) {
+    if (m_pCues == NULL) {
+      m_pCues = new (std::nothrow)
+          Cues(this, pos, size, element_start, element_size);
+
+      if (m_pCues == NULL)
+        return -1;
+    }
+  } else if (id == libwebm::kMkvSeekHead) {
+    if (m_pSeekHead == NULL) {
+      m_pSeekHead = new (std::nothrow)
+          SeekHead(this, pos, size, element_start, element_size);
+
+      if (m_pSeekHead == NULL)
+        return -1;
+
+      const long status = m_pSeekHead->Parse();
+
+      if (status)
+        return status;
+    }
+  } else if (id == libwebm::kMkvChapters) {
+    if (m_pChapters == NULL) {
+      m_pChapters = new (std::nothrow)
+          Chapters(this, pos, size, element_start, element_size);
+
+      if (m_pChapters == NULL)
+        return -1;
+
+      const long status = m_pChapters->Parse();
+
+      if (status)
+        return status;
+    }
+  } else if (id == libwebm::kMkvTags) {
+    if (m_pTags == NULL) {
+      m_pTags = new (std::nothrow)
+          Tags(this, pos, size, element_start, element_size);
+
+      if (m_pTags == NULL)
+        return -1;
+
+      const long status = m_pTags->Parse();
+
+      if (status)
+        return status;
+    }
+  }
+
+  return 0;
+}
+
+long Segment::LoadCluster(long long& pos, long& len) {
+  for (;;) {
+    const long result = DoLoadCluster(pos, len);
+
+    if (result <= 1)
+      return result;
+  }
+}
+
+long Segment::GetNextLiveBlock(const BlockEntry* pCurr,
+                               const BlockEntry*& pNext) {
+  pNext = NULL;
+
+  long long pos;
+  long len;
+
+  const Cluster* pCluster;
+
+  if (pCurr) {
+    pCluster = pCurr->GetCluster();
+
+    const long status = pCluster->GetNext(pCurr, pNext);
+
+    if (status < 0)  // error or underflow
+      return status;
+  } else {
+    if (m_clusterCount <= 0) {
+      const long status = LoadCluster(pos, len);
+
+      if (status < 0)  // error or underflow
+        return status;
+
+      if (status > 0)
+        return 1;  // no clusters
+    }
+
+    pCluster = m_clusters[0];
+
+    const long status = pCluster->GetFirst(pNext);
+
+    if (status < 0)
+      return status;
+  }
+
+  while (pNext == NULL) {  // |pCluster| has no more blocks
+    const long idx = pCluster->GetIndex();
+
+    if (idx + 1 >= m_clusterCount) {
+      const long status = LoadCluster(pos, len);
+
+      if (status < 0)  // error or underflow
+        return status;
+
+      if (status > 0)
+        return 1;  // no more clusters
+
+      if (idx + 1 >= m_clusterCount)
+        return E_PARSE_FAILED;
+    }
+
+    pCluster = m_clusters[idx + 1];
+
+    const long status = pCluster->GetFirst(pNext);
+
+    if (status < 0)
+      return status;
+  }
+
+  // The entry exists once its header is parsed; wait for its frames too.
+  const Block* const pBlock = pNext->GetBlock();
+
+  long long total, avail;
+
+  const int status = m_pReader->Length(&total, &avail);
+
+  if (status < 0)
+    return status;
+
+  if (pBlock->m_start + pBlock->m_size > avail) {
+    pNext = NULL;
+    return E_BUFFER_NOT_FULL;
+  }
+
+  if (!m_frozen && !m_indexed && pCluster->GetIndex() > 0)
+    DiscardClusters(pCluster->GetIndex());
+
+  return 0;
+}
+
+void Segment::DiscardClusters(long count) {
+  if (count > m_clusterCount)
+    count = m_clusterCount;
+
+  ClusterCacheStats& stats = m_cluster_cache_stats;
+
+  // Drop the discarded clusters from the eviction queue, keeping its order.
+  long k = 0;
+
+  for (long j = 0; j < m_resident_clusters_count; ++j) {
+    const long src = (m_resident_clusters_head + j) % m_resident_clusters_size;
+    const Cluster* const pCluster = m_resident_clusters[src];
+
+    if (pCluster->m_index >= 0 && pCluster->m_index < count)
+      continue;
+
+    const long dst = (m_resident_clusters_head + k++) %
+                     m_resident_clusters_size;
+    m_resident_clusters[dst] = pCluster;
+  }
+
+  m_resident_clusters_count = k;
+  m_evict_blocked_count = -1;
+
+  for (long i = 0; i < count; ++i) {
+    Cluster* const pCluster = m_clusters[i];
+    assert(pCluster);
+    assert(pCluster != m_pUnknownSize);
+
+    if (pCluster->m_resident) {
+      stats.resident_bytes -= pCluster->m_resident_bytes;
+      --stats.resident_clusters;
+    }
+
+    delete pCluster;
+  }
+
+  for (long i = count; i < m_clusterCount; ++i) {
+    Cluster* const pCluster = m_clusters[i];
+    pCluster->m_index -= count;
+    m_clusters[i - count] = pCluster;
+  }
+
+  m_clusterCount -= count;
+}
+
+long Segment::DoLoadCluster(long long& pos, long& len) {
+  if (m_pos < 0)
+    return DoLoadClusterUnknownSize(pos, len);
+
+  long long total, avail;
+
+  long status = m_pReader->Length(&total, &avail);
+
+  if (status < 0)  // error
+    return status;
+
+  if (total >= 0 && avail > total)
+    return E_FILE_FORMAT_INVALID;
+
+  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
+
+  long long cluster_off = -1;  // offset relative to start of segment
+  long long cluster_size = -1;  // size of cluster payload
+
+  for (;;) {
+    if ((total >= 0) && (m_pos >= total))
+      return 1;  // no more clusters
+
+    if ((segment_stop >= 0) && (m_pos >= segment_stop))
+      return 1;  // no more clusters
+
+    pos = m_pos;
+
+    // Read ID
+
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
+
+    long long result = GetUIntLength(m_pReader, pos, len);
+
+    if (result < 0)  // error
+      return static_cast<long>(result);
+
+    if (result > 0)
+      return E_BUFFER_NOT_FULL;
+
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
+
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
+
+    const long long idpos = pos;
+    const long long id = ReadID(m_pReader, idpos, len);
+
+    if (id < 0)
+      return E_FILE_FORMAT_INVALID;
+
+    pos += len;  // consume ID
+
+    // Read Size
+
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
+
+    result = GetUIntLength(m_pReader, pos, len);
+
+    if (result < 0)  // error
+      return static_cast<long>(result);
+
+    if (result > 0)
+      return E_BUFFER_NOT_FULL;
+
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
+
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
+
+    const long long size = ReadUInt(m_pReader, pos, len);
+
+    if (size < 0)  // error
+      return static_cast<long>(size);
+
+    pos += len;  // consume length of size of element
+
+    // pos now points to start of payload
+
+    if (size == 0) {
+      // Missing element payload: move on.
+      m_pos = pos;
+      continue;
+    }
+
+    const long long unknown_size = (1LL << (7 * len)) - 1;
+
+    if ((segment_stop >= 0) && (size != unknown_size) &&
+        ((pos + size) > segment_stop)) {
+      return E_FILE_FORMAT_INVALID;
+    }
+
+    if (id == libwebm::kMkvCues) {
+      if (size == unknown_size) {
+        // Cues element of unknown size: Not supported.
+        return E_FILE_FORMAT_INVALID;
+      }
+
+      if (m_pCues == NULL) {
+        const long long element_size = (pos - idpos) + size;
+
+        m_pCues = new (std::nothrow) Cues(this, pos, size, idpos, element_size);
+        if (m_pCues == NULL)
+          return -1;
+      }
+
+      m_pos = pos + size;  // consume payload
+      continue;
+    }
+
+    if (id != libwebm::kMkvCluster) {
+      // Besides the Segment, Libwebm allows only cluster elements of unknown
+      // size. Fail the parse upon encountering a non-cluster element reporting
+      // unknown size.
+      if (size == unknown_size)
+        return E_FILE_FORMAT_INVALID;
+
+      m_pos = pos + size;  // consume payload
+      continue;
+    }
+
+    // We have a cluster.
+
+    cluster_off = idpos - m_start;  // relative pos
+
+    if (size != unknown_size)
+      cluster_size = size;
+
+    break;
+  }
+
+  if (cluster_off < 0) {
+    // No cluster, die.
+    return E_FILE_FORMAT_INVALID;
+  }
+
+  long long pos_;
+  long len_;
+
+  status = Cluster::HasBlockEntries(this, cluster_off, pos_, len_);
+
+  if (status < 0) {  // error, or underflow
+    pos = pos_;
+    len = len_;
+
+    return status;
+  }
+
+  // status == 0 means "no block entries found"
+  // status > 0 means "found at least one block entry"
+
+  // TODO:
+  // The issue here is that the segment increments its own
+  // pos ptr past the most recent cluster parsed, and then
+  // starts from there to parse the next cluster.  If we
+  // don't know the size of the current cluster, then we
+  // must either parse its payload (as we do below), looking
+  // for the cluster (or cues) ID to terminate the parse.
+  // This isn't really what we want: rather, we really need
+  // a way to create the curr cluster object immediately.
+  // The pity is that cluster::parse can determine its own
+  // boundary, and we largely duplicate that same logic here.
+  //
+  // Maybe we need to get rid of our look-ahead preloading
+  // in source::parse???
+  //
+  // As we're parsing the blocks in the curr cluster
+  //(in cluster::parse), we should have some way to signal
+  // to the segment that we have determined the boundary,
+  // so it can adjust its own segment::m_pos member.
+  //
+  // The problem is that we're asserting in asyncreadinit,
+  // because we adjust the pos down to the curr seek pos,
+  // and the resulting adjusted len is > 2GB.  I'm suspicious
+  // that this is even correct, but even if it is, we can't
+  // be loading that much data in the cache anyway.
+
+  const long idx = m_clusterCount;
+
+  if (m_clusterPreloadCount > 0) {
+    Cluster* const pCluster = GetFirstPreloadedCluster();
+    if (pCluster == NULL || pCluster->m_index >= 0)
+      return E_FILE_FORMAT_INVALID;
+
+    const long long off = pCluster->GetPosition();
+    if (off < 0)
+      return E_FILE_FORMAT_INVALID;
+
+    if (off == cluster_off) {  // preloaded already
+      if (status == 0)  // no entries found
+        return E_FILE_FORMAT_INVALID;
+
+      if (cluster_size >= 0)
+        pos += cluster_size;
+      else {
+        const long long element_size = pCluster->GetElementSize();
+
+        if (element_size <= 0)
+          return E_FILE_FORMAT_INVALID;  // TODO: handle this case
+
+        pos = pCluster->m_element_start + element_size;
+      }
+
+      pCluster->m_index = idx;  // move from preloaded to loaded
+
+      if (!AppendCluster(pCluster)) {
+        pCluster->m_index = -1;
+        return -1;
+      }
+
+      RemoveFirstPreloadedCluster();
+
+      m_pos = pos;  // consume payload
+      if (segment_stop >= 0 && m_pos > segment_stop)
+        return E_FILE_FORMAT_INVALID;
+
+      return 0;  // success
+    }
+  }
+
+  if (status == 0) {  // no entries found
+    if (cluster_size >= 0)
+      pos += cluster_size;
+
+    if ((total >= 0) && (pos >= total)) {
+      m_pos = total;
+      return 1;  // no more clusters
+    }
+
+    if ((segment_stop >= 0) && (pos >= segment_stop)) {
+      m_pos = segment_stop;
+      return 1;  // no more clusters
+    }
+
+    m_pos = pos;
+    return 2;  // try again
+  }
+
+  // status > 0 means we have an entry
+
+  Cluster* const pCluster = Cluster::Create(this, idx, cluster_off);
+  if (pCluster == NULL)
+    return -1;
+
+  if (!AppendCluster(pCluster)) {
+    delete pCluster;
+    return -1;
+  }
+
+  if (cluster_size >= 0) {
+    pos += cluster_size;
+
+    m_pos = pos;
+
+    if (segment_stop > 0 && m_pos > segment_stop)
+      return E_FILE_FORMAT_INVALID;
+
+    return 0;
+  }
+
+  m_pUnknownSize = pCluster;
+  m_pos = -pos;
+
+  return 0;  // partial success, since we have a new cluster
+
+  // status == 0 means "no block entries found"
+  // pos designates start of payload
+  // m_pos has NOT been adjusted yet (in case we need to come back here)
+}
+
+long Segment::DoLoadClusterUnknownSize(long long& pos, long& len) {
+  if (m_pos >= 0 || m_pUnknownSize == NULL)
+    return E_PARSE_FAILED;
+
+  const long status = m_pUnknownSize->Parse(pos, len);
+
+  if (status < 0)  // error or underflow
+    return status;
+
+  if (status == 0)  // parsed a block
+    return 2;  // continue parsing
+
+  const long long start = m_pUnknownSize->m_element_start;
+  const long long size = m_pUnknownSize->GetElementSize();
+
+  if (size < 0)
+    return E_FILE_FORMAT_INVALID;
+
+  pos = start + size;
+  m_pos = pos;
+
+  m_pUnknownSize = 0;
+
+  return 2;  // continue parsing
+}
+
+bool Segment::AppendCluster(Cluster* pCluster) {
+  if (pCluster == NULL || pCluster->m_index < 0)
+    return false;
+
+  const long count = m_clusterCount;
+
+  long& size = m_clusterSize;
+  const long idx = pCluster->m_index;
+
+  if (size < count || idx != count)
+    return false;
+
+  if (count >= size) {
+    const long n = (size <= 0) ? 2048 : 2 * size;
+
+    Cluster** const qq = new (std::nothrow) Cluster*[n];
+    if (qq == NULL)
+      return false;
+
+    Cluster** q = qq;
+    Cluster** p = m_clusters;
+    Cluster** const pp = p + count;
+
+    while (p != pp)
+      *q++ = *p++;
+
+    delete[] m_clusters;
+
+    m_clusters = qq;
+    size = n;
+  }
+
+  m_clusters[idx] = pCluster;
+  ++m_clusterCount;
+  return true;
+}
+
+bool Segment::PreloadCluster(Cluster* pCluster) {
+  if (pCluster == NULL || pCluster->m_index >= 0)
+    return false;
+
+  const long long pos = pCluster->GetPosition();
+
+  if (m_clusterCount > 0 &&
+      m_clusters[m_clusterCount - 1]->GetPosition() >= pos) {
+    return false;
+  }
+
+  long chunk, idx;
+
+  if (FindPreloadedCluster(pos, chunk, idx) != NULL)
+    return false;
+
+  if (chunk >= m_preload_chunk_count) {  // beyond the last one
+    --chunk;
+
+    if (chunk < 0 || m_preload_chunks[chunk]->count >= kPreloadChunkSize) {
+      if (!InsertPreloadChunk(++chunk))
+        return false;
+    }
+
+    idx = m_preload_chunks[chunk]->count;
+  } else if (m_preload_chunks[chunk]->count >= kPreloadChunkSize) {
+    if (!InsertPreloadChunk(chunk + 1))
+      return false;
+
+    // Split the full chunk in two.
+    PreloadChunk* const pFull = m_preload_chunks[chunk];
+    PreloadChunk* const pHalf = m_preload_chunks[chunk + 1];
+
+    const long half = kPreloadChunkSize / 2;
+
+    for (long k = half; k < kPreloadChunkSize; ++k)
+      pHalf->clusters[k - half] = pFull->clusters[k];
+
+    pHalf->count = kPreloadChunkSize - half;
+    pFull->count = half;
+
+    if (idx > half) {
+      ++chunk;
+      idx -= half;
+    }
+  }
+
+  PreloadChunk* const pChunk = m_preload_chunks[chunk];
+
+  for (long k = pChunk->count; k > idx; --k)
+    pChunk->clusters[k] = pChunk->clusters[k - 1];
+
+  pChunk->clusters[idx] = pCluster;
+  ++pChunk->count;
+
+  ++m_clusterPreloadCount;
+  return true;
+}
+
+Cluster* Segment::FindPreloadedCluster(long long pos, long& chunk,
+                                       long& idx) const {
+  // Find the first chunk whose last cluster is not before |pos|.
+  long i = 0;
+  long j = m_preload_chunk_count;
+
+  while (i < j) {
+    const long k = i + (j - i) / 2;
+    const PreloadChunk* const pChunk = m_preload_chunks[k];
+
+    if (pChunk->clusters[pChunk->count - 1]->GetPosition() < pos)
+      i = k + 1;
+    else
+      j = k;
+  }
+
+  chunk = i;
+  idx = 0;
+
+  if (i >= m_preload_chunk_count)
+    return NULL;
+
+  const PreloadChunk* const pChunk = m_preload_chunks[i];
+
+  i = 0;
+  j = pChunk->count;
+
+  while (i < j) {
+    const long k = i + (j - i) / 2;
+
+    if (pChunk->clusters[k]->GetPosition() < pos)
+      i = k + 1;
+    else
+      j = k;
+  }
+
+  assert(i < pChunk->count);
+  idx = i;
+
+  Cluster* const pCluster = pChunk->clusters[i];
+  return (pCluster->GetPosition() == pos) ? pCluster : NULL;
+}
+
+bool Segment::InsertPreloadChunk(long chunk) {
+  if (chunk < 0 || chunk > m_preload_chunk_count)
+    return false;
+
+  PreloadChunk* const pChunk = new (std::nothrow) PreloadChunk;
+  if (pChunk == NULL)
+    return false;
+
+  pChunk->count = 0;
+
+  long& size = m_preload_chunk_size;
+
+  if (m_preload_chunk_count >= size) {
+    const long n = (size <= 0) ? 16 : 2 * size;
+
+    PreloadChunk** const qq = new (std::nothrow) PreloadChunk*[n];
+    if (qq == NULL) {
+      delete pChunk;
+      return false;
+    }
+
+    for (long k = 0; k < m_preload_chunk_count; ++k)
+      qq[k] = m_preload_chunks[k];
+
+    delete[] m_preload_chunks;
+
+    m_preload_chunks = qq;
+    size = n;
+  }
+
+  for (long k = m_preload_chunk_count; k > chunk; --k)
+    m_preload_chunks[k] = m_preload_chunks[k - 1];
+
+  m_preload_chunks[chunk] = pChunk;
+  ++m_preload_chunk_count;
+  return true;
+}
+
+Cluster* Segment::GetFirstPreloadedCluster() const {
+  if (m_preload_chunk_count <= 0)
+    return NULL;
+
+  return m_preload_chunks[0]->clusters[0];
+}
+
+void Segment::RemoveFirstPreloadedCluster() {
+  if (m_preload_chunk_count <= 0)
+    return;
+
+  PreloadChunk* const pChunk = m_preload_chunks[0];
+
+  for (long k = 1; k < pChunk->count; ++k)
+    pChunk->clusters[k - 1] = pChunk->clusters[k];
+
+  if (--pChunk->count <= 0) {
+    delete pChunk;
+
+    for (long k = 1; k < m_preload_chunk_count; ++k)
+      m_preload_chunks[k - 1] = m_preload_chunks[k];
+
+    --m_preload_chunk_count;
+  }
+
+  --m_clusterPreloadCount;
+}
+
+long Segment::Load() {
+  if (m_indexed)
+    return 0;
+
+  if (m_clusters != NULL || m_clusterSize != 0 || m_clusterCount != 0 ||
+      m_clusterPreloadCount != 0) {
+    return E_PARSE_FAILED;
+  }
+
+  // Outermost (level 0) segment object has been constructed,
+  // and pos designates start of payload.  We need to find the
+  // inner (level 1) elements.
+
+  const long long header_status = ParseHeaders();
+
+  if (header_status < 0)  // error
+    return static_cast<long>(header_status);
+
+  if (header_status > 0)  // underflow
+    return E_BUFFER_NOT_FULL;
+
+  if (m_pInfo == NULL || m_pTracks == NULL)
+    return E_FILE_FORMAT_INVALID;
+
+  for (;;) {
+    const long status = LoadCluster();
+
+    if (status < 0)  // error
+      return status;
+
+    if (status >= 1)  // no more clusters
+      return 0;
+  }
+}
+
+SeekHead::Entry::Entry() : id(0), pos(0), element_start(0), element_size(0) {}
+
+SeekHead::SeekHead(Segment* pSegment, long long start, long long size_,
+                   long long element_start, long long element_size)
+    : m_pSegment(pSegment),
+      m_start(start),
+      m_size(size_),
+      m_element_start(element_start),
+      m_element_size(element_size),
+      m_entries(0),
+      m_entry_count(0),
+      m_void_elements(0),
+      m_void_element_count(0) {}
+
+SeekHead::~SeekHead() {
+  delete[] m_entries;
+  delete[] m_void_elements;
+}
+
+long SeekHead::Parse() {
+  IMkvReader* const pReader = m_pSegment->m_pReader;
+
+  long long pos = m_start;
+  const long long stop = m_start + m_size;
+
+  // first count the seek head entries
+
+  long long entry_count = 0;
+  long long void_element_count = 0;
+
+  while (pos < stop) {
+    long long id, size;
+
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (id == libwebm::kMkvSeek) {
+      ++entry_count;
+      if (entry_count > INT_MAX)
+        return E_PARSE_FAILED;
+    } else if (id == libwebm::kMkvVoid) {
+      ++void_element_count;
+      if (void_element_count > INT_MAX)
+        return E_PARSE_FAILED;
+    }
+
+    pos += size;  // consume payload
+
+    if (pos > stop)
+      return E_FILE_FORMAT_INVALID;
+  }
+
+  if (pos != stop)
+    return E_FILE_FORMAT_INVALID;
+
+  if (entry_count > 0) {
+    m_entries = new (std::nothrow) Entry[static_cast<size_t>(entry_count)];
+
+    if (m_entries == NULL)
+      return -1;
+  }
+
+  if (void_element_count > 0) {
+    m_void_elements =
+        new (std::nothrow) VoidElement[static_cast<size_t>(void_element_count)];
+
+    if (m_void_elements == NULL)
+      return -1;
+  }
+
+  // now parse the entries and void elements
+
+  Entry* pEntry = m_entries;
+  VoidElement* pVoidElement = m_void_elements;
+
+  pos = m_start;
+
+  while (pos < stop) {
+    const long long idpos = pos;
+
+    long long id, size;
+
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (id == libwebm::kMkvSeek && entry_count > 0) {
+      if (ParseEntry(pReader, pos, size, pEntry)) {
+        Entry& e = *pEntry++;
+
+        e.element_start = idpos;
+        e.element_size = (pos + size) - idpos;
+      }
+    } else if (id == libwebm::kMkvVoid && void_element_count > 0) {
+      VoidElement& e = *pVoidElement++;
+
+      e.element_start = idpos;
+      e.element_size = (pos + size) - idpos;
+    }
+
+    pos += size;  // consume payload
+    if (pos > stop)
+      return E_FILE_FORMAT_INVALID;
+  }
+
+  if (pos != stop)
+    return E_FILE_FORMAT_INVALID;
+
+  ptrdiff_t count_ = ptrdiff_t(pEntry - m_entries);
+  assert(count_ >= 0);
+  assert(static_cast<long long>(count_) <= entry_count);
+
+  m_entry_count = static_cast<int>(count_);
+
+  count_ = ptrdiff_t(pVoidElement - m_void_elements);
+  assert(count_ >= 0);
+  assert(static_cast<long long>(count_) <= void_element_count);
+
+  m_void_element_count = static_cast<int>(count_);
+
+  return 0;
+}
+
+int SeekHead::GetCount() const { return m_entry_count; }
+
+const SeekHead::Entry* SeekHead::GetEntry(int idx) const {
+  if (idx < 0)
+    return 0;
+
+  if (idx >= m_entry_count)
+    return 0;
+
+  return m_entries + idx;
+}
+
+int SeekHead::GetVoidElementCount() const { return m_void_element_count; }
+
+const SeekHead::VoidElement* SeekHead::GetVoidElement(int idx) const {
+  if (idx < 0)
+    return 0;
+
+  if (idx >= m_void_element_count)
+    return 0;
 
   return m_void_elements + idx;
 }
 
+long long SeekHead::GetMemoryUsage() const {
+  return sizeof(SeekHead) + m_entry_count * sizeof(Entry) +
+         m_void_element_count * sizeof(VoidElement);
+}
+
 long Segment::ParseCues(long long off, long long& pos, long& len) {
   if (m_pCues)
     return 0;  // success
@@ -1832,11 +3529,18 @@ Cues::Cues(Segment* pSegment, long long start_, long long size_,
       m_element_start(element_start),
       m_element_size(element_size),
       m_cue_points(NULL),
+      m_cue_points_size(0),
       m_count(0),
       m_preload_count(0),
-      m_pos(start_) {}
+      m_pos(start_),
+      m_track_indexes(NULL),
+      m_track_indexes_count(0),
+      m_track_indexes_size(0),
+      m_track_indexes_cue_count(0) {}
 
 Cues::~Cues() {
+  FreeTrackIndexes();
+
   const long n = m_count + m_preload_count;
 
   CuePoint** p = m_cue_points;
@@ -1864,6 +3568,31 @@ bool Cues::DoneParsing() const {
   return (m_pos >= stop);
 }
 
+long long Cues::GetMemoryUsage() const {
+  long long bytes = sizeof(Cues) + m_cue_points_size * sizeof(CuePoint*);
+
+  const long count = m_count + m_preload_count;
+
+  for (long i = 0; i < count; ++i) {
+    const CuePoint* const pCP = m_cue_points[i];
+    assert(pCP);
+
+    bytes += sizeof(CuePoint);
+    bytes += pCP->m_track_positions_count * sizeof(CuePoint::TrackPosition);
+  }
+
+  bytes += m_track_indexes_size * sizeof(TrackIndex);
+
+  for (long k = 0; k < m_track_indexes_count; ++k) {
+    const long long n = m_track_indexes[k].size;
+
+    bytes += n * (sizeof(long long) + sizeof(const CuePoint*) +
+                  sizeof(const CuePoint::TrackPosition*));
+  }
+
+  return bytes;
+}
+
 bool Cues::Init() const {
   if (m_cue_points)
     return true;
@@ -1876,8 +3605,6 @@ bool Cues::Init() const {
   const long long stop = m_start + m_size;
   long long pos = m_start;
 
-  long cue_points_size = 0;
-
   while (pos < stop) {
     const long long idpos = pos;
 
@@ -1901,7 +3628,7 @@ bool Cues::Init() const {
     }
 
     if (id == libwebm::kMkvCuePoint) {
-      if (!PreloadCuePoint(cue_points_size, idpos))
+      if (!PreloadCuePoint(m_cue_points_size, idpos))
         return false;
     }
 
@@ -2004,72 +3731,270 @@ bool Cues::LoadCuePoint() const {
     return true;  // yes, we loaded a cue point
   }
 
-  return false;  // no, we did not load a cue point
+  return false;  // no, we did not load a cue point
+}
+
+bool Cues::Find(long long time_ns, const Track* pTrack, const CuePoint*& pCP,
+                const CuePoint::TrackPosition*& pTP) const {
+  if (time_ns < 0)
+    return false;
+
+  const TrackIndex* pIndex = NULL;
+  const long i = UpperBound(time_ns, pTrack, pIndex);
+
+  if (i < 0)
+    return false;
+
+  // Times before the first cue point of the track map to that cue point.
+  const long index = (i > 0) ? i - 1 : 0;
+
+  pCP = pIndex->cue_points[index];
+  pTP = pIndex->track_positions[index];
+
+  return (pCP != NULL && pTP != NULL);
+}
+
+bool Cues::FindNext(long long time_ns, const Track* pTrack,
+                    const CuePoint*& pCP,
+                    const CuePoint::TrackPosition*& pTP) const {
+  const TrackIndex* pIndex = NULL;
+  const long i = UpperBound(time_ns, pTrack, pIndex);
+
+  if (i < 0 || i >= pIndex->count)
+    return false;
+
+  pCP = pIndex->cue_points[i];
+  pTP = pIndex->track_positions[i];
+
+  return (pCP != NULL && pTP != NULL);
+}
+
+long Cues::UpperBound(long long time_ns, const Track* pTrack,
+                      const TrackIndex*& pIndex) const {
+  if (pTrack == NULL || m_cue_points == NULL || m_count == 0)
+    return -1;
+
+  pIndex = GetTrackIndex(pTrack->GetNumber());
+
+  if (pIndex == NULL || pIndex->count <= 0)
+    return -1;
+
+  const SegmentInfo* const pInfo = m_pSegment->GetInfo();
+  if (pInfo == NULL)
+    return -1;
+
+  const long long scale = pInfo->GetTimeCodeScale();
+  if (scale < 1)
+    return -1;
+
+  const long long* const times = pIndex->times;
+
+  long i = 0;
+  long j = pIndex->count;
+
+  while (i < j) {
+    // INVARIANT:
+    //[0, i) <= time_ns
+    //[i, j)  ?
+    //[j, count) > time_ns
+
+    const long k = i + (j - i) / 2;
+
+    if (times[k] * scale <= time_ns)
+      i = k + 1;
+    else
+      j = k;
+  }
+
+  return i;
+}
+
+const Cues::TrackIndex* Cues::GetTrackIndex(long long track) const {
+  if (m_track_indexes_cue_count != m_count && !UpdateTrackIndexes()) {
+    // Start over on the next call.
+    FreeTrackIndexes();
+    return NULL;
+  }
+
+  for (long i = 0; i < m_track_indexes_count; ++i) {
+    if (m_track_indexes[i].track == track)
+      return &m_track_indexes[i];
+  }
+
+  return NULL;
+}
+
+void Cues::FreeTrackIndexes() const {
+  for (long i = 0; i < m_track_indexes_count; ++i) {
+    TrackIndex& index = m_track_indexes[i];
+
+    delete[] index.times;
+    delete[] index.cue_points;
+    delete[] index.track_positions;
+  }
+
+  delete[] m_track_indexes;
+
+  m_track_indexes = NULL;
+  m_track_indexes_count = 0;
+  m_track_indexes_size = 0;
+  m_track_indexes_cue_count = 0;
+}
+
+bool Cues::UpdateTrackIndexes() const {
+  for (long i = m_track_indexes_cue_count; i < m_count; ++i) {
+    const CuePoint* const pCP = m_cue_points[i];
+    if (pCP == NULL || pCP->GetTimeCode() < 0)
+      return false;
+
+    for (size_t n = 0; n < pCP->m_track_positions_count; ++n) {
+      const CuePoint::TrackPosition* const pTP = pCP->m_track_positions + n;
+
+      // A cue point that lists the same track twice is found by its first
+      // entry, as in CuePoint::Find.
+      size_t m = 0;
+
+      while (m < n && pCP->m_track_positions[m].m_track != pTP->m_track)
+        ++m;
+
+      if (m < n)
+        continue;
+
+      TrackIndex* pIndex = NULL;
+
+      for (long k = 0; k < m_track_indexes_count && pIndex == NULL; ++k) {
+        if (m_track_indexes[k].track == pTP->m_track)
+          pIndex = &m_track_indexes[k];
+      }
+
+      if (pIndex == NULL)
+        pIndex = AddTrackIndex(pTP->m_track);
+
+      if (pIndex == NULL || !AppendToTrackIndex(*pIndex, pCP, pTP))
+        return false;
+    }
+
+    m_track_indexes_cue_count = i + 1;
+  }
+
+  for (long k = 0; k < m_track_indexes_count; ++k) {
+    TrackIndex& index = m_track_indexes[k];
+
+    if (!index.sorted && !SortTrackIndex(index))
+      return false;
+  }
+
+  return true;
 }
 
-bool Cues::Find(long long time_ns, const Track* pTrack, const CuePoint*& pCP,
-                const CuePoint::TrackPosition*& pTP) const {
-  if (time_ns < 0 || pTrack == NULL || m_cue_points == NULL || m_count == 0)
-    return false;
+Cues::TrackIndex* Cues::AddTrackIndex(long long track) const {
+  if (m_track_indexes_count >= m_track_indexes_size) {
+    const long new_size =
+        (m_track_indexes_size <= 0) ? 4 : 2 * m_track_indexes_size;
 
-  CuePoint** const ii = m_cue_points;
-  CuePoint** i = ii;
+    TrackIndex* const indexes = new (std::nothrow) TrackIndex[new_size];
+    if (indexes == NULL)
+      return NULL;
 
-  CuePoint** const jj = ii + m_count;
-  CuePoint** j = jj;
+    for (long idx = 0; idx < m_track_indexes_count; ++idx)
+      indexes[idx] = m_track_indexes[idx];
 
-  pCP = *i;
-  if (pCP == NULL)
-    return false;
+    delete[] m_track_indexes;
 
-  if (time_ns <= pCP->GetTime(m_pSegment)) {
-    pTP = pCP->Find(pTrack);
-    return (pTP != NULL);
+    m_track_indexes = indexes;
+    m_track_indexes_size = new_size;
   }
 
-  while (i < j) {
-    // INVARIANT:
-    //[ii, i) <= time_ns
-    //[i, j)  ?
-    //[j, jj) > time_ns
-
-    CuePoint** const k = i + (j - i) / 2;
-    if (k >= jj)
-      return false;
+  TrackIndex& index = m_track_indexes[m_track_indexes_count++];
 
-    CuePoint* const pCP = *k;
-    if (pCP == NULL)
-      return false;
+  index.track = track;
+  index.count = 0;
+  index.size = 0;
+  index.sorted = true;
+  index.times = NULL;
+  index.cue_points = NULL;
+  index.track_positions = NULL;
 
-    const long long t = pCP->GetTime(m_pSegment);
+  return &index;
+}
 
-    if (t <= time_ns)
-      i = k + 1;
-    else
-      j = k;
+bool Cues::AppendToTrackIndex(TrackIndex& index, const CuePoint* pCP,
+                              const CuePoint::TrackPosition* pTP) {
+  if (index.count >= index.size) {
+    const long new_size = (index.size <= 0) ? 16 : 2 * index.size;
 
-    if (i > j)
+    if (!ReallocTrackIndex(index, new_size, NULL))
       return false;
   }
 
-  if (i != j || i > jj || i <= ii)
+  const long long time = pCP->GetTimeCode();
+
+  // Cue points are normally stored in time order.
+  if (index.count > 0 && index.times[index.count - 1] > time)
+    index.sorted = false;
+
+  const long j = index.count++;
+
+  index.times[j] = time;
+  index.cue_points[j] = pCP;
+  index.track_positions[j] = pTP;
+
+  return true;
+}
+
+bool Cues::SortTrackIndex(TrackIndex& index) {
+  long* const order = new (std::nothrow) long[index.count];
+  if (order == NULL)
     return false;
 
-  pCP = *--i;
+  for (long j = 0; j < index.count; ++j)
+    order[j] = j;
+
+  // Stable, so cue points with equal times stay in load order.
+  const long long* const times = index.times;
+  std::stable_sort(order, order + index.count,
+                   [times](long a, long b) { return times[a] < times[b]; });
+
+  const bool result = ReallocTrackIndex(index, index.size, order);
+  delete[] order;
+
+  if (result)
+    index.sorted = true;
+
+  return result;
+}
+
+bool Cues::ReallocTrackIndex(TrackIndex& index, long size, const long* order) {
+  long long* const times = new (std::nothrow) long long[size];
+  const CuePoint** const cue_points = new (std::nothrow) const CuePoint*[size];
+  const CuePoint::TrackPosition** const track_positions =
+      new (std::nothrow) const CuePoint::TrackPosition*[size];
 
-  if (pCP == NULL || pCP->GetTime(m_pSegment) > time_ns)
+  if (times == NULL || cue_points == NULL || track_positions == NULL) {
+    delete[] times;
+    delete[] cue_points;
+    delete[] track_positions;
     return false;
+  }
+
+  for (long j = 0; j < index.count; ++j) {
+    const long from = (order == NULL) ? j : order[j];
+
+    times[j] = index.times[from];
+    cue_points[j] = index.cue_points[from];
+    track_positions[j] = index.track_positions[from];
+  }
+
+  delete[] index.times;
+  delete[] index.cue_points;
+  delete[] index.track_positions;
 
-  // TODO: here and elsewhere, it's probably not correct to search
-  // for the cue point with this time, and then search for a matching
-  // track.  In principle, the matching track could be on some earlier
-  // cue point, and with our current algorithm, we'd miss it.  To make
-  // this bullet-proof, we'd need to create a secondary structure,
-  // with a list of cue points that apply to a track, and then search
-  // that track-based structure for a matching cue point.
+  index.size = size;
+  index.times = times;
+  index.cue_points = cue_points;
+  index.track_positions = track_positions;
 
-  pTP = pCP->Find(pTrack);
-  return (pTP != NULL);
+  return true;
 }
 
 const CuePoint* Cues::GetFirst() const {
@@ -2141,12 +4066,21 @@ const BlockEntry* Cues::GetBlock(const CuePoint* pCP,
 
 const BlockEntry* Segment::GetBlock(const CuePoint& cp,
                                     const CuePoint::TrackPosition& tp) {
+  const Cluster* const pCluster = FindOrPreloadCluster(tp.m_pos);
+  if (pCluster == NULL)
+    return NULL;
+
+  return pCluster->GetEntry(cp, tp);
+}
+
+const Cluster* Segment::FindOrPreloadCluster(long long requested_pos) {
+  if (requested_pos < 0)
+    return 0;
+
   Cluster** const ii = m_clusters;
   Cluster** i = ii;
 
-  const long count = m_clusterCount + m_clusterPreloadCount;
-
-  Cluster** const jj = ii + count;
+  Cluster** const jj = ii + m_clusterCount;
   Cluster** j = jj;
 
   while (i < j) {
@@ -2161,1060 +4095,1355 @@ const BlockEntry* Segment::GetBlock(const CuePoint& cp,
     Cluster* const pCluster = *k;
     assert(pCluster);
 
-    // const long long pos_ = pCluster->m_pos;
-    // assert(pos_);
-    // const long long pos = pos_ * ((pos_ < 0) ? -1 : 1);
+    const long long pos = pCluster->GetPosition();
+    assert(pos >= 0);
+
+    if (pos < requested_pos)
+      i = k + 1;
+    else if (pos > requested_pos)
+      j = k;
+    else
+      return pCluster;
+  }
+
+  assert(i == j);
+
+  if (i != jj)  // between two loaded clusters
+    return NULL;
+
+  long chunk, idx;
+
+  Cluster* pCluster = FindPreloadedCluster(requested_pos, chunk, idx);
+  if (pCluster != NULL)
+    return pCluster;
+
+  pCluster = Cluster::Create(this, -1, requested_pos);
+  if (pCluster == NULL)
+    return NULL;
+
+  if (!PreloadCluster(pCluster)) {
+    delete pCluster;
+    return NULL;
+  }
+  assert(m_clusterPreloadCount > 0);
+
+  return pCluster;
+}
+
+CuePoint::CuePoint(long idx, long long pos)
+    : m_element_start(0),
+      m_element_size(0),
+      m_index(idx),
+      m_timecode(-1 * pos),
+      m_track_positions(NULL),
+      m_track_positions_count(0) {
+  assert(pos > 0);
+}
+
+CuePoint::~CuePoint() { delete[] m_track_positions; }
+
+bool CuePoint::Load(IMkvReader* pReader) {
+  // odbgstream os;
+  // os << "CuePoint::Load(begin): timecode=" << m_timecode << endl;
+
+  if (m_timecode >= 0)  // already loaded
+    return true;
+
+  assert(m_track_positions == NULL);
+  assert(m_track_positions_count == 0);
+
+  long long pos_ = -m_timecode;
+  const long long element_start = pos_;
+
+  long long stop;
+
+  {
+    long len;
+
+    const long long id = ReadID(pReader, pos_, len);
+    if (id != libwebm::kMkvCuePoint)
+      return false;
+
+    pos_ += len;  // consume ID
+
+    const long long size = ReadUInt(pReader, pos_, len);
+    assert(size >= 0);
+
+    pos_ += len;  // consume Size field
+    // pos_ now points to start of payload
+
+    stop = pos_ + size;
+  }
+
+  const long long element_size = stop - element_start;
+
+  long long pos = pos_;
+
+  // First count number of track positions
+  unsigned long long track_positions_count = 0;
+  while (pos < stop) {
+    long len;
+
+    const long long id = ReadID(pReader, pos, len);
+    if ((id < 0) || (pos + len > stop)) {
+      return false;
+    }
+
+    pos += len;  // consume ID
+
+    const long long size = ReadUInt(pReader, pos, len);
+    if ((size < 0) || (pos + len > stop)) {
+      return false;
+    }
+
+    pos += len;  // consume Size field
+    if ((pos + size) > stop) {
+      return false;
+    }
+
+    if (id == libwebm::kMkvCueTime)
+      m_timecode = UnserializeUInt(pReader, pos, size);
+
+    else if (id == libwebm::kMkvCueTrackPositions) {
+      ++track_positions_count;
+      if (track_positions_count > UINT_MAX)
+        return E_PARSE_FAILED;
+    }
+
+    pos += size;  // consume payload
+  }
+
+  m_track_positions_count = static_cast<size_t>(track_positions_count);
+
+  if (m_timecode < 0 || m_track_positions_count <= 0) {
+    return false;
+  }
+
+  // os << "CuePoint::Load(cont'd): idpos=" << idpos
+  //   << " timecode=" << m_timecode
+  //   << endl;
+
+  m_track_positions = new (std::nothrow) TrackPosition[m_track_positions_count];
+  if (m_track_positions == NULL)
+    return false;
+
+  // Now parse track positions
+
+  TrackPosition* p = m_track_positions;
+  pos = pos_;
+
+  while (pos < stop) {
+    long len;
+
+    const long long id = ReadID(pReader, pos, len);
+    if (id < 0 || (pos + len) > stop)
+      return false;
+
+    pos += len;  // consume ID
+
+    const long long size = ReadUInt(pReader, pos, len);
+    assert(size >= 0);
+    assert((pos + len) <= stop);
+
+    pos += len;  // consume Size field
+    assert((pos + size) <= stop);
+
+    if (id == libwebm::kMkvCueTrackPositions) {
+      TrackPosition& tp = *p++;
+      if (!tp.Parse(pReader, pos, size)) {
+        return false;
+      }
+    }
+
+    pos += size;  // consume payload
+    if (pos > stop)
+      return false;
+  }
+
+  assert(size_t(p - m_track_positions) == m_track_positions_count);
+
+  m_element_start = element_start;
+  m_element_size = element_size;
+
+  return true;
+}
+
+bool CuePoint::TrackPosition::Parse(IMkvReader* pReader, long long start_,
+                                    long long size_) {
+  const long long stop = start_ + size_;
+  long long pos = start_;
+
+  m_track = -1;
+  m_pos = -1;
+  m_block = 1;  // default
+
+  while (pos < stop) {
+    long len;
+
+    const long long id = ReadID(pReader, pos, len);
+    if ((id < 0) || ((pos + len) > stop)) {
+      return false;
+    }
+
+    pos += len;  // consume ID
+
+    const long long size = ReadUInt(pReader, pos, len);
+    if ((size < 0) || ((pos + len) > stop)) {
+      return false;
+    }
+
+    pos += len;  // consume Size field
+    if ((pos + size) > stop) {
+      return false;
+    }
+
+    if (id == libwebm::kMkvCueTrack)
+      m_track = UnserializeUInt(pReader, pos, size);
+    else if (id == libwebm::kMkvCueClusterPosition)
+      m_pos = UnserializeUInt(pReader, pos, size);
+    else if (id == libwebm::kMkvCueBlockNumber)
+      m_block = UnserializeUInt(pReader, pos, size);
+
+    pos += size;  // consume payload
+  }
+
+  if ((m_pos < 0) || (m_track <= 0) || (m_block < 0) || (m_block > LONG_MAX)) {
+    return false;
+  }
 
-    const long long pos = pCluster->GetPosition();
-    assert(pos >= 0);
+  return true;
+}
 
-    if (pos < tp.m_pos)
-      i = k + 1;
-    else if (pos > tp.m_pos)
-      j = k;
-    else
-      return pCluster->GetEntry(cp, tp);
+const CuePoint::TrackPosition* CuePoint::Find(const Track* pTrack) const {
+  if (pTrack == NULL) {
+    return NULL;
   }
 
-  assert(i == j);
-  // assert(Cluster::HasBlockEntries(this, tp.m_pos));
+  const long long n = pTrack->GetNumber();
 
-  Cluster* const pCluster = Cluster::Create(this, -1, tp.m_pos);  //, -1);
-  if (pCluster == NULL)
-    return NULL;
+  const TrackPosition* i = m_track_positions;
+  const TrackPosition* const j = i + m_track_positions_count;
 
-  const ptrdiff_t idx = i - m_clusters;
+  while (i != j) {
+    const TrackPosition& p = *i++;
 
-  if (!PreloadCluster(pCluster, idx)) {
-    delete pCluster;
-    return NULL;
+    if (p.m_track == n)
+      return &p;
   }
-  assert(m_clusters);
-  assert(m_clusterPreloadCount > 0);
-  assert(m_clusters[idx] == pCluster);
 
-  return pCluster->GetEntry(cp, tp);
+  return NULL;  // no matching track number found
 }
 
-const Cluster* Segment::FindOrPreloadCluster(long long requested_pos) {
-  if (requested_pos < 0)
-    return 0;
+long long CuePoint::GetTimeCode() const { return m_timecode; }
 
-  Cluster** const ii = m_clusters;
-  Cluster** i = ii;
+long long CuePoint::GetTime(const Segment* pSegment) const {
+  assert(pSegment);
+  assert(m_timecode >= 0);
 
-  const long count = m_clusterCount + m_clusterPreloadCount;
+  const SegmentInfo* const pInfo = pSegment->GetInfo();
+  assert(pInfo);
 
-  Cluster** const jj = ii + count;
-  Cluster** j = jj;
+  const long long scale = pInfo->GetTimeCodeScale();
+  assert(scale >= 1);
 
-  while (i < j) {
-    // INVARIANT:
-    //[ii, i) < pTP->m_pos
-    //[i, j) ?
-    //[j, jj)  > pTP->m_pos
+  const long long time = scale * m_timecode;
 
-    Cluster** const k = i + (j - i) / 2;
-    assert(k < jj);
+  return time;
+}
 
-    Cluster* const pCluster = *k;
-    assert(pCluster);
+bool Segment::DoneParsing() const {
+  if (m_size < 0) {
+    long long total, avail;
 
-    // const long long pos_ = pCluster->m_pos;
-    // assert(pos_);
-    // const long long pos = pos_ * ((pos_ < 0) ? -1 : 1);
+    const int status = m_pReader->Length(&total, &avail);
 
-    const long long pos = pCluster->GetPosition();
-    assert(pos >= 0);
+    if (status < 0)  // error
+      return true;  // must assume done
 
-    if (pos < requested_pos)
-      i = k + 1;
-    else if (pos > requested_pos)
-      j = k;
-    else
-      return pCluster;
+    if (total < 0)
+      return false;  // assume live stream
+
+    return (m_pos >= total);
   }
 
-  assert(i == j);
-  // assert(Cluster::HasBlockEntries(this, tp.m_pos));
+  const long long stop = m_start + m_size;
 
-  Cluster* const pCluster = Cluster::Create(this, -1, requested_pos);
-  if (pCluster == NULL)
-    return NULL;
+  return (m_pos >= stop);
+}
 
-  const ptrdiff_t idx = i - m_clusters;
+const Cluster* Segment::GetFirst() const {
+  if ((m_clusters == NULL) || (m_clusterCount <= 0))
+    return &m_eos;
 
-  if (!PreloadCluster(pCluster, idx)) {
-    delete pCluster;
-    return NULL;
-  }
-  assert(m_clusters);
-  assert(m_clusterPreloadCount > 0);
-  assert(m_clusters[idx] == pCluster);
+  Cluster* const pCluster = m_clusters[0];
+  assert(pCluster);
 
   return pCluster;
 }
 
-CuePoint::CuePoint(long idx, long long pos)
-    : m_element_start(0),
-      m_element_size(0),
-      m_index(idx),
-      m_timecode(-1 * pos),
-      m_track_positions(NULL),
-      m_track_positions_count(0) {
-  assert(pos > 0);
+const Cluster* Segment::GetLast() const {
+  if ((m_clusters == NULL) || (m_clusterCount <= 0))
+    return &m_eos;
+
+  const long idx = m_clusterCount - 1;
+
+  Cluster* const pCluster = m_clusters[idx];
+  assert(pCluster);
+
+  return pCluster;
 }
 
-CuePoint::~CuePoint() { delete[] m_track_positions; }
+unsigned long Segment::GetCount() const { return m_clusterCount; }
 
-bool CuePoint::Load(IMkvReader* pReader) {
-  // odbgstream os;
-  // os << "CuePoint::Load(begin): timecode=" << m_timecode << endl;
+const Cluster* Segment::GetNext(const Cluster* pCurr) {
+  assert(pCurr);
+  assert(pCurr != &m_eos);
 
-  if (m_timecode >= 0)  // already loaded
-    return true;
+  long idx = pCurr->m_index;
 
-  assert(m_track_positions == NULL);
-  assert(m_track_positions_count == 0);
+  if (idx >= 0) {
+    assert(m_clusters);
+    assert(m_clusterCount > 0);
+    assert(idx < m_clusterCount);
+    assert(pCurr == m_clusters[idx]);
 
-  long long pos_ = -m_timecode;
-  const long long element_start = pos_;
+    ++idx;
 
-  long long stop;
+    if (idx >= m_clusterCount)
+      return &m_eos;  // caller will LoadCluster as desired
+
+    Cluster* const pNext = m_clusters[idx];
+    assert(pNext);
+    assert(pNext->m_index >= 0);
+    assert(pNext->m_index == idx);
+
+    return pNext;
+  }
+
+  assert(m_clusterPreloadCount > 0);
+
+  long long pos = pCurr->m_element_start;
+
+  assert(m_size >= 0);  // TODO
+  const long long stop = m_start + m_size;  // end of segment
 
   {
     long len;
 
-    const long long id = ReadID(pReader, pos_, len);
-    if (id != libwebm::kMkvCuePoint)
-      return false;
+    long long result = GetUIntLength(m_pReader, pos, len);
+    assert(result == 0);
+    assert((pos + len) <= stop);  // TODO
+    if (result != 0)
+      return NULL;
 
-    pos_ += len;  // consume ID
+    const long long id = ReadID(m_pReader, pos, len);
+    if (id != libwebm::kMkvCluster)
+      return NULL;
 
-    const long long size = ReadUInt(pReader, pos_, len);
-    assert(size >= 0);
+    pos += len;  // consume ID
 
-    pos_ += len;  // consume Size field
-    // pos_ now points to start of payload
+    // Read Size
+    result = GetUIntLength(m_pReader, pos, len);
+    assert(result == 0);  // TODO
+    assert((pos + len) <= stop);  // TODO
 
-    stop = pos_ + size;
-  }
+    const long long size = ReadUInt(m_pReader, pos, len);
+    assert(size > 0);  // TODO
+    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
 
-  const long long element_size = stop - element_start;
+    pos += len;  // consume length of size of element
+    assert((pos + size) <= stop);  // TODO
 
-  long long pos = pos_;
+    // Pos now points to start of payload
+
+    pos += size;  // consume payload
+  }
+
+  long long off_next = 0;
 
-  // First count number of track positions
-  unsigned long long track_positions_count = 0;
   while (pos < stop) {
     long len;
 
-    const long long id = ReadID(pReader, pos, len);
-    if ((id < 0) || (pos + len > stop)) {
-      return false;
-    }
+    long long result = GetUIntLength(m_pReader, pos, len);
+    assert(result == 0);
+    assert((pos + len) <= stop);  // TODO
+    if (result != 0)
+      return NULL;
+
+    const long long idpos = pos;  // pos of next (potential) cluster
+
+    const long long id = ReadID(m_pReader, idpos, len);
+    if (id < 0)
+      return NULL;
 
     pos += len;  // consume ID
 
-    const long long size = ReadUInt(pReader, pos, len);
-    if ((size < 0) || (pos + len > stop)) {
-      return false;
-    }
+    // Read Size
+    result = GetUIntLength(m_pReader, pos, len);
+    assert(result == 0);  // TODO
+    assert((pos + len) <= stop);  // TODO
 
-    pos += len;  // consume Size field
-    if ((pos + size) > stop) {
-      return false;
-    }
+    const long long size = ReadUInt(m_pReader, pos, len);
+    assert(size >= 0);  // TODO
 
-    if (id == libwebm::kMkvCueTime)
-      m_timecode = UnserializeUInt(pReader, pos, size);
+    pos += len;  // consume length of size of element
+    assert((pos + size) <= stop);  // TODO
 
-    else if (id == libwebm::kMkvCueTrackPositions) {
-      ++track_positions_count;
-      if (track_positions_count > UINT_MAX)
-        return E_PARSE_FAILED;
+    // Pos now points to start of payload
+
+    if (size == 0)  // weird
+      continue;
+
+    if (id == libwebm::kMkvCluster) {
+      const long long off_next_ = idpos - m_start;
+
+      long long pos_;
+      long len_;
+
+      const long status = Cluster::HasBlockEntries(this, off_next_, pos_, len_);
+
+      assert(status >= 0);
+
+      if (status > 0) {
+        off_next = off_next_;
+        break;
+      }
     }
 
     pos += size;  // consume payload
   }
 
-  m_track_positions_count = static_cast<size_t>(track_positions_count);
+  if (off_next <= 0)
+    return 0;
 
-  if (m_timecode < 0 || m_track_positions_count <= 0) {
-    return false;
+  long chunk, idx_next;
+
+  Cluster* pNext = FindPreloadedCluster(off_next, chunk, idx_next);
+  if (pNext != NULL)
+    return pNext;
+
+  pNext = Cluster::Create(this, -1, off_next);
+  if (pNext == NULL)
+    return NULL;
+
+  if (!PreloadCluster(pNext)) {
+    delete pNext;
+    return NULL;
   }
 
-  // os << "CuePoint::Load(cont'd): idpos=" << idpos
-  //   << " timecode=" << m_timecode
-  //   << endl;
+  return pNext;
+}
 
-  m_track_positions = new (std::nothrow) TrackPosition[m_track_positions_count];
-  if (m_track_positions == NULL)
-    return false;
+long Segment::ParseNext(const Cluster* pCurr, const Cluster*& pResult,
+                        long long& pos, long& len) {
+  assert(pCurr);
+  assert(!pCurr->EOS());
 
-  // Now parse track positions
+  pResult = 0;
 
-  TrackPosition* p = m_track_positions;
-  pos = pos_;
+  if (pCurr->m_index >= 0) {  // loaded (not merely preloaded)
+    assert(m_clusters);
+    assert(m_clusters[pCurr->m_index] == pCurr);
 
-  while (pos < stop) {
-    long len;
+    const long next_idx = pCurr->m_index + 1;
 
-    const long long id = ReadID(pReader, pos, len);
-    if (id < 0 || (pos + len) > stop)
-      return false;
+    if (next_idx < m_clusterCount) {
+      pResult = m_clusters[next_idx];
+      return 0;  // success
+    }
 
-    pos += len;  // consume ID
+    // curr cluster is last among loaded
 
-    const long long size = ReadUInt(pReader, pos, len);
-    assert(size >= 0);
-    assert((pos + len) <= stop);
+    const long result = LoadCluster(pos, len);
 
-    pos += len;  // consume Size field
-    assert((pos + size) <= stop);
+    if (result < 0)  // error or underflow
+      return result;
 
-    if (id == libwebm::kMkvCueTrackPositions) {
-      TrackPosition& tp = *p++;
-      if (!tp.Parse(pReader, pos, size)) {
-        return false;
-      }
+    if (result > 0)  // no more clusters
+    {
+      // pResult = &m_eos;
+      return 1;
     }
 
-    pos += size;  // consume payload
-    if (pos > stop)
-      return false;
+    pResult = GetLast();
+    return 0;  // success
   }
 
-  assert(size_t(p - m_track_positions) == m_track_positions_count);
+  assert(m_pos > 0);
 
-  m_element_start = element_start;
-  m_element_size = element_size;
+  long long total, avail;
 
-  return true;
-}
+  long status = m_pReader->Length(&total, &avail);
 
-bool CuePoint::TrackPosition::Parse(IMkvReader* pReader, long long start_,
-                                    long long size_) {
-  const long long stop = start_ + size_;
-  long long pos = start_;
+  if (status < 0)  // error
+    return status;
 
-  m_track = -1;
-  m_pos = -1;
-  m_block = 1;  // default
+  assert((total < 0) || (avail <= total));
 
-  while (pos < stop) {
-    long len;
+  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
 
-    const long long id = ReadID(pReader, pos, len);
-    if ((id < 0) || ((pos + len) > stop)) {
-      return false;
-    }
+  // interrogate curr cluster
 
-    pos += len;  // consume ID
+  pos = pCurr->m_element_start;
 
-    const long long size = ReadUInt(pReader, pos, len);
-    if ((size < 0) || ((pos + len) > stop)) {
-      return false;
+  if (pCurr->m_element_size >= 0)
+    pos += pCurr->m_element_size;
+  else {
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
     }
 
-    pos += len;  // consume Size field
-    if ((pos + size) > stop) {
-      return false;
-    }
+    long long result = GetUIntLength(m_pReader, pos, len);
 
-    if (id == libwebm::kMkvCueTrack)
-      m_track = UnserializeUInt(pReader, pos, size);
-    else if (id == libwebm::kMkvCueClusterPosition)
-      m_pos = UnserializeUInt(pReader, pos, size);
-    else if (id == libwebm::kMkvCueBlockNumber)
-      m_block = UnserializeUInt(pReader, pos, size);
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-    pos += size;  // consume payload
-  }
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-  if ((m_pos < 0) || (m_track <= 0) || (m_block < 0) || (m_block > LONG_MAX)) {
-    return false;
-  }
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  return true;
-}
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-const CuePoint::TrackPosition* CuePoint::Find(const Track* pTrack) const {
-  if (pTrack == NULL) {
-    return NULL;
-  }
+    const long long id = ReadUInt(m_pReader, pos, len);
 
-  const long long n = pTrack->GetNumber();
+    if (id != libwebm::kMkvCluster)
+      return -1;
 
-  const TrackPosition* i = m_track_positions;
-  const TrackPosition* const j = i + m_track_positions_count;
+    pos += len;  // consume ID
 
-  while (i != j) {
-    const TrackPosition& p = *i++;
+    // Read Size
 
-    if (p.m_track == n)
-      return &p;
-  }
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-  return NULL;  // no matching track number found
-}
+    result = GetUIntLength(m_pReader, pos, len);
 
-long long CuePoint::GetTimeCode() const { return m_timecode; }
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-long long CuePoint::GetTime(const Segment* pSegment) const {
-  assert(pSegment);
-  assert(m_timecode >= 0);
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-  const SegmentInfo* const pInfo = pSegment->GetInfo();
-  assert(pInfo);
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  const long long scale = pInfo->GetTimeCodeScale();
-  assert(scale >= 1);
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-  const long long time = scale * m_timecode;
+    const long long size = ReadUInt(m_pReader, pos, len);
 
-  return time;
-}
+    if (size < 0)  // error
+      return static_cast<long>(size);
 
-bool Segment::DoneParsing() const {
-  if (m_size < 0) {
-    long long total, avail;
+    pos += len;  // consume size field
 
-    const int status = m_pReader->Length(&total, &avail);
+    const long long unknown_size = (1LL << (7 * len)) - 1;
 
-    if (status < 0)  // error
-      return true;  // must assume done
+    if (size == unknown_size)  // TODO: should never happen
+      return E_FILE_FORMAT_INVALID;  // TODO: resolve this
 
-    if (total < 0)
-      return false;  // assume live stream
+    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
 
-    return (m_pos >= total);
-  }
+    if ((segment_stop >= 0) && ((pos + size) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  const long long stop = m_start + m_size;
+    // Pos now points to start of payload
 
-  return (m_pos >= stop);
-}
+    pos += size;  // consume payload (that is, the current cluster)
+    if (segment_stop >= 0 && pos > segment_stop)
+      return E_FILE_FORMAT_INVALID;
 
-const Cluster* Segment::GetFirst() const {
-  if ((m_clusters == NULL) || (m_clusterCount <= 0))
-    return &m_eos;
+    // By consuming the payload, we are assuming that the curr
+    // cluster isn't interesting.  That is, we don't bother checking
+    // whether the payload of the curr cluster is less than what
+    // happens to be available (obtained via IMkvReader::Length).
+    // Presumably the caller has already dispensed with the current
+    // cluster, and really does want the next cluster.
+  }
 
-  Cluster* const pCluster = m_clusters[0];
-  assert(pCluster);
+  // pos now points to just beyond the last fully-loaded cluster
 
-  return pCluster;
+  for (;;) {
+    const long status = DoParseNext(pResult, pos, len);
+
+    if (status <= 1)
+      return status;
+  }
 }
 
-const Cluster* Segment::GetLast() const {
-  if ((m_clusters == NULL) || (m_clusterCount <= 0))
-    return &m_eos;
+long Segment::DoParseNext(const Cluster*& pResult, long long& pos, long& len) {
+  long long total, avail;
 
-  const long idx = m_clusterCount - 1;
+  long status = m_pReader->Length(&total, &avail);
 
-  Cluster* const pCluster = m_clusters[idx];
-  assert(pCluster);
+  if (status < 0)  // error
+    return status;
 
-  return pCluster;
-}
+  assert((total < 0) || (avail <= total));
 
-unsigned long Segment::GetCount() const { return m_clusterCount; }
+  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
 
-const Cluster* Segment::GetNext(const Cluster* pCurr) {
-  assert(pCurr);
-  assert(pCurr != &m_eos);
-  assert(m_clusters);
+  // Parse next cluster.  This is strictly a parsing activity.
+  // Creation of a new cluster object happens later, after the
+  // parsing is done.
 
-  long idx = pCurr->m_index;
+  long long off_next = 0;
+  long long cluster_size = -1;
 
-  if (idx >= 0) {
-    assert(m_clusterCount > 0);
-    assert(idx < m_clusterCount);
-    assert(pCurr == m_clusters[idx]);
+  for (;;) {
+    if ((total >= 0) && (pos >= total))
+      return 1;  // EOF
 
-    ++idx;
+    if ((segment_stop >= 0) && (pos >= segment_stop))
+      return 1;  // EOF
 
-    if (idx >= m_clusterCount)
-      return &m_eos;  // caller will LoadCluster as desired
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-    Cluster* const pNext = m_clusters[idx];
-    assert(pNext);
-    assert(pNext->m_index >= 0);
-    assert(pNext->m_index == idx);
+    long long result = GetUIntLength(m_pReader, pos, len);
 
-    return pNext;
-  }
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-  assert(m_clusterPreloadCount > 0);
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
+
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  long long pos = pCurr->m_element_start;
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-  assert(m_size >= 0);  // TODO
-  const long long stop = m_start + m_size;  // end of segment
+    const long long idpos = pos;  // absolute
+    const long long idoff = pos - m_start;  // relative
 
-  {
-    long len;
+    const long long id = ReadID(m_pReader, idpos, len);  // absolute
 
-    long long result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);
-    assert((pos + len) <= stop);  // TODO
-    if (result != 0)
-      return NULL;
+    if (id < 0)  // error
+      return static_cast<long>(id);
 
-    const long long id = ReadID(m_pReader, pos, len);
-    if (id != libwebm::kMkvCluster)
-      return NULL;
+    if (id == 0)  // weird
+      return -1;  // generic error
 
     pos += len;  // consume ID
 
     // Read Size
+
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
+
     result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);  // TODO
-    assert((pos + len) <= stop);  // TODO
+
+    if (result < 0)  // error
+      return static_cast<long>(result);
+
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
+
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
+
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
     const long long size = ReadUInt(m_pReader, pos, len);
-    assert(size > 0);  // TODO
-    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
+
+    if (size < 0)  // error
+      return static_cast<long>(size);
 
     pos += len;  // consume length of size of element
-    assert((pos + size) <= stop);  // TODO
 
     // Pos now points to start of payload
 
-    pos += size;  // consume payload
-  }
+    if (size == 0)  // weird
+      continue;
 
-  long long off_next = 0;
+    const long long unknown_size = (1LL << (7 * len)) - 1;
 
-  while (pos < stop) {
-    long len;
+    if ((segment_stop >= 0) && (size != unknown_size) &&
+        ((pos + size) > segment_stop)) {
+      return E_FILE_FORMAT_INVALID;
+    }
 
-    long long result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);
-    assert((pos + len) <= stop);  // TODO
-    if (result != 0)
-      return NULL;
+    if (id == libwebm::kMkvCues) {
+      if (size == unknown_size)
+        return E_FILE_FORMAT_INVALID;
 
-    const long long idpos = pos;  // pos of next (potential) cluster
+      const long long element_stop = pos + size;
 
-    const long long id = ReadID(m_pReader, idpos, len);
-    if (id < 0)
-      return NULL;
+      if ((segment_stop >= 0) && (element_stop > segment_stop))
+        return E_FILE_FORMAT_INVALID;
 
-    pos += len;  // consume ID
+      const long long element_start = idpos;
+      const long long element_size = element_stop - element_start;
 
-    // Read Size
-    result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);  // TODO
-    assert((pos + len) <= stop);  // TODO
+      if (m_pCues == NULL) {
+        m_pCues = new (std::nothrow)
+            Cues(this, pos, size, element_start, element_size);
+        if (m_pCues == NULL)
+          return false;
+      }
 
-    const long long size = ReadUInt(m_pReader, pos, len);
-    assert(size >= 0);  // TODO
+      pos += size;  // consume payload
+      if (segment_stop >= 0 && pos > segment_stop)
+        return E_FILE_FORMAT_INVALID;
 
-    pos += len;  // consume length of size of element
-    assert((pos + size) <= stop);  // TODO
+      continue;
+    }
 
-    // Pos now points to start of payload
+    if (id != libwebm::kMkvCluster) {  // not a Cluster ID
+      if (size == unknown_size)
+        return E_FILE_FORMAT_INVALID;
+
+      pos += size;  // consume payload
+      if (segment_stop >= 0 && pos > segment_stop)
+        return E_FILE_FORMAT_INVALID;
 
-    if (size == 0)  // weird
       continue;
+    }
 
-    if (id == libwebm::kMkvCluster) {
-      const long long off_next_ = idpos - m_start;
+    // We have a cluster.
+    off_next = idoff;
 
-      long long pos_;
-      long len_;
+    if (size != unknown_size)
+      cluster_size = size;
 
-      const long status = Cluster::HasBlockEntries(this, off_next_, pos_, len_);
+    break;
+  }
 
-      assert(status >= 0);
+  assert(off_next > 0);  // have cluster
 
-      if (status > 0) {
-        off_next = off_next_;
-        break;
-      }
-    }
+  // We have parsed the next cluster.
+  // We have not created a cluster object yet.  What we need
+  // to do now is determine whether it has already be preloaded
+  //(in which case, an object for this cluster has already been
+  // created), and if not, create a new cluster object.
 
-    pos += size;  // consume payload
-  }
+  long chunk, idx;
 
-  if (off_next <= 0)
-    return 0;
+  const Cluster* const pPreloaded = FindPreloadedCluster(off_next, chunk, idx);
 
-  Cluster** const ii = m_clusters + m_clusterCount;
-  Cluster** i = ii;
+  if (pPreloaded != NULL) {
+    pos = off_next;
+    pResult = pPreloaded;
+    return 0;  // success
+  }
 
-  Cluster** const jj = ii + m_clusterPreloadCount;
-  Cluster** j = jj;
+  long long pos_;
+  long len_;
 
-  while (i < j) {
-    // INVARIANT:
-    //[0, i) < pos_next
-    //[i, j) ?
-    //[j, jj)  > pos_next
+  status = Cluster::HasBlockEntries(this, off_next, pos_, len_);
 
-    Cluster** const k = i + (j - i) / 2;
-    assert(k < jj);
+  if (status < 0) {  // error or underflow
+    pos = pos_;
+    len = len_;
 
-    Cluster* const pNext = *k;
-    assert(pNext);
-    assert(pNext->m_index < 0);
+    return status;
+  }
 
-    // const long long pos_ = pNext->m_pos;
-    // assert(pos_);
-    // pos = pos_ * ((pos_ < 0) ? -1 : 1);
+  if (status > 0) {  // means "found at least one block entry"
+    Cluster* const pNext = Cluster::Create(this,
+                                           -1,  // preloaded
+                                           off_next);
+    if (pNext == NULL)
+      return -1;
 
-    pos = pNext->GetPosition();
+    if (!PreloadCluster(pNext)) {
+      delete pNext;
+      return -1;
+    }
 
-    if (pos < off_next)
-      i = k + 1;
-    else if (pos > off_next)
-      j = k;
-    else
-      return pNext;
+    pResult = pNext;
+    return 0;  // success
   }
 
-  assert(i == j);
+  // status == 0 means "no block entries found"
 
-  Cluster* const pNext = Cluster::Create(this, -1, off_next);
-  if (pNext == NULL)
-    return NULL;
+  if (cluster_size < 0) {  // unknown size
+    const long long payload_pos = pos;  // absolute pos of cluster payload
 
-  const ptrdiff_t idx_next = i - m_clusters;  // insertion position
+    for (;;) {  // determine cluster size
+      if ((total >= 0) && (pos >= total))
+        break;
 
-  if (!PreloadCluster(pNext, idx_next)) {
-    delete pNext;
-    return NULL;
-  }
-  assert(m_clusters);
-  assert(idx_next < m_clusterSize);
-  assert(m_clusters[idx_next] == pNext);
+      if ((segment_stop >= 0) && (pos >= segment_stop))
+        break;  // no more clusters
 
-  return pNext;
-}
+      // Read ID
 
-long Segment::ParseNext(const Cluster* pCurr, const Cluster*& pResult,
-                        long long& pos, long& len) {
-  assert(pCurr);
-  assert(!pCurr->EOS());
-  assert(m_clusters);
+      if ((pos + 1) > avail) {
+        len = 1;
+        return E_BUFFER_NOT_FULL;
+      }
 
-  pResult = 0;
+      long long result = GetUIntLength(m_pReader, pos, len);
 
-  if (pCurr->m_index >= 0) {  // loaded (not merely preloaded)
-    assert(m_clusters[pCurr->m_index] == pCurr);
+      if (result < 0)  // error
+        return static_cast<long>(result);
 
-    const long next_idx = pCurr->m_index + 1;
+      if (result > 0)  // weird
+        return E_BUFFER_NOT_FULL;
 
-    if (next_idx < m_clusterCount) {
-      pResult = m_clusters[next_idx];
-      return 0;  // success
-    }
+      if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+        return E_FILE_FORMAT_INVALID;
 
-    // curr cluster is last among loaded
+      if ((pos + len) > avail)
+        return E_BUFFER_NOT_FULL;
 
-    const long result = LoadCluster(pos, len);
+      const long long idpos = pos;
+      const long long id = ReadID(m_pReader, idpos, len);
 
-    if (result < 0)  // error or underflow
-      return result;
+      if (id < 0)  // error (or underflow)
+        return static_cast<long>(id);
 
-    if (result > 0)  // no more clusters
-    {
-      // pResult = &m_eos;
-      return 1;
-    }
+      // This is the distinguished set of ID's we use to determine
+      // that we have exhausted the sub-element's inside the cluster
+      // whose ID we parsed earlier.
 
-    pResult = GetLast();
-    return 0;  // success
-  }
+      if (id == libwebm::kMkvCluster || id == libwebm::kMkvCues)
+        break;
 
-  assert(m_pos > 0);
+      pos += len;  // consume ID (of sub-element)
 
-  long long total, avail;
+      // Read Size
+
+      if ((pos + 1) > avail) {
+        len = 1;
+        return E_BUFFER_NOT_FULL;
+      }
+
+      result = GetUIntLength(m_pReader, pos, len);
+
+      if (result < 0)  // error
+        return static_cast<long>(result);
+
+      if (result > 0)  // weird
+        return E_BUFFER_NOT_FULL;
+
+      if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+        return E_FILE_FORMAT_INVALID;
+
+      if ((pos + len) > avail)
+        return E_BUFFER_NOT_FULL;
+
+      const long long size = ReadUInt(m_pReader, pos, len);
 
-  long status = m_pReader->Length(&total, &avail);
+      if (size < 0)  // error
+        return static_cast<long>(size);
 
-  if (status < 0)  // error
-    return status;
+      pos += len;  // consume size field of element
 
-  assert((total < 0) || (avail <= total));
+      // pos now points to start of sub-element's payload
 
-  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
+      if (size == 0)  // weird
+        continue;
 
-  // interrogate curr cluster
+      const long long unknown_size = (1LL << (7 * len)) - 1;
 
-  pos = pCurr->m_element_start;
+      if (size == unknown_size)
+        return E_FILE_FORMAT_INVALID;  // not allowed for sub-elements
 
-  if (pCurr->m_element_size >= 0)
-    pos += pCurr->m_element_size;
-  else {
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+      if ((segment_stop >= 0) && ((pos + size) > segment_stop))  // weird
+        return E_FILE_FORMAT_INVALID;
 
-    long long result = GetUIntLength(m_pReader, pos, len);
+      pos += size;  // consume payload of sub-element
+      if (segment_stop >= 0 && pos > segment_stop)
+        return E_FILE_FORMAT_INVALID;
+    }  // determine cluster size
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+    cluster_size = pos - payload_pos;
+    assert(cluster_size >= 0);  // TODO: handle cluster_size = 0
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+    pos = payload_pos;  // reset and re-parse original cluster
+  }
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+  pos += cluster_size;  // consume payload
+  if (segment_stop >= 0 && pos > segment_stop)
+    return E_FILE_FORMAT_INVALID;
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+  return 2;  // try to find a cluster that follows next
+}
 
-    const long long id = ReadUInt(m_pReader, pos, len);
+const Cluster* Segment::FindCluster(long long time_ns) const {
+  if ((m_clusters == NULL) || (m_clusterCount <= 0))
+    return &m_eos;
 
-    if (id != libwebm::kMkvCluster)
-      return -1;
+  {
+    Cluster* const pCluster = m_clusters[0];
+    assert(pCluster);
+    assert(pCluster->m_index == 0);
 
-    pos += len;  // consume ID
+    if (time_ns <= pCluster->GetTime())
+      return pCluster;
+  }
 
-    // Read Size
+  // Binary search of cluster array
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+  long i = 0;
+  long j = m_clusterCount;
 
-    result = GetUIntLength(m_pReader, pos, len);
+  while (i < j) {
+    // INVARIANT:
+    //[0, i) <= time_ns
+    //[i, j) ?
+    //[j, m_clusterCount)  > time_ns
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+    const long k = i + (j - i) / 2;
+    assert(k < m_clusterCount);
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+    Cluster* const pCluster = m_clusters[k];
+    assert(pCluster);
+    assert(pCluster->m_index == k);
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+    const long long t = pCluster->GetTime();
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+    if (t <= time_ns)
+      i = k + 1;
+    else
+      j = k;
 
-    const long long size = ReadUInt(m_pReader, pos, len);
+    assert(i <= j);
+  }
 
-    if (size < 0)  // error
-      return static_cast<long>(size);
+  assert(i == j);
+  assert(i > 0);
+  assert(i <= m_clusterCount);
 
-    pos += len;  // consume size field
+  const long k = i - 1;
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+  Cluster* const pCluster = m_clusters[k];
+  assert(pCluster);
+  assert(pCluster->m_index == k);
+  assert(pCluster->GetTime() <= time_ns);
 
-    if (size == unknown_size)  // TODO: should never happen
-      return E_FILE_FORMAT_INVALID;  // TODO: resolve this
+  return pCluster;
+}
 
-    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
+long Segment::SyncCluster(long long& pos, long long stop,
+                          long long& timecode) const {
+  const long long kCrc32Id = 0xBF;
+  const long kScanSize = 4096;
 
-    if ((segment_stop >= 0) && ((pos + size) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
 
-    // Pos now points to start of payload
+  unsigned char buf[kScanSize];
 
-    pos += size;  // consume payload (that is, the current cluster)
-    if (segment_stop >= 0 && pos > segment_stop)
-      return E_FILE_FORMAT_INVALID;
+  while (pos < stop) {
+    long len = kScanSize;
 
-    // By consuming the payload, we are assuming that the curr
-    // cluster isn't interesting.  That is, we don't bother checking
-    // whether the payload of the curr cluster is less than what
-    // happens to be available (obtained via IMkvReader::Length).
-    // Presumably the caller has already dispensed with the current
-    // cluster, and really does want the next cluster.
-  }
+    if (len > stop - pos)
+      len = static_cast<long>(stop - pos);
 
-  // pos now points to just beyond the last fully-loaded cluster
+    // The ID must lie entirely before |stop|.
+    if (len < 4)
+      return 1;
 
-  for (;;) {
-    const long status = DoParseNext(pResult, pos, len);
+    const int status = m_pReader->Read(pos, len, buf);
 
-    if (status <= 1)
+    if (status < 0)
       return status;
-  }
-}
 
-long Segment::DoParseNext(const Cluster*& pResult, long long& pos, long& len) {
-  long long total, avail;
+    if (status > 0)
+      return E_BUFFER_NOT_FULL;
 
-  long status = m_pReader->Length(&total, &avail);
+    for (long i = 0; i + 4 <= len; ++i) {
+      if (buf[i] != 0x1F || buf[i + 1] != 0x43 || buf[i + 2] != 0xB6 ||
+          buf[i + 3] != 0x75) {
+        continue;
+      }
 
-  if (status < 0)  // error
-    return status;
+      // A cluster ID inside block data is possible, so the candidate must
+      // also have a valid size and begin with a Timecode (optionally after
+      // a CRC-32), as muxers write it.
+      const long long element_start = pos + i;
+      long long p = element_start + 4;
 
-  assert((total < 0) || (avail <= total));
+      long size_len;
+      const long long size = ReadUInt(m_pReader, p, size_len);
 
-  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
+      if (size < 0)
+        continue;
 
-  // Parse next cluster.  This is strictly a parsing activity.
-  // Creation of a new cluster object happens later, after the
-  // parsing is done.
+      p += size_len;
 
-  long long off_next = 0;
-  long long cluster_size = -1;
+      const long long unknown_size = (1LL << (7 * size_len)) - 1;
+      const long long cluster_stop =
+          (size == unknown_size) ? segment_stop : p + size;
 
-  for (;;) {
-    if ((total >= 0) && (pos >= total))
-      return 1;  // EOF
+      if (segment_stop >= 0 && cluster_stop > segment_stop)
+        continue;
 
-    if ((segment_stop >= 0) && (pos >= segment_stop))
-      return 1;  // EOF
+      long id_len;
+      long long id = ReadID(m_pReader, p, id_len);
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+      if (id == kCrc32Id) {
+        p += id_len;
 
-    long long result = GetUIntLength(m_pReader, pos, len);
+        long crc_len;
+        const long long crc_size = ReadUInt(m_pReader, p, crc_len);
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+        if (crc_size != 4)
+          continue;
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+        p += crc_len + crc_size;
+        id = ReadID(m_pReader, p, id_len);
+      }
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+      if (id != libwebm::kMkvTimecode)
+        continue;
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+      p += id_len;
 
-    const long long idpos = pos;  // absolute
-    const long long idoff = pos - m_start;  // relative
+      long tc_len;
+      const long long tc_size = ReadUInt(m_pReader, p, tc_len);
 
-    const long long id = ReadID(m_pReader, idpos, len);  // absolute
+      if (tc_size <= 0 || tc_size > 8)
+        continue;
 
-    if (id < 0)  // error
-      return static_cast<long>(id);
+      p += tc_len;
 
-    if (id == 0)  // weird
-      return -1;  // generic error
+      if (cluster_stop >= 0 && p + tc_size > cluster_stop)
+        continue;
 
-    pos += len;  // consume ID
+      const long long tc = UnserializeUInt(m_pReader, p, tc_size);
 
-    // Read Size
+      if (tc < 0)
+        continue;
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
+      pos = element_start;
+      timecode = tc;
+
+      return 0;
     }
 
-    result = GetUIntLength(m_pReader, pos, len);
+    // Rescan the last bytes, which may hold the start of a split ID.
+    pos += len - 3;
+  }
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+  return 1;
+}
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+long Segment::SeekByBisection(long long time_ns, const Cluster*& pCluster) {
+  pCluster = NULL;
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+  if (m_pInfo == NULL)
+    return E_PARSE_FAILED;  // headers have not been parsed
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+  const long long scale = m_pInfo->GetTimeCodeScale();
 
-    const long long size = ReadUInt(m_pReader, pos, len);
+  if (scale <= 0)
+    return E_FILE_FORMAT_INVALID;
 
-    if (size < 0)  // error
-      return static_cast<long>(size);
+  long long total, available;
 
-    pos += len;  // consume length of size of element
+  const int status = m_pReader->Length(&total, &available);
 
-    // Pos now points to start of payload
+  if (status < 0)
+    return status;
 
-    if (size == 0)  // weird
-      continue;
+  long long stop = (m_size < 0) ? total : m_start + m_size;
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+  if (stop < 0 || stop > available)
+    stop = available;
 
-    if ((segment_stop >= 0) && (size != unknown_size) &&
-        ((pos + size) > segment_stop)) {
-      return E_FILE_FORMAT_INVALID;
+  // [lo, hi) holds the start of the cluster we want: lo is a cluster at or
+  // before |time_ns|, and no cluster at or after hi is.
+  long long lo, hi;
+  long long lo_timecode;
+
+  if (m_clusterCount > 0) {
+    const Cluster* const pLo = FindCluster(time_ns);
+    assert(pLo && !pLo->EOS());
+
+    if (pLo->m_index + 1 < m_clusterCount || DoneParsing()) {
+      pCluster = pLo;
+      return 0;
     }
 
-    if (id == libwebm::kMkvCues) {
-      if (size == unknown_size)
-        return E_FILE_FORMAT_INVALID;
+    lo = pLo->m_element_start;
+    lo_timecode = pLo->GetTimeCode();
 
-      const long long element_stop = pos + size;
+    if (lo_timecode < 0)
+      return E_FILE_FORMAT_INVALID;
 
-      if ((segment_stop >= 0) && (element_stop > segment_stop))
-        return E_FILE_FORMAT_INVALID;
+    hi = stop;
+  } else {
+    lo = m_pos;
 
-      const long long element_start = idpos;
-      const long long element_size = element_stop - element_start;
+    const long sync = SyncCluster(lo, stop, lo_timecode);
 
-      if (m_pCues == NULL) {
-        m_pCues = new (std::nothrow)
-            Cues(this, pos, size, element_start, element_size);
-        if (m_pCues == NULL)
-          return false;
-      }
+    if (sync < 0)
+      return sync;
 
-      pos += size;  // consume payload
-      if (segment_stop >= 0 && pos > segment_stop)
-        return E_FILE_FORMAT_INVALID;
+    if (sync > 0 || lo != m_pos)  // m_pos is not at the first cluster
+      return E_FILE_FORMAT_INVALID;
 
-      continue;
-    }
+    hi = stop;
+  }
 
-    if (id != libwebm::kMkvCluster) {  // not a Cluster ID
-      if (size == unknown_size)
-        return E_FILE_FORMAT_INVALID;
+  while (hi - lo > 1) {
+    const long long mid = lo + (hi - lo) / 2;
 
-      pos += size;  // consume payload
-      if (segment_stop >= 0 && pos > segment_stop)
-        return E_FILE_FORMAT_INVALID;
+    long long pos = mid;
+    long long timecode;
 
-      continue;
+    const long sync = SyncCluster(pos, hi, timecode);
+
+    if (sync < 0)
+      return sync;
+
+    if (sync > 0 || timecode < lo_timecode || timecode * scale > time_ns) {
+      hi = mid;
+    } else {
+      lo = pos;
+      lo_timecode = timecode;
     }
+  }
 
-    // We have a cluster.
-    off_next = idoff;
+  pCluster = FindOrPreloadCluster(lo - m_start);
 
-    if (size != unknown_size)
-      cluster_size = size;
+  if (pCluster == NULL)
+    return -1;
 
-    break;
-  }
+  return 0;
+}
 
-  assert(off_next > 0);  // have cluster
+bool Segment::PeekElement(long long pos, long long& id, long long& payload,
+                          long long& size) const {
+  long len;
 
-  // We have parsed the next cluster.
-  // We have not created a cluster object yet.  What we need
-  // to do now is determine whether it has already be preloaded
-  //(in which case, an object for this cluster has already been
-  // created), and if not, create a new cluster object.
+  id = ReadID(m_pReader, pos, len);
 
-  Cluster** const ii = m_clusters + m_clusterCount;
-  Cluster** i = ii;
+  if (id < 0)
+    return false;
 
-  Cluster** const jj = ii + m_clusterPreloadCount;
-  Cluster** j = jj;
+  payload = pos + len;
+  size = ReadUInt(m_pReader, payload, len);
 
-  while (i < j) {
-    // INVARIANT:
-    //[0, i) < pos_next
-    //[i, j) ?
-    //[j, jj)  > pos_next
+  if (size < 0)
+    return false;
 
-    Cluster** const k = i + (j - i) / 2;
-    assert(k < jj);
+  payload += len;
 
-    const Cluster* const pNext = *k;
-    assert(pNext);
-    assert(pNext->m_index < 0);
+  if (size == (1LL << (7 * len)) - 1)
+    size = -1;  // unknown
 
-    pos = pNext->GetPosition();
-    assert(pos >= 0);
+  return true;
+}
 
-    if (pos < off_next)
-      i = k + 1;
-    else if (pos > off_next)
-      j = k;
-    else {
-      pResult = pNext;
-      return 0;  // success
-    }
-  }
+long long Segment::FindSeekEntry(long long payload, long long size,
+                                 long long id) const {
+  long long pos = payload;
+  const long long stop = payload + size;
 
-  assert(i == j);
+  while (pos < stop) {
+    long long seek_id, seek_payload, seek_size;
 
-  long long pos_;
-  long len_;
+    if (!PeekElement(pos, seek_id, seek_payload, seek_size) || seek_size < 0)
+      return -1;
 
-  status = Cluster::HasBlockEntries(this, off_next, pos_, len_);
+    if (seek_id == libwebm::kMkvSeek) {
+      long long entry_id = -1;
+      long long entry_pos = -1;
 
-  if (status < 0) {  // error or underflow
-    pos = pos_;
-    len = len_;
+      long long p = seek_payload;
+      const long long seek_stop = seek_payload + seek_size;
 
-    return status;
-  }
+      while (p < seek_stop) {
+        long long child_id, child_payload, child_size;
 
-  if (status > 0) {  // means "found at least one block entry"
-    Cluster* const pNext = Cluster::Create(this,
-                                           -1,  // preloaded
-                                           off_next);
-    if (pNext == NULL)
-      return -1;
+        if (!PeekElement(p, child_id, child_payload, child_size) ||
+            child_size < 0) {
+          return -1;
+        }
 
-    const ptrdiff_t idx_next = i - m_clusters;  // insertion position
+        if (child_id == libwebm::kMkvSeekID) {
+          long len;
+          entry_id = ReadID(m_pReader, child_payload, len);
+        } else if (child_id == libwebm::kMkvSeekPosition && child_size <= 8) {
+          entry_pos = UnserializeUInt(m_pReader, child_payload, child_size);
+        }
 
-    if (!PreloadCluster(pNext, idx_next)) {
-      delete pNext;
-      return -1;
+        p = child_payload + child_size;
+      }
+
+      if (entry_id == id && entry_pos >= 0)
+        return m_start + entry_pos;
     }
-    assert(m_clusters);
-    assert(idx_next < m_clusterSize);
-    assert(m_clusters[idx_next] == pNext);
 
-    pResult = pNext;
-    return 0;  // success
+    pos = seek_payload + seek_size;
   }
 
-  // status == 0 means "no block entries found"
+  return -1;
+}
 
-  if (cluster_size < 0) {  // unknown size
-    const long long payload_pos = pos;  // absolute pos of cluster payload
+long Segment::PlanHeaders(ReadPlan& plan) const {
+  const long long kProbeSize = 4096;
 
-    for (;;) {  // determine cluster size
-      if ((total >= 0) && (pos >= total))
-        break;
+  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
 
-      if ((segment_stop >= 0) && (pos >= segment_stop))
-        break;  // no more clusters
+  long long pos = m_start;
 
-      // Read ID
+  for (;;) {
+    if (segment_stop >= 0 && pos >= segment_stop)
+      return 0;
 
-      if ((pos + 1) > avail) {
-        len = 1;
-        return E_BUFFER_NOT_FULL;
-      }
+    long long id, payload, size;
 
-      long long result = GetUIntLength(m_pReader, pos, len);
+    if (!PeekElement(pos, id, payload, size)) {
+      long long len = kProbeSize;
 
-      if (result < 0)  // error
-        return static_cast<long>(result);
+      if (segment_stop >= 0 && len > segment_stop - pos)
+        len = segment_stop - pos;
 
-      if (result > 0)  // weird
-        return E_BUFFER_NOT_FULL;
+      return plan.Add(pos, len) ? 1 : -1;
+    }
 
-      if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-        return E_FILE_FORMAT_INVALID;
+    if (id == libwebm::kMkvCluster)  // ParseHeaders() stops at its ID
+      return plan.Add(pos, payload - pos) ? 0 : -1;
 
-      if ((pos + len) > avail)
-        return E_BUFFER_NOT_FULL;
+    if (size < 0)
+      return E_FILE_FORMAT_INVALID;
 
-      const long long idpos = pos;
-      const long long id = ReadID(m_pReader, idpos, len);
+    const long long stop = payload + size;
 
-      if (id < 0)  // error (or underflow)
-        return static_cast<long>(id);
+    if (segment_stop >= 0 && stop > segment_stop)
+      return E_FILE_FORMAT_INVALID;
 
-      // This is the distinguished set of ID's we use to determine
-      // that we have exhausted the sub-element's inside the cluster
-      // whose ID we parsed earlier.
+    // The payload of a Void element is skipped, not read.
+    const long long len =
+        (id == libwebm::kMkvVoid) ? payload - pos : stop - pos;
 
-      if (id == libwebm::kMkvCluster || id == libwebm::kMkvCues)
-        break;
+    if (!plan.Add(pos, len))
+      return -1;
 
-      pos += len;  // consume ID (of sub-element)
+    if (id == libwebm::kMkvSeekHead) {
+      // If the SeekHead locates the first cluster, everything before it is
+      // the headers.
+      const long long cluster_pos =
+          FindSeekEntry(payload, size, libwebm::kMkvCluster);
 
-      // Read Size
+      if (cluster_pos >= stop) {
+        long long cluster_id, cluster_payload, cluster_size;
 
-      if ((pos + 1) > avail) {
-        len = 1;
-        return E_BUFFER_NOT_FULL;
-      }
+        if (!PeekElement(cluster_pos, cluster_id, cluster_payload,
+                         cluster_size)) {
+          return plan.Add(m_start, cluster_pos + 4 - m_start) ? 1 : -1;
+        }
 
-      result = GetUIntLength(m_pReader, pos, len);
+        if (cluster_id == libwebm::kMkvCluster)
+          return plan.Add(m_start, cluster_payload - m_start) ? 0 : -1;
+      }
+    }
 
-      if (result < 0)  // error
-        return static_cast<long>(result);
+    pos = stop;
+  }
+}
 
-      if (result > 0)  // weird
-        return E_BUFFER_NOT_FULL;
+long Segment::PlanSeek(long long time_ns, const Track* pTrack,
+                       ReadPlan& plan) {
+  const long long kHeaderSize = 12;  // enough for an ID and a size
 
-      if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-        return E_FILE_FORMAT_INVALID;
+  if (m_pInfo == NULL || pTrack == NULL)
+    return E_PARSE_FAILED;
 
-      if ((pos + len) > avail)
-        return E_BUFFER_NOT_FULL;
+  if (m_pCues == NULL) {
+    const SeekHead::Entry* pEntry = NULL;
 
-      const long long size = ReadUInt(m_pReader, pos, len);
+    const int count = m_pSeekHead ? m_pSeekHead->GetCount() : 0;
 
-      if (size < 0)  // error
-        return static_cast<long>(size);
+    for (int i = 0; i < count && pEntry == NULL; ++i) {
+      const SeekHead::Entry* const p = m_pSeekHead->GetEntry(i);
 
-      pos += len;  // consume size field of element
+      if (p->id == libwebm::kMkvCues)
+        pEntry = p;
+    }
 
-      // pos now points to start of sub-element's payload
+    if (pEntry == NULL)
+      return E_PARSE_FAILED;  // no Cues
 
-      if (size == 0)  // weird
-        continue;
+    const long long cues_pos = m_start + pEntry->pos;
 
-      const long long unknown_size = (1LL << (7 * len)) - 1;
+    long long id, payload, size;
 
-      if (size == unknown_size)
-        return E_FILE_FORMAT_INVALID;  // not allowed for sub-elements
+    if (!PeekElement(cues_pos, id, payload, size))
+      return plan.Add(cues_pos, kHeaderSize) ? 1 : -1;
 
-      if ((segment_stop >= 0) && ((pos + size) > segment_stop))  // weird
-        return E_FILE_FORMAT_INVALID;
+    if (id != libwebm::kMkvCues || size < 0)
+      return E_FILE_FORMAT_INVALID;
 
-      pos += size;  // consume payload of sub-element
-      if (segment_stop >= 0 && pos > segment_stop)
-        return E_FILE_FORMAT_INVALID;
-    }  // determine cluster size
+    if (!plan.Add(cues_pos, payload + size - cues_pos))
+      return -1;
 
-    cluster_size = pos - payload_pos;
-    assert(cluster_size >= 0);  // TODO: handle cluster_size = 0
+    // The Cues are fetched as one range, so if both ends are readable the
+    // whole element is.
+    unsigned char b;
 
-    pos = payload_pos;  // reset and re-parse original cluster
-  }
+    if (size > 0 && (m_pReader->Read(payload, 1, &b) != 0 ||
+                     m_pReader->Read(payload + size - 1, 1, &b) != 0)) {
+      return 1;
+    }
 
-  pos += cluster_size;  // consume payload
-  if (segment_stop >= 0 && pos > segment_stop)
-    return E_FILE_FORMAT_INVALID;
+    long long pos;
+    long len;
 
-  return 2;  // try to find a cluster that follows next
-}
+    const long status = ParseCues(pEntry->pos, pos, len);
 
-const Cluster* Segment::FindCluster(long long time_ns) const {
-  if ((m_clusters == NULL) || (m_clusterCount <= 0))
-    return &m_eos;
+    if (status < 0)
+      return status;
 
-  {
-    Cluster* const pCluster = m_clusters[0];
-    assert(pCluster);
-    assert(pCluster->m_index == 0);
+    if (m_pCues == NULL)
+      return E_PARSE_FAILED;
+  }
 
-    if (time_ns <= pCluster->GetTime())
-      return pCluster;
+  while (m_pCues->LoadCuePoint()) {
   }
 
-  // Binary search of cluster array
+  const CuePoint* pCP;
+  const CuePoint::TrackPosition* pTP;
 
-  long i = 0;
-  long j = m_clusterCount;
+  if (!m_pCues->Find(time_ns, pTrack, pCP, pTP))
+    return E_PARSE_FAILED;  // no cue points for the track
 
-  while (i < j) {
-    // INVARIANT:
-    //[0, i) <= time_ns
-    //[i, j) ?
-    //[j, m_clusterCount)  > time_ns
+  const long long cluster_pos = m_start + pTP->m_pos;
 
-    const long k = i + (j - i) / 2;
-    assert(k < m_clusterCount);
+  long long id, payload, size;
+  const bool known = PeekElement(cluster_pos, id, payload, size);
 
-    Cluster* const pCluster = m_clusters[k];
-    assert(pCluster);
-    assert(pCluster->m_index == k);
+  if (known && id != libwebm::kMkvCluster)
+    return E_FILE_FORMAT_INVALID;
 
-    const long long t = pCluster->GetTime();
+  if (known && size >= 0)
+    return plan.Add(cluster_pos, payload + size - cluster_pos) ? 0 : -1;
 
-    if (t <= time_ns)
-      i = k + 1;
-    else
-      j = k;
+  // The next cued cluster of the track bounds this one.
+  for (const CuePoint* p = m_pCues->GetNext(pCP); p; p = m_pCues->GetNext(p)) {
+    const CuePoint::TrackPosition* const pNext = p->Find(pTrack);
 
-    assert(i <= j);
+    if (pNext && pNext->m_pos > pTP->m_pos) {
+      const long long len = m_start + pNext->m_pos - cluster_pos;
+      return plan.Add(cluster_pos, len) ? 0 : -1;
+    }
   }
 
-  assert(i == j);
-  assert(i > 0);
-  assert(i <= m_clusterCount);
-
-  const long k = i - 1;
+  if (!known)
+    return plan.Add(cluster_pos, kHeaderSize) ? 1 : -1;
 
-  Cluster* const pCluster = m_clusters[k];
-  assert(pCluster);
-  assert(pCluster->m_index == k);
-  assert(pCluster->GetTime() <= time_ns);
+  // The last cluster, of unknown size, runs to the end of the segment.
+  if (m_size < 0)
+    return E_PARSE_FAILED;
 
-  return pCluster;
+  return plan.Add(cluster_pos, m_start + m_size - cluster_pos) ? 0 : -1;
 }
 
 const Tracks* Segment::GetTracks() const { return m_pTracks; }
@@ -3295,6 +5524,15 @@ const Chapters::Edition* Chapters::GetEdition(int idx) const {
   return m_editions + idx;
 }
 
+long long Chapters::GetMemoryUsage() const {
+  long long bytes = sizeof(Chapters) + m_editions_size * sizeof(Edition);
+
+  for (int idx = 0; idx < m_editions_count; ++idx)
+    bytes += m_editions[idx].GetMemoryUsage();
+
+  return bytes;
+}
+
 bool Chapters::ExpandEditionsArray() {
   if (m_editions_size > m_editions_count)
     return true;  // nothing else to do
@@ -3343,6 +5581,15 @@ const Chapters::Atom* Chapters::Edition::GetAtom(int index) const {
   return m_atoms + index;
 }
 
+long long Chapters::Edition::GetMemoryUsage() const {
+  long long bytes = m_atoms_size * sizeof(Atom);
+
+  for (int idx = 0; idx < m_atoms_count; ++idx)
+    bytes += m_atoms[idx].GetMemoryUsage();
+
+  return bytes;
+}
+
 void Chapters::Edition::Init() {
   m_atoms = NULL;
   m_atoms_size = 0;
@@ -3464,6 +5711,16 @@ const Chapters::Display* Chapters::Atom::GetDisplay(int index) const {
   return m_displays + index;
 }
 
+long long Chapters::Atom::GetMemoryUsage() const {
+  long long bytes = StringMemoryUsage(m_string_uid);
+  bytes += m_displays_size * sizeof(Display);
+
+  for (int idx = 0; idx < m_displays_count; ++idx)
+    bytes += m_displays[idx].GetMemoryUsage();
+
+  return bytes;
+}
+
 void Chapters::Atom::Init() {
   m_string_uid = NULL;
   m_uid = 0;
@@ -3630,6 +5887,11 @@ const char* Chapters::Display::GetLanguage() const { return m_language; }
 
 const char* Chapters::Display::GetCountry() const { return m_country; }
 
+long long Chapters::Display::GetMemoryUsage() const {
+  return StringMemoryUsage(m_string) + StringMemoryUsage(m_language) +
+         StringMemoryUsage(m_country);
+}
+
 void Chapters::Display::Init() {
   m_string = NULL;
   m_language = NULL;
@@ -3761,6 +6023,15 @@ const Tags::Tag* Tags::GetTag(int idx) const {
   return m_tags + idx;
 }
 
+long long Tags::GetMemoryUsage() const {
+  long long bytes = sizeof(Tags) + m_tags_size * sizeof(Tag);
+
+  for (int idx = 0; idx < m_tags_count; ++idx)
+    bytes += m_tags[idx].GetMemoryUsage();
+
+  return bytes;
+}
+
 bool Tags::ExpandTagsArray() {
   if (m_tags_size > m_tags_count)
     return true;  // nothing else to do
@@ -3809,6 +6080,15 @@ const Tags::SimpleTag* Tags::Tag::GetSimpleTag(int index) const {
   return m_simple_tags + index;
 }
 
+long long Tags::Tag::GetMemoryUsage() const {
+  long long bytes = m_simple_tags_size * sizeof(SimpleTag);
+
+  for (int idx = 0; idx < m_simple_tags_count; ++idx)
+    bytes += m_simple_tags[idx].GetMemoryUsage();
+
+  return bytes;
+}
+
 void Tags::Tag::Init() {
   m_simple_tags = NULL;
   m_simple_tags_size = 0;
@@ -3905,6 +6185,10 @@ const char* Tags::SimpleTag::GetTagName() const { return m_tag_name; }
 
 const char* Tags::SimpleTag::GetTagString() const { return m_tag_string; }
 
+long long Tags::SimpleTag::GetMemoryUsage() const {
+  return StringMemoryUsage(m_tag_name) + StringMemoryUsage(m_tag_string);
+}
+
 void Tags::SimpleTag::Init() {
   m_tag_name = NULL;
   m_tag_string = NULL;
@@ -4075,6 +6359,12 @@ const char* SegmentInfo::GetWritingAppAsUTF8() const {
 
 const char* SegmentInfo::GetTitleAsUTF8() const { return m_pTitleAsUTF8; }
 
+long long SegmentInfo::GetMemoryUsage() const {
+  return sizeof(SegmentInfo) + StringMemoryUsage(m_pMuxingAppAsUTF8) +
+         StringMemoryUsage(m_pWritingAppAsUTF8) +
+         StringMemoryUsage(m_pTitleAsUTF8);
+}
+
 ///////////////////////////////////////////////////////////////
 // ContentEncoding element
 ContentEncoding::ContentCompression::ContentCompression()
@@ -4168,6 +6458,24 @@ unsigned long ContentEncoding::GetEncryptionCount() const {
   return static_cast<unsigned long>(count);
 }
 
+long long ContentEncoding::GetMemoryUsage() const {
+  long long bytes = sizeof(ContentEncoding);
+
+  for (ContentCompression** i = compression_entries_;
+       i != compression_entries_end_; ++i) {
+    bytes += sizeof(ContentCompression*) + sizeof(ContentCompression);
+    bytes += (*i)->settings_len;
+  }
+
+  for (ContentEncryption** i = encryption_entries_;
+       i != encryption_entries_end_; ++i) {
+    bytes += sizeof(ContentEncryption*) + sizeof(ContentEncryption);
+    bytes += (*i)->key_id_len + (*i)->signature_len + (*i)->sig_key_id_len;
+  }
+
+  return bytes;
+}
+
 long ContentEncoding::ParseContentEncAESSettingsEntry(
     long long start, long long size, IMkvReader* pReader,
     ContentEncAESSettings* aes) {
@@ -4476,7 +6784,8 @@ Track::Track(Segment* pSegment, long long element_start, long long element_size)
       m_element_start(element_start),
       m_element_size(element_size),
       content_encoding_entries_(NULL),
-      content_encoding_entries_end_(NULL) {}
+      content_encoding_entries_end_(NULL),
+      m_cursor_pos(-1) {}
 
 Track::~Track() {
   Info& info = const_cast<Info&>(m_info);
@@ -4654,11 +6963,51 @@ unsigned long long Track::GetDefaultDuration() const {
   return m_info.defaultDuration;
 }
 
-unsigned long long Track::GetCodecDelay() const { return m_info.codecDelay; }
+unsigned long long Track::GetCodecDelay() const { return m_info.codecDelay; }
+
+unsigned long long Track::GetSeekPreRoll() const { return m_info.seekPreRoll; }
+
+long long Track::GetMemoryUsage() const {
+  long long bytes = sizeof(Track);
+
+  bytes += StringMemoryUsage(m_info.nameAsUTF8);
+  bytes += StringMemoryUsage(m_info.language);
+  bytes += StringMemoryUsage(m_info.codecId);
+  bytes += StringMemoryUsage(m_info.codecNameAsUTF8);
+  bytes += m_info.codecPrivateSize;
+
+  for (ContentEncoding** i = content_encoding_entries_;
+       i != content_encoding_entries_end_; ++i) {
+    bytes += sizeof(ContentEncoding*) + (*i)->GetMemoryUsage();
+  }
+
+  return bytes;
+}
+
+void Track::SetCursor(const BlockEntry* pEntry) const {
+  if (pEntry == NULL || !m_pSegment->IsEvicting())
+    return;
+
+  const long long pos =
+      pEntry->EOS() ? -1 : pEntry->GetCluster()->m_element_start;
+
+  if (m_cursor_pos == pos)
+    return;
+
+  m_cursor_pos = pos;
+  m_pSegment->EvictClusters(NULL);
+}
+
+long Track::GetFirst(const BlockEntry*& pBlockEntry) const {
+  const long status = FindFirst(pBlockEntry);
+
+  if (status >= 0)
+    SetCursor(pBlockEntry);
 
-unsigned long long Track::GetSeekPreRoll() const { return m_info.seekPreRoll; }
+  return status;
+}
 
-long Track::GetFirst(const BlockEntry*& pBlockEntry) const {
+long Track::FindFirst(const BlockEntry*& pBlockEntry) const {
   const Cluster* pCluster = m_pSegment->GetFirst();
 
   for (int i = 0;;) {
@@ -4677,36 +7026,25 @@ long Track::GetFirst(const BlockEntry*& pBlockEntry) const {
       return E_BUFFER_NOT_FULL;
     }
 
-    long status = pCluster->GetFirst(pBlockEntry);
-
-    if (status < 0)  // error
-      return status;
-
-    if (pBlockEntry == 0) {  // empty cluster
-      pCluster = m_pSegment->GetNext(pCluster);
-      continue;
-    }
+    pBlockEntry = NULL;
 
     for (;;) {
-      const Block* const pBlock = pBlockEntry->GetBlock();
-      assert(pBlock);
-
-      const long long tn = pBlock->GetTrackNumber();
-
-      if ((tn == m_info.number) && VetEntry(pBlockEntry))
-        return 0;
-
-      const BlockEntry* pNextEntry;
-
-      status = pCluster->GetNext(pBlockEntry, pNextEntry);
+      const long status =
+          pCluster->GetNextForTrack(m_info.number, pBlockEntry, pBlockEntry);
 
       if (status < 0)  // error
         return status;
 
-      if (pNextEntry == 0)
+      if (pBlockEntry == NULL)
         break;
 
-      pBlockEntry = pNextEntry;
+      if (VetEntry(pBlockEntry))
+        return 0;
+    }
+
+    if (pCluster->GetEntryCount() <= 0) {  // empty cluster
+      pCluster = m_pSegment->GetNext(pCluster);
+      continue;
     }
 
     ++i;
@@ -4727,6 +7065,16 @@ long Track::GetFirst(const BlockEntry*& pBlockEntry) const {
 
 long Track::GetNext(const BlockEntry* pCurrEntry,
                     const BlockEntry*& pNextEntry) const {
+  const long status = FindNext(pCurrEntry, pNextEntry);
+
+  if (status >= 0)
+    SetCursor(pNextEntry);
+
+  return status;
+}
+
+long Track::FindNext(const BlockEntry* pCurrEntry,
+                     const BlockEntry*& pNextEntry) const {
   assert(pCurrEntry);
   assert(!pCurrEntry->EOS());  //?
 
@@ -4739,26 +7087,15 @@ long Track::GetNext(const BlockEntry* pCurrEntry,
   assert(pCluster);
   assert(!pCluster->EOS());
 
-  long status = pCluster->GetNext(pCurrEntry, pNextEntry);
+  long status =
+      pCluster->GetNextForTrack(m_info.number, pCurrEntry, pNextEntry);
 
   if (status < 0)  // error
     return status;
 
   for (int i = 0;;) {
-    while (pNextEntry) {
-      const Block* const pNextBlock = pNextEntry->GetBlock();
-      assert(pNextBlock);
-
-      if (pNextBlock->GetTrackNumber() == m_info.number)
-        return 0;
-
-      pCurrEntry = pNextEntry;
-
-      status = pCluster->GetNext(pCurrEntry, pNextEntry);
-
-      if (status < 0)  // error
-        return status;
-    }
+    if (pNextEntry)
+      return 0;
 
     pCluster = m_pSegment->GetNext(pCluster);
 
@@ -4789,13 +7126,13 @@ long Track::GetNext(const BlockEntry* pCurrEntry,
       return E_BUFFER_NOT_FULL;
     }
 
-    status = pCluster->GetFirst(pNextEntry);
+    status = pCluster->GetNextForTrack(m_info.number, NULL, pNextEntry);
 
     if (status < 0)  // error
       return status;
 
-    if (pNextEntry == NULL)  // empty cluster
-      continue;
+    if (pNextEntry == NULL && pCluster->GetEntryCount() <= 0)
+      continue;  // empty cluster
 
     ++i;
 
@@ -4811,6 +7148,124 @@ long Track::GetNext(const BlockEntry* pCurrEntry,
   return 1;
 }
 
+long Track::GetFirstKey(const BlockEntry*& pBlockEntry) const {
+  long status;
+
+  if (GetCuedKey(-1, pBlockEntry))
+    status = pBlockEntry->EOS() ? 1 : 0;
+  else
+    status = FindKey(m_pSegment->GetFirst(), NULL, pBlockEntry);
+
+  if (status >= 0)
+    SetCursor(pBlockEntry);
+
+  return status;
+}
+
+long Track::GetNextKey(const BlockEntry* pCurrEntry,
+                       const BlockEntry*& pNextEntry) const {
+  if (pCurrEntry == NULL || pCurrEntry->EOS())
+    return -1;
+
+  const Block* const pCurrBlock = pCurrEntry->GetBlock();
+  if (!pCurrBlock || pCurrBlock->GetTrackNumber() != m_info.number)
+    return -1;
+
+  const Cluster* const pCluster = pCurrEntry->GetCluster();
+  long status;
+
+  if (GetCuedKey(pCurrBlock->GetTime(pCluster), pNextEntry))
+    status = pNextEntry->EOS() ? 1 : 0;
+  else
+    status = FindKey(pCluster, pCurrEntry, pNextEntry);
+
+  if (status >= 0)
+    SetCursor(pNextEntry);
+
+  return status;
+}
+
+bool Track::GetCuedKey(long long time_ns, const BlockEntry*& pEntry) const {
+  const Cues* const pCues = m_pSegment->GetCues();
+
+  if (pCues == NULL)
+    return false;
+
+  while (pCues->LoadCuePoint()) {
+  }
+
+  const CuePoint* pCP;
+  const CuePoint::TrackPosition* pTP;
+
+  if (!pCues->FindNext(-1, this, pCP, pTP))
+    return false;
+
+  while (pCues->FindNext(time_ns, this, pCP, pTP)) {
+    const BlockEntry* const p = pCues->GetBlock(pCP, pTP);
+
+    if (p && !p->EOS() && p->GetBlock()->GetTrackNumber() == m_info.number &&
+        p->GetBlock()->IsKey()) {
+      pEntry = p;
+      return true;
+    }
+
+    time_ns = pCP->GetTime(m_pSegment);  // skip a cue point that is off
+  }
+
+  pEntry = GetEOS();
+  return true;
+}
+
+long Track::FindKey(const Cluster* pCluster, const BlockEntry* pCurrEntry,
+                    const BlockEntry*& pNextEntry) const {
+  for (;;) {
+    if (pCluster == NULL) {
+      pNextEntry = GetEOS();
+      return 1;
+    }
+
+    if (pCluster->EOS()) {
+      if (m_pSegment->DoneParsing()) {
+        pNextEntry = GetEOS();
+        return 1;
+      }
+
+      pNextEntry = NULL;
+      return E_BUFFER_NOT_FULL;
+    }
+
+    long status = 1;
+
+    // A cluster that has already been parsed is searched as is.
+    if (pCurrEntry == NULL && pCluster->GetEntryCount() < 0)
+      status = pCluster->ScanForKey(m_info.number);
+
+    if (status < 0 && status != E_BUFFER_NOT_FULL)
+      return status;
+
+    if (status != 0) {
+      pNextEntry = pCurrEntry;
+
+      for (;;) {
+        status =
+            pCluster->GetNextForTrack(m_info.number, pNextEntry, pNextEntry);
+
+        if (status < 0)  // error
+          return status;
+
+        if (pNextEntry == NULL)
+          break;
+
+        if (pNextEntry->GetBlock()->IsKey() && VetEntry(pNextEntry))
+          return 0;
+      }
+    }
+
+    pCurrEntry = NULL;
+    pCluster = m_pSegment->GetNext(pCluster);
+  }
+}
+
 bool Track::VetEntry(const BlockEntry* pBlockEntry) const {
   assert(pBlockEntry);
   const Block* const pBlock = pBlockEntry->GetBlock();
@@ -4897,13 +7352,16 @@ long Track::Seek(long long time_ns, const BlockEntry*& pResult) const {
 
     pResult = pCluster->GetEntry(this);
 
-    if ((pResult != 0) && !pResult->EOS())
+    if ((pResult != 0) && !pResult->EOS()) {
+      SetCursor(pResult);
       return 0;
+    }
 
     // landed on empty cluster (no entries)
   }
 
   pResult = GetEOS();  // weird
+  SetCursor(pResult);
   return 0;
 }
 
@@ -4927,6 +7385,67 @@ unsigned long Track::GetContentEncodingCount() const {
   return static_cast<unsigned long>(count);
 }
 
+const unsigned char* Track::GetStrippedHeader(size_t& len) const {
+  const unsigned long long kHeaderStripping = 3;
+
+  len = 0;
+
+  for (ContentEncoding** i = content_encoding_entries_;
+       i != content_encoding_entries_end_; ++i) {
+    const ContentEncoding* const pEncoding = *i;
+
+    // Compression of the frame contents.
+    if (pEncoding->encoding_type() != 0 ||
+        (pEncoding->encoding_scope() & 1) == 0) {
+      continue;
+    }
+
+    const unsigned long count = pEncoding->GetCompressionCount();
+
+    for (unsigned long j = 0; j < count; ++j) {
+      const ContentEncoding::ContentCompression* const pCompression =
+          pEncoding->GetCompressionByIndex(j);
+
+      if (pCompression->algo == kHeaderStripping &&
+          pCompression->settings != NULL) {
+        len = static_cast<size_t>(pCompression->settings_len);
+        return pCompression->settings;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+long long Track::GetFrameSize(const Block::Frame& frame) const {
+  size_t header_len;
+  GetStrippedHeader(header_len);
+
+  return frame.len + static_cast<long long>(header_len);
+}
+
+long Track::ReadFrame(IMkvReader* pReader, const Block::Frame& frame,
+                      unsigned char* buf) const {
+  assert(pReader);
+  assert(buf);
+
+  size_t header_len;
+  const unsigned char* const header = GetStrippedHeader(header_len);
+
+  if (header_len > 0)
+    memcpy(buf, header, header_len);
+
+  return frame.Read(pReader, buf + header_len);
+}
+
+long Track::ReadFrame(IMkvReader* pReader, const Block::Frame& frame,
+                      unsigned char* buf, FrameParts& parts) const {
+  parts.header = GetStrippedHeader(parts.header_len);
+  parts.payload_len = frame.len;
+
+  return frame.Read(pReader, buf, parts.payload);
+}
+
 long Track::ParseContentEncodingsEntry(long long start, long long size) {
   IMkvReader* const pReader = m_pSegment->m_pReader;
   assert(pReader);
@@ -5456,6 +7975,13 @@ bool VideoTrack::VetEntry(const BlockEntry* pBlockEntry) const {
 }
 
 long VideoTrack::Seek(long long time_ns, const BlockEntry*& pResult) const {
+  pResult = m_pSegment->FindIndexedKeyframe(this, time_ns);
+
+  if (pResult) {
+    SetCursor(pResult);
+    return 0;
+  }
+
   const long status = GetFirst(pResult);
 
   if (status < 0)  // buffer underflow, etc
@@ -5523,8 +8049,10 @@ long VideoTrack::Seek(long long time_ns, const BlockEntry*& pResult) const {
 
   pResult = pCluster->GetEntry(this, time_ns);
 
-  if ((pResult != 0) && !pResult->EOS())  // found a keyframe
+  if ((pResult != 0) && !pResult->EOS()) {  // found a keyframe
+    SetCursor(pResult);
     return 0;
+  }
 
   while (lo != i) {
     pCluster = *--lo;
@@ -5533,14 +8061,17 @@ long VideoTrack::Seek(long long time_ns, const BlockEntry*& pResult) const {
 
     pResult = pCluster->GetEntry(this, time_ns);
 
-    if ((pResult != 0) && !pResult->EOS())
+    if ((pResult != 0) && !pResult->EOS()) {
+      SetCursor(pResult);
       return 0;
+    }
   }
 
   // weird: we're on the first cluster, but no keyframe found
   // should never happen but we must return something anyway
 
   pResult = GetEOS();
+  SetCursor(pResult);
   return 0;
 }
 
@@ -5548,6 +8079,31 @@ Colour* VideoTrack::GetColour() const { return m_colour; }
 
 Projection* VideoTrack::GetProjection() const { return m_projection; }
 
+long long VideoTrack::GetMemoryUsage() const {
+  long long bytes = Track::GetMemoryUsage();
+  bytes += sizeof(VideoTrack) - sizeof(Track);
+  bytes += StringMemoryUsage(m_colour_space);
+
+  if (m_colour) {
+    bytes += sizeof(Colour);
+
+    const MasteringMetadata* const mm = m_colour->mastering_metadata;
+
+    if (mm) {
+      bytes += sizeof(MasteringMetadata);
+      bytes += (mm->r ? sizeof(PrimaryChromaticity) : 0) +
+               (mm->g ? sizeof(PrimaryChromaticity) : 0) +
+               (mm->b ? sizeof(PrimaryChromaticity) : 0) +
+               (mm->white_point ? sizeof(PrimaryChromaticity) : 0);
+    }
+  }
+
+  if (m_projection)
+    bytes += sizeof(Projection) + m_projection->private_data_length;
+
+  return bytes;
+}
+
 long long VideoTrack::GetWidth() const { return m_width; }
 
 long long VideoTrack::GetHeight() const { return m_height; }
@@ -5657,6 +8213,10 @@ long long AudioTrack::GetChannels() const { return m_channels; }
 
 long long AudioTrack::GetBitDepth() const { return m_bitDepth; }
 
+long long AudioTrack::GetMemoryUsage() const {
+  return Track::GetMemoryUsage() + sizeof(AudioTrack) - sizeof(Track);
+}
+
 Tracks::Tracks(Segment* pSegment, long long start, long long size_,
                long long element_start, long long element_size)
     : m_pSegment(pSegment),
@@ -6051,6 +8611,17 @@ const Track* Tracks::GetTrackByIndex(unsigned long idx) const {
   return m_trackEntries[idx];
 }
 
+long long Tracks::GetMemoryUsage() const {
+  const ptrdiff_t count = m_trackEntriesEnd - m_trackEntries;
+
+  long long bytes = sizeof(Tracks) + count * sizeof(Track*);
+
+  for (ptrdiff_t idx = 0; idx < count; ++idx)
+    bytes += m_trackEntries[idx]->GetMemoryUsage();
+
+  return bytes;
+}
+
 long Cluster::Load(long long& pos, long& len) const {
   if (m_pSegment == NULL)
     return E_PARSE_FAILED;
@@ -6061,7 +8632,7 @@ long Cluster::Load(long long& pos, long& len) const {
   if (m_pos != m_element_start || m_element_size >= 0)
     return E_PARSE_FAILED;
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+  IMkvReader* const pReader = GetReader();
   long long total, avail;
   const int status = pReader->Length(&total, &avail);
 
@@ -6268,6 +8839,7 @@ long Cluster::Load(long long& pos, long& len) const {
     return E_FILE_FORMAT_INVALID;
 
   m_pos = new_pos;  // designates position just beyond timecode payload
+  m_blocks_pos = new_pos;
   m_timecode = timecode;  // m_timecode >= 0 means we're partially loaded
 
   if (cluster_size >= 0)
@@ -6291,7 +8863,7 @@ long Cluster::Parse(long long& pos, long& len) const {
   if ((cluster_stop >= 0) && (m_pos >= cluster_stop))
     return 1;  // nothing else to do
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+  IMkvReader* const pReader = GetReader();
 
   long long total, avail;
 
@@ -6471,7 +9043,7 @@ long Cluster::ParseSimpleBlock(long long block_size, long long& pos,
   const long long block_start = pos;
   const long long block_stop = pos + block_size;
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+  IMkvReader* const pReader = GetReader();
 
   long long total, avail;
 
@@ -6569,7 +9141,7 @@ long Cluster::ParseBlockGroup(long long payload_size, long long& pos,
   const long long payload_start = pos;
   const long long payload_stop = pos + payload_size;
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+  IMkvReader* const pReader = GetReader();
 
   long long total, avail;
 
@@ -6792,6 +9364,7 @@ long Cluster::GetEntry(long index, const mkvparser::BlockEntry*& pEntry) const {
     pEntry = m_entries[index];
     assert(pEntry);
 
+    m_pSegment->OnClusterRead(this);
     return 1;  // found entry
   }
 
@@ -6827,8 +9400,20 @@ Cluster::Cluster()
       m_timecode(0),
       m_entries(NULL),
       m_entries_size(0),
-      m_entries_count(0)  // means "no entries"
-{}
+      m_entries_count(0),  // means "no entries"
+      m_track_entries(NULL),
+      m_track_entries_count(0),
+      m_track_entries_size(0),
+      m_blocks_pos(0),
+      m_resident_bytes(0),
+      m_resident(false),
+      m_evicted(false),
+      m_pParseReader(NULL),
+      m_arena(NULL),
+      m_arena_bytes(0),
+      m_heap_allocations(0),
+      m_arena_allocations(0),
+      m_arena_allocated_bytes(0) {}
 
 Cluster::Cluster(Segment* pSegment, long idx, long long element_start
                  /* long long element_size */)
@@ -6840,26 +9425,125 @@ Cluster::Cluster(Segment* pSegment, long idx, long long element_start
       m_timecode(-1),
       m_entries(NULL),
       m_entries_size(0),
-      m_entries_count(-1)  // means "has not been parsed yet"
-{}
+      m_entries_count(-1),  // means "has not been parsed yet"
+      m_track_entries(NULL),
+      m_track_entries_count(0),
+      m_track_entries_size(0),
+      m_blocks_pos(-1),
+      m_resident_bytes(0),
+      m_resident(false),
+      m_evicted(false),
+      m_pParseReader(NULL),
+      m_arena(NULL),
+      m_arena_bytes(0),
+      m_heap_allocations(0),
+      m_arena_allocations(0),
+      m_arena_allocated_bytes(0) {}
+
+Cluster::~Cluster() { ReleaseEntries(); }
+
+void* Cluster::Allocate(size_t size) const {
+  const size_t kAlign = sizeof(long long) > sizeof(void*) ? sizeof(long long)
+                                                          : sizeof(void*);
+  const size_t kHeaderSize = (sizeof(ArenaChunk) + kAlign - 1) & ~(kAlign - 1);
+  const size_t kMinChunkSize = 4096;
+  const size_t kMaxChunkSize = 256 * 1024;
+
+  size = (size + kAlign - 1) & ~(kAlign - 1);
+
+  if (m_arena == NULL || m_arena->size - m_arena->used < size) {
+    // Chunks double in size, so a cluster of n entries costs O(log n) heap
+    // allocations.
+    size_t chunk_size = m_arena ? 2 * m_arena->size : kMinChunkSize;
+
+    if (chunk_size > kMaxChunkSize)
+      chunk_size = kMaxChunkSize;
+
+    if (chunk_size < size)
+      chunk_size = size;
+
+    unsigned char* const buf =
+        new (std::nothrow) unsigned char[kHeaderSize + chunk_size];
+
+    if (buf == NULL)
+      return NULL;
 
-Cluster::~Cluster() {
-  if (m_entries_count <= 0) {
-    delete[] m_entries;
-    return;
+    ArenaChunk* const pChunk = reinterpret_cast<ArenaChunk*>(buf);
+    pChunk->next = m_arena;
+    pChunk->size = chunk_size;
+    pChunk->used = 0;
+
+    m_arena = pChunk;
+    m_arena_bytes += static_cast<long long>(kHeaderSize + chunk_size);
+    ++m_heap_allocations;
   }
 
-  BlockEntry** i = m_entries;
-  BlockEntry** const j = m_entries + m_entries_count;
+  unsigned char* const data =
+      reinterpret_cast<unsigned char*>(m_arena) + kHeaderSize;
+  void* const p = data + m_arena->used;
 
-  while (i != j) {
-    BlockEntry* p = *i++;
+  m_arena->used += size;
+  ++m_arena_allocations;
+  m_arena_allocated_bytes += static_cast<long long>(size);
+
+  return p;
+}
+
+void Cluster::DestroyEntry(BlockEntry* pEntry) const {
+  // The storage belongs to the arena.
+  pEntry->~BlockEntry();
+}
+
+void Cluster::ReleaseArena() const {
+  while (m_arena) {
+    ArenaChunk* const pChunk = m_arena;
+    m_arena = pChunk->next;
+
+    delete[] reinterpret_cast<unsigned char*>(pChunk);
+  }
+
+  m_arena_bytes = 0;
+}
+
+void Cluster::ReleaseEntries() const {
+  for (long i = 0; i < m_track_entries_count; ++i) {
+    delete[] m_track_entries[i].indices;
+    delete[] m_track_entries[i].timecodes;
+  }
+
+  delete[] m_track_entries;
+
+  m_track_entries = NULL;
+  m_track_entries_count = 0;
+  m_track_entries_size = 0;
+
+  for (long i = 0; i < m_entries_count; ++i) {
+    BlockEntry* const p = m_entries[i];
     assert(p);
 
-    delete p;
+    DestroyEntry(p);
   }
 
   delete[] m_entries;
+
+  m_entries = NULL;
+  m_entries_size = 0;
+
+  ReleaseArena();
+
+  m_resident_bytes = 0;
+
+  if (m_resident) {
+    m_resident = false;
+    m_evicted = true;
+  }
+
+  if (m_entries_count >= 0) {
+    m_entries_count = -1;  // has not been parsed yet
+
+    assert(m_blocks_pos >= 0);
+    m_pos = m_blocks_pos;
+  }
 }
 
 bool Cluster::EOS() const { return (m_pSegment == NULL); }
@@ -6875,6 +9559,10 @@ long long Cluster::GetPosition() const {
 
 long long Cluster::GetElementSize() const { return m_element_size; }
 
+IMkvReader* Cluster::GetReader() const {
+  return m_pParseReader ? m_pParseReader : m_pSegment->m_pReader;
+}
+
 long Cluster::HasBlockEntries(
     const Segment* pSegment,
     long long off,  // relative to start of segment payload
@@ -7164,6 +9852,7 @@ long Cluster::CreateBlock(long long id,
     if (m_entries == NULL)
       return -1;
 
+    ++m_heap_allocations;
     m_entries_count = 0;
   } else {
     assert(m_entries);
@@ -7177,25 +9866,142 @@ long Cluster::CreateBlock(long long id,
       if (entries == NULL)
         return -1;
 
-      BlockEntry** src = m_entries;
-      BlockEntry** const src_end = src + m_entries_count;
+      ++m_heap_allocations;
+
+      BlockEntry** src = m_entries;
+      BlockEntry** const src_end = src + m_entries_count;
+
+      BlockEntry** dst = entries;
+
+      while (src != src_end)
+        *dst++ = *src++;
+
+      delete[] m_entries;
+
+      m_entries = entries;
+      m_entries_size = entries_size;
+    }
+  }
+
+  const long status = (id == libwebm::kMkvBlockGroup)
+                          ? CreateBlockGroup(pos, size, discard_padding)
+                          : CreateSimpleBlock(pos, size);
+
+  if (status != 0)
+    return status;
+
+  const long idx = m_entries_count - 1;
+
+  if (!IndexEntry(idx)) {
+    DestroyEntry(m_entries[idx]);
+    m_entries[idx] = NULL;
+    m_entries_count = idx;
+
+    return -1;
+  }
+
+  long long resident_bytes = m_arena_bytes;
+
+  resident_bytes += m_entries_size * sizeof(BlockEntry*);
+  resident_bytes += m_track_entries_size * sizeof(TrackEntries);
+
+  for (long i = 0; i < m_track_entries_count; ++i)
+    resident_bytes += m_track_entries[i].size * (sizeof(long) + sizeof(short));
+
+  const long long delta = resident_bytes - m_resident_bytes;
+  m_resident_bytes = resident_bytes;
+
+  m_pSegment->OnClusterParsed(this, delta);
+
+  return 0;
+}
+
+bool Cluster::IndexEntry(long idx) {
+  const BlockEntry* const pEntry = m_entries[idx];
+  assert(pEntry);
+
+  const Block* const pBlock = pEntry->GetBlock();
+  assert(pBlock);
+
+  const long long track = pBlock->GetTrackNumber();
+  const short timecode = static_cast<short>(pBlock->GetTimeCode(NULL));
+
+  TrackEntries* pTrack = const_cast<TrackEntries*>(FindTrackEntries(track));
+
+  if (pTrack == NULL) {
+    if (m_track_entries_count >= m_track_entries_size) {
+      const long size =
+          (m_track_entries_size <= 0) ? 4 : 2 * m_track_entries_size;
+
+      TrackEntries* const tracks = new (std::nothrow) TrackEntries[size];
+      if (tracks == NULL)
+        return false;
+
+      ++m_heap_allocations;
+
+      for (long i = 0; i < m_track_entries_count; ++i)
+        tracks[i] = m_track_entries[i];
+
+      delete[] m_track_entries;
+
+      m_track_entries = tracks;
+      m_track_entries_size = size;
+    }
+
+    pTrack = m_track_entries + m_track_entries_count++;
+
+    pTrack->track = track;
+    pTrack->count = 0;
+    pTrack->size = 0;
+    pTrack->indices = NULL;
+    pTrack->timecodes = NULL;
+    pTrack->ordered = true;
+  }
+
+  if (pTrack->count >= pTrack->size) {
+    const long size = (pTrack->size <= 0) ? 16 : 2 * pTrack->size;
+
+    long* const indices = new (std::nothrow) long[size];
+    short* const timecodes = new (std::nothrow) short[size];
+
+    if (indices == NULL || timecodes == NULL) {
+      delete[] indices;
+      delete[] timecodes;
+      return false;
+    }
+
+    m_heap_allocations += 2;
+
+    for (long i = 0; i < pTrack->count; ++i) {
+      indices[i] = pTrack->indices[i];
+      timecodes[i] = pTrack->timecodes[i];
+    }
+
+    delete[] pTrack->indices;
+    delete[] pTrack->timecodes;
 
-      BlockEntry** dst = entries;
+    pTrack->indices = indices;
+    pTrack->timecodes = timecodes;
+    pTrack->size = size;
+  }
 
-      while (src != src_end)
-        *dst++ = *src++;
+  if (pTrack->count > 0 && timecode < pTrack->timecodes[pTrack->count - 1])
+    pTrack->ordered = false;
 
-      delete[] m_entries;
+  pTrack->indices[pTrack->count] = idx;
+  pTrack->timecodes[pTrack->count] = timecode;
+  ++pTrack->count;
 
-      m_entries = entries;
-      m_entries_size = entries_size;
-    }
+  return true;
+}
+
+const Cluster::TrackEntries* Cluster::FindTrackEntries(long long track) const {
+  for (long i = 0; i < m_track_entries_count; ++i) {
+    if (m_track_entries[i].track == track)
+      return m_track_entries + i;
   }
 
-  if (id == libwebm::kMkvBlockGroup)
-    return CreateBlockGroup(pos, size, discard_padding);
-  else
-    return CreateSimpleBlock(pos, size);
+  return NULL;
 }
 
 long Cluster::CreateBlockGroup(long long start_offset, long long size,
@@ -7205,7 +10011,7 @@ long Cluster::CreateBlockGroup(long long start_offset, long long size,
   assert(m_entries_count >= 0);
   assert(m_entries_count < m_entries_size);
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+  IMkvReader* const pReader = GetReader();
 
   long long pos = start_offset;
   const long long stop = start_offset + size;
@@ -7284,12 +10090,14 @@ long Cluster::CreateBlockGroup(long long start_offset, long long size,
   BlockEntry** const ppEntry = m_entries + idx;
   BlockEntry*& pEntry = *ppEntry;
 
-  pEntry = new (std::nothrow)
-      BlockGroup(this, idx, bpos, bsize, prev, next, duration, discard_padding);
+  void* const buf = Allocate(sizeof(BlockGroup));
 
-  if (pEntry == NULL)
+  if (buf == NULL)
     return -1;  // generic error
 
+  pEntry = new (buf)
+      BlockGroup(this, idx, bpos, bsize, prev, next, duration, discard_padding);
+
   BlockGroup* const p = static_cast<BlockGroup*>(pEntry);
 
   const long status = p->Parse();
@@ -7299,7 +10107,7 @@ long Cluster::CreateBlockGroup(long long start_offset, long long size,
     return 0;
   }
 
-  delete pEntry;
+  DestroyEntry(pEntry);
   pEntry = 0;
 
   return status;
@@ -7316,11 +10124,13 @@ long Cluster::CreateSimpleBlock(long long st, long long sz) {
   BlockEntry** const ppEntry = m_entries + idx;
   BlockEntry*& pEntry = *ppEntry;
 
-  pEntry = new (std::nothrow) SimpleBlock(this, idx, st, sz);
+  void* const buf = Allocate(sizeof(SimpleBlock));
 
-  if (pEntry == NULL)
+  if (buf == NULL)
     return -1;  // generic error
 
+  pEntry = new (buf) SimpleBlock(this, idx, st, sz);
+
   SimpleBlock* const p = static_cast<SimpleBlock*>(pEntry);
 
   const long status = p->Parse();
@@ -7330,7 +10140,7 @@ long Cluster::CreateSimpleBlock(long long st, long long sz) {
     return 0;
   }
 
-  delete pEntry;
+  DestroyEntry(pEntry);
   pEntry = 0;
 
   return status;
@@ -7359,6 +10169,7 @@ long Cluster::GetFirst(const BlockEntry*& pFirst) const {
   pFirst = m_entries[0];
   assert(pFirst);
 
+  m_pSegment->OnClusterRead(this);
   return 0;  // success
 }
 
@@ -7390,6 +10201,7 @@ long Cluster::GetLast(const BlockEntry*& pLast) const {
   pLast = m_entries[idx];
   assert(pLast);
 
+  m_pSegment->OnClusterRead(this);
   return 0;
 }
 
@@ -7428,11 +10240,284 @@ long Cluster::GetNext(const BlockEntry* pCurr, const BlockEntry*& pNext) const {
   pNext = m_entries[idx];
   assert(pNext);
 
+  m_pSegment->OnClusterRead(this);
   return 0;
 }
 
 long Cluster::GetEntryCount() const { return m_entries_count; }
 
+long Cluster::ReadFrames(long long track, FrameBatch& batch) const {
+  batch.m_count = 0;
+
+  for (;;) {
+    long long pos;
+    long len;
+
+    const long status = Parse(pos, len);
+
+    if (status < 0)  // error or underflow
+      return status;
+
+    if (status > 0)  // fully parsed
+      break;
+  }
+
+  long frame_count = 0;
+  long long start = -1;
+  long long stop = -1;
+
+  for (long i = 0; i < m_entries_count; ++i) {
+    const Block* const pBlock = m_entries[i]->GetBlock();
+
+    if (track > 0 && pBlock->GetTrackNumber() != track)
+      continue;
+
+    const int count = pBlock->GetFrameCount();
+
+    for (int j = 0; j < count; ++j) {
+      const Block::Frame& f = pBlock->GetFrame(j);
+
+      if (start < 0 || f.pos < start)
+        start = f.pos;
+
+      if (f.pos + f.len > stop)
+        stop = f.pos + f.len;
+    }
+
+    frame_count += count;
+  }
+
+  if (frame_count == 0)
+    return 0;
+
+  if (stop - start > LONG_MAX)
+    return E_FILE_FORMAT_INVALID;
+
+  const long size = static_cast<long>(stop - start);
+
+  IMkvReader* const pReader = GetReader();
+
+  const unsigned char* data = pReader->GetView(start, size);
+
+  if (data == NULL) {
+    if (!batch.Reserve(frame_count, size))
+      return -1;
+
+    const int status = pReader->Read(start, size, batch.m_buf);
+
+    if (status < 0)
+      return status;
+
+    if (status > 0)
+      return E_BUFFER_NOT_FULL;
+
+    data = batch.m_buf;
+  } else if (!batch.Reserve(frame_count, 0)) {
+    return -1;
+  }
+
+  for (long i = 0; i < m_entries_count; ++i) {
+    const Block* const pBlock = m_entries[i]->GetBlock();
+
+    if (track > 0 && pBlock->GetTrackNumber() != track)
+      continue;
+
+    const long long time = pBlock->GetTime(this);
+    const int count = pBlock->GetFrameCount();
+
+    for (int j = 0; j < count; ++j) {
+      const Block::Frame& f = pBlock->GetFrame(j);
+
+      FrameBatch::Frame& out = batch.m_frames[batch.m_count++];
+
+      out.track = pBlock->GetTrackNumber();
+      out.time = time;
+      out.key = pBlock->IsKey();
+      out.data = data + (f.pos - start);
+      out.len = f.len;
+    }
+  }
+
+  return 0;
+}
+
+long Cluster::ScanForKey(long long track) const {
+  long long pos;
+  long len;
+
+  long status = Load(pos, len);
+
+  if (status < 0)
+    return status;
+
+  if (m_element_size < 0)
+    return E_BUFFER_NOT_FULL;
+
+  IMkvReader* const pReader = GetReader();
+
+  const long long stop = m_element_start + m_element_size;
+
+  long long total, avail;
+
+  status = pReader->Length(&total, &avail);
+
+  if (status < 0)  // error
+    return status;
+
+  if (avail < stop)
+    return E_BUFFER_NOT_FULL;
+
+  pos = m_blocks_pos;
+
+  while (pos < stop) {
+    const long long id = ReadID(pReader, pos, len);
+
+    if (id < 0 || (pos + len) > stop)
+      return E_FILE_FORMAT_INVALID;
+
+    pos += len;  // consume ID
+
+    const long long size = ReadUInt(pReader, pos, len);
+
+    if (size < 0 || (pos + len) > stop)
+      return E_FILE_FORMAT_INVALID;
+
+    pos += len;  // consume size
+
+    if ((pos + size) > stop)
+      return E_FILE_FORMAT_INVALID;
+
+    if (id == libwebm::kMkvSimpleBlock) {
+      // Track number, 2-byte relative timecode, then the flags.
+      long long block_pos = pos;
+
+      const long long block_track = ReadUInt(pReader, block_pos, len);
+
+      if (block_track <= 0 || (len + 3) > size)
+        return E_FILE_FORMAT_INVALID;
+
+      block_pos += len + 2;
+
+      unsigned char flags;
+
+      status = pReader->Read(block_pos, 1, &flags);
+
+      if (status < 0)  // error
+        return status;
+
+      if (status > 0)
+        return E_BUFFER_NOT_FULL;
+
+      if (block_track == track && (flags & 0x80))
+        return 1;
+    } else if (id == libwebm::kMkvBlockGroup) {
+      // A block group holds a keyframe unless it has a ReferenceBlock.
+      const long long group_stop = pos + size;
+
+      long long block_track = -1;
+      bool referenced = false;
+
+      for (long long group_pos = pos; group_pos < group_stop;) {
+        const long long child_id = ReadID(pReader, group_pos, len);
+
+        if (child_id < 0 || (group_pos + len) > group_stop)
+          return E_FILE_FORMAT_INVALID;
+
+        group_pos += len;  // consume ID
+
+        const long long child_size = ReadUInt(pReader, group_pos, len);
+
+        if (child_size < 0 || (group_pos + len) > group_stop)
+          return E_FILE_FORMAT_INVALID;
+
+        group_pos += len;  // consume size
+
+        if (child_id == libwebm::kMkvBlock && block_track < 0) {
+          long long block_pos = group_pos;
+
+          block_track = ReadUInt(pReader, block_pos, len);
+
+          if (block_track <= 0)
+            return E_FILE_FORMAT_INVALID;
+        } else if (child_id == libwebm::kMkvReferenceBlock) {
+          referenced = true;
+        }
+
+        group_pos += child_size;  // consume payload
+      }
+
+      if (block_track == track && !referenced)
+        return 1;
+    }
+
+    pos += size;  // consume payload
+  }
+
+  return 0;
+}
+
+long Cluster::GetNextForTrack(long long track, const BlockEntry* pCurr,
+                              const BlockEntry*& pNext) const {
+  pNext = NULL;
+
+  const long start = (pCurr == NULL) ? 0 : pCurr->GetIndex() + 1;
+
+  // Look among the entries parsed so far.
+  const TrackEntries* const pTrack = FindTrackEntries(track);
+
+  if (pTrack && pTrack->count > 0 &&
+      pTrack->indices[pTrack->count - 1] >= start) {
+    long i = 0;
+    long j = pTrack->count - 1;
+
+    while (i < j) {
+      const long k = i + (j - i) / 2;
+
+      if (pTrack->indices[k] < start)
+        i = k + 1;
+      else
+        j = k;
+    }
+
+    pNext = m_entries[pTrack->indices[i]];
+    assert(pNext);
+
+    m_pSegment->OnClusterRead(this);
+    return 0;
+  }
+
+  // Parse further until a block of the track turns up.
+  for (;;) {
+    long long pos;
+    long len;
+
+    const long status = Parse(pos, len);
+
+    if (status < 0)  // error
+      return status;
+
+    if (status > 0)  // no more blocks
+      return 0;
+
+    assert(m_entries);
+    assert(m_entries_count > 0);
+
+    const long idx = m_entries_count - 1;
+
+    if (idx < start)
+      continue;
+
+    const BlockEntry* const pEntry = m_entries[idx];
+    assert(pEntry);
+
+    if (pEntry->GetBlock()->GetTrackNumber() == track) {
+      pNext = pEntry;
+      m_pSegment->OnClusterRead(this);
+      return 0;
+    }
+  }
+}
+
 const BlockEntry* Cluster::GetEntry(const Track* pTrack,
                                     long long time_ns) const {
   assert(pTrack);
@@ -7440,64 +10525,95 @@ const BlockEntry* Cluster::GetEntry(const Track* pTrack,
   if (m_pSegment == NULL)  // this is the special EOS cluster
     return pTrack->GetEOS();
 
-  const BlockEntry* pResult = pTrack->GetEOS();
-
-  long index = 0;
+  m_pSegment->OnClusterRead(this);
 
-  for (;;) {
-    if (index >= m_entries_count) {
-      long long pos;
-      long len;
+  const long long tn = pTrack->GetNumber();
 
-      const long status = Parse(pos, len);
-      assert(status >= 0);
+  if (time_ns < 0) {  // just want first candidate block
+    const BlockEntry* pEntry = NULL;
 
-      if (status > 0)  // completely parsed, and no more entries
-        return pResult;
+    for (;;) {
+      const long status = GetNextForTrack(tn, pEntry, pEntry);
 
       if (status < 0)  // should never happen
         return 0;
 
-      assert(m_entries);
-      assert(index < m_entries_count);
+      if (pEntry == NULL)
+        return pTrack->GetEOS();
+
+      if (pTrack->VetEntry(pEntry))
+        return pEntry;
     }
+  }
 
-    const BlockEntry* const pEntry = m_entries[index];
-    assert(pEntry);
-    assert(!pEntry->EOS());
+  // A time search needs all of the blocks of the cluster.
+  for (;;) {
+    long long pos;
+    long len;
 
-    const Block* const pBlock = pEntry->GetBlock();
-    assert(pBlock);
+    const long status = Parse(pos, len);
 
-    if (pBlock->GetTrackNumber() != pTrack->GetNumber()) {
-      ++index;
-      continue;
-    }
+    if (status < 0)  // should never happen
+      return 0;
 
-    if (pTrack->VetEntry(pEntry)) {
-      if (time_ns < 0)  // just want first candidate block
-        return pEntry;
+    if (status > 0)  // completely parsed
+      break;
+  }
+
+  const TrackEntries* const pEntries = FindTrackEntries(tn);
+
+  if (pEntries == NULL)
+    return pTrack->GetEOS();
+
+  const SegmentInfo* const pInfo = m_pSegment->GetInfo();
+  assert(pInfo);
+
+  const long long scale = pInfo->GetTimeCodeScale();
+  assert(scale >= 1);
 
-      const long long ns = pBlock->GetTime(this);
+  const long long tc0 = GetTimeCode();
+  assert(tc0 >= 0);
+
+  const short* const timecodes = pEntries->timecodes;
 
-      if (ns > time_ns)
-        return pResult;
+  // Find the first block of the track that starts after |time_ns|; the
+  // result is the last acceptable seek target before it.
+  long stop = 0;
 
-      pResult = pEntry;  // have a candidate
-    } else if (time_ns >= 0) {
-      const long long ns = pBlock->GetTime(this);
+  if (pEntries->ordered) {
+    long j = pEntries->count;
 
-      if (ns > time_ns)
-        return pResult;
+    while (stop < j) {
+      const long k = stop + (j - stop) / 2;
+
+      if ((tc0 + timecodes[k]) * scale <= time_ns)
+        stop = k + 1;
+      else
+        j = k;
     }
+  } else {
+    while (stop < pEntries->count &&
+           (tc0 + timecodes[stop]) * scale <= time_ns) {
+      ++stop;
+    }
+  }
+
+  while (stop > 0) {
+    const BlockEntry* const pEntry = m_entries[pEntries->indices[--stop]];
+    assert(pEntry);
 
-    ++index;
+    if (pTrack->VetEntry(pEntry))
+      return pEntry;
   }
+
+  return pTrack->GetEOS();
 }
 
 const BlockEntry* Cluster::GetEntry(const CuePoint& cp,
                                     const CuePoint::TrackPosition& tp) const {
   assert(m_pSegment);
+  m_pSegment->OnClusterRead(this);
+
   const long long tc = cp.GetTimeCode();
 
   if (tp.m_block > 0) {
@@ -7644,7 +10760,7 @@ Block::Block(long long start, long long size_, long long discard_padding)
       m_frame_count(-1),
       m_discard_padding(discard_padding) {}
 
-Block::~Block() { delete[] m_frames; }
+Block::~Block() {}  // m_frames is owned by the cluster's arena
 
 long Block::Parse(const Cluster* pCluster) {
   if (pCluster == NULL)
@@ -7664,7 +10780,7 @@ long Block::Parse(const Cluster* pCluster) {
 
   long len;
 
-  IMkvReader* const pReader = pCluster->m_pSegment->m_pReader;
+  IMkvReader* const pReader = pCluster->GetReader();
 
   m_track = ReadUInt(pReader, pos, len);
 
@@ -7714,7 +10830,7 @@ long Block::Parse(const Cluster* pCluster) {
       return E_FILE_FORMAT_INVALID;
 
     m_frame_count = 1;
-    m_frames = new (std::nothrow) Frame[m_frame_count];
+    m_frames = static_cast<Frame*>(pCluster->Allocate(sizeof(Frame)));
     if (m_frames == NULL)
       return -1;
 
@@ -7747,7 +10863,8 @@ long Block::Parse(const Cluster* pCluster) {
 
   m_frame_count = int(biased_count) + 1;
 
-  m_frames = new (std::nothrow) Frame[m_frame_count];
+  m_frames = static_cast<Frame*>(
+      pCluster->Allocate(m_frame_count * sizeof(Frame)));
   if (m_frames == NULL)
     return -1;
 
@@ -8095,6 +11212,30 @@ long Block::Frame::Read(IMkvReader* pReader, unsigned char* buf) const {
   return status;
 }
 
+long Block::Frame::Read(IMkvReader* pReader, unsigned char* buf,
+                        const unsigned char*& data) const {
+  assert(pReader);
+
+  data = pReader->GetView(pos, len);
+
+  if (data)
+    return 0;
+
+  assert(buf);
+
+  const long status = pReader->Read(pos, len, buf);
+
+  if (status == 0)
+    data = buf;
+
+  return status;
+}
+
+const unsigned char* Block::Frame::GetView(IMkvReader* pReader) const {
+  assert(pReader);
+  return pReader->GetView(pos, len);
+}
+
 long long Block::GetDiscardPadding() const { return m_discard_padding; }
 
 }  // namespace mkvparser
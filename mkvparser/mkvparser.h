@@ -21,10 +21,51 @@ class IMkvReader {
   virtual int Read(long long pos, long len, unsigned char* buf) = 0;
   virtual int Length(long long* total, long long* available) = 0;
 
+  // Returns a pointer to the |len| bytes at |pos| if the reader can expose its
+  // data directly (e.g. a memory mapping), or NULL otherwise. The pointer
+  // remains valid until the reader is closed or destroyed. Callers must be
+  // prepared to fall back to Read().
+  virtual const unsigned char* GetView(long long /* pos */, long /* len */) {
+    return NULL;
+  }
+
  protected:
   virtual ~IMkvReader() {}
 };
 
+// A set of byte ranges of a file, kept sorted. Ranges that overlap, or are
+// separated by at most |max_gap| bytes, are coalesced into one.
+class ReadPlan {
+  ReadPlan(const ReadPlan&);
+  ReadPlan& operator=(const ReadPlan&);
+
+ public:
+  struct Range {
+    long long pos;
+    long long len;
+  };
+
+  explicit ReadPlan(long long max_gap = 0);
+  ~ReadPlan();
+
+  // Returns false if memory could not be allocated.
+  bool Add(long long pos, long long len);
+  void Clear();
+
+  long GetCount() const { return m_count; }
+  const Range* GetRange(long idx) const;
+  long long GetTotalBytes() const;
+
+  // True if [pos, pos + len) lies within a single range.
+  bool Contains(long long pos, long long len) const;
+
+ private:
+  const long long m_max_gap;
+  Range* m_ranges;
+  long m_count;
+  long m_size;
+};
+
 template <typename Type>
 Type* SafeArrayAlloc(unsigned long long num_elements,
                      unsigned long long element_size);
@@ -79,6 +120,8 @@ class Block {
   Block(long long start, long long size, long long discard_padding);
   ~Block();
 
+  // The frame array is allocated from the cluster's arena, so the block
+  // must not outlive the entries of |pCluster|.
   long Parse(const Cluster*);
 
   long long GetTrackNumber() const;
@@ -98,6 +141,17 @@ class Block {
     long len;
 
     long Read(IMkvReader*, unsigned char*) const;
+
+    // Sets |data| to the frame payload. When the reader supports GetView()
+    // |data| points into the reader's memory and |buf| is left untouched;
+    // otherwise the payload is read into |buf|, which must hold |len| bytes,
+    // and |data| is set to |buf|.
+    long Read(IMkvReader*, unsigned char* buf,
+              const unsigned char*& data) const;
+
+    // Returns the frame payload without copying, or NULL if the reader does
+    // not support GetView().
+    const unsigned char* GetView(IMkvReader*) const;
   };
 
   const Frame& GetFrame(int frame_index) const;
@@ -277,6 +331,9 @@ class ContentEncoding {
   unsigned long long encoding_scope() const { return encoding_scope_; }
   unsigned long long encoding_type() const { return encoding_type_; }
 
+  // Bytes allocated for this element and its children.
+  long long GetMemoryUsage() const;
+
  private:
   // Member variables for list of ContentCompression elements.
   ContentCompression** compression_entries_;
@@ -297,6 +354,8 @@ class ContentEncoding {
 };
 
 class Track {
+  friend class Segment;
+
   Track(const Track&);
   Track& operator=(const Track&);
 
@@ -361,6 +420,14 @@ class Track {
 
   long GetFirst(const BlockEntry*&) const;
   long GetNext(const BlockEntry* pCurr, const BlockEntry*& pNext) const;
+
+  // As GetFirst() and GetNext(), but only visiting keyframes. If the segment
+  // has cues for this track, these step from one cued keyframe to the next.
+  // Otherwise each cluster is first scanned by block headers alone, and only
+  // clusters holding a keyframe of this track are parsed.
+  long GetFirstKey(const BlockEntry*&) const;
+  long GetNextKey(const BlockEntry* pCurr, const BlockEntry*& pNext) const;
+
   virtual bool VetEntry(const BlockEntry*) const;
   virtual long Seek(long long time_ns, const BlockEntry*&) const;
 
@@ -369,6 +436,37 @@ class Track {
 
   long ParseContentEncodingsEntry(long long start, long long size);
 
+  // Header stripping (ContentCompAlgo 3): returns the bytes removed from the
+  // front of every frame of this track, or NULL (and 0 in |len|) if its
+  // frames are stored as-is.
+  const unsigned char* GetStrippedHeader(size_t& len) const;
+
+  // The size of |frame| once its stripped header is restored.
+  long long GetFrameSize(const Block::Frame& frame) const;
+
+  // Reads |frame| into |buf|, which must hold GetFrameSize() bytes, with the
+  // stripped header restored in front of the stored payload.
+  long ReadFrame(IMkvReader*, const Block::Frame& frame,
+                 unsigned char* buf) const;
+
+  // Zero-copy form of ReadFrame(): |parts| gets the stripped header and the
+  // stored payload, for a gather write. As with Block::Frame::Read(), the
+  // payload points into the reader's memory if it supports GetView(), and
+  // is otherwise read into |buf|, which must hold |frame.len| bytes.
+  struct FrameParts {
+    const unsigned char* header;  // owned by the track
+    size_t header_len;
+    const unsigned char* payload;
+    long payload_len;
+  };
+
+  long ReadFrame(IMkvReader*, const Block::Frame& frame, unsigned char* buf,
+                 FrameParts& parts) const;
+
+  // Bytes allocated for this track, its strings, codec private data and
+  // content encodings.
+  virtual long long GetMemoryUsage() const;
+
  protected:
   Track(Segment*, long long element_start, long long element_size);
 
@@ -384,9 +482,29 @@ class Track {
 
   EOSBlock m_eos;
 
+  // Records the cluster of |pEntry| as this track's read position while the
+  // segment evicts clusters.
+  void SetCursor(const BlockEntry* pEntry) const;
+
  private:
+  long FindFirst(const BlockEntry*&) const;
+  long FindNext(const BlockEntry* pCurr, const BlockEntry*& pNext) const;
+
+  // Sets |pEntry| to the keyframe of the first cue point of this track after
+  // |time_ns|, or to EOS after the last. Returns false if there are no cues
+  // for the track.
+  bool GetCuedKey(long long time_ns, const BlockEntry*& pEntry) const;
+
+  // Finds the first keyframe after |pCurr| in |pCluster| (from its start if
+  // |pCurr| is NULL), or else in the clusters that follow.
+  long FindKey(const Cluster* pCluster, const BlockEntry* pCurr,
+               const BlockEntry*& pNext) const;
+
   ContentEncoding** content_encoding_entries_;
   ContentEncoding** content_encoding_entries_end_;
+
+  // Start of the cluster of the entry last handed out, or -1.
+  mutable long long m_cursor_pos;
 };
 
 struct PrimaryChromaticity {
@@ -529,6 +647,8 @@ class VideoTrack : public Track {
 
   const char* GetColourSpace() const { return m_colour_space; }
 
+  long long GetMemoryUsage() const;
+
  private:
   long long m_width;
   long long m_height;
@@ -557,6 +677,8 @@ class AudioTrack : public Track {
   long long GetChannels() const;
   long long GetBitDepth() const;
 
+  long long GetMemoryUsage() const;
+
  private:
   double m_rate;
   long long m_channels;
@@ -586,6 +708,8 @@ class Tracks {
   const Track* GetTrackByNumber(long tn) const;
   const Track* GetTrackByIndex(unsigned long idx) const;
 
+  long long GetMemoryUsage() const;
+
  private:
   Track** m_trackEntries;
   Track** m_trackEntriesEnd;
@@ -633,6 +757,7 @@ class Chapters {
     void ShallowCopy(Display&) const;
     void Clear();
     long Parse(IMkvReader*, long long pos, long long size);
+    long long GetMemoryUsage() const;  // excluding the object itself
 
     char* m_string;
     char* m_language;
@@ -668,6 +793,7 @@ class Chapters {
 
     long ParseDisplay(IMkvReader*, long long pos, long long size);
     bool ExpandDisplaysArray();
+    long long GetMemoryUsage() const;  // excluding the object itself
 
     char* m_string_uid;
     unsigned long long m_uid;
@@ -698,6 +824,7 @@ class Chapters {
 
     long ParseAtom(IMkvReader*, long long pos, long long size);
     bool ExpandAtomsArray();
+    long long GetMemoryUsage() const;  // excluding the object itself
 
     Atom* m_atoms;
     int m_atoms_size;
@@ -707,6 +834,8 @@ class Chapters {
   int GetEditionCount() const;
   const Edition* GetEdition(int index) const;
 
+  long long GetMemoryUsage() const;
+
  private:
   long ParseEdition(long long pos, long long size);
   bool ExpandEditionsArray();
@@ -753,6 +882,7 @@ class Tags {
     void ShallowCopy(SimpleTag&) const;
     void Clear();
     long Parse(IMkvReader*, long long pos, long long size);
+    long long GetMemoryUsage() const;  // excluding the object itself
 
     char* m_tag_name;
     char* m_tag_string;
@@ -777,6 +907,7 @@ class Tags {
 
     long ParseSimpleTag(IMkvReader*, long long pos, long long size);
     bool ExpandSimpleTagsArray();
+    long long GetMemoryUsage() const;  // excluding the object itself
 
     SimpleTag* m_simple_tags;
     int m_simple_tags_size;
@@ -786,6 +917,8 @@ class Tags {
   int GetTagCount() const;
   const Tag* GetTag(int index) const;
 
+  long long GetMemoryUsage() const;
+
  private:
   long ParseTag(long long pos, long long size);
   bool ExpandTagsArray();
@@ -819,6 +952,8 @@ class SegmentInfo {
   const char* GetWritingAppAsUTF8() const;
   const char* GetTitleAsUTF8() const;
 
+  long long GetMemoryUsage() const;
+
  private:
   long long m_timecodeScale;
   double m_duration;
@@ -873,6 +1008,8 @@ class SeekHead {
   int GetVoidElementCount() const;
   const VoidElement* GetVoidElement(int idx) const;
 
+  long long GetMemoryUsage() const;
+
  private:
   Entry* m_entries;
   int m_entry_count;
@@ -945,6 +1082,10 @@ class Cues {
       long long time_ns, const Track*, const CuePoint*&,
       const CuePoint::TrackPosition*&) const;
 
+  // The first loaded cue point of the track strictly after time_ns.
+  bool FindNext(long long time_ns, const Track*, const CuePoint*&,
+                const CuePoint::TrackPosition*&) const;
+
   const CuePoint* GetFirst() const;
   const CuePoint* GetLast() const;
   const CuePoint* GetNext(const CuePoint*) const;
@@ -957,18 +1098,94 @@ class Cues {
   // long GetTotal() const;  //loaded + preloaded
   bool DoneParsing() const;
 
+  // Bytes allocated for the cue points, loaded or not, and the per-track
+  // indexes built from them.
+  long long GetMemoryUsage() const;
+
  private:
   bool Init() const;
   bool PreloadCuePoint(long&, long long) const;
 
+  // The loaded cue points that refer to one track, sorted by time. Cue
+  // points are appended as they are loaded; the index is sorted again only
+  // when one arrives out of time order.
+  struct TrackIndex {
+    long long track;
+    long count;
+    long size;  // allocated
+    bool sorted;
+    long long* times;  // unscaled timecodes
+    const CuePoint** cue_points;
+    const CuePoint::TrackPosition** track_positions;
+  };
+
+  // Returns the index for |track|, first adding the cue points loaded since
+  // the last call to the track indexes. Returns NULL if |track| has no cue
+  // points or on allocation failure.
+  const TrackIndex* GetTrackIndex(long long track) const;
+
+  // Returns the number of cue points of |pTrack| at or before |time_ns|,
+  // i.e. the position of the first one after it, and sets |pIndex| to the
+  // index of the track. Returns -1 if the track has no usable index.
+  long UpperBound(long long time_ns, const Track* pTrack,
+                  const TrackIndex*& pIndex) const;
+  bool UpdateTrackIndexes() const;
+  TrackIndex* AddTrackIndex(long long track) const;
+  static bool AppendToTrackIndex(TrackIndex&, const CuePoint*,
+                                 const CuePoint::TrackPosition*);
+  static bool SortTrackIndex(TrackIndex&);
+  static bool ReallocTrackIndex(TrackIndex&, long size, const long* order);
+  void FreeTrackIndexes() const;
+
   mutable CuePoint** m_cue_points;
+  mutable long m_cue_points_size;
   mutable long m_count;
   mutable long m_preload_count;
   mutable long long m_pos;
+
+  mutable TrackIndex* m_track_indexes;
+  mutable long m_track_indexes_count;
+  mutable long m_track_indexes_size;
+  mutable long m_track_indexes_cue_count;  // cue points indexed so far
+};
+
+// The frames of a cluster, read by Cluster::ReadFrames() with one read.
+// The frame data points into a buffer owned by the batch, which is reused,
+// along with the frame array, when the batch is filled again.
+class FrameBatch {
+  friend class Cluster;
+
+  FrameBatch(const FrameBatch&);
+  FrameBatch& operator=(const FrameBatch&);
+
+ public:
+  struct Frame {
+    long long track;
+    long long time;  // ns
+    bool key;
+    const unsigned char* data;
+    long len;
+  };
+
+  FrameBatch();
+  ~FrameBatch();
+
+  long GetCount() const { return m_count; }
+  const Frame* GetFrame(long idx) const;
+
+ private:
+  bool Reserve(long frame_count, long long buf_size);
+
+  Frame* m_frames;
+  long m_count;
+  long m_size;
+  unsigned char* m_buf;
+  long long m_buf_size;
 };
 
 class Cluster {
   friend class Segment;
+  friend class Block;
 
   Cluster(const Cluster&);
   Cluster& operator=(const Cluster&);
@@ -996,6 +1213,19 @@ class Cluster {
   long GetLast(const BlockEntry*&) const;
   long GetNext(const BlockEntry* curr, const BlockEntry*& next) const;
 
+  // Sets |next| to the first entry of track number |track| that follows
+  // |curr|, or to the first entry of that track if |curr| is NULL, parsing
+  // the cluster as needed. |next| is NULL if the cluster holds no further
+  // blocks of the track.
+  long GetNextForTrack(long long track, const BlockEntry* curr,
+                       const BlockEntry*& next) const;
+
+  // Parses the whole cluster and fills |batch| with the frames of track
+  // number |track| (or of all tracks, if |track| <= 0) in block order,
+  // reading the bytes that span them with a single read, or none if the
+  // reader offers a view.
+  long ReadFrames(long long track, FrameBatch& batch) const;
+
   const BlockEntry* GetEntry(const Track*, long long ns = -1) const;
   const BlockEntry* GetEntry(const CuePoint&,
                              const CuePoint::TrackPosition&) const;
@@ -1008,6 +1238,11 @@ class Cluster {
 
   long GetEntryCount() const;
 
+  // Returns 1 if the cluster holds a keyframe of |track|, 0 if not, reading
+  // only block headers and creating no entries. Returns E_BUFFER_NOT_FULL if
+  // the end of the cluster is not known yet.
+  long ScanForKey(long long track) const;
+
   long Load(long long& pos, long& size) const;
 
   long Parse(long long& pos, long& size) const;
@@ -1037,6 +1272,55 @@ class Cluster {
   mutable long m_entries_size;
   mutable long m_entries_count;
 
+  // The entries of one track, in parse order.
+  struct TrackEntries {
+    long long track;
+    long count;
+    long size;
+    long* indices;  // into m_entries
+    short* timecodes;  // relative to the cluster
+    bool ordered;  // timecodes are non-decreasing
+  };
+
+  mutable TrackEntries* m_track_entries;
+  mutable long m_track_entries_count;
+  mutable long m_track_entries_size;
+
+  mutable long long m_blocks_pos;  // just beyond the timecode payload
+  mutable long long m_resident_bytes;  // arena plus the entry arrays
+  mutable bool m_resident;  // counted as resident by the segment
+  mutable bool m_evicted;
+  mutable IMkvReader* m_pParseReader;  // if set, used instead of the segment's
+
+  // Block entries and their frame arrays are bump-allocated from a list of
+  // chunks owned by the cluster, and freed together by ReleaseEntries().
+  struct ArenaChunk {
+    ArenaChunk* next;
+    size_t size;  // usable bytes after the header
+    size_t used;
+  };
+
+  mutable ArenaChunk* m_arena;  // most recently allocated chunk first
+  mutable long long m_arena_bytes;  // reserved by the chunks in m_arena
+
+  // Cumulative over the life of the cluster, including reparses.
+  mutable long long m_heap_allocations;
+  mutable long long m_arena_allocations;
+  mutable long long m_arena_allocated_bytes;
+
+  IMkvReader* GetReader() const;
+
+  void* Allocate(size_t size) const;
+  void DestroyEntry(BlockEntry*) const;
+  void ReleaseArena() const;
+
+  const TrackEntries* FindTrackEntries(long long track) const;
+  bool IndexEntry(long index);
+
+  // Deletes the parsed entries, returning the cluster to the state it was
+  // in just after Load().
+  void ReleaseEntries() const;
+
   long ParseSimpleBlock(long long, long long&, long&);
   long ParseBlockGroup(long long, long long&, long&);
 
@@ -1048,6 +1332,7 @@ class Cluster {
 };
 
 class Segment {
+  friend class Cluster;
   friend class Cues;
   friend class Track;
   friend class VideoTrack;
@@ -1084,6 +1369,18 @@ class Segment {
   long ParseNext(const Cluster* pCurr, const Cluster*& pNext, long long& pos,
                  long& size);
 
+  // Live mode, for a stream that is still growing. Sets |pNext| to the block
+  // that follows |pCurr| (or to the first block, if |pCurr| is NULL) as soon
+  // as its bytes are available, loading and parsing clusters, including
+  // those of unknown size, only as far as needed. Returns 0 on success, 1 at
+  // the end of the segment, or E_BUFFER_NOT_FULL until more data arrives;
+  // then call again with the same |pCurr|.
+  //
+  // Once a block of a new cluster is returned, the clusters before it are
+  // consumed and deleted (unless the segment is frozen or indexed), so
+  // memory stays bounded. Their entries, including |pCurr|, become invalid.
+  long GetNextLiveBlock(const BlockEntry* pCurr, const BlockEntry*& pNext);
+
   const SeekHead* GetSeekHead() const;
   const Tracks* GetTracks() const;
   const SegmentInfo* GetInfo() const;
@@ -1101,11 +1398,120 @@ class Segment {
   const Cluster* FindCluster(long long time_nanoseconds) const;
   // const BlockEntry* Seek(long long time_nanoseconds, const Track*) const;
 
+  // Finds the last cluster that starts at or before |time_ns| without Cues
+  // and without loading the clusters in between, by bisecting over byte
+  // offsets and resynchronizing on cluster headers. Only the headers must
+  // have been parsed. The cluster found is preloaded (see
+  // FindOrPreloadCluster); a keyframe at or before |time_ns| may lie in an
+  // earlier cluster.
+  long SeekByBisection(long long time_ns, const Cluster*& pCluster);
+
+  // Planning mode, for readers where each miss is a round trip. These add to
+  // |plan| the byte ranges that parsing will read, using the SeekHead, the
+  // Cues and element sizes, so that the caller can fetch them in one batch.
+  // They return 0 if |plan| is then complete, or 1 if more of the layout
+  // must be fetched first; in that case, fetch |plan| and call again.
+  // Negative values are errors.
+  //
+  // PlanHeaders() covers ParseHeaders(). PlanSeek() covers finding |time_ns|
+  // on |pTrack| with Cues::Find() and Cues::GetBlock(); it parses the Cues
+  // once their bytes are readable, and requires the headers to be parsed.
+  // It returns E_PARSE_FAILED if the segment has no Cues.
+  long PlanHeaders(ReadPlan& plan) const;
+  long PlanSeek(long long time_ns, const Track* pTrack, ReadPlan& plan);
+
   const Cluster* FindOrPreloadCluster(long long pos);
 
   long ParseCues(long long cues_off,  // offset relative to start of segment
                  long long& parse_pos, long& parse_len);
 
+  // Opt-in bound on the memory held by parsed clusters. Once more than
+  // |max_clusters| clusters hold parsed block entries (if > 0), or their
+  // entries take more than |max_bytes| of heap (if > 0), the entries of the
+  // least recently parsed clusters are released. Those clusters keep their
+  // position, size and timecode and are parsed again when next accessed.
+  // Only clusters before the position of every track iterator (the entries
+  // last returned by Track::GetFirst(), GetNext(), GetFirstKey(),
+  // GetNextKey() or Seek()) and before the cluster last read through its
+  // own accessors are released, so the entries most recently handed out
+  // stay valid. A track whose iteration is abandoned holds back eviction
+  // from its position on. Passing 0 for both limits disables eviction (the
+  // default).
+  void SetClusterEvictionPolicy(long max_clusters, long long max_bytes);
+
+  struct ClusterCacheStats {
+    long resident_clusters;  // clusters holding parsed block entries
+    long peak_resident_clusters;
+    long long resident_bytes;  // estimated heap held by those entries
+    long long peak_resident_bytes;
+    long long evictions;
+    long long reparses;  // parses of clusters that had been evicted
+  };
+
+  const ClusterCacheStats& GetClusterCacheStats() const;
+
+  struct AllocationStats {
+    long long heap_allocations;  // arena chunks and entry arrays
+    long long arena_allocations;  // block entries and frame arrays
+    long long arena_allocated_bytes;
+    long long arena_reserved_bytes;  // held by the clusters' arenas now
+  };
+
+  // Totals the allocation counters of the loaded and preloaded clusters.
+  // The counters are cumulative, so clusters that were released and parsed
+  // again count each parse.
+  void GetAllocationStats(AllocationStats& stats) const;
+
+  struct MemoryUsage {
+    long long segment;  // the segment, its cluster directory and index
+    long long clusters;  // cluster objects and their entry arrays
+    long long block_entries;  // cluster arenas: blocks and frame arrays
+    long long tracks;  // including codec private data
+    long long cues;
+    long long chapters;
+    long long tags;
+    long long other;  // segment info and seek head
+    long long total;
+  };
+
+  // Reports the heap currently held by the parsed elements, by component.
+  // This is what the parser itself allocated, not counting allocator
+  // overhead or any buffers owned by the reader.
+  void GetMemoryUsage(MemoryUsage& usage) const;
+
+  // Serializes the layout of a fully loaded segment (header element
+  // locations, cluster positions and timecodes, and the keyframes of each
+  // video track) into a sidecar index. |buf| is allocated with new[] and
+  // owned by the caller.
+  long BuildIndex(unsigned char*& buf, long long& size);
+
+  // Restores a layout saved by BuildIndex(), in place of ParseHeaders() and
+  // Load(), so that no cluster scan is needed. Call on a segment fresh from
+  // CreateInstance(). Returns E_FILE_FORMAT_INVALID if the index is malformed
+  // or was built for a different file (as judged by its size and a hash of
+  // its first and last 64KiB).
+  long AttachIndex(const unsigned char* buf, long long size);
+
+  // Loads all remaining clusters, then parses the blocks of every cluster not
+  // yet parsed using |thread_count| threads (the calling thread included).
+  // Each thread reads a whole cluster at a time from the reader, which is
+  // only ever called by one thread at a time. Any cluster eviction policy is
+  // applied once all clusters have been parsed.
+  long LoadAllClustersParallel(int thread_count);
+
+  // Loads and parses everything the segment refers to: headers, all clusters
+  // and their blocks, all cue points and the blocks they point at. Cluster
+  // eviction is turned off and stays off. Afterwards nothing is parsed
+  // lazily, so the const accessors of the segment, its tracks, clusters,
+  // block entries and cues (GetFirst(), GetNext(), FindCluster(),
+  // Cues::Find(), Cues::GetBlock(), Track::Seek() and the like) and
+  // GetNext(const Cluster*) may be called from several threads at once.
+  // Reading frame payloads concurrently additionally requires a reader whose
+  // Read() is thread-safe, such as MmapMkvReader. Clusters are parsed with
+  // |thread_count| threads, as in LoadAllClustersParallel().
+  long Freeze(int thread_count);
+  bool IsFrozen() const;
+
  private:
   long long m_pos;  // absolute file posn; what has been consumed so far
   Cluster* m_pUnknownSize;
@@ -1116,17 +1522,108 @@ class Segment {
   Cues* m_pCues;
   Chapters* m_pChapters;
   Tags* m_pTags;
-  Cluster** m_clusters;
-  long m_clusterCount;  // number of entries for which m_index >= 0
-  long m_clusterPreloadCount;  // number of entries for which m_index < 0
+  Cluster** m_clusters;  // loaded clusters, in order
+  long m_clusterCount;  // number of clusters for which m_index >= 0
+  long m_clusterPreloadCount;  // number of clusters for which m_index < 0
   long m_clusterSize;  // array size
 
+  // Preloaded clusters all lie beyond the last loaded one. They are kept
+  // apart, ordered by position, in chunks of at most kPreloadChunkSize.
+  // Preloading or loading a cluster shifts the entries of one chunk, plus
+  // the chunk pointers when a chunk is split or emptied, so it costs
+  // O(n / kPreloadChunkSize + kPreloadChunkSize) for n preloaded clusters
+  // rather than O(n). A search tree would bring that to O(log n), at the
+  // price of an allocation per cluster.
+  enum { kPreloadChunkSize = 256 };
+
+  struct PreloadChunk {
+    long count;
+    Cluster* clusters[kPreloadChunkSize];
+  };
+
+  PreloadChunk** m_preload_chunks;  // no chunk is ever empty
+  long m_preload_chunk_count;
+  long m_preload_chunk_size;
+
+  long m_max_resident_clusters;
+  long long m_max_resident_bytes;
+  const Cluster** m_resident_clusters;  // ring, least recently parsed first
+  long m_resident_clusters_head;
+  long m_resident_clusters_count;
+  long m_resident_clusters_size;
+  long long m_cursor_pos;  // start of the cluster last read, or -1
+
+  // The last eviction pass that could not get under the limits; it is not
+  // repeated until one of these changes.
+  long long m_evict_blocked_limit;
+  const Cluster* m_evict_blocked_current;
+  long m_evict_blocked_count;  // -1 if the last pass succeeded
+  ClusterCacheStats m_cluster_cache_stats;
+
+  struct IndexedKeyframe {
+    long long track;
+    long long time;  // ns
+    long cluster;  // index in m_clusters
+    long block;  // entry index in that cluster
+  };
+
+  IndexedKeyframe* m_index_keyframes;  // by track, then time
+  long m_index_keyframes_count;
+  bool m_indexed;  // layout was supplied by AttachIndex()
+  bool m_parallel_parse;  // clusters are being parsed on worker threads
+  bool m_frozen;
+
+  long ParseHeaderElement(long long id, long long pos, long long size,
+                          long long element_start, long long element_size);
+  const BlockEntry* FindIndexedKeyframe(const Track*, long long time_ns) const;
+
+  // Builds the headers, clusters and keyframes of an index checked by
+  // AttachIndex(). On failure ClearIndexedLayout() undoes what was built.
+  long RestoreIndex(const unsigned char* headers, long long header_count,
+                    const unsigned char* clusters, long long cluster_count,
+                    const unsigned char* keyframes, long long keyframes_count,
+                    long long stop);
+  void ClearIndexedLayout();
+
+  // Scans [pos, stop) for the next plausible cluster header. Returns 0 and
+  // sets |pos| and |timecode| if one is found, 1 if there is none.
+  long SyncCluster(long long& pos, long long stop, long long& timecode) const;
+
+  // Reads the ID and size of the element at |pos|. Returns false if they
+  // cannot be read (yet).
+  bool PeekElement(long long pos, long long& id, long long& payload,
+                   long long& size) const;
+  long long FindSeekEntry(long long payload, long long size,
+                          long long id) const;
+
+  // Called by a cluster each time it parses a block.
+  void OnClusterParsed(const Cluster*, long long bytes_delta);
+  // Called by a cluster when it returns one of its entries.
+  void OnClusterRead(const Cluster*);
+  bool IsEvicting() const;
+  // Start of the lowest cluster that may not be evicted, or -1.
+  long long GetEvictionLimit() const;
+  void EvictClusters(const Cluster* pCurrent);
+  bool AddResidentCluster(const Cluster*);
+
+  // Deletes the first |count| loaded clusters.
+  void DiscardClusters(long count);
+
+  void AddClusterMemoryUsage(const Cluster*, MemoryUsage&) const;
+
   long DoLoadCluster(long long&, long&);
   long DoLoadClusterUnknownSize(long long&, long&);
   long DoParseNext(const Cluster*&, long long&, long&);
 
   bool AppendCluster(Cluster*);
-  bool PreloadCluster(Cluster*, ptrdiff_t);
+  bool PreloadCluster(Cluster*);
+
+  // Returns the preloaded cluster at |pos|, or NULL. In either case |chunk|
+  // and |idx| are set to where it is, or would be inserted.
+  Cluster* FindPreloadedCluster(long long pos, long& chunk, long& idx) const;
+  bool InsertPreloadChunk(long chunk);
+  Cluster* GetFirstPreloadedCluster() const;
+  void RemoveFirstPreloadedCluster();
 
   // void ParseSeekHead(long long pos, long long size);
   // void ParseSeekEntry(long long pos, long long size);
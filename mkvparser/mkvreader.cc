@@ -9,7 +9,18 @@
 
 #include <sys/types.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <cassert>
+#include <cstring>
+#include <new>
 
 namespace mkvparser {
 
@@ -132,4 +143,374 @@ int MkvReader::Read(long long offset, long len, unsigned char* buffer) {
   return 0;  // success
 }
 
+MmapMkvReader::MmapMkvReader()
+    : m_data(NULL),
+      m_length(0),
+      m_open(false)
+#ifdef _WIN32
+      ,
+      m_file(INVALID_HANDLE_VALUE),
+      m_mapping(NULL)
+#endif
+{
+}
+
+MmapMkvReader::~MmapMkvReader() { Close(); }
+
+int MmapMkvReader::Open(const char* filename) {
+  if (filename == NULL)
+    return -1;
+
+  if (m_open)
+    return -1;
+
+#ifdef _WIN32
+  m_file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+  if (m_file == INVALID_HANDLE_VALUE)
+    return -1;
+
+  LARGE_INTEGER size;
+
+  if (!GetFileSizeEx(m_file, &size) || size.QuadPart < 0) {
+    CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+    return -1;
+  }
+
+  m_length = size.QuadPart;
+
+  if (m_length > 0) {
+    m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (m_mapping == NULL) {
+      CloseHandle(m_file);
+      m_file = INVALID_HANDLE_VALUE;
+      return -1;
+    }
+
+    m_data = static_cast<const unsigned char*>(
+        MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+
+    if (m_data == NULL) {
+      CloseHandle(m_mapping);
+      m_mapping = NULL;
+      CloseHandle(m_file);
+      m_file = INVALID_HANDLE_VALUE;
+      return -1;
+    }
+  }
+#else
+  const int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || st.st_size < 0 ||
+      static_cast<unsigned long long>(st.st_size) > size_t(-1)) {
+    close(fd);
+    return -1;
+  }
+
+  m_length = st.st_size;
+
+  if (m_length > 0) {
+    void* const addr = mmap(NULL, static_cast<size_t>(m_length), PROT_READ,
+                            MAP_PRIVATE, fd, 0);
+
+    if (addr == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+
+    m_data = static_cast<const unsigned char*>(addr);
+  }
+
+  close(fd);  // the mapping keeps the file referenced
+#endif
+
+  m_open = true;
+  return 0;
+}
+
+void MmapMkvReader::Close() {
+#ifdef _WIN32
+  if (m_data)
+    UnmapViewOfFile(m_data);
+
+  if (m_mapping)
+    CloseHandle(m_mapping);
+
+  if (m_file != INVALID_HANDLE_VALUE)
+    CloseHandle(m_file);
+
+  m_mapping = NULL;
+  m_file = INVALID_HANDLE_VALUE;
+#else
+  if (m_data)
+    munmap(const_cast<unsigned char*>(m_data), static_cast<size_t>(m_length));
+#endif
+
+  m_data = NULL;
+  m_length = 0;
+  m_open = false;
+}
+
+int MmapMkvReader::Length(long long* total, long long* available) {
+  if (!m_open)
+    return -1;
+
+  if (total)
+    *total = m_length;
+
+  if (available)
+    *available = m_length;
+
+  return 0;
+}
+
+int MmapMkvReader::Read(long long offset, long len, unsigned char* buffer) {
+  if (!m_open)
+    return -1;
+
+  if (offset < 0 || len < 0)
+    return -1;
+
+  if (len == 0)
+    return 0;
+
+  if (offset >= m_length || len > m_length - offset)
+    return -1;
+
+  memcpy(buffer, m_data + offset, len);
+  return 0;
+}
+
+const unsigned char* MmapMkvReader::GetView(long long offset, long len) {
+  if (m_data == NULL)
+    return NULL;
+
+  if (offset < 0 || len < 0)
+    return NULL;
+
+  if (offset > m_length || len > m_length - offset)
+    return NULL;
+
+  return m_data + offset;
+}
+
+CachedMkvReader::CachedMkvReader(IMkvReader* reader, long page_size,
+                                 int page_count)
+    : m_reader(reader),
+      m_page_size(page_size > 0 ? page_size : long(kDefaultPageSize)),
+      m_page_count(page_count > 0 ? page_count : int(kDefaultPageCount)),
+      m_pages(NULL),
+      m_buffer(NULL),
+      m_init_failed(false),
+      m_clock(0),
+      m_hits(0),
+      m_misses(0) {}
+
+CachedMkvReader::~CachedMkvReader() {
+  delete[] m_pages;
+  delete[] m_buffer;
+}
+
+bool CachedMkvReader::Init() {
+  if (m_pages)
+    return true;
+
+  if (m_init_failed)
+    return false;
+
+  m_pages = new (std::nothrow) Page[m_page_count];
+  m_buffer = new (std::nothrow)
+      unsigned char[static_cast<size_t>(m_page_size) * m_page_count];
+
+  if (m_pages == NULL || m_buffer == NULL) {
+    delete[] m_pages;
+    m_pages = NULL;
+    delete[] m_buffer;
+    m_buffer = NULL;
+    m_init_failed = true;  // fall back to passing reads through
+    return false;
+  }
+
+  for (int i = 0; i < m_page_count; ++i) {
+    Page& page = m_pages[i];
+    page.pos = -1;
+    page.len = 0;
+    page.last_use = 0;
+    page.data = m_buffer + static_cast<size_t>(m_page_size) * i;
+  }
+
+  return true;
+}
+
+void CachedMkvReader::Invalidate() {
+  if (m_pages == NULL)
+    return;
+
+  for (int i = 0; i < m_page_count; ++i) {
+    m_pages[i].pos = -1;
+    m_pages[i].len = 0;
+  }
+}
+
+int CachedMkvReader::Length(long long* total, long long* available) {
+  if (m_reader == NULL)
+    return -1;
+
+  return m_reader->Length(total, available);
+}
+
+const CachedMkvReader::Page* CachedMkvReader::GetPage(long long page_pos,
+                                                      long long stop,
+                                                      int& status) {
+  Page* victim = NULL;
+
+  for (int i = 0; i < m_page_count; ++i) {
+    Page& page = m_pages[i];
+
+    if (page.pos == page_pos) {
+      if (page_pos + page.len >= stop) {
+        ++m_hits;
+        page.last_use = ++m_clock;
+        return &page;
+      }
+
+      victim = &page;  // resident but short, e.g. a live stream that grew
+      break;
+    }
+
+    if (victim == NULL || page.last_use < victim->last_use)
+      victim = &page;
+  }
+
+  assert(victim);
+  ++m_misses;
+
+  long long total, available;
+  status = m_reader->Length(&total, &available);
+
+  if (status < 0)
+    return NULL;
+
+  long long fill_stop = page_pos + m_page_size;
+
+  if (available >= 0 && fill_stop > available)
+    fill_stop = available;
+
+  if (total >= 0 && fill_stop > total)
+    fill_stop = total;
+
+  if (fill_stop < stop) {
+    status = 1;  // caller reads through
+    return NULL;
+  }
+
+  const long fill_len = static_cast<long>(fill_stop - page_pos);
+
+  victim->pos = -1;
+  status = m_reader->Read(page_pos, fill_len, victim->data);
+
+  if (status)
+    return NULL;
+
+  victim->pos = page_pos;
+  victim->len = fill_len;
+  victim->last_use = ++m_clock;
+
+  return victim;
+}
+
+int CachedMkvReader::Read(long long position, long length,
+                          unsigned char* buffer) {
+  if (m_reader == NULL)
+    return -1;
+
+  if (position < 0 || length < 0)
+    return -1;
+
+  if (length == 0)
+    return 0;
+
+  if (length > m_page_size || !Init()) {
+    ++m_misses;
+    return m_reader->Read(position, length, buffer);
+  }
+
+  const long long stop = position + length;
+
+  while (position < stop) {
+    const long long page_pos = position - (position % m_page_size);
+    const long long page_stop = page_pos + m_page_size;
+    const long long chunk_stop = (stop < page_stop) ? stop : page_stop;
+    const long chunk_len = static_cast<long>(chunk_stop - position);
+
+    int status = 0;
+    const Page* const page = GetPage(page_pos, chunk_stop, status);
+
+    if (page == NULL) {
+      if (status < 0)
+        return status;
+
+      // The page cannot be filled far enough (e.g. the data is not
+      // available yet), so let the underlying reader report on the request.
+      return m_reader->Read(position, static_cast<long>(stop - position),
+                            buffer);
+    }
+
+    memcpy(buffer, page->data + (position - page_pos), chunk_len);
+    buffer += chunk_len;
+    position = chunk_stop;
+  }
+
+  return 0;
+}
+
+RecordingMkvReader::RecordingMkvReader(IMkvReader* reader, long long max_gap)
+    : m_reader(reader), m_ranges(max_gap), m_reads(0), m_failed_reads(0) {}
+
+RecordingMkvReader::~RecordingMkvReader() {}
+
+int RecordingMkvReader::Read(long long position, long length,
+                             unsigned char* buffer) {
+  ++m_reads;
+  m_ranges.Add(position, length);
+
+  const int status = m_reader->Read(position, length, buffer);
+
+  if (status != 0)
+    ++m_failed_reads;
+
+  return status;
+}
+
+int RecordingMkvReader::Length(long long* total, long long* available) {
+  return m_reader->Length(total, available);
+}
+
+const unsigned char* RecordingMkvReader::GetView(long long position,
+                                                 long length) {
+  const unsigned char* const data = m_reader->GetView(position, length);
+
+  // A NULL view is followed by a Read() of the same range.
+  if (data) {
+    ++m_reads;
+    m_ranges.Add(position, length);
+  }
+
+  return data;
+}
+
+void RecordingMkvReader::Clear() {
+  m_ranges.Clear();
+  m_reads = 0;
+  m_failed_reads = 0;
+}
+
 }  // namespace mkvparser
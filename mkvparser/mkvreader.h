@@ -40,6 +40,124 @@ class MkvReader : public IMkvReader {
   bool reader_owns_file_;
 };
 
+// Read-only IMkvReader that maps the whole file into memory. Read() copies out
+// of the mapping without any system calls, and GetView() hands out pointers
+// into it so that frame payloads need not be copied at all.
+class MmapMkvReader : public IMkvReader {
+ public:
+  MmapMkvReader();
+  virtual ~MmapMkvReader();
+
+  // Maps |filename|. Returns 0 on success, -1 on failure.
+  int Open(const char* filename);
+  void Close();
+
+  virtual int Read(long long position, long length, unsigned char* buffer);
+  virtual int Length(long long* total, long long* available);
+  virtual const unsigned char* GetView(long long position, long length);
+
+ private:
+  MmapMkvReader(const MmapMkvReader&);
+  MmapMkvReader& operator=(const MmapMkvReader&);
+
+  const unsigned char* m_data;
+  long long m_length;
+  bool m_open;
+#ifdef _WIN32
+  void* m_file;
+  void* m_mapping;
+#endif
+};
+
+// IMkvReader decorator that serves reads from a small set of aligned pages.
+// The parser issues many tiny reads (often a single byte at a time); with this
+// wrapper each page of the underlying reader is fetched at most once while it
+// stays resident. Pages are recycled in least recently used order. Reads larger
+// than a page bypass the cache.
+class CachedMkvReader : public IMkvReader {
+ public:
+  enum { kDefaultPageSize = 64 * 1024, kDefaultPageCount = 16 };
+
+  // |reader| is not owned and must outlive this object. A non-positive
+  // |page_size| or |page_count| selects the default.
+  explicit CachedMkvReader(IMkvReader* reader,
+                           long page_size = kDefaultPageSize,
+                           int page_count = kDefaultPageCount);
+  virtual ~CachedMkvReader();
+
+  virtual int Read(long long position, long length, unsigned char* buffer);
+  virtual int Length(long long* total, long long* available);
+
+  // Drops all cached pages.
+  void Invalidate();
+
+  long GetPageSize() const { return m_page_size; }
+  int GetPageCount() const { return m_page_count; }
+
+  // Number of page lookups satisfied from the cache, and number that had to
+  // go to the underlying reader (bypassed large reads count as misses).
+  long long GetHitCount() const { return m_hits; }
+  long long GetMissCount() const { return m_misses; }
+
+ private:
+  CachedMkvReader(const CachedMkvReader&);
+  CachedMkvReader& operator=(const CachedMkvReader&);
+
+  struct Page {
+    long long pos;  // aligned offset of the page, or -1 when unused
+    long len;  // number of valid bytes
+    unsigned long long last_use;
+    unsigned char* data;
+  };
+
+  bool Init();
+
+  // Returns the page that holds [pos, stop) filling it from the underlying
+  // reader if necessary, or NULL (with |status| set) on failure.
+  const Page* GetPage(long long page_pos, long long stop, int& status);
+
+  IMkvReader* const m_reader;
+  const long m_page_size;
+  const int m_page_count;
+  Page* m_pages;
+  unsigned char* m_buffer;
+  bool m_init_failed;
+  unsigned long long m_clock;
+  long long m_hits;
+  long long m_misses;
+};
+
+// IMkvReader decorator that records the byte ranges read through it,
+// coalesced as in a ReadPlan. Useful to find the ranges a parse touches, or
+// to check a plan made with Segment::PlanHeaders() or PlanSeek().
+class RecordingMkvReader : public IMkvReader {
+ public:
+  // |reader| is not owned and must outlive this object.
+  explicit RecordingMkvReader(IMkvReader* reader, long long max_gap = 0);
+  virtual ~RecordingMkvReader();
+
+  virtual int Read(long long position, long length, unsigned char* buffer);
+  virtual int Length(long long* total, long long* available);
+  virtual const unsigned char* GetView(long long position, long length);
+
+  const ReadPlan& GetRanges() const { return m_ranges; }
+
+  // Number of Read() and GetView() calls, and how many of them failed.
+  long long GetReadCount() const { return m_reads; }
+  long long GetFailedReadCount() const { return m_failed_reads; }
+
+  void Clear();
+
+ private:
+  RecordingMkvReader(const RecordingMkvReader&);
+  RecordingMkvReader& operator=(const RecordingMkvReader&);
+
+  IMkvReader* const m_reader;
+  ReadPlan m_ranges;
+  long long m_reads;
+  long long m_failed_reads;
+};
+
 }  // namespace mkvparser
 
 #endif  // MKVPARSER_MKVREADER_H_
@@ -0,0 +1,306 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#include "mkvparser/prefetchingmkvreader.h"
+
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <system_error>
+
+namespace mkvparser {
+
+PrefetchingMkvReader::PrefetchingMkvReader(IMkvReader* reader, int max_ranges,
+                                           long long max_bytes)
+    : m_reader(reader),
+      m_max_ranges((max_ranges > 0) ? max_ranges : kDefaultMaxRanges),
+      m_max_bytes((max_bytes > 0) ? max_bytes : kDefaultMaxBytes),
+      m_ranges(NULL),
+      m_range_count(0),
+      m_range_bytes(0),
+      m_last_hit_pos(0),
+      m_starving(false),
+      m_stop(false) {
+  memset(&m_stats, 0, sizeof(m_stats));
+
+  m_ranges = new (std::nothrow) Range[m_max_ranges];
+
+  if (m_ranges == NULL)
+    return;
+
+  try {
+    m_thread = std::thread(&PrefetchingMkvReader::Run, this);
+  } catch (const std::system_error&) {
+    // Without a thread every read goes straight to the underlying reader.
+  }
+}
+
+PrefetchingMkvReader::~PrefetchingMkvReader() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+
+  m_cond.notify_all();
+
+  if (m_thread.joinable())
+    m_thread.join();
+
+  for (int i = 0; i < m_range_count; ++i)
+    delete[] m_ranges[i].data;
+
+  delete[] m_ranges;
+}
+
+void PrefetchingMkvReader::Run() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  for (;;) {
+    Range* range = NULL;
+
+    for (int i = 0; i < m_range_count && range == NULL; ++i) {
+      if (m_ranges[i].state == kQueued)
+        range = &m_ranges[i];
+    }
+
+    if (range == NULL) {
+      if (m_stop)
+        return;
+
+      m_cond.wait(lock);
+      continue;
+    }
+
+    // Ranges being read are never released, but may move within the array
+    // while the lock is dropped, so find it again by its buffer afterwards.
+    range->state = kReading;
+
+    const long long pos = range->pos;
+    const long long len = range->len;
+    unsigned char* const data = range->data;
+
+    lock.unlock();
+
+    int status;
+
+    {
+      std::lock_guard<std::mutex> reader_lock(m_reader_mutex);
+      status = m_reader->Read(pos, static_cast<long>(len), data);
+    }
+
+    lock.lock();
+
+    range = FindRange(data);
+    assert(range);
+
+    range->state = (status == 0) ? kReady : kFailed;
+
+    if (status == 0)
+      m_stats.prefetched_bytes += len;
+
+    m_cond.notify_all();
+  }
+}
+
+void PrefetchingMkvReader::ReleaseRanges(long long length) {
+  // Once reads are served from a later range, earlier ones are done with.
+  int j = 0;
+
+  for (int i = 0; i < m_range_count; ++i) {
+    Range& range = m_ranges[i];
+
+    if (range.state == kFailed ||
+        (range.state == kReady && range.pos + range.len <= m_last_hit_pos)) {
+      delete[] range.data;
+      m_range_bytes -= range.len;
+      continue;
+    }
+
+    m_ranges[j++] = range;
+  }
+
+  m_range_count = j;
+
+  // After a seek, ranges queued for the old position may still be held.
+  // Release the oldest finished ones if that is what it takes to make room.
+  for (int i = 0; i < m_range_count;) {
+    if (m_range_count < m_max_ranges && m_range_bytes + length <= m_max_bytes)
+      break;
+
+    Range& range = m_ranges[i];
+
+    if (range.state != kReady) {
+      ++i;
+      continue;
+    }
+
+    delete[] range.data;
+    m_range_bytes -= range.len;
+
+    for (int k = i + 1; k < m_range_count; ++k)
+      m_ranges[k - 1] = m_ranges[k];
+
+    --m_range_count;
+  }
+}
+
+PrefetchingMkvReader::Range* PrefetchingMkvReader::FindRange(
+    const unsigned char* data) {
+  for (int i = 0; i < m_range_count; ++i) {
+    if (m_ranges[i].data == data)
+      return &m_ranges[i];
+  }
+
+  return NULL;
+}
+
+bool PrefetchingMkvReader::Prefetch(long long position, long long length) {
+  if (position < 0 || length <= 0 || length > LONG_MAX)
+    return false;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if (m_ranges == NULL || !m_thread.joinable()) {
+    ++m_stats.rejected;
+    return false;
+  }
+
+  for (int i = 0; i < m_range_count; ++i) {
+    const Range& range = m_ranges[i];
+
+    if (position >= range.pos &&
+        position + length <= range.pos + range.len) {
+      return false;  // already held
+    }
+  }
+
+  ReleaseRanges(length);
+
+  if (m_range_count >= m_max_ranges || m_range_bytes + length > m_max_bytes) {
+    ++m_stats.rejected;
+    return false;
+  }
+
+  unsigned char* const data =
+      new (std::nothrow) unsigned char[static_cast<size_t>(length)];
+
+  if (data == NULL) {
+    ++m_stats.rejected;
+    return false;
+  }
+
+  Range& range = m_ranges[m_range_count++];
+
+  range.pos = position;
+  range.len = length;
+  range.data = data;
+  range.state = kQueued;
+
+  m_range_bytes += length;
+
+  m_cond.notify_all();
+  return true;
+}
+
+int PrefetchingMkvReader::PrefetchClusters(Segment* segment,
+                                           const Cluster* current,
+                                           int count) {
+  if (segment == NULL || current == NULL || current->EOS())
+    return 0;
+
+  int queued = 0;
+
+  for (int i = 0; i < count; ++i) {
+    current = segment->GetNext(current);
+
+    if (current == NULL || current->EOS())
+      break;
+
+    // Loading the cluster reads just its header, which gives its size.
+    if (current->GetTimeCode() < 0)
+      break;
+
+    const long long size = current->GetElementSize();
+
+    if (size <= 0)
+      break;  // unknown size: the parser has not found its end yet
+
+    if (Prefetch(current->m_element_start, size))
+      ++queued;
+  }
+
+  return queued;
+}
+
+int PrefetchingMkvReader::Read(long long position, long length,
+                               unsigned char* buffer) {
+  if (position < 0 || length < 0 || buffer == NULL)
+    return -1;
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    m_starving = false;
+
+    for (int i = 0; i < m_range_count; ++i) {
+      const Range* range = &m_ranges[i];
+
+      if (position < range->pos ||
+          position + length > range->pos + range->len) {
+        continue;
+      }
+
+      if (range->state == kQueued || range->state == kReading) {
+        ++m_stats.starved;
+        m_starving = true;
+
+        // Prefetch() may be called on another thread while we wait, moving
+        // the range within the array, or releasing it once it is read.
+        const unsigned char* const data = range->data;
+
+        m_cond.wait(lock, [this, data, &range]() {
+          range = FindRange(data);
+          return range == NULL || range->state == kReady ||
+                 range->state == kFailed;
+        });
+      }
+
+      if (range && range->state == kReady) {
+        memcpy(buffer, range->data + (position - range->pos), length);
+        m_last_hit_pos = position;
+        ++m_stats.hits;
+        return 0;
+      }
+
+      break;  // failed or released: go to the underlying reader
+    }
+
+    ++m_stats.misses;
+    m_starving = true;
+  }
+
+  std::lock_guard<std::mutex> reader_lock(m_reader_mutex);
+  return m_reader->Read(position, length, buffer);
+}
+
+int PrefetchingMkvReader::Length(long long* total, long long* available) {
+  std::lock_guard<std::mutex> reader_lock(m_reader_mutex);
+  return m_reader->Length(total, available);
+}
+
+PrefetchingMkvReader::Stats PrefetchingMkvReader::GetStats() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+bool PrefetchingMkvReader::IsStarving() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_starving;
+}
+
+}  // namespace mkvparser
@@ -0,0 +1,103 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef MKVPARSER_PREFETCHINGMKVREADER_H_
+#define MKVPARSER_PREFETCHINGMKVREADER_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "mkvparser/mkvparser.h"
+
+namespace mkvparser {
+
+// IMkvReader decorator that reads byte ranges ahead of the parser on a
+// background thread. The caller queues the ranges it will need soon, usually
+// the clusters that follow the one being demuxed (see PrefetchClusters());
+// reads that fall inside a prefetched range are then served from memory.
+// Read() and Length() may be called from one thread at a time, and Prefetch()
+// from any thread, even while a Read() waits for a range.
+class PrefetchingMkvReader : public IMkvReader {
+ public:
+  enum { kDefaultMaxRanges = 8 };
+  static const long long kDefaultMaxBytes = 32 * 1024 * 1024;
+
+  // |reader| is not owned and must outlive this object. At most |max_ranges|
+  // ranges totalling |max_bytes| are held or queued at once.
+  explicit PrefetchingMkvReader(IMkvReader* reader,
+                                int max_ranges = kDefaultMaxRanges,
+                                long long max_bytes = kDefaultMaxBytes);
+  virtual ~PrefetchingMkvReader();
+
+  virtual int Read(long long position, long length, unsigned char* buffer);
+  virtual int Length(long long* total, long long* available);
+
+  // Queues [position, position + length) for reading. To make room, ranges
+  // that end at or before the last read served from memory are released,
+  // then the oldest finished ones. Returns false if the range is already
+  // held, or does not fit in the pool.
+  bool Prefetch(long long position, long long length);
+
+  // Queues up to |count| clusters of |segment| that follow |current|, as far
+  // as they have been loaded. Returns the number of clusters queued.
+  int PrefetchClusters(Segment* segment, const Cluster* current, int count);
+
+  struct Stats {
+    long long hits;  // reads served from a prefetched range
+    long long misses;  // reads that went to the underlying reader
+    long long starved;  // reads that waited for a range still being read
+    long long prefetched_bytes;
+    long long rejected;  // Prefetch() calls refused for lack of room
+  };
+
+  Stats GetStats() const;
+
+  // True if the last read had to wait for, or bypass, the prefetcher.
+  bool IsStarving() const;
+
+ private:
+  PrefetchingMkvReader(const PrefetchingMkvReader&);
+  PrefetchingMkvReader& operator=(const PrefetchingMkvReader&);
+
+  enum RangeState { kQueued, kReading, kReady, kFailed };
+
+  struct Range {
+    long long pos;
+    long long len;
+    unsigned char* data;
+    RangeState state;
+  };
+
+  void Run();
+
+  // Returns the range whose buffer is |data|, or NULL if it was released.
+  Range* FindRange(const unsigned char* data);
+
+  // Releases finished ranges to make room for |length| more bytes.
+  void ReleaseRanges(long long length);
+
+  IMkvReader* const m_reader;
+  const int m_max_ranges;
+  const long long m_max_bytes;
+
+  mutable std::mutex m_mutex;  // guards everything below
+  std::mutex m_reader_mutex;  // serializes calls into |m_reader|
+  std::condition_variable m_cond;
+  Range* m_ranges;
+  int m_range_count;
+  long long m_range_bytes;
+  long long m_last_hit_pos;
+  bool m_starving;
+  bool m_stop;
+  Stats m_stats;
+  std::thread m_thread;
+};
+
+}  // namespace mkvparser
+
+#endif  // MKVPARSER_PREFETCHINGMKVREADER_H_
@@ -17,6 +17,7 @@
 
 #include "mkvparser/mkvparser.h"
 #include "mkvparser/mkvreader.h"
+#include "mkvparser/prefetchingmkvreader.h"
 #include "libnmf.h"
 
 namespace {
@@ -67,19 +68,58 @@ bool ColourValuePresent(long long value) {
 }  // namespace
 
 int main(int argc, char* argv[]) {
-  if (argc == 1) {
+  const char* input = NULL;
+  bool use_cached_reader = false;
+  bool use_prefetch = false;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp("-cached_reader", argv[i]))
+      use_cached_reader = true;
+    else if (!strcmp("-prefetch", argv[i]))
+      use_prefetch = true;
+    else
+      input = argv[i];
+  }
+
+  if (input == NULL) {
     printf("Mkv Parser Sample Application\n");
-    printf("  Usage: %s <input file> \n", argv[0]);
+    printf("  Usage: %s [-cached_reader] [-prefetch] <input file> \n",
+           argv[0]);
+    printf("  -cached_reader  Read the file through a page cache.\n");
+    printf("  -prefetch       Read the next clusters ahead on a thread.\n");
     return EXIT_FAILURE;
   }
 
-  mkvparser::MkvReader reader;
+  mkvparser::MkvReader file_reader;
 
-  if (reader.Open(argv[1])) {
+  if (file_reader.Open(input)) {
     printf("\n Filename is invalid or error while opening.\n");
     return EXIT_FAILURE;
   }
 
+  // The prefetcher starts a thread, so only create it when asked for.
+  std::unique_ptr<mkvparser::PrefetchingMkvReader> prefetch_reader;
+
+  if (use_prefetch) {
+    prefetch_reader.reset(new (std::nothrow)
+                              mkvparser::PrefetchingMkvReader(&file_reader));
+
+    if (!prefetch_reader) {
+      printf("\n Out of memory creating the prefetching reader.\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  mkvparser::IMkvReader* const source_reader =
+      prefetch_reader ? static_cast<mkvparser::IMkvReader*>(
+                            prefetch_reader.get())
+                      : &file_reader;
+
+  mkvparser::CachedMkvReader cached_reader(source_reader);
+  mkvparser::IMkvReader* const reader =
+      use_cached_reader ? static_cast<mkvparser::IMkvReader*>(&cached_reader)
+                        : source_reader;
+
   int maj, min, build, rev;
 
   mkvparser::GetVersion(maj, min, build, rev);
@@ -89,7 +129,7 @@ int main(int argc, char* argv[]) {
 
   mkvparser::EBMLHeader ebmlHeader;
 
-  long long ret = ebmlHeader.Parse(&reader, pos);
+  long long ret = ebmlHeader.Parse(reader, pos);
   if (ret < 0) {
     printf("\n EBMLHeader::Parse() failed.");
     return EXIT_FAILURE;
@@ -105,7 +145,7 @@ int main(int argc, char* argv[]) {
   typedef mkvparser::Segment seg_t;
   seg_t* pSegment_;
 
-  ret = seg_t::CreateInstance(&reader, pos, pSegment_);
+  ret = seg_t::CreateInstance(reader, pos, pSegment_);
   if (ret) {
     printf("\n Segment::CreateInstance() failed.");
     return EXIT_FAILURE;
@@ -396,6 +436,9 @@ int main(int argc, char* argv[]) {
 	int frame_smallest = INT_MAX;
 
   while (pCluster != NULL && !pCluster->EOS()) {
+    if (prefetch_reader)
+      prefetch_reader->PrefetchClusters(pSegment.get(), pCluster, 4);
+
     const long long timeCode = pCluster->GetTimeCode();
     printf("\t\tCluster Time Code\t: %lld\n", timeCode);
 
@@ -447,7 +490,7 @@ int main(int argc, char* argv[]) {
 
 		unsigned char* block;
 		block = (unsigned char*)malloc(1024768);
-		theFrame.Read(&reader, block);
+		theFrame.Read(reader, block);
 
 		if (trackType == mkvparser::Track::kVideo) {
 			frame_biggest = size > frame_biggest ? size : frame_biggest;
@@ -546,6 +589,18 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  if (use_cached_reader) {
+    printf("\t\tReader cache hits: %lld misses: %lld\n",
+           cached_reader.GetHitCount(), cached_reader.GetMissCount());
+  }
+
+  if (prefetch_reader) {
+    const mkvparser::PrefetchingMkvReader::Stats stats =
+        prefetch_reader->GetStats();
+    printf("\t\tPrefetch hits: %lld misses: %lld starved: %lld\n",
+           stats.hits, stats.misses, stats.starved);
+  }
+
   fflush(stdout);
   return EXIT_SUCCESS;
 }
@@ -14,6 +14,7 @@
 #include <memory>
 #include <ostream>
 #include <string>
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -509,6 +510,43 @@ TEST_F(MuxerTest, CuesBeforeClusters) {
   remove(cues_filename.c_str());
 }
 
+TEST_F(MuxerTest, CuesBeforeClustersManyCuePoints) {
+  EXPECT_TRUE(SegmentInit(true, false, false));
+  AddVideoTrack();
+
+  // One cue point per cluster. The clusters span several megabytes, so moving
+  // the Cues in front of them grows the coded size of many cue positions.
+  const int kCuePointCount = 120000;
+  for (int i = 0; i < kCuePointCount; ++i) {
+    segment_.ForceNewClusterOnNextFrame();
+    ASSERT_TRUE(segment_.AddFrame(dummy_data_, 1 + i % kFrameLength,
+                                  kVideoTrackNumber, i * 1000000ULL, true));
+  }
+  ASSERT_TRUE(segment_.Finalize());
+  EXPECT_EQ(kCuePointCount, segment_.GetCues()->cue_entries_size());
+  CloseWriter();
+#ifdef _MSC_VER
+  temp_file_.reset();
+#endif
+  mkvparser::MkvReader reader;
+  ASSERT_EQ(0, reader.Open(filename_.c_str()));
+  MkvWriter cues_writer;
+  std::string cues_filename = libwebm::GetTempFileName();
+  ASSERT_GT(cues_filename.length(), 0u);
+  cues_writer.Open(cues_filename.c_str());
+  EXPECT_TRUE(segment_.CopyAndMoveCuesBeforeClusters(&reader, &cues_writer));
+  reader.Close();
+  cues_writer.Close();
+
+  MkvParser parser;
+  ASSERT_TRUE(ParseMkvFileReleaseParser(cues_filename, &parser));
+  int64_t cues_offset = 0;
+  ASSERT_TRUE(HasCuePoints(parser.segment, &cues_offset));
+  ASSERT_GT(cues_offset, 0);
+  ASSERT_TRUE(ValidateCues(parser.segment, parser.reader));
+  remove(cues_filename.c_str());
+}
+
 TEST_F(MuxerTest, MaxClusterSize) {
   EXPECT_TRUE(SegmentInit(false, false, false));
   AddVideoTrack();
@@ -728,6 +766,61 @@ TEST_F(MuxerTest, AccurateClusterDurationTwoTracks) {
       GetTestFilePath("accurate_cluster_duration_two_tracks.webm"), filename_));
 }
 
+TEST_F(MuxerTest, AccurateClusterDurationManyTracks) {
+  EXPECT_TRUE(SegmentInit(false, true, false));
+  AddVideoTrack();
+  AddAudioTrack();
+  const int kTrackCount = 6;
+  for (int i = 2; i < kTrackCount; ++i)
+    ASSERT_NE(0u, segment_.AddAudioTrack(kSampleRate, kChannels, 0));
+  segment_.set_max_cluster_duration(100000000);
+
+  // Tracks take turns in an irregular pattern, often at equal timestamps.
+  const int kFrameCount = 600;
+  std::uint64_t timestamp = 0;
+  for (int i = 0; i < kFrameCount; ++i) {
+    timestamp += (i * 7 % 3) * 1000000;
+    Frame frame;
+    ASSERT_TRUE(frame.Init(dummy_data_, kFrameLength));
+    frame.set_track_number(1 + i * 5 % kTrackCount);
+    frame.set_timestamp(timestamp);
+    frame.set_is_key(true);
+    ASSERT_TRUE(segment_.AddGenericFrame(&frame));
+  }
+  ASSERT_TRUE(segment_.Finalize());
+  CloseWriter();
+
+  MkvParser parser;
+  std::vector<BlockEntries> clusters;
+  ASSERT_TRUE(ParseMkvFileBlocks(filename_, &parser, &clusters));
+
+  // Every frame is written once, in timestamp order, and each track's last
+  // block in a cluster is a BlockGroup carrying a duration.
+  int frame_count = 0;
+  long long last_time_ns = -1;
+  for (size_t i = 0; i < clusters.size(); ++i) {
+    const mkvparser::BlockEntry* last_entries[kTrackCount + 1] = {NULL};
+    for (const mkvparser::BlockEntry* block_entry : clusters[i]) {
+      const mkvparser::Block* const block = block_entry->GetBlock();
+      const long long time_ns = block->GetTime(block_entry->GetCluster());
+      EXPECT_GE(time_ns, last_time_ns);
+      last_time_ns = time_ns;
+      last_entries[block->GetTrackNumber()] = block_entry;
+      ++frame_count;
+    }
+    // The last cluster is finalized without frame durations.
+    if (i + 1 == clusters.size())
+      continue;
+    for (int track = 1; track <= kTrackCount; ++track) {
+      if (last_entries[track] != NULL) {
+        EXPECT_EQ(mkvparser::BlockEntry::kBlockGroup,
+                  last_entries[track]->GetKind());
+      }
+    }
+  }
+  EXPECT_EQ(kFrameCount, frame_count);
+}
+
 TEST_F(MuxerTest, AccurateClusterDurationWithoutFinalizingCluster) {
   EXPECT_TRUE(SegmentInit(false, true, false));
   AddVideoTrack();
@@ -1002,6 +1095,228 @@ TEST_F(MuxerTest, LongTagString) {
   EXPECT_TRUE(CompareFiles(GetTestFilePath("long_tag_string.webm"), filename_));
 }
 
+TEST_F(MuxerTest, QueuedAudioFrames) {
+  EXPECT_TRUE(SegmentInit(false, false, false));
+  AddVideoTrack();
+  AddAudioTrack();
+  EXPECT_TRUE(segment_.ReserveQueuedFrames(8));
+  EXPECT_EQ(8, segment_.queued_frames_capacity());
+  EXPECT_EQ(0, segment_.max_queued_frames());
+
+  // Audio frames are held back until the next video frame.
+  std::uint64_t timestamp = 0;
+  for (int queued : {4, 3, 10}) {
+    EXPECT_TRUE(segment_.AddFrame(dummy_data_, kFrameLength,
+                                  kVideoTrackNumber, timestamp, true));
+    for (int i = 0; i < queued; ++i) {
+      timestamp += 1000000;
+      EXPECT_TRUE(segment_.AddFrame(dummy_data_, kFrameLength,
+                                    kAudioTrackNumber, timestamp, true));
+    }
+    timestamp += 1000000;
+  }
+  EXPECT_EQ(10, segment_.max_queued_frames());
+  EXPECT_EQ(16, segment_.queued_frames_capacity());
+  EXPECT_TRUE(segment_.Finalize());
+  CloseWriter();
+
+  MkvParser parser;
+  std::vector<BlockEntries> clusters;
+  ASSERT_TRUE(ParseMkvFileBlocks(filename_, &parser, &clusters));
+
+  // Every frame was written, in timestamp order.
+  int frame_count = 0;
+  long long last_time_ns = -1;
+  for (const BlockEntries& blocks : clusters) {
+    for (const mkvparser::BlockEntry* block_entry : blocks) {
+      const long long time_ns =
+          block_entry->GetBlock()->GetTime(block_entry->GetCluster());
+      EXPECT_GE(time_ns, last_time_ns);
+      last_time_ns = time_ns;
+      ++frame_count;
+    }
+  }
+  EXPECT_EQ(3 + 4 + 3 + 10, frame_count);
+}
+
+TEST(BufferedMkvWriterTest, PatchesFlushedAndBufferedData) {
+  const std::string filename = libwebm::GetTempFileName();
+  std::string expected = "0123456789abcdefghij";
+  {
+    mkvmuxer::BufferedMkvWriter writer(8);
+    ASSERT_TRUE(writer.Open(filename.c_str()));
+    for (size_t i = 0; i < expected.size(); i += 4)
+      ASSERT_EQ(0, writer.Write(&expected[i], 4));
+    EXPECT_EQ(20, writer.Position());
+    EXPECT_EQ(2, writer.flush_count());
+
+    // Across the end of the flushed data and into the buffer.
+    ASSERT_EQ(0, writer.Position(14));
+    ASSERT_EQ(0, writer.Write("XYZ", 3));
+    expected.replace(14, 3, "XYZ");
+    EXPECT_EQ(1, writer.patch_count());
+
+    // Within the buffer, then on past its end.
+    ASSERT_EQ(0, writer.Position(18));
+    ASSERT_EQ(0, writer.Write("pqrs", 4));
+    expected.replace(18, 4, "pqrs");
+    EXPECT_EQ(1, writer.patch_count());
+    EXPECT_EQ(22, writer.Position());
+
+    // Writes larger than the buffer go straight out.
+    const std::string large(20, 'L');
+    ASSERT_EQ(0, writer.Write(large.data(), 20));
+    expected += large;
+
+    ASSERT_EQ(0, writer.Position(0));
+    ASSERT_EQ(0, writer.Write("!", 1));
+    expected[0] = '!';
+    EXPECT_EQ(2, writer.patch_count());
+
+    // The three patched bytes that had been flushed were written twice.
+    EXPECT_TRUE(writer.Flush());
+    EXPECT_EQ(static_cast<int64_t>(expected.size()) + 3,
+              writer.bytes_written());
+  }
+
+  std::string actual(expected.size() + 1, '\0');
+  FILE* const file = std::fopen(filename.c_str(), "rb");
+  ASSERT_TRUE(file != NULL);
+  actual.resize(std::fread(&actual[0], 1, actual.size(), file));
+  std::fclose(file);
+  std::remove(filename.c_str());
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(BufferedMkvWriterTest, MatchesMkvWriter) {
+  // Mux the same frames through both writers. The small buffer makes the
+  // size patches of Cluster and Segment land in data already written out.
+  const auto mux = [](mkvmuxer::IMkvWriter* writer) {
+    Segment segment;
+    if (!segment.Init(writer))
+      return false;
+    segment.GetSegmentInfo()->set_writing_app(kAppString);
+    segment.GetSegmentInfo()->set_muxing_app(kAppString);
+    if (segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber) == 0 ||
+        segment.AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber) == 0) {
+      return false;
+    }
+    segment.set_max_cluster_duration(100000000);
+    std::uint8_t data[kFrameLength] = {0};
+    for (std::uint64_t ms = 0; ms < 3000; ms += 20) {
+      data[0] = static_cast<std::uint8_t>(ms);
+      if (ms % 40 == 0 &&
+          !segment.AddFrame(data, kFrameLength, kVideoTrackNumber,
+                            ms * 1000000, ms % 1000 == 0)) {
+        return false;
+      }
+      if (!segment.AddFrame(data, kFrameLength, kAudioTrackNumber,
+                            ms * 1000000, true)) {
+        return false;
+      }
+    }
+    return segment.Finalize();
+  };
+
+  const std::string reference = libwebm::GetTempFileName();
+  {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(reference.c_str()));
+    ASSERT_TRUE(mux(&writer));
+  }
+
+  const std::string buffered = libwebm::GetTempFileName();
+  {
+    mkvmuxer::BufferedMkvWriter writer(256);
+    ASSERT_TRUE(writer.Open(buffered.c_str()));
+    ASSERT_TRUE(mux(&writer));
+    ASSERT_TRUE(writer.Flush());
+    EXPECT_GT(writer.flush_count(), 1);
+    EXPECT_GT(writer.patch_count(), 0);
+    EXPECT_GE(writer.bytes_written(), writer.Position());
+  }
+
+  EXPECT_TRUE(CompareFiles(reference, buffered));
+  std::remove(reference.c_str());
+  std::remove(buffered.c_str());
+}
+
+TEST(SharedFrameTest, MatchesCopiedFrames) {
+  struct Releases {
+    static void Count(void* opaque, const std::uint8_t*) {
+      ++*static_cast<int*>(opaque);
+    }
+  };
+
+  // Audio frames are held back until the next video frame, so the muxer has
+  // to keep them past AddGenericFrame().
+  const auto mux = [](mkvmuxer::IMkvWriter* writer, bool shared,
+                      int* released) {
+    Segment segment;
+    if (!segment.Init(writer))
+      return false;
+    segment.GetSegmentInfo()->set_writing_app(kAppString);
+    segment.GetSegmentInfo()->set_muxing_app(kAppString);
+    if (segment.AddVideoTrack(kWidth, kHeight, kVideoTrackNumber) == 0 ||
+        segment.AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber) == 0) {
+      return false;
+    }
+    std::uint8_t data[2][kFrameLength] = {{0}};
+    int created = 0;
+    bool held = false;
+    for (std::uint64_t ms = 0; ms < 1000; ms += 20) {
+      const bool video = ms % 40 == 0;
+      std::uint8_t* const payload = data[video];
+      payload[0] = static_cast<std::uint8_t>(ms);
+      {
+        Frame frame;
+        if (shared) {
+          mkvmuxer::FrameBuffer* const buffer = mkvmuxer::FrameBuffer::Create(
+              payload, kFrameLength, &Releases::Count, released);
+          if (!buffer || !frame.InitShared(buffer))
+            return false;
+          buffer->Release();
+          ++created;
+        } else if (!frame.Init(payload, kFrameLength)) {
+          return false;
+        }
+        frame.set_track_number(video ? kVideoTrackNumber : kAudioTrackNumber);
+        frame.set_timestamp(ms * 1000000);
+        frame.set_is_key(!video || ms % 200 == 0);
+        if (!segment.AddGenericFrame(&frame))
+          return false;
+      }
+      // Only a queued audio frame may still hold the buffer.
+      if (shared && *released + (video ? 0 : 1) < created)
+        return false;
+      held |= shared && *released < created;
+    }
+    if (!segment.Finalize())
+      return false;
+    return !shared || (held && *released == created);
+  };
+
+  const std::string reference = libwebm::GetTempFileName();
+  {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(reference.c_str()));
+    ASSERT_TRUE(mux(&writer, false, NULL));
+  }
+
+  const std::string shared = libwebm::GetTempFileName();
+  int released = 0;
+  {
+    MkvWriter writer;
+    ASSERT_TRUE(writer.Open(shared.c_str()));
+    ASSERT_TRUE(mux(&writer, true, &released));
+  }
+  EXPECT_EQ(50, released);
+
+  EXPECT_TRUE(CompareFiles(reference, shared));
+  std::remove(reference.c_str());
+  std::remove(shared.c_str());
+}
+
 }  // namespace test
 
 int main(int argc, char* argv[]) {
@@ -0,0 +1,97 @@
+// Copyright (c) 2026 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+// Writes the synthetic inputs of mkvparser_benchmarks to a directory.
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "mkvmuxer/mkvmuxer.h"
+#include "mkvmuxer/mkvwriter.h"
+#include "testing/mkvparser_benchmark_data.h"
+
+namespace {
+
+const uint64_t kMs = 1000000;  // ns
+
+bool WriteFile(const std::string& path,
+               const test::BenchmarkDataFile& spec) {
+  mkvmuxer::MkvWriter writer;
+  if (!writer.Open(path.c_str())) {
+    fprintf(stderr, "Error opening %s\n", path.c_str());
+    return false;
+  }
+
+  mkvmuxer::Segment segment;
+  if (!segment.Init(&writer))
+    return false;
+
+  const uint64_t video = segment.AddVideoTrack(640, 360, 1);
+  const uint64_t audio = segment.AddAudioTrack(48000, 2, 2);
+  if (video == 0 || audio == 0)
+    return false;
+
+  segment.set_max_cluster_duration(spec.cluster_ms * kMs);
+
+  // Incompressible, but reproducible, payloads.
+  std::vector<uint8_t> data(spec.video_frame_size);
+  uint32_t seed = 0x9e3779b9;
+  for (size_t i = 0; i < data.size(); ++i) {
+    seed = seed * 1664525 + 1013904223;
+    data[i] = static_cast<uint8_t>(seed >> 24);
+  }
+
+  const uint64_t video_ms = 1000 / spec.video_fps;
+  const uint64_t audio_ms = 20;
+  uint64_t next_video = 0;
+  uint64_t next_audio = 0;
+  const uint64_t duration_ms = spec.duration_s * 1000;
+
+  while (next_video < duration_ms || next_audio < duration_ms) {
+    if (next_video <= next_audio) {
+      const bool key = (next_video % (spec.keyframe_s * 1000)) < video_ms;
+      if (!segment.AddFrame(&data[0], data.size(), video, next_video * kMs,
+                            key)) {
+        return false;
+      }
+      next_video += video_ms;
+    } else {
+      if (!segment.AddFrame(&data[0], spec.audio_frame_size, audio,
+                            next_audio * kMs, true)) {
+        return false;
+      }
+      next_audio += audio_ms;
+    }
+  }
+
+  if (!segment.Finalize())
+    return false;
+
+  writer.Close();
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: mkvparser_benchmark_data <output directory>\n");
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < test::kBenchmarkDataFileCount; ++i) {
+    const test::BenchmarkDataFile& spec = test::kBenchmarkDataFiles[i];
+    if (!WriteFile(std::string(argv[1]) + "/" + spec.name, spec))
+      return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,41 @@
+// Copyright (c) 2026 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+#ifndef LIBWEBM_TESTING_MKVPARSER_BENCHMARK_DATA_H_
+#define LIBWEBM_TESTING_MKVPARSER_BENCHMARK_DATA_H_
+
+#include <stdint.h>
+
+#include <cstddef>
+
+namespace test {
+
+// A synthetic benchmark input: one video and one audio track, muxed at build
+// time by mkvparser_benchmark_data.
+struct BenchmarkDataFile {
+  const char* name;
+  uint64_t duration_s;
+  uint64_t video_fps;
+  std::size_t video_frame_size;
+  std::size_t audio_frame_size;  // 20ms frames
+  uint64_t cluster_ms;  // maximum cluster duration
+  uint64_t keyframe_s;  // video keyframe interval
+};
+
+const BenchmarkDataFile kBenchmarkDataFiles[] = {
+    // Large frames in few clusters.
+    {"synthetic_large_frames.webm", 120, 30, 4096, 160, 2000, 2},
+    // Small frames in many clusters.
+    {"synthetic_many_clusters.webm", 600, 30, 256, 64, 250, 1},
+};
+
+const std::size_t kBenchmarkDataFileCount =
+    sizeof(kBenchmarkDataFiles) / sizeof(kBenchmarkDataFiles[0]);
+
+}  // namespace test
+
+#endif  // LIBWEBM_TESTING_MKVPARSER_BENCHMARK_DATA_H_
@@ -0,0 +1,493 @@
+// Copyright (c) 2026 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+// Benchmarks of the mkvparser hot paths, over the files in
+// LIBWEBM_TEST_DATA_PATH and the synthetic files in
+// LIBWEBM_BENCHMARK_DATA_PATH (by default the directory they were generated
+// in at build time). Each benchmark reports the bytes or items it processes
+// per second and the heap allocations it makes per iteration.
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+
+#include "benchmark/benchmark.h"
+
+#include "mkvparser/mkvparser.h"
+#include "mkvparser/mkvreader.h"
+#include "testing/mkvparser_benchmark_data.h"
+#include "testing/test_util.h"
+
+namespace {
+
+std::atomic<long long> g_allocations(0);
+std::atomic<long long> g_allocated_bytes(0);
+
+void* CountedAlloc(std::size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  g_allocated_bytes.fetch_add(static_cast<long long>(size),
+                              std::memory_order_relaxed);
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  void* const p = CountedAlloc(size);
+  if (p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[](std::size_t size) {
+  void* const p = CountedAlloc(size);
+  if (p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return CountedAlloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return CountedAlloc(size);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+
+namespace {
+
+const char* const kTestDataFiles[] = {
+    "bbb_480p_vp9_opus_1second.webm",
+    "test_stereo_left_right.webm",
+};
+
+enum ReaderType { kFileReader, kMmapReader };
+
+const char* const kReaderNames[] = {"file", "mmap"};
+
+// Counts the allocations made between construction and Stop().
+class AllocationCounter {
+ public:
+  AllocationCounter()
+      : allocations_(g_allocations.load()),
+        bytes_(g_allocated_bytes.load()) {}
+
+  void Stop(long long& allocations, long long& bytes) const {
+    allocations += g_allocations.load() - allocations_;
+    bytes += g_allocated_bytes.load() - bytes_;
+  }
+
+ private:
+  const long long allocations_;
+  const long long bytes_;
+};
+
+void ReportAllocations(benchmark::State& state, long long allocations,
+                       long long bytes) {
+  state.counters["allocs"] =
+      benchmark::Counter(static_cast<double>(allocations),
+                         benchmark::Counter::kAvgIterations);
+  state.counters["alloc_bytes"] = benchmark::Counter(
+      static_cast<double>(bytes), benchmark::Counter::kAvgIterations);
+}
+
+// Counts the bytes that the parser reads or views through |reader|.
+class CountingReader : public mkvparser::IMkvReader {
+ public:
+  explicit CountingReader(mkvparser::IMkvReader* reader)
+      : reader_(reader), bytes_read_(0) {}
+  virtual ~CountingReader() {}
+
+  virtual int Read(long long pos, long len, unsigned char* buf) {
+    bytes_read_ += len;
+    return reader_->Read(pos, len, buf);
+  }
+
+  virtual int Length(long long* total, long long* available) {
+    return reader_->Length(total, available);
+  }
+
+  virtual const unsigned char* GetView(long long pos, long len) {
+    const unsigned char* const view = reader_->GetView(pos, len);
+    if (view != NULL)
+      bytes_read_ += len;
+    return view;
+  }
+
+  long long bytes_read() const { return bytes_read_; }
+  void ResetBytesRead() { bytes_read_ = 0; }
+
+ private:
+  mkvparser::IMkvReader* const reader_;
+  long long bytes_read_;
+};
+
+// Opens |path| with the reader selected by |type|. Reads go through a
+// CountingReader so that benchmarks can report the bytes actually touched.
+class Reader {
+ public:
+  Reader(const std::string& path, ReaderType type)
+      : counting_(type == kMmapReader ?
+                      static_cast<mkvparser::IMkvReader*>(&mmap_) :
+                      static_cast<mkvparser::IMkvReader*>(&file_)) {
+    ok_ = (type == kMmapReader) ? mmap_.Open(path.c_str()) == 0 :
+                                  file_.Open(path.c_str()) == 0;
+  }
+
+  bool ok() const { return ok_; }
+
+  CountingReader* get() { return &counting_; }
+
+  long long length() {
+    long long total = 0;
+    long long available = 0;
+    get()->Length(&total, &available);
+    return total;
+  }
+
+ private:
+  mkvparser::MkvReader file_;
+  mkvparser::MmapMkvReader mmap_;
+  CountingReader counting_;
+  bool ok_;
+};
+
+// Creates the segment of |reader| and parses its headers. Loads all of its
+// clusters too if |load| is true.
+std::unique_ptr<mkvparser::Segment> OpenSegment(mkvparser::IMkvReader* reader,
+                                                bool load) {
+  long long pos = 0;
+  mkvparser::EBMLHeader ebml_header;
+  if (ebml_header.Parse(reader, pos) < 0)
+    return nullptr;
+
+  mkvparser::Segment* segment = NULL;
+  if (mkvparser::Segment::CreateInstance(reader, pos, segment) != 0)
+    return nullptr;
+
+  std::unique_ptr<mkvparser::Segment> result(segment);
+  const long status = load ? segment->Load() : segment->ParseHeaders();
+  if (status < 0)
+    return nullptr;
+
+  return result;
+}
+
+const mkvparser::Track* FindVideoTrack(const mkvparser::Segment* segment) {
+  const mkvparser::Tracks* const tracks = segment->GetTracks();
+
+  for (unsigned long i = 0; i < tracks->GetTracksCount(); ++i) {
+    const mkvparser::Track* const track = tracks->GetTrackByIndex(i);
+    if (track != NULL && track->GetType() == mkvparser::Track::kVideo)
+      return track;
+  }
+
+  return NULL;
+}
+
+// The times at which the lookup benchmarks seek, spread over the segment.
+const int kSeekCount = 64;
+
+long long SeekTime(const mkvparser::Segment* segment, int i) {
+  const long long duration = segment->GetDuration();
+  return (duration > 0) ? duration * ((i * 37) % kSeekCount) / kSeekCount : 0;
+}
+
+void BM_EBMLHeaderParse(benchmark::State& state, const std::string& path) {
+  Reader reader(path, kFileReader);
+  if (!reader.ok()) {
+    state.SkipWithError("cannot open input");
+    return;
+  }
+
+  long long allocations = 0;
+  long long bytes = 0;
+  long long pos = 0;
+
+  for (auto _ : state) {
+    AllocationCounter counter;
+    mkvparser::EBMLHeader ebml_header;
+    pos = 0;
+    if (ebml_header.Parse(reader.get(), pos) < 0) {
+      state.SkipWithError("EBMLHeader::Parse() failed");
+      break;
+    }
+    counter.Stop(allocations, bytes);
+  }
+
+  state.SetBytesProcessed(state.iterations() * pos);
+  ReportAllocations(state, allocations, bytes);
+}
+
+void BM_ParseHeaders(benchmark::State& state, const std::string& path) {
+  Reader reader(path, kFileReader);
+  if (!reader.ok()) {
+    state.SkipWithError("cannot open input");
+    return;
+  }
+
+  // The headers span the file up to the first cluster.
+  long long header_bytes = reader.length();
+  {
+    std::unique_ptr<mkvparser::Segment> segment =
+        OpenSegment(reader.get(), true);
+    if (segment && !segment->GetFirst()->EOS())
+      header_bytes = segment->GetFirst()->m_element_start;
+  }
+
+  long long allocations = 0;
+  long long bytes = 0;
+
+  for (auto _ : state) {
+    AllocationCounter counter;
+    if (!OpenSegment(reader.get(), false)) {
+      state.SkipWithError("Segment::ParseHeaders() failed");
+      break;
+    }
+    counter.Stop(allocations, bytes);
+  }
+
+  state.SetBytesProcessed(state.iterations() * header_bytes);
+  ReportAllocations(state, allocations, bytes);
+}
+
+void BM_SegmentLoad(benchmark::State& state, const std::string& path,
+                    ReaderType type) {
+  Reader reader(path, type);
+  if (!reader.ok()) {
+    state.SkipWithError("cannot open input");
+    return;
+  }
+
+  long long allocations = 0;
+  long long bytes = 0;
+
+  // Load() reads the cluster headers, not the whole file.
+  reader.get()->ResetBytesRead();
+
+  for (auto _ : state) {
+    AllocationCounter counter;
+    if (!OpenSegment(reader.get(), true)) {
+      state.SkipWithError("Segment::Load() failed");
+      break;
+    }
+    counter.Stop(allocations, bytes);
+  }
+
+  state.SetBytesProcessed(reader.get()->bytes_read());
+  ReportAllocations(state, allocations, bytes);
+}
+
+// Parses the blocks of every cluster of a freshly loaded segment.
+void BM_ClusterParse(benchmark::State& state, const std::string& path,
+                     ReaderType type) {
+  Reader reader(path, type);
+  if (!reader.ok()) {
+    state.SkipWithError("cannot open input");
+    return;
+  }
+
+  long long allocations = 0;
+  long long bytes = 0;
+  long long clusters = 0;
+  long long bytes_read = 0;
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::unique_ptr<mkvparser::Segment> segment =
+        OpenSegment(reader.get(), true);
+    reader.get()->ResetBytesRead();
+    state.ResumeTiming();
+
+    if (!segment) {
+      state.SkipWithError("Segment::Load() failed");
+      break;
+    }
+
+    AllocationCounter counter;
+    for (const mkvparser::Cluster* cluster = segment->GetFirst();
+         !cluster->EOS(); cluster = segment->GetNext(cluster)) {
+      long long pos;
+      long len;
+      long status;
+
+      do {
+        status = cluster->Parse(pos, len);
+      } while (status == 0);
+
+      if (status < 0) {
+        state.SkipWithError("Cluster::Parse() failed");
+        break;
+      }
+      ++clusters;
+    }
+    counter.Stop(allocations, bytes);
+    bytes_read += reader.get()->bytes_read();
+
+    state.PauseTiming();
+    segment.reset();
+    state.ResumeTiming();
+  }
+
+  state.SetBytesProcessed(bytes_read);
+  state.SetItemsProcessed(clusters);
+  ReportAllocations(state, allocations, bytes);
+}
+
+void BM_CuesFind(benchmark::State& state, const std::string& path) {
+  Reader reader(path, kMmapReader);
+  std::unique_ptr<mkvparser::Segment> segment;
+  if (reader.ok())
+    segment = OpenSegment(reader.get(), true);
+
+  const mkvparser::Track* const track =
+      segment ? FindVideoTrack(segment.get()) : NULL;
+  const mkvparser::Cues* const cues = segment ? segment->GetCues() : NULL;
+
+  if (track == NULL || cues == NULL) {
+    state.SkipWithError("no cued video track");
+    return;
+  }
+
+  while (!cues->DoneParsing())
+    cues->LoadCuePoint();
+
+  long long allocations = 0;
+  long long bytes = 0;
+
+  for (auto _ : state) {
+    AllocationCounter counter;
+    for (int i = 0; i < kSeekCount; ++i) {
+      const mkvparser::CuePoint* cue_point = NULL;
+      const mkvparser::CuePoint::TrackPosition* track_position = NULL;
+      cues->Find(SeekTime(segment.get(), i), track, cue_point,
+                 track_position);
+      benchmark::DoNotOptimize(track_position);
+    }
+    counter.Stop(allocations, bytes);
+  }
+
+  state.SetItemsProcessed(state.iterations() * kSeekCount);
+  ReportAllocations(state, allocations, bytes);
+}
+
+void BM_TrackSeek(benchmark::State& state, const std::string& path) {
+  Reader reader(path, kMmapReader);
+  std::unique_ptr<mkvparser::Segment> segment;
+  if (reader.ok())
+    segment = OpenSegment(reader.get(), true);
+
+  const mkvparser::Track* const track =
+      segment ? FindVideoTrack(segment.get()) : NULL;
+
+  if (track == NULL) {
+    state.SkipWithError("no video track");
+    return;
+  }
+
+  long long allocations = 0;
+  long long bytes = 0;
+
+  for (auto _ : state) {
+    AllocationCounter counter;
+    for (int i = 0; i < kSeekCount; ++i) {
+      const mkvparser::BlockEntry* entry = NULL;
+      if (track->Seek(SeekTime(segment.get(), i), entry) < 0) {
+        state.SkipWithError("Track::Seek() failed");
+        break;
+      }
+      benchmark::DoNotOptimize(entry);
+    }
+    counter.Stop(allocations, bytes);
+  }
+
+  state.SetItemsProcessed(state.iterations() * kSeekCount);
+  ReportAllocations(state, allocations, bytes);
+}
+
+void RegisterFile(const std::string& name, const std::string& path) {
+  FILE* const file = std::fopen(path.c_str(), "rb");
+  if (file == NULL) {
+    std::fprintf(stderr, "Skipping missing input %s\n", path.c_str());
+    return;
+  }
+  std::fclose(file);
+
+  benchmark::RegisterBenchmark(
+      ("EBMLHeaderParse/" + name).c_str(),
+      [path](benchmark::State& state) { BM_EBMLHeaderParse(state, path); });
+  benchmark::RegisterBenchmark(
+      ("ParseHeaders/" + name).c_str(),
+      [path](benchmark::State& state) { BM_ParseHeaders(state, path); });
+
+  for (int type = kFileReader; type <= kMmapReader; ++type) {
+    const ReaderType reader_type = static_cast<ReaderType>(type);
+    const std::string suffix = name + "/" + kReaderNames[type];
+
+    benchmark::RegisterBenchmark(
+        ("SegmentLoad/" + suffix).c_str(),
+        [path, reader_type](benchmark::State& state) {
+          BM_SegmentLoad(state, path, reader_type);
+        });
+    benchmark::RegisterBenchmark(
+        ("ClusterParse/" + suffix).c_str(),
+        [path, reader_type](benchmark::State& state) {
+          BM_ClusterParse(state, path, reader_type);
+        });
+  }
+
+  benchmark::RegisterBenchmark(
+      ("CuesFind/" + name).c_str(),
+      [path](benchmark::State& state) { BM_CuesFind(state, path); });
+  benchmark::RegisterBenchmark(
+      ("TrackSeek/" + name).c_str(),
+      [path](benchmark::State& state) { BM_TrackSeek(state, path); });
+}
+
+std::string GetBenchmarkDataDir() {
+  const char* const path = std::getenv("LIBWEBM_BENCHMARK_DATA_PATH");
+  if (path != NULL)
+    return path;
+#ifdef LIBWEBM_BENCHMARK_DATA_DIR
+  return LIBWEBM_BENCHMARK_DATA_DIR;
+#else
+  return ".";
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return EXIT_FAILURE;
+
+  if (!test::GetTestDataDir().empty()) {
+    for (const char* name : kTestDataFiles)
+      RegisterFile(name, test::GetTestFilePath(name));
+  } else {
+    std::fprintf(stderr,
+                 "LIBWEBM_TEST_DATA_PATH is not set; "
+                 "benchmarking synthetic inputs only.\n");
+  }
+
+  const std::string data_dir = GetBenchmarkDataDir();
+  for (std::size_t i = 0; i < test::kBenchmarkDataFileCount; ++i) {
+    const char* const name = test::kBenchmarkDataFiles[i].name;
+    RegisterFile(name, data_dir + "/" + name);
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return EXIT_SUCCESS;
+}
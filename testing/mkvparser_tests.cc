@@ -7,16 +7,27 @@
 // be found in the AUTHORS file in the root of the source tree.
 #include "gtest/gtest.h"
 
+#include <algorithm>
 #include <array>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <functional>
 #include <iomanip>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "common/file_util.h"
 #include "common/hdr_util.h"
+#include "mkvmuxer/mkvmuxer.h"
+#include "mkvmuxer/mkvwriter.h"
 #include "mkvparser/mkvparser.h"
 #include "mkvparser/mkvreader.h"
+#include "mkvparser/prefetchingmkvreader.h"
 #include "testing/test_util.h"
 
 using mkvparser::AudioTrack;
@@ -35,6 +46,34 @@ using mkvparser::VideoTrack;
 
 namespace test {
 
+// Adds a video track with a frame every 40ms and a keyframe every second, and
+// an audio track with a frame every 20ms, to |muxer|. Frames carry their
+// timestamp in their first bytes. Clusters are cut every |cluster_ms|.
+bool AddAudioVideoFrames(mkvmuxer::Segment* muxer, int duration_ms,
+                         int cluster_ms) {
+  if (muxer->AddVideoTrack(kWidth, kHeight, kVideoTrackNumber) == 0 ||
+      muxer->AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber) == 0) {
+    return false;
+  }
+  const std::uint64_t kMs = 1000000;
+  muxer->set_max_cluster_duration(cluster_ms * kMs);
+  for (int ms = 0; ms < duration_ms; ms += 20) {
+    std::uint8_t data[kFrameLength] = {0};
+    memcpy(data, &ms, sizeof(ms));
+    if (ms % 40 == 0 &&
+        !muxer->AddFrame(data, kFrameLength, kVideoTrackNumber, ms * kMs,
+                         ms % 1000 == 0)) {
+      return false;
+    }
+    data[kFrameLength - 1] = 1;
+    if (!muxer->AddFrame(data, kFrameLength, kAudioTrackNumber, ms * kMs,
+                         true)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // Base class containing boiler plate stuff.
 class ParserTest : public testing::Test {
  public:
@@ -49,6 +88,8 @@ class ParserTest : public testing::Test {
       delete segment_;
       segment_ = NULL;
     }
+    if (!temp_filename_.empty())
+      remove(temp_filename_.c_str());
   }
 
   void CloseReader() {
@@ -84,6 +125,58 @@ class ParserTest : public testing::Test {
     return CreateAndLoadSegment(filename, 4);
   }
 
+  // Muxes a temporary file, with |add_frames| adding the tracks and frames to
+  // an initialized muxer segment, then opens and loads it.
+  bool CreateAndLoadMuxedSegment(
+      const std::function<bool(mkvmuxer::Segment*)>& add_frames) {
+    temp_filename_ = libwebm::GetTempFileName();
+    {
+      mkvmuxer::MkvWriter writer;
+      if (!writer.Open(temp_filename_.c_str()))
+        return false;
+      mkvmuxer::Segment muxer_segment;
+      if (!muxer_segment.Init(&writer) || !add_frames(&muxer_segment) ||
+          !muxer_segment.Finalize()) {
+        return false;
+      }
+      writer.Close();
+    }
+    filename_ = temp_filename_;
+    if (reader_.Open(filename_.c_str()))
+      return false;
+    is_reader_open_ = true;
+    pos_ = 0;
+    mkvparser::EBMLHeader ebml_header;
+    if (ebml_header.Parse(&reader_, pos_) < 0)
+      return false;
+    if (Segment::CreateInstance(&reader_, pos_, segment_))
+      return false;
+    return segment_->Load() >= 0;
+  }
+
+  // Walks every block of every cluster and returns, for each, its track
+  // number, time and payload.
+  std::vector<std::string> WalkBlocks() {
+    std::vector<std::string> blocks;
+    for (const Cluster* cluster = segment_->GetFirst();
+         cluster != NULL && !cluster->EOS();
+         cluster = segment_->GetNext(cluster)) {
+      const BlockEntry* block_entry = NULL;
+      EXPECT_EQ(0, cluster->GetFirst(block_entry));
+      while (block_entry != NULL) {
+        const Block* const block = block_entry->GetBlock();
+        const Block::Frame& frame = block->GetFrame(0);
+        std::string data(static_cast<size_t>(frame.len), '\0');
+        EXPECT_EQ(0, frame.Read(segment_->m_pReader,
+                                reinterpret_cast<unsigned char*>(&data[0])));
+        blocks.push_back(std::to_string(block->GetTrackNumber()) + "@" +
+                         std::to_string(block->GetTime(cluster)) + ":" + data);
+        EXPECT_EQ(0, cluster->GetNext(block_entry, block_entry));
+      }
+    }
+    return blocks;
+  }
+
   void CreateSegmentNoHeaderChecks(const std::string& filename) {
     filename_ = GetTestFilePath(filename);
     ASSERT_NE(0u, filename_.length());
@@ -125,6 +218,7 @@ class ParserTest : public testing::Test {
   bool is_reader_open_;
   Segment* segment_;
   std::string filename_;
+  std::string temp_filename_;
   long long pos_;
   std::uint8_t dummy_data_[kFrameLength];
   std::uint8_t gold_frame_[kFrameLength];
@@ -815,6 +909,1444 @@ TEST_F(ParserTest, InvalidPrimaryChromaticityParseFail) {
   EXPECT_EQ(mkvparser::E_FILE_FORMAT_INVALID, segment_->Load());
 }
 
+TEST_F(ParserTest, CachedReader) {
+  filename_ = GetTestFilePath("bbb_480p_vp9_opus_1second.webm");
+  ASSERT_EQ(0, reader_.Open(filename_.c_str()));
+  is_reader_open_ = true;
+
+  // Small pages so that walking the file forces evictions.
+  mkvparser::CachedMkvReader cached_reader(&reader_, 512, 4);
+  EXPECT_EQ(512, cached_reader.GetPageSize());
+  EXPECT_EQ(4, cached_reader.GetPageCount());
+
+  long long total, available;
+  ASSERT_EQ(0, cached_reader.Length(&total, &available));
+  std::vector<unsigned char> direct(static_cast<size_t>(total));
+  ASSERT_EQ(0, reader_.Read(0, static_cast<long>(total), &direct[0]));
+
+  pos_ = 0;
+  mkvparser::EBMLHeader ebml_header;
+  ASSERT_EQ(0, ebml_header.Parse(&cached_reader, pos_));
+  ASSERT_EQ(0, Segment::CreateInstance(&cached_reader, pos_, segment_));
+  ASSERT_EQ(0, segment_->Load());
+
+  int block_count = 0;
+  std::vector<unsigned char> frame_data;
+  const Cluster* cluster = segment_->GetFirst();
+  while (cluster != NULL && !cluster->EOS()) {
+    const BlockEntry* block_entry = NULL;
+    ASSERT_EQ(0, cluster->GetFirst(block_entry));
+    while (block_entry != NULL && !block_entry->EOS()) {
+      const Block* const block = block_entry->GetBlock();
+      for (int i = 0; i < block->GetFrameCount(); ++i) {
+        const Block::Frame& frame = block->GetFrame(i);
+        frame_data.resize(static_cast<size_t>(frame.len));
+        ASSERT_EQ(0, frame.Read(&cached_reader, &frame_data[0]));
+        EXPECT_EQ(0, memcmp(&direct[static_cast<size_t>(frame.pos)],
+                            &frame_data[0], frame_data.size()));
+      }
+      ++block_count;
+      ASSERT_EQ(0, cluster->GetNext(block_entry, block_entry));
+    }
+    cluster = segment_->GetNext(cluster);
+  }
+  EXPECT_GT(block_count, 0);
+
+  // Most lookups should be served from the cache.
+  EXPECT_GT(cached_reader.GetMissCount(), 0);
+  EXPECT_GT(cached_reader.GetHitCount(), cached_reader.GetMissCount());
+
+  // Reads that straddle a page boundary, and reads past the end of the file.
+  unsigned char buf[600];
+  ASSERT_EQ(0, cached_reader.Read(500, 600, buf));
+  EXPECT_EQ(0, memcmp(&direct[500], buf, 600));
+  EXPECT_NE(0, cached_reader.Read(total - 1, 2, buf));
+  ASSERT_EQ(0, cached_reader.Read(total - 1, 1, buf));
+  EXPECT_EQ(direct[static_cast<size_t>(total - 1)], buf[0]);
+}
+
+TEST_F(ParserTest, MmapReader) {
+  filename_ = GetTestFilePath("bbb_480p_vp9_opus_1second.webm");
+  ASSERT_EQ(0, reader_.Open(filename_.c_str()));
+  is_reader_open_ = true;
+
+  mkvparser::MmapMkvReader mmap_reader;
+  ASSERT_EQ(0, mmap_reader.Open(filename_.c_str()));
+  EXPECT_NE(0, mmap_reader.Open(filename_.c_str()));
+
+  long long total, available;
+  ASSERT_EQ(0, mmap_reader.Length(&total, &available));
+  long long file_total;
+  ASSERT_EQ(0, reader_.Length(&file_total, NULL));
+  EXPECT_EQ(file_total, total);
+  EXPECT_EQ(total, available);
+  EXPECT_TRUE(mmap_reader.GetView(total - 1, 2) == NULL);
+  EXPECT_TRUE(reader_.GetView(0, 1) == NULL);
+
+  pos_ = 0;
+  mkvparser::EBMLHeader ebml_header;
+  ASSERT_EQ(0, ebml_header.Parse(&mmap_reader, pos_));
+  ASSERT_EQ(0, Segment::CreateInstance(&mmap_reader, pos_, segment_));
+  ASSERT_EQ(0, segment_->Load());
+
+  int frame_count = 0;
+  std::vector<unsigned char> expected;
+  std::vector<unsigned char> scratch;
+  const Cluster* cluster = segment_->GetFirst();
+  while (cluster != NULL && !cluster->EOS()) {
+    const BlockEntry* block_entry = NULL;
+    ASSERT_EQ(0, cluster->GetFirst(block_entry));
+    while (block_entry != NULL && !block_entry->EOS()) {
+      const Block* const block = block_entry->GetBlock();
+      for (int i = 0; i < block->GetFrameCount(); ++i) {
+        const Block::Frame& frame = block->GetFrame(i);
+        expected.resize(static_cast<size_t>(frame.len));
+        ASSERT_EQ(0, frame.Read(&reader_, &expected[0]));
+
+        const unsigned char* const view = frame.GetView(&mmap_reader);
+        ASSERT_TRUE(view != NULL);
+        EXPECT_EQ(0, memcmp(&expected[0], view, expected.size()));
+
+        // Zero-copy through the mapping, copy through the file reader.
+        const unsigned char* data = NULL;
+        ASSERT_EQ(0, frame.Read(&mmap_reader, NULL, data));
+        EXPECT_EQ(view, data);
+        scratch.resize(expected.size());
+        ASSERT_EQ(0, frame.Read(&reader_, &scratch[0], data));
+        EXPECT_EQ(&scratch[0], data);
+        EXPECT_EQ(0, memcmp(&expected[0], data, expected.size()));
+        ++frame_count;
+      }
+      ASSERT_EQ(0, cluster->GetNext(block_entry, block_entry));
+    }
+    cluster = segment_->GetNext(cluster);
+  }
+  EXPECT_GT(frame_count, 0);
+}
+
+// IMkvReader over a memory buffer. |available| bytes are readable, the rest
+// are reported as not yet arrived.
+class MemoryReader : public mkvparser::IMkvReader {
+ public:
+  MemoryReader(const std::vector<unsigned char>& data, long long available)
+      : data_(data), available_(available) {}
+  virtual ~MemoryReader() {}
+
+  virtual int Read(long long pos, long len, unsigned char* buf) {
+    if (pos < 0 || len < 0 || pos + len > available_)
+      return -1;
+    if (len > 0)
+      memcpy(buf, &data_[static_cast<size_t>(pos)], len);
+    return 0;
+  }
+
+  virtual int Length(long long* total, long long* available) {
+    if (total)
+      *total = static_cast<long long>(data_.size());
+    if (available)
+      *available = available_;
+    return 0;
+  }
+
+ private:
+  const std::vector<unsigned char>& data_;
+  const long long available_;
+};
+
+TEST_F(ParserTest, CuesFindWhileLoading) {
+  // Audio cues are added by hand, the one for 0.5s after the one for 1.5s.
+  const long long kMs = 1000000;
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([&](mkvmuxer::Segment* muxer) {
+    if (muxer->AddVideoTrack(kWidth, kHeight, kVideoTrackNumber) == 0 ||
+        muxer->AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber) == 0) {
+      return false;
+    }
+    const std::uint8_t data[kFrameLength] = {0};
+    for (long long t = 0; t <= 3000 * kMs; t += 100 * kMs) {
+      if (t % (500 * kMs) == 0 &&
+          !muxer->AddFrame(data, kFrameLength, kVideoTrackNumber, t,
+                           t % (1000 * kMs) == 0)) {
+        return false;
+      }
+      if (!muxer->AddFrame(data, kFrameLength, kAudioTrackNumber, t, true))
+        return false;
+      if (t == 1500 * kMs && !muxer->AddCuePoint(t, kAudioTrackNumber))
+        return false;
+      if (t == 2000 * kMs && !muxer->AddCuePoint(500 * kMs, kAudioTrackNumber))
+        return false;
+    }
+    return true;
+  }));
+
+  const Cues* const cues = segment_->GetCues();
+  ASSERT_TRUE(cues != NULL);
+  const Track* const video =
+      segment_->GetTracks()->GetTrackByNumber(kVideoTrackNumber);
+  const Track* const audio =
+      segment_->GetTracks()->GetTrackByNumber(kAudioTrackNumber);
+  ASSERT_TRUE(video != NULL);
+  ASSERT_TRUE(audio != NULL);
+
+  const CuePoint* cue_point = NULL;
+  const CuePoint::TrackPosition* track_position = NULL;
+
+  // Each search sees the cue points loaded so far.
+  while (!cues->DoneParsing()) {
+    cues->LoadCuePoint();
+    const CuePoint* const last = cues->GetLast();
+    ASSERT_TRUE(last != NULL);
+    if (last->Find(video) != NULL) {
+      ASSERT_TRUE(cues->Find(last->GetTime(segment_), video, cue_point,
+                             track_position));
+      EXPECT_EQ(last, cue_point);
+    }
+  }
+
+  ASSERT_TRUE(cues->Find(0, audio, cue_point, track_position));
+  EXPECT_EQ(500 * kMs, cue_point->GetTime(segment_));
+  ASSERT_TRUE(cues->Find(1499 * kMs, audio, cue_point, track_position));
+  EXPECT_EQ(500 * kMs, cue_point->GetTime(segment_));
+  ASSERT_TRUE(cues->Find(2500 * kMs, audio, cue_point, track_position));
+  EXPECT_EQ(1500 * kMs, cue_point->GetTime(segment_));
+  ASSERT_TRUE(cues->FindNext(600 * kMs, audio, cue_point, track_position));
+  EXPECT_EQ(1500 * kMs, cue_point->GetTime(segment_));
+  ASSERT_TRUE(cues->Find(2500 * kMs, video, cue_point, track_position));
+  EXPECT_EQ(2000 * kMs, cue_point->GetTime(segment_));
+}
+
+TEST(ParserVarIntTest, FastAndByteWisePathsAgree) {
+  // Var-ints of every length, followed by enough padding for the 8 byte
+  // fast path; the same values at the very end of the buffer take the
+  // byte-wise path.
+  const unsigned long long kValues[8] = {
+      0x7e, 0x3ffe, 0x1ffffe, 0x0ffffffe, 0x07fffffffeULL,
+      0x03fffffffffeULL, 0x01fffffffffffeULL, 0x00fffffffffffffeULL};
+
+  for (int size = 1; size <= 8; ++size) {
+    std::vector<unsigned char> encoded(size);
+    const unsigned long long value = kValues[size - 1];
+    for (int i = 0; i < size; ++i)
+      encoded[i] = static_cast<unsigned char>(value >> (8 * (size - 1 - i)));
+    encoded[0] |= static_cast<unsigned char>(0x80 >> (size - 1));
+
+    std::vector<unsigned char> data(encoded);
+    data.resize(16, 0xff);
+    data.insert(data.end(), encoded.begin(), encoded.end());
+    const long long tail = static_cast<long long>(data.size()) - size;
+
+    MemoryReader reader(data, static_cast<long long>(data.size()));
+    long len = 0;
+    EXPECT_EQ(static_cast<long long>(value),
+              mkvparser::ReadUInt(&reader, 0, len));
+    EXPECT_EQ(size, len);
+    EXPECT_EQ(static_cast<long long>(value),
+              mkvparser::ReadUInt(&reader, tail, len));
+    EXPECT_EQ(size, len);
+
+    EXPECT_EQ(0, mkvparser::GetUIntLength(&reader, tail, len));
+    EXPECT_EQ(size, len);
+
+    if (size <= 4) {
+      const long long id = static_cast<long long>(
+          mkvparser::UnserializeUInt(&reader, 0, size));
+      EXPECT_EQ(id, mkvparser::ReadID(&reader, 0, len));
+      EXPECT_EQ(size, len);
+      EXPECT_EQ(id, mkvparser::ReadID(&reader, tail, len));
+      EXPECT_EQ(size, len);
+    }
+
+    // Truncated by the end of the available data.
+    MemoryReader partial(data, static_cast<long long>(data.size()) - 1);
+    if (size > 1) {
+      EXPECT_LT(mkvparser::ReadUInt(&partial, tail, len), 0);
+    }
+  }
+
+  std::vector<unsigned char> data(16, 0);
+  data[0] = 0x08;  // 5 byte IDs are not allowed
+  MemoryReader reader(data, static_cast<long long>(data.size()));
+  long len = 0;
+  EXPECT_EQ(mkvparser::E_FILE_FORMAT_INVALID,
+            mkvparser::ReadID(&reader, 0, len));
+  EXPECT_EQ(mkvparser::E_FILE_FORMAT_INVALID,
+            mkvparser::ReadUInt(&reader, 1, len));
+
+  long long signed_value = 0;
+  data[0] = 0xfe;
+  data[1] = 0x01;
+  EXPECT_EQ(0, mkvparser::UnserializeInt(&reader, 0, 2, signed_value));
+  EXPECT_EQ(-511, signed_value);
+}
+
+TEST_F(ParserTest, CuesFindPerTrack) {
+  // Video cues every second come from the muxer; a single audio cue at 1.5s
+  // is added by hand, on a cue point of its own.
+  const long long kMs = 1000000;
+  const long long kAudioCueTime = 1500 * kMs;
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([&](mkvmuxer::Segment* muxer) {
+    if (muxer->AddVideoTrack(kWidth, kHeight, kVideoTrackNumber) == 0 ||
+        muxer->AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber) == 0) {
+      return false;
+    }
+    const std::uint8_t data[kFrameLength] = {0};
+    for (long long t = 0; t <= 3000 * kMs; t += 100 * kMs) {
+      if (t % (500 * kMs) == 0 &&
+          !muxer->AddFrame(data, kFrameLength, kVideoTrackNumber, t,
+                           t % (1000 * kMs) == 0)) {
+        return false;
+      }
+      if (!muxer->AddFrame(data, kFrameLength, kAudioTrackNumber, t, true))
+        return false;
+      if (t == kAudioCueTime && !muxer->AddCuePoint(t, kAudioTrackNumber))
+        return false;
+    }
+    return true;
+  }));
+
+  const Cues* const cues = segment_->GetCues();
+  ASSERT_TRUE(cues != NULL);
+  while (!cues->DoneParsing())
+    cues->LoadCuePoint();
+
+  const Track* const video =
+      segment_->GetTracks()->GetTrackByNumber(kVideoTrackNumber);
+  const Track* const audio =
+      segment_->GetTracks()->GetTrackByNumber(kAudioTrackNumber);
+  ASSERT_TRUE(video != NULL);
+  ASSERT_TRUE(audio != NULL);
+
+  const CuePoint* cue_point = NULL;
+  const CuePoint::TrackPosition* track_position = NULL;
+
+  // The latest cue point at 2.5s is a video one; the audio track must still
+  // find its own, earlier, cue point.
+  ASSERT_TRUE(cues->Find(2500 * kMs, audio, cue_point, track_position));
+  EXPECT_EQ(kAudioCueTime, cue_point->GetTime(segment_));
+  EXPECT_EQ(kAudioTrackNumber, track_position->m_track);
+
+  ASSERT_TRUE(cues->Find(2500 * kMs, video, cue_point, track_position));
+  EXPECT_EQ(2000 * kMs, cue_point->GetTime(segment_));
+  EXPECT_EQ(kVideoTrackNumber, track_position->m_track);
+
+  // Before the first cue point of a track, that cue point is returned.
+  ASSERT_TRUE(cues->Find(0, audio, cue_point, track_position));
+  EXPECT_EQ(kAudioCueTime, cue_point->GetTime(segment_));
+
+  ASSERT_TRUE(cues->Find(1999 * kMs, video, cue_point, track_position));
+  EXPECT_EQ(1000 * kMs, cue_point->GetTime(segment_));
+  ASSERT_TRUE(cues->Find(5000 * kMs, video, cue_point, track_position));
+  EXPECT_EQ(3000 * kMs, cue_point->GetTime(segment_));
+
+  const BlockEntry* const block_entry =
+      cues->GetBlock(cue_point, track_position);
+  ASSERT_TRUE(block_entry != NULL);
+  EXPECT_EQ(3000 * kMs, block_entry->GetBlock()->GetTime(
+                            segment_->FindCluster(3000 * kMs)));
+}
+
+TEST_F(ParserTest, PerTrackBlockIndex) {
+  // Two seconds of interleaved audio and video in few clusters.
+  const long long kMs = 1000000;
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([&](mkvmuxer::Segment* muxer) {
+    if (muxer->AddVideoTrack(kWidth, kHeight, kVideoTrackNumber) == 0 ||
+        muxer->AddAudioTrack(kSampleRate, kChannels, kAudioTrackNumber) == 0) {
+      return false;
+    }
+    const std::uint8_t data[kFrameLength] = {0};
+    for (long long t = 0; t < 2000 * kMs; t += 10 * kMs) {
+      if (t % (40 * kMs) == 0 &&
+          !muxer->AddFrame(data, kFrameLength, kVideoTrackNumber, t,
+                           t % (1000 * kMs) == 0 || t == 480 * kMs)) {
+        return false;
+      }
+      if (!muxer->AddFrame(data, kFrameLength, kAudioTrackNumber, t, true))
+        return false;
+    }
+    return true;
+  }));
+
+  const Tracks* const tracks = segment_->GetTracks();
+  for (unsigned long i = 0; i < tracks->GetTracksCount(); ++i) {
+    const Track* const track = tracks->GetTrackByIndex(i);
+    ASSERT_TRUE(track != NULL);
+
+    // Every block of the track, found by walking all blocks.
+    std::vector<const BlockEntry*> expected;
+    for (const Cluster* cluster = segment_->GetFirst();
+         cluster != NULL && !cluster->EOS();
+         cluster = segment_->GetNext(cluster)) {
+      const BlockEntry* block_entry = NULL;
+      ASSERT_EQ(0, cluster->GetFirst(block_entry));
+      while (block_entry != NULL) {
+        if (block_entry->GetBlock()->GetTrackNumber() == track->GetNumber())
+          expected.push_back(block_entry);
+        ASSERT_EQ(0, cluster->GetNext(block_entry, block_entry));
+      }
+    }
+    ASSERT_FALSE(expected.empty());
+
+    std::vector<const BlockEntry*> actual;
+    const BlockEntry* block_entry = NULL;
+    ASSERT_EQ(0, track->GetFirst(block_entry));
+    while (!block_entry->EOS()) {
+      actual.push_back(block_entry);
+      ASSERT_GE(track->GetNext(block_entry, block_entry), 0);
+    }
+    EXPECT_TRUE(expected == actual);
+
+    // Time lookups within each cluster match a linear search.
+    for (size_t j = 0; j < expected.size(); ++j) {
+      const Cluster* const cluster = expected[j]->GetCluster();
+      const long long time_ns = expected[j]->GetBlock()->GetTime(cluster) + 1;
+      const BlockEntry* candidate = track->GetEOS();
+      for (size_t k = 0; k < expected.size(); ++k) {
+        if (expected[k]->GetCluster() == cluster &&
+            expected[k]->GetBlock()->GetTime(cluster) <= time_ns &&
+            track->VetEntry(expected[k])) {
+          candidate = expected[k];
+        }
+      }
+      EXPECT_EQ(candidate, cluster->GetEntry(track, time_ns));
+    }
+  }
+}
+
+TEST_F(ParserTest, ClusterEviction) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 10000, 500);
+  }));
+  ASSERT_GE(segment_->GetCount(), 10u);
+
+  // Without a policy everything stays resident.
+  const std::vector<std::string> expected = WalkBlocks();
+  ASSERT_FALSE(expected.empty());
+  Segment::ClusterCacheStats stats = segment_->GetClusterCacheStats();
+  EXPECT_EQ(static_cast<long>(segment_->GetCount()), stats.resident_clusters);
+  EXPECT_EQ(stats.resident_clusters, stats.peak_resident_clusters);
+  EXPECT_GT(stats.resident_bytes, 0);
+  EXPECT_EQ(0, stats.evictions);
+
+  // Enabling a policy trims the clusters already parsed.
+  segment_->SetClusterEvictionPolicy(2, 0);
+  stats = segment_->GetClusterCacheStats();
+  EXPECT_EQ(2, stats.resident_clusters);
+  EXPECT_EQ(static_cast<long long>(segment_->GetCount()) - 2, stats.evictions);
+
+  // Evicted clusters are parsed again on demand, with the same results.
+  EXPECT_TRUE(expected == WalkBlocks());
+  stats = segment_->GetClusterCacheStats();
+  EXPECT_LE(stats.resident_clusters, 2);
+  EXPECT_GT(stats.reparses, 0);
+
+  // A byte budget smaller than one cluster keeps only the current one.
+  segment_->SetClusterEvictionPolicy(0, 1);
+  const long long evictions = segment_->GetClusterCacheStats().evictions;
+  EXPECT_TRUE(expected == WalkBlocks());
+  stats = segment_->GetClusterCacheStats();
+  EXPECT_EQ(1, stats.resident_clusters);
+  EXPECT_GT(stats.evictions, evictions);
+
+  // Turning the policy off stops eviction.
+  segment_->SetClusterEvictionPolicy(0, 0);
+  EXPECT_TRUE(expected == WalkBlocks());
+  EXPECT_EQ(static_cast<long>(segment_->GetCount()),
+            segment_->GetClusterCacheStats().resident_clusters);
+}
+
+TEST_F(ParserTest, ClusterEvictionTrackCursors) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 10000, 500);
+  }));
+  const Tracks* const tracks = segment_->GetTracks();
+  const Track* const video = tracks->GetTrackByNumber(kVideoTrackNumber);
+  const Track* const audio = tracks->GetTrackByNumber(kAudioTrackNumber);
+  ASSERT_TRUE(video != NULL);
+  ASSERT_TRUE(audio != NULL);
+
+  const auto describe = [this](const BlockEntry* block_entry) {
+    const Block* const block = block_entry->GetBlock();
+    const Block::Frame& frame = block->GetFrame(0);
+    std::string data(static_cast<size_t>(frame.len), '\0');
+    EXPECT_EQ(0, frame.Read(segment_->m_pReader,
+                            reinterpret_cast<unsigned char*>(&data[0])));
+    return std::to_string(block->GetTime(block_entry->GetCluster())) + ":" +
+           data;
+  };
+  const auto walk = [&](const Track* track) {
+    std::vector<std::string> blocks;
+    const BlockEntry* block_entry = NULL;
+    EXPECT_EQ(0, track->GetFirst(block_entry));
+    while (block_entry != NULL && !block_entry->EOS()) {
+      blocks.push_back(describe(block_entry));
+      EXPECT_GE(track->GetNext(block_entry, block_entry), 0);
+    }
+    return blocks;
+  };
+  const std::vector<std::string> expected_video = walk(video);
+  const std::vector<std::string> expected_audio = walk(audio);
+  ASSERT_FALSE(expected_video.empty());
+  ASSERT_FALSE(expected_audio.empty());
+
+  // Video runs about four clusters ahead of audio. The clusters between the
+  // two iterators stay resident despite the limit of one.
+  segment_->SetClusterEvictionPolicy(1, 0);
+  const long long evictions = segment_->GetClusterCacheStats().evictions;
+
+  std::vector<std::string> video_blocks;
+  std::vector<std::string> audio_blocks;
+  const BlockEntry* video_entry = NULL;
+  const BlockEntry* audio_entry = NULL;
+  ASSERT_EQ(0, video->GetFirst(video_entry));
+  ASSERT_EQ(0, audio->GetFirst(audio_entry));
+  long max_resident = 0;
+
+  while (!video_entry->EOS() || !audio_entry->EOS()) {
+    if (!video_entry->EOS() &&
+        (audio_entry->EOS() ||
+         video_blocks.size() < audio_blocks.size() / 2 + 50)) {
+      video_blocks.push_back(describe(video_entry));
+      ASSERT_GE(video->GetNext(video_entry, video_entry), 0);
+    } else {
+      audio_blocks.push_back(describe(audio_entry));
+      ASSERT_GE(audio->GetNext(audio_entry, audio_entry), 0);
+    }
+    max_resident = std::max(
+        max_resident, segment_->GetClusterCacheStats().resident_clusters);
+  }
+
+  EXPECT_TRUE(expected_video == video_blocks);
+  EXPECT_TRUE(expected_audio == audio_blocks);
+  EXPECT_GT(segment_->GetClusterCacheStats().evictions, evictions);
+  EXPECT_GT(max_resident, 1);
+  EXPECT_LT(max_resident, static_cast<long>(segment_->GetCount()) / 2);
+}
+
+TEST_F(ParserTest, SidecarIndex) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 5000, 500);
+  }));
+
+  const long long kMs = 1000000;
+  const auto seek_all = [&]() {
+    std::vector<std::string> results;
+    const Track* const track =
+        segment_->GetTracks()->GetTrackByNumber(kVideoTrackNumber);
+    for (long long t = 0; t < 5500 * kMs; t += 130 * kMs) {
+      const BlockEntry* block_entry = NULL;
+      EXPECT_EQ(0, track->Seek(t, block_entry));
+      const Block* const block = block_entry->GetBlock();
+      EXPECT_TRUE(block->IsKey());
+      results.push_back(
+          std::to_string(block->GetTime(block_entry->GetCluster())));
+    }
+    return results;
+  };
+
+  const std::vector<std::string> expected_blocks = WalkBlocks();
+  const std::vector<std::string> expected_seeks = seek_all();
+  const unsigned long count = segment_->GetCount();
+
+  unsigned char* buf = NULL;
+  long long size = 0;
+  ASSERT_EQ(0, segment_->BuildIndex(buf, size));
+  std::unique_ptr<unsigned char[]> index(buf);
+  ASSERT_GT(size, 0);
+
+  // A segment opened with the index needs no cluster scan.
+  delete segment_;
+  segment_ = NULL;
+  ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, segment_));
+  ASSERT_EQ(0, segment_->AttachIndex(index.get(), size));
+  EXPECT_EQ(count, segment_->GetCount());
+  EXPECT_TRUE(segment_->DoneParsing());
+  EXPECT_EQ(0, segment_->Load());
+  EXPECT_TRUE(segment_->GetCues() != NULL);
+  EXPECT_TRUE(expected_seeks == seek_all());
+  EXPECT_TRUE(expected_blocks == WalkBlocks());
+
+  // An index that does not match the file is rejected.
+  std::vector<unsigned char> bad(index.get(), index.get() + size);
+  bad[16] ^= 1;  // file hash
+  Segment* other = NULL;
+  ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, other));
+  EXPECT_EQ(mkvparser::E_FILE_FORMAT_INVALID,
+            other->AttachIndex(&bad[0], size));
+  delete other;
+
+  ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, other));
+  EXPECT_EQ(mkvparser::E_FILE_FORMAT_INVALID,
+            other->AttachIndex(index.get(), size - 1));
+  delete other;
+
+  // An index that fails once some of the headers are parsed leaves the
+  // segment able to parse the file itself.
+  const size_t kHeaderCountOffset = 40;
+  const size_t header_count = bad[kHeaderCountOffset];
+  ASSERT_GE(header_count, 2u);
+  bad = std::vector<unsigned char>(index.get(), index.get() + size);
+  bad[kHeaderCountOffset + 4 + (header_count - 1) * 24] ^= 1;  // last ID
+  ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, other));
+  EXPECT_EQ(mkvparser::E_FILE_FORMAT_INVALID,
+            other->AttachIndex(&bad[0], size));
+  EXPECT_EQ(0, other->ParseHeaders());
+  EXPECT_EQ(0, other->Load());
+  EXPECT_EQ(count, other->GetCount());
+  delete other;
+}
+
+TEST_F(ParserTest, ParallelClusterLoad) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 10000, 250);
+  }));
+  const std::vector<std::string> expected = WalkBlocks();
+  const unsigned long count = segment_->GetCount();
+  ASSERT_GE(count, 20u);
+
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    delete segment_;
+    segment_ = NULL;
+    ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, segment_));
+    ASSERT_EQ(0, segment_->LoadAllClustersParallel(threads));
+    EXPECT_EQ(count, segment_->GetCount());
+    const Segment::ClusterCacheStats stats = segment_->GetClusterCacheStats();
+    EXPECT_EQ(static_cast<long>(count), stats.resident_clusters);
+    EXPECT_EQ(0, stats.reparses);
+    EXPECT_TRUE(expected == WalkBlocks());
+  }
+
+  // An eviction policy is applied once all clusters have been parsed.
+  delete segment_;
+  segment_ = NULL;
+  ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, segment_));
+  segment_->SetClusterEvictionPolicy(3, 0);
+  ASSERT_EQ(0, segment_->LoadAllClustersParallel(4));
+  const Segment::ClusterCacheStats stats = segment_->GetClusterCacheStats();
+  EXPECT_EQ(3, stats.resident_clusters);
+  EXPECT_EQ(static_cast<long long>(count) - 3, stats.evictions);
+  EXPECT_TRUE(expected == WalkBlocks());
+}
+
+TEST_F(ParserTest, FrozenSegmentConcurrentReads) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 10000, 500);
+  }));
+  ASSERT_EQ(0, segment_->Freeze(2));
+  EXPECT_TRUE(segment_->IsFrozen());
+
+  // Eviction cannot be turned back on.
+  segment_->SetClusterEvictionPolicy(0, 1);
+  EXPECT_EQ(static_cast<long>(segment_->GetCount()),
+            segment_->GetClusterCacheStats().resident_clusters);
+
+  const Segment* const segment = segment_;
+  const Cues* const cues = segment->GetCues();
+  ASSERT_TRUE(cues != NULL);
+  ASSERT_GT(cues->GetCount(), 0);
+
+  const auto probe = [segment, cues]() {
+    const long long kMs = 1000000;
+    std::vector<std::string> results;
+    const Tracks* const tracks = segment->GetTracks();
+    for (unsigned long i = 0; i < tracks->GetTracksCount(); ++i) {
+      const Track* const track = tracks->GetTrackByIndex(i);
+      const BlockEntry* block_entry = NULL;
+      if (track->GetFirst(block_entry) < 0)
+        return std::vector<std::string>();
+      while (block_entry != NULL && !block_entry->EOS()) {
+        const Block* const block = block_entry->GetBlock();
+        results.push_back(std::to_string(block->GetTrackNumber()) + "@" +
+                          std::to_string(block->GetTime(
+                              block_entry->GetCluster())));
+        if (track->GetNext(block_entry, block_entry) < 0)
+          return std::vector<std::string>();
+      }
+      for (long long t = 0; t < 10000 * kMs; t += 170 * kMs) {
+        const CuePoint* cue_point = NULL;
+        const CuePoint::TrackPosition* track_position = NULL;
+        if (cues->Find(t, track, cue_point, track_position)) {
+          const BlockEntry* const cue_entry =
+              cues->GetBlock(cue_point, track_position);
+          results.push_back(
+              "cue " + std::to_string(cue_point->GetTime(segment)) + " " +
+              (cue_entry ? std::to_string(cue_entry->GetBlock()->GetTime(
+                               cue_entry->GetCluster()))
+                         : std::string("-")));
+        }
+        if (track->Seek(t, block_entry) == 0 && !block_entry->EOS()) {
+          results.push_back("seek " +
+                            std::to_string(block_entry->GetBlock()->GetTime(
+                                block_entry->GetCluster())));
+        }
+        results.push_back("cluster " +
+                          std::to_string(segment->FindCluster(t)->GetTime()));
+      }
+    }
+    return results;
+  };
+
+  const std::vector<std::string> expected = probe();
+  ASSERT_FALSE(expected.empty());
+
+  const int kThreads = 8;
+  std::vector<std::vector<std::string>> results(kThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i)
+    threads.push_back(std::thread([&results, &probe, i]() {
+      for (int j = 0; j < 4; ++j)
+        results[i] = probe();
+    }));
+  for (int i = 0; i < kThreads; ++i) {
+    threads[i].join();
+    EXPECT_TRUE(expected == results[i]);
+  }
+}
+
+// IMkvReader whose reads block until the test lets them through.
+class GatedReader : public mkvparser::IMkvReader {
+ public:
+  explicit GatedReader(mkvparser::IMkvReader* reader)
+      : reader_(reader), allowed_(0) {}
+  virtual ~GatedReader() {}
+
+  virtual int Read(long long pos, long len, unsigned char* buf) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return allowed_ > 0; });
+      --allowed_;
+    }
+    return reader_->Read(pos, len, buf);
+  }
+
+  virtual int Length(long long* total, long long* available) {
+    return reader_->Length(total, available);
+  }
+
+  void Allow(int count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    allowed_ += count;
+    cond_.notify_all();
+  }
+
+ private:
+  mkvparser::IMkvReader* const reader_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  int allowed_;
+};
+
+TEST_F(ParserTest, PrefetchingReader) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 5000, 500);
+  }));
+  const std::vector<std::string> expected = WalkBlocks();
+
+  mkvparser::PrefetchingMkvReader prefetcher(&reader_, 4, 1024 * 1024);
+  delete segment_;
+  segment_ = NULL;
+  ASSERT_EQ(0, Segment::CreateInstance(&prefetcher, pos_, segment_));
+  ASSERT_EQ(0, segment_->Load());
+
+  // Playback that keeps three clusters queued ahead.
+  std::vector<std::string> blocks;
+  for (const Cluster* cluster = segment_->GetFirst();
+       cluster != NULL && !cluster->EOS();
+       cluster = segment_->GetNext(cluster)) {
+    prefetcher.PrefetchClusters(segment_, cluster, 3);
+    const BlockEntry* block_entry = NULL;
+    ASSERT_EQ(0, cluster->GetFirst(block_entry));
+    while (block_entry != NULL) {
+      const Block* const block = block_entry->GetBlock();
+      const Block::Frame& frame = block->GetFrame(0);
+      std::string data(static_cast<size_t>(frame.len), '\0');
+      ASSERT_EQ(0, frame.Read(&prefetcher,
+                              reinterpret_cast<unsigned char*>(&data[0])));
+      blocks.push_back(std::to_string(block->GetTrackNumber()) + "@" +
+                       std::to_string(block->GetTime(cluster)) + ":" + data);
+      ASSERT_EQ(0, cluster->GetNext(block_entry, block_entry));
+    }
+  }
+  EXPECT_TRUE(expected == blocks);
+
+  const mkvparser::PrefetchingMkvReader::Stats stats = prefetcher.GetStats();
+  EXPECT_GT(stats.hits, stats.misses);
+  EXPECT_GT(stats.prefetched_bytes, 0);
+
+  // The pool is bounded, and ranges already held are not queued twice.
+  long long total, available;
+  ASSERT_EQ(0, prefetcher.Length(&total, &available));
+  EXPECT_FALSE(prefetcher.Prefetch(0, 2 * 1024 * 1024));
+  EXPECT_TRUE(prefetcher.Prefetch(0, 64));
+  EXPECT_FALSE(prefetcher.Prefetch(16, 32));
+  unsigned char direct[32];
+  unsigned char prefetched[32];
+  ASSERT_EQ(0, reader_.Read(16, 32, direct));
+  ASSERT_EQ(0, prefetcher.Read(16, 32, prefetched));
+  EXPECT_EQ(0, memcmp(direct, prefetched, sizeof(direct)));
+  EXPECT_GT(prefetcher.GetStats().rejected, stats.rejected);
+}
+
+TEST_F(ParserTest, PrefetchingReaderPrefetchWhileReading) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 5000, 500);
+  }));
+  GatedReader gated(&reader_);
+  mkvparser::PrefetchingMkvReader prefetcher(&gated, 2, 1024 * 1024);
+  const auto wait_for = [&prefetcher](
+      const std::function<bool(const mkvparser::PrefetchingMkvReader::Stats&)>&
+          done) {
+    while (!done(prefetcher.GetStats()))
+      std::this_thread::yield();
+  };
+
+  ASSERT_TRUE(prefetcher.Prefetch(0, 64));
+  ASSERT_TRUE(prefetcher.Prefetch(1000, 64));
+
+  // A read waits for the second range while the first is still being read.
+  unsigned char prefetched[32];
+  int status = -1;
+  std::thread reader_thread([&]() {
+    status = prefetcher.Read(1016, sizeof(prefetched), prefetched);
+  });
+  wait_for([](const mkvparser::PrefetchingMkvReader::Stats& stats) {
+    return stats.starved > 0;
+  });
+
+  // Queueing a third range releases the first, which moves the second one.
+  gated.Allow(1);
+  wait_for([](const mkvparser::PrefetchingMkvReader::Stats& stats) {
+    return stats.prefetched_bytes >= 64;
+  });
+  EXPECT_TRUE(prefetcher.Prefetch(2000, 64));
+  gated.Allow(8);
+  reader_thread.join();
+
+  unsigned char direct[32];
+  ASSERT_EQ(0, reader_.Read(1016, sizeof(direct), direct));
+  ASSERT_EQ(0, status);
+  EXPECT_EQ(0, memcmp(direct, prefetched, sizeof(direct)));
+}
+
+TEST_F(ParserTest, KeyFrameIterator) {
+  for (int with_cues = 0; with_cues < 2; ++with_cues) {
+    if (segment_ != NULL) {
+      delete segment_;
+      segment_ = NULL;
+      CloseReader();
+      remove(temp_filename_.c_str());
+    }
+    ASSERT_TRUE(CreateAndLoadMuxedSegment([&](mkvmuxer::Segment* muxer) {
+      muxer->OutputCues(with_cues != 0);
+      return AddAudioVideoFrames(muxer, 10000, 500);
+    }));
+    ASSERT_EQ(with_cues != 0, segment_->GetCues() != NULL);
+
+    const Track* const video =
+        segment_->GetTracks()->GetTrackByNumber(kVideoTrackNumber);
+    ASSERT_TRUE(video != NULL);
+
+    std::vector<long long> keys;
+    const BlockEntry* block_entry = NULL;
+    ASSERT_EQ(0, video->GetFirstKey(block_entry));
+    while (!block_entry->EOS()) {
+      EXPECT_TRUE(block_entry->GetBlock()->IsKey());
+      keys.push_back(
+          block_entry->GetBlock()->GetTime(block_entry->GetCluster()));
+      ASSERT_GE(video->GetNextKey(block_entry, block_entry), 0);
+    }
+
+    if (!with_cues) {
+      // Clusters without a keyframe were only scanned, never parsed.
+      EXPECT_LT(segment_->GetClusterCacheStats().resident_clusters,
+                static_cast<long>(segment_->GetCount()));
+    }
+
+    // Every keyframe is visited, as found by walking all blocks.
+    std::vector<long long> expected;
+    ASSERT_EQ(0, video->GetFirst(block_entry));
+    while (!block_entry->EOS()) {
+      if (block_entry->GetBlock()->IsKey()) {
+        expected.push_back(
+            block_entry->GetBlock()->GetTime(block_entry->GetCluster()));
+      }
+      ASSERT_GE(video->GetNext(block_entry, block_entry), 0);
+    }
+    EXPECT_EQ(10u, expected.size());
+    EXPECT_TRUE(expected == keys);
+  }
+}
+
+TEST_F(ParserTest, ClusterArenaAllocation) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 10000, 500);
+  }));
+
+  Segment::AllocationStats stats;
+  segment_->GetAllocationStats(stats);
+  EXPECT_EQ(0, stats.arena_allocations);
+
+  long long block_count = 0;
+  for (const Cluster* cluster = segment_->GetFirst();
+       cluster != NULL && !cluster->EOS();
+       cluster = segment_->GetNext(cluster)) {
+    const BlockEntry* block_entry = NULL;
+    ASSERT_EQ(0, cluster->GetFirst(block_entry));
+    while (block_entry != NULL && !block_entry->EOS()) {
+      ++block_count;
+      ASSERT_EQ(0, cluster->GetNext(block_entry, block_entry));
+    }
+  }
+  ASSERT_GT(block_count, 0);
+
+  // Each block takes two arena allocations (the entry and its frame array),
+  // and far fewer heap allocations.
+  segment_->GetAllocationStats(stats);
+  EXPECT_EQ(2 * block_count, stats.arena_allocations);
+  EXPECT_GT(stats.arena_allocated_bytes, 0);
+  EXPECT_GE(stats.arena_reserved_bytes, stats.arena_allocated_bytes);
+  EXPECT_LT(stats.heap_allocations, block_count);
+
+  // Releasing the entries frees the arenas, but the counters are kept.
+  segment_->SetClusterEvictionPolicy(0, 1);
+  Segment::AllocationStats released;
+  segment_->GetAllocationStats(released);
+  EXPECT_EQ(stats.arena_allocations, released.arena_allocations);
+  EXPECT_LT(released.arena_reserved_bytes, stats.arena_reserved_bytes);
+}
+
+TEST_F(ParserTest, SeekByBisection) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    muxer->OutputCues(false);
+    return AddAudioVideoFrames(muxer, 10000, 300);
+  }));
+  ASSERT_TRUE(segment_->GetCues() == NULL);
+
+  const long long kMs = 1000000;
+  std::vector<long long> expected;
+  for (long long t = -kMs; t < 11000 * kMs; t += 70 * kMs)
+    expected.push_back(segment_->FindCluster(t)->GetPosition());
+
+  // A fresh segment with only its headers parsed.
+  delete segment_;
+  segment_ = NULL;
+  pos_ = 0;
+  mkvparser::EBMLHeader ebml_header;
+  ASSERT_EQ(0, ebml_header.Parse(&reader_, pos_));
+  ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, segment_));
+  ASSERT_EQ(0, segment_->ParseHeaders());
+
+  size_t i = 0;
+  for (long long t = -kMs; t < 11000 * kMs; t += 70 * kMs, ++i) {
+    const Cluster* cluster = NULL;
+    ASSERT_EQ(0, segment_->SeekByBisection(t, cluster));
+    ASSERT_TRUE(cluster != NULL);
+    EXPECT_EQ(expected[i], cluster->GetPosition()) << t;
+  }
+
+  // No cluster was loaded by scanning.
+  EXPECT_EQ(0u, segment_->GetCount());
+
+  // Once loaded, the clusters themselves are searched.
+  long status;
+  while ((status = segment_->LoadCluster()) == 0) {
+  }
+  ASSERT_EQ(1, status);
+  const Cluster* cluster = NULL;
+  ASSERT_EQ(0, segment_->SeekByBisection(5000 * kMs, cluster));
+  EXPECT_EQ(segment_->FindCluster(5000 * kMs), cluster);
+}
+
+// IMkvReader standing in for a local cache of a remote file: only the
+// ranges fetched so far are readable.
+class FetchedRangesReader : public mkvparser::IMkvReader {
+ public:
+  explicit FetchedRangesReader(const std::vector<unsigned char>& data)
+      : data_(data) {}
+  virtual ~FetchedRangesReader() {}
+
+  virtual int Read(long long pos, long len, unsigned char* buf) {
+    if (len == 0)
+      return 0;
+    if (pos < 0 || len < 0 || !fetched_.Contains(pos, len) ||
+        pos + len > static_cast<long long>(data_.size())) {
+      return -1;
+    }
+    memcpy(buf, &data_[static_cast<size_t>(pos)], len);
+    return 0;
+  }
+
+  virtual int Length(long long* total, long long* available) {
+    if (total)
+      *total = static_cast<long long>(data_.size());
+    if (available)
+      *available = static_cast<long long>(data_.size());
+    return 0;
+  }
+
+  // Fetches |plan| in one round trip.
+  void Fetch(const mkvparser::ReadPlan& plan) {
+    for (long i = 0; i < plan.GetCount(); ++i)
+      fetched_.Add(plan.GetRange(i)->pos, plan.GetRange(i)->len);
+    ++round_trips_;
+  }
+
+  int round_trips() const { return round_trips_; }
+  long long fetched_bytes() const { return fetched_.GetTotalBytes(); }
+
+ private:
+  const std::vector<unsigned char>& data_;
+  mkvparser::ReadPlan fetched_;
+  int round_trips_ = 0;
+};
+
+TEST(ParserReadPlanTest, CoalescesRanges) {
+  mkvparser::ReadPlan plan(4);
+  EXPECT_TRUE(plan.Add(100, 10));
+  EXPECT_TRUE(plan.Add(0, 10));
+  EXPECT_TRUE(plan.Add(200, 10));
+  EXPECT_EQ(3, plan.GetCount());
+
+  EXPECT_TRUE(plan.Add(112, 10));  // within the gap of [100, 110)
+  EXPECT_EQ(3, plan.GetCount());
+  EXPECT_EQ(100, plan.GetRange(1)->pos);
+  EXPECT_EQ(22, plan.GetRange(1)->len);
+
+  EXPECT_TRUE(plan.Add(5, 200));  // spans everything
+  EXPECT_EQ(1, plan.GetCount());
+  EXPECT_EQ(0, plan.GetRange(0)->pos);
+  EXPECT_EQ(210, plan.GetTotalBytes());
+  EXPECT_TRUE(plan.Contains(150, 60));
+  EXPECT_FALSE(plan.Contains(150, 61));
+}
+
+TEST_F(ParserTest, PlanHeadersAndSeek) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 10000, 500);
+  }));
+  ASSERT_TRUE(segment_->GetCues() != NULL);
+
+  long long total, available;
+  ASSERT_EQ(0, reader_.Length(&total, &available));
+  std::vector<unsigned char> data(static_cast<size_t>(total));
+  ASSERT_EQ(0, reader_.Read(0, static_cast<long>(total), &data[0]));
+
+  FetchedRangesReader cache(data);
+  mkvparser::RecordingMkvReader recorder(&cache);
+
+  // The EBML and segment headers.
+  mkvparser::ReadPlan start;
+  start.Add(0, 64);
+  cache.Fetch(start);
+  long long pos = 0;
+  mkvparser::EBMLHeader ebml_header;
+  ASSERT_EQ(0, ebml_header.Parse(&recorder, pos));
+  Segment* segment = NULL;
+  ASSERT_EQ(0, Segment::CreateInstance(&recorder, pos, segment));
+  std::unique_ptr<Segment> segment_ptr(segment);
+
+  long status = 1;
+  for (int round = 0; round < 4 && status == 1; ++round) {
+    mkvparser::ReadPlan plan;
+    status = segment->PlanHeaders(plan);
+    ASSERT_GE(status, 0);
+    cache.Fetch(plan);
+  }
+  ASSERT_EQ(0, status);
+
+  // Parsing the headers reads only what was planned.
+  recorder.Clear();
+  ASSERT_EQ(0, segment->ParseHeaders());
+  EXPECT_EQ(0, recorder.GetFailedReadCount());
+  EXPECT_GT(recorder.GetReadCount(), 0);
+
+  const long long kMs = 1000000;
+  const Track* const video =
+      segment->GetTracks()->GetTrackByNumber(kVideoTrackNumber);
+  ASSERT_TRUE(video != NULL);
+
+  const int header_trips = cache.round_trips();
+  status = 1;
+  for (int round = 0; round < 4 && status == 1; ++round) {
+    mkvparser::ReadPlan plan;
+    status = segment->PlanSeek(5300 * kMs, video, plan);
+    ASSERT_GE(status, 0);
+    cache.Fetch(plan);
+  }
+  ASSERT_EQ(0, status);
+  EXPECT_LE(cache.round_trips() - header_trips, 3);
+
+  recorder.Clear();
+  const CuePoint* cue_point = NULL;
+  const CuePoint::TrackPosition* track_position = NULL;
+  ASSERT_TRUE(
+      segment->GetCues()->Find(5300 * kMs, video, cue_point, track_position));
+  const BlockEntry* const block_entry =
+      segment->GetCues()->GetBlock(cue_point, track_position);
+  ASSERT_TRUE(block_entry != NULL);
+  EXPECT_EQ(5000 * kMs,
+            block_entry->GetBlock()->GetTime(block_entry->GetCluster()));
+  EXPECT_EQ(0, recorder.GetFailedReadCount());
+
+  // Only a fraction of the file was fetched.
+  EXPECT_LT(cache.fetched_bytes(), total / 2);
+}
+
+// IMkvReader over a live stream that is still being written: |available|
+// bytes have arrived and the total length is unknown until the end.
+class GrowingReader : public mkvparser::IMkvReader {
+ public:
+  explicit GrowingReader(const std::vector<unsigned char>& data)
+      : data_(data), available_(0) {}
+  virtual ~GrowingReader() {}
+
+  virtual int Read(long long pos, long len, unsigned char* buf) {
+    if (pos < 0 || len < 0 || pos + len > available_)
+      return -1;
+    if (len > 0)
+      memcpy(buf, &data_[static_cast<size_t>(pos)], len);
+    return 0;
+  }
+
+  virtual int Length(long long* total, long long* available) {
+    const long long size = static_cast<long long>(data_.size());
+    if (total)
+      *total = (available_ < size) ? -1 : size;
+    if (available)
+      *available = available_;
+    return 0;
+  }
+
+  void Grow(long long bytes) {
+    available_ += bytes;
+    if (available_ > static_cast<long long>(data_.size()))
+      available_ = static_cast<long long>(data_.size());
+  }
+  long long available() const { return available_; }
+
+ private:
+  const std::vector<unsigned char>& data_;
+  long long available_;
+};
+
+TEST_F(ParserTest, LiveBlockCursor) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    muxer->set_mode(mkvmuxer::Segment::kLive);
+    return AddAudioVideoFrames(muxer, 5000, 1000);
+  }));
+  std::vector<std::string> expected;
+  for (const std::string& block : WalkBlocks())
+    expected.push_back(block.substr(0, block.find(':')));
+
+  long long total, available;
+  ASSERT_EQ(0, reader_.Length(&total, &available));
+  std::vector<unsigned char> data(static_cast<size_t>(total));
+  ASSERT_EQ(0, reader_.Read(0, static_cast<long>(total), &data[0]));
+
+  // A live encoder cannot go back to write cluster sizes.
+  for (const Cluster* cluster = segment_->GetFirst();
+       cluster != NULL && !cluster->EOS();
+       cluster = segment_->GetNext(cluster)) {
+    const size_t size_pos = static_cast<size_t>(cluster->m_element_start) + 4;
+    ASSERT_EQ(0x01, data[size_pos]);  // 8 byte size
+    memset(&data[size_pos + 1], 0xFF, 7);
+  }
+
+  GrowingReader live(data);
+  live.Grow(64);
+  long long pos = 0;
+  mkvparser::EBMLHeader ebml_header;
+  ASSERT_EQ(0, ebml_header.Parse(&live, pos));
+  Segment* segment = NULL;
+  ASSERT_EQ(0, Segment::CreateInstance(&live, pos, segment));
+  std::unique_ptr<Segment> segment_ptr(segment);
+
+  std::vector<std::string> blocks;
+  const BlockEntry* curr = NULL;
+  long status = mkvparser::E_BUFFER_NOT_FULL;
+  long long previous_available = 0;
+  unsigned long max_clusters = 0;
+  while (status != 1) {
+    live.Grow(50);
+    if (segment->GetTracks() == NULL) {
+      if (segment->ParseHeaders() != 0)
+        continue;
+    }
+    for (;;) {
+      const BlockEntry* next = NULL;
+      status = segment->GetNextLiveBlock(curr, next);
+      if (status != 0)
+        break;
+      const Block* const block = next->GetBlock();
+      // Each block is returned as soon as its last byte arrives.
+      EXPECT_GT(block->m_start + block->m_size, previous_available);
+      blocks.push_back(std::to_string(block->GetTrackNumber()) + "@" +
+                       std::to_string(block->GetTime(next->GetCluster())));
+      curr = next;
+      if (segment->GetCount() > max_clusters)
+        max_clusters = segment->GetCount();
+    }
+    ASSERT_TRUE(status == 1 || status == mkvparser::E_BUFFER_NOT_FULL);
+    previous_available = live.available();
+  }
+
+  EXPECT_TRUE(expected == blocks);
+  // Consumed clusters were discarded.
+  EXPECT_LE(max_clusters, 2u);
+  EXPECT_EQ(1u, segment->GetCount());
+}
+
+TEST_F(ParserTest, ReadFramesBatch) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 3000, 1000);
+  }));
+
+  // A second segment over the same file, to count its reads.
+  mkvparser::RecordingMkvReader recorder(&reader_);
+  long long pos = 0;
+  mkvparser::EBMLHeader ebml_header;
+  ASSERT_EQ(0, ebml_header.Parse(&recorder, pos));
+  Segment* segment = NULL;
+  ASSERT_EQ(0, Segment::CreateInstance(&recorder, pos, segment));
+  std::unique_ptr<Segment> segment_ptr(segment);
+  ASSERT_EQ(0, segment->Load());
+
+  mkvparser::FrameBatch batch;
+  for (long long track = 0; track <= kAudioTrackNumber; ++track) {
+    for (const Cluster* cluster = segment->GetFirst();
+         cluster != NULL && !cluster->EOS();
+         cluster = segment->GetNext(cluster)) {
+      std::vector<std::string> expected;
+      const BlockEntry* block_entry = NULL;
+      ASSERT_EQ(0, cluster->GetFirst(block_entry));
+      while (block_entry != NULL) {
+        const Block* const block = block_entry->GetBlock();
+        if (track == 0 || block->GetTrackNumber() == track) {
+          const Block::Frame& frame = block->GetFrame(0);
+          std::string data(static_cast<size_t>(frame.len), '\0');
+          EXPECT_EQ(0, frame.Read(&reader_,
+                                  reinterpret_cast<unsigned char*>(&data[0])));
+          expected.push_back(std::to_string(block->GetTrackNumber()) + "@" +
+                             std::to_string(block->GetTime(cluster)) +
+                             (block->IsKey() ? "k:" : ":") + data);
+        }
+        ASSERT_EQ(0, cluster->GetNext(block_entry, block_entry));
+      }
+
+      recorder.Clear();
+      ASSERT_EQ(0, cluster->ReadFrames(track, batch));
+      EXPECT_EQ(1, recorder.GetReadCount());
+
+      std::vector<std::string> frames;
+      for (long i = 0; i < batch.GetCount(); ++i) {
+        const mkvparser::FrameBatch::Frame* const frame = batch.GetFrame(i);
+        frames.push_back(
+            std::to_string(frame->track) + "@" + std::to_string(frame->time) +
+            (frame->key ? "k:" : ":") +
+            std::string(reinterpret_cast<const char*>(frame->data),
+                        frame->len));
+      }
+      EXPECT_TRUE(expected == frames);
+      EXPECT_FALSE(frames.empty());
+    }
+  }
+}
+
+TEST_F(ParserTest, HeaderStripping) {
+  const std::uint8_t kHeader[] = {0x82, 0x49, 0x83, 0x42, 0x00};
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([&](mkvmuxer::Segment* muxer) {
+    if (muxer->AddVideoTrack(kWidth, kHeight, kVideoTrackNumber) == 0)
+      return false;
+    mkvmuxer::Track* const track = muxer->GetTrackByNumber(kVideoTrackNumber);
+    if (!track->AddContentEncoding() ||
+        !track->GetContentEncodingByIndex(0)->SetEncryptionID(
+            kHeader, sizeof(kHeader))) {
+      return false;
+    }
+    for (int ms = 0; ms < 400; ms += 40) {
+      std::uint8_t data[kFrameLength] = {0};
+      memcpy(data, &ms, sizeof(ms));
+      if (!muxer->AddFrame(data, kFrameLength, kVideoTrackNumber,
+                           ms * 1000000ULL, ms == 0)) {
+        return false;
+      }
+    }
+    return true;
+  }));
+
+  long long total, available;
+  ASSERT_EQ(0, reader_.Length(&total, &available));
+  std::vector<unsigned char> data(static_cast<size_t>(total));
+  ASSERT_EQ(0, reader_.Read(0, static_cast<long>(total), &data[0]));
+
+  // The muxer only writes ContentEncryption, so rewrite it in place into a
+  // ContentCompression of the same layout: Type 1 -> 0, ContentEncryption ->
+  // ContentCompression, ContentEncAlgo 5 -> ContentCompAlgo 3 and
+  // ContentEncKeyID -> ContentCompSettings.
+  const auto patch = [&](const std::vector<unsigned char>& from,
+                         const std::vector<unsigned char>& to) {
+    const auto begin = data.begin() + segment_->GetTracks()->m_element_start;
+    const auto end = begin + segment_->GetTracks()->m_element_size;
+    const auto it = std::search(begin, end, from.begin(), from.end());
+    ASSERT_TRUE(it != end);
+    std::copy(to.begin(), to.end(), it);
+  };
+  patch({0x50, 0x33, 0x81, 0x01}, {0x50, 0x33, 0x81, 0x00});
+  patch({0x50, 0x35}, {0x50, 0x34});
+  patch({0x47, 0xE1, 0x81, 0x05}, {0x42, 0x54, 0x81, 0x03});
+  patch({0x47, 0xE2}, {0x42, 0x55});
+
+  MemoryReader memory(data, total);
+  long long pos = 0;
+  mkvparser::EBMLHeader ebml_header;
+  ASSERT_EQ(0, ebml_header.Parse(&memory, pos));
+  Segment* segment = NULL;
+  ASSERT_EQ(0, Segment::CreateInstance(&memory, pos, segment));
+  std::unique_ptr<Segment> segment_ptr(segment);
+  ASSERT_EQ(0, segment->Load());
+
+  const Track* const track =
+      segment->GetTracks()->GetTrackByNumber(kVideoTrackNumber);
+  size_t header_len = 0;
+  const unsigned char* const header = track->GetStrippedHeader(header_len);
+  ASSERT_EQ(sizeof(kHeader), header_len);
+  EXPECT_EQ(0, memcmp(kHeader, header, header_len));
+
+  int frame_count = 0;
+  const BlockEntry* block_entry = NULL;
+  ASSERT_EQ(0, track->GetFirst(block_entry));
+  while (!block_entry->EOS()) {
+    const Block::Frame& frame = block_entry->GetBlock()->GetFrame(0);
+    ASSERT_EQ(kFrameLength + static_cast<long long>(sizeof(kHeader)),
+              track->GetFrameSize(frame));
+
+    std::vector<unsigned char> stored(static_cast<size_t>(frame.len));
+    ASSERT_EQ(0, frame.Read(&memory, &stored[0]));
+
+    std::vector<unsigned char> restored(
+        static_cast<size_t>(track->GetFrameSize(frame)));
+    ASSERT_EQ(0, track->ReadFrame(&memory, frame, &restored[0]));
+    EXPECT_EQ(0, memcmp(kHeader, &restored[0], sizeof(kHeader)));
+    EXPECT_TRUE(std::equal(stored.begin(), stored.end(),
+                           restored.begin() + sizeof(kHeader)));
+
+    std::vector<unsigned char> buf(static_cast<size_t>(frame.len));
+    Track::FrameParts parts;
+    ASSERT_EQ(0, track->ReadFrame(&memory, frame, &buf[0], parts));
+    EXPECT_EQ(header, parts.header);
+    EXPECT_EQ(sizeof(kHeader), parts.header_len);
+    ASSERT_EQ(frame.len, parts.payload_len);
+    EXPECT_EQ(0, memcmp(&stored[0], parts.payload, parts.payload_len));
+
+    ++frame_count;
+    ASSERT_GE(track->GetNext(block_entry, block_entry), 0);
+  }
+  EXPECT_EQ(10, frame_count);
+
+  // Tracks without header stripping are read as stored.
+  EXPECT_TRUE(segment_->GetTracks()
+                  ->GetTrackByNumber(kVideoTrackNumber)
+                  ->GetStrippedHeader(header_len) == NULL);
+  EXPECT_EQ(0u, header_len);
+}
+
+TEST_F(ParserTest, PreloadManyClustersOutOfOrder) {
+  ASSERT_TRUE(CreateAndLoadMuxedSegment([](mkvmuxer::Segment* muxer) {
+    return AddAudioVideoFrames(muxer, 30000, 20);
+  }));
+  const long count = segment_->GetCount();
+  ASSERT_GE(count, 600);
+
+  std::vector<long long> positions;
+  for (const Cluster* cluster = segment_->GetFirst(); !cluster->EOS();
+       cluster = segment_->GetNext(cluster)) {
+    positions.push_back(cluster->GetPosition());
+  }
+  ASSERT_EQ(static_cast<size_t>(count), positions.size());
+
+  // A fresh segment with only its headers parsed.
+  delete segment_;
+  segment_ = NULL;
+  pos_ = 0;
+  mkvparser::EBMLHeader ebml_header;
+  ASSERT_EQ(0, ebml_header.Parse(&reader_, pos_));
+  ASSERT_EQ(0, Segment::CreateInstance(&reader_, pos_, segment_));
+  ASSERT_EQ(0, segment_->ParseHeaders());
+
+  // Every other cluster back to front, then the rest front to back.
+  std::vector<const Cluster*> preloaded(positions.size());
+  for (long i = (count - 1) & ~1L; i >= 0; i -= 2)
+    preloaded[i] = segment_->FindOrPreloadCluster(positions[i]);
+  for (long i = 1; i < count; i += 2)
+    preloaded[i] = segment_->FindOrPreloadCluster(positions[i]);
+
+  for (long i = 0; i < count; ++i) {
+    ASSERT_TRUE(preloaded[i] != NULL);
+    EXPECT_EQ(-1, preloaded[i]->GetIndex());
+    EXPECT_EQ(preloaded[i], segment_->FindOrPreloadCluster(positions[i]));
+    if (i + 1 < count) {
+      EXPECT_EQ(preloaded[i + 1], segment_->GetNext(preloaded[i]));
+    }
+  }
+  EXPECT_EQ(0u, segment_->GetCount());
+
+  // Loading picks up the preloaded clusters in order.
+  long status;
+  while ((status = segment_->LoadCluster()) == 0) {
+  }
+  ASSERT_EQ(1, status);
+  ASSERT_EQ(static_cast<unsigned long>(count), segment_->GetCount());
+
+  const Cluster* cluster = segment_->GetFirst();
+  for (long i = 0; i < count; ++i, cluster = segment_->GetNext(cluster)) {
+    EXPECT_EQ(preloaded[i], cluster);
+    EXPECT_EQ(i, cluster->GetIndex());
+  }
+  EXPECT_TRUE(cluster->EOS());
+}
+
+TEST_F(ParserTest, MemoryUsage) {
+  ASSERT_TRUE(CreateAndLoadSegment("bbb_480p_vp9_opus_1second.webm", 4));
+  ASSERT_TRUE(segment_->GetCues() != NULL);
+
+  Segment::MemoryUsage loaded;
+  segment_->GetMemoryUsage(loaded);
+  EXPECT_GT(loaded.segment, 0);
+  EXPECT_GE(loaded.clusters,
+            static_cast<long long>(segment_->GetCount() * sizeof(Cluster)));
+  EXPECT_GT(loaded.other, 0);
+
+  // The Opus track holds its codec private data.
+  size_t private_size = 0;
+  const Track* const audio = segment_->GetTracks()->GetTrackByNumber(2);
+  ASSERT_TRUE(audio != NULL);
+  ASSERT_TRUE(audio->GetCodecPrivate(private_size) != NULL);
+  EXPECT_GT(loaded.tracks, static_cast<long long>(private_size));
+  EXPECT_EQ(0, loaded.chapters);
+  EXPECT_EQ(0, loaded.tags);
+
+  // Parsing the blocks and loading the cues adds to their components.
+  ASSERT_FALSE(WalkBlocks().empty());
+  while (!segment_->GetCues()->DoneParsing())
+    segment_->GetCues()->LoadCuePoint();
+
+  Segment::MemoryUsage parsed;
+  segment_->GetMemoryUsage(parsed);
+  EXPECT_GT(parsed.block_entries, loaded.block_entries);
+  EXPECT_GT(parsed.clusters, loaded.clusters);
+  EXPECT_GT(parsed.cues, loaded.cues);
+  EXPECT_EQ(loaded.tracks, parsed.tracks);
+  EXPECT_EQ(parsed.segment + parsed.clusters + parsed.block_entries +
+                parsed.tracks + parsed.cues + parsed.chapters + parsed.tags +
+                parsed.other,
+            parsed.total);
+
+  // Evicted clusters give their entries back.
+  segment_->SetClusterEvictionPolicy(0, 1);
+  Segment::MemoryUsage evicted;
+  segment_->GetMemoryUsage(evicted);
+  EXPECT_LT(evicted.block_entries, parsed.block_entries);
+  EXPECT_LT(evicted.total, parsed.total);
+}
+
 }  // namespace test
 
 int main(int argc, char* argv[]) {
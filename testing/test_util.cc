@@ -204,6 +204,33 @@ bool ParseMkvFileReleaseParser(const std::string& webm_file,
   return true;
 }
 
+bool ParseMkvFileBlocks(const std::string& webm_file, MkvParser* parser_out,
+                        std::vector<BlockEntries>* clusters) {
+  if (!ParseMkvFileReleaseParser(webm_file, parser_out))
+    return false;
+
+  mkvparser::Segment* const segment = parser_out->segment;
+  clusters->clear();
+
+  for (const mkvparser::Cluster* cluster = segment->GetFirst();
+       cluster != NULL && !cluster->EOS();
+       cluster = segment->GetNext(cluster)) {
+    clusters->push_back(BlockEntries());
+
+    const mkvparser::BlockEntry* block = nullptr;
+    if (cluster->GetFirst(block) < 0)
+      return false;
+
+    while (block != NULL && !block->EOS()) {
+      clusters->back().push_back(block);
+      if (cluster->GetNext(block, block) < 0)
+        return false;
+    }
+  }
+
+  return true;
+}
+
 bool ParseMkvFile(const std::string& webm_file) {
   MkvParser parser;
   const bool result = ParseMkvFileReleaseParser(webm_file, &parser);
@@ -12,8 +12,10 @@
 
 #include <cstddef>
 #include <string>
+#include <vector>
 
 namespace mkvparser {
+class BlockEntry;
 class IMkvReader;
 class MkvReader;
 class Segment;
@@ -83,6 +85,12 @@ bool ParseMkvFile(const std::string& webm_file);
 bool ParseMkvFileReleaseParser(const std::string& webm_file,
                                MkvParser* parser_out);
 
+// As ParseMkvFileReleaseParser(), and also returns the block entries of each
+// cluster of |webm_file| in file order. The entries belong to |parser_out|.
+typedef std::vector<const mkvparser::BlockEntry*> BlockEntries;
+bool ParseMkvFileBlocks(const std::string& webm_file, MkvParser* parser_out,
+                        std::vector<BlockEntries>* clusters);
+
 }  // namespace test
 
 #endif  // LIBWEBM_TESTING_TEST_UTIL_H_
\ No newline at end of file
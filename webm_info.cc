@@ -64,6 +64,8 @@ struct Options {
   bool output_cues;
   bool output_frame_stats;
   bool output_vp9_level;
+  bool output_memory_stats;
+  bool use_cached_reader;
 };
 
 Options::Options()
@@ -84,7 +86,9 @@ Options::Options()
       output_encrypted_info(false),
       output_cues(false),
       output_frame_stats(false),
-      output_vp9_level(false) {}
+      output_vp9_level(false),
+      output_memory_stats(false),
+      use_cached_reader(false) {}
 
 void Options::SetAll(bool value) {
   output_video = value;
@@ -104,6 +108,7 @@ void Options::SetAll(bool value) {
   output_cues = value;
   output_frame_stats = value;
   output_vp9_level = value;
+  output_memory_stats = value;
 }
 
 bool Options::MatchesBooleanOption(const string& option, const string& value) {
@@ -161,6 +166,9 @@ void Usage() {
   printf("  -cues                 Output Cues entries (false)\n");
   printf("  -frame_stats          Output frame stats (VP9)(false)\n");
   printf("  -vp9_level            Output VP9 level(false)\n");
+  printf("  -memory_stats         Output parser memory usage (false)\n");
+  printf("  -cached_reader        Read input through a page cache (false)\n");
+  printf("  -write_index <file>   Write a sidecar index of the input\n");
   printf("\nOutput options may be negated by prefixing 'no'.\n");
 }
 
@@ -839,7 +847,7 @@ int PrintSubSampleEncryption(const uint8_t* data, int size, FILE* o) {
 
 bool OutputCluster(const mkvparser::Cluster& cluster,
                    const mkvparser::Tracks& tracks, const Options& options,
-                   FILE* o, mkvparser::MkvReader* reader, Indent* indent,
+                   FILE* o, mkvparser::IMkvReader* reader, Indent* indent,
                    int64_t* clusters_size, FrameStats* stats,
                    vp9_parser::Vp9HeaderParser* parser,
                    vp9_parser::Vp9LevelStats* level_stats) {
@@ -1142,6 +1150,7 @@ bool OutputCues(const mkvparser::Segment& segment,
 
 int main(int argc, char* argv[]) {
   string input;
+  string index_output;
   Options options;
 
   const int argc_check = argc - 1;
@@ -1191,6 +1200,12 @@ int main(int argc, char* argv[]) {
       options.output_frame_stats = !strcmp("-frame_stats", argv[i]);
     } else if (Options::MatchesBooleanOption("vp9_level", argv[i])) {
       options.output_vp9_level = !strcmp("-vp9_level", argv[i]);
+    } else if (Options::MatchesBooleanOption("memory_stats", argv[i])) {
+      options.output_memory_stats = !strcmp("-memory_stats", argv[i]);
+    } else if (Options::MatchesBooleanOption("cached_reader", argv[i])) {
+      options.use_cached_reader = !strcmp("-cached_reader", argv[i]);
+    } else if (!strcmp("-write_index", argv[i]) && i < argc_check) {
+      index_output = argv[++i];
     }
   }
 
@@ -1206,10 +1221,22 @@ int main(int argc, char* argv[]) {
     return EXIT_FAILURE;
   }
 
+  std::unique_ptr<mkvparser::CachedMkvReader> cached_reader;
+  mkvparser::IMkvReader* input_reader = reader.get();
+  if (options.use_cached_reader) {
+    cached_reader.reset(new (std::nothrow)  // NOLINT
+                        mkvparser::CachedMkvReader(reader.get()));
+    if (!cached_reader) {
+      fprintf(stderr, "Error creating cached reader.\n");
+      return EXIT_FAILURE;
+    }
+    input_reader = cached_reader.get();
+  }
+
   long long int pos = 0;
   std::unique_ptr<mkvparser::EBMLHeader> ebml_header(
       new (std::nothrow) mkvparser::EBMLHeader());  // NOLINT
-  if (ebml_header->Parse(reader.get(), pos) < 0) {
+  if (ebml_header->Parse(input_reader, pos) < 0) {
     fprintf(stderr, "Error parsing EBML header.\n");
     return EXIT_FAILURE;
   }
@@ -1221,7 +1248,7 @@ int main(int argc, char* argv[]) {
     OutputEBMLHeader(*ebml_header.get(), out, &indent);
 
   mkvparser::Segment* temp_segment;
-  if (mkvparser::Segment::CreateInstance(reader.get(), pos, temp_segment)) {
+  if (mkvparser::Segment::CreateInstance(input_reader, pos, temp_segment)) {
     fprintf(stderr, "Segment::CreateInstance() failed.\n");
     return EXIT_FAILURE;
   }
@@ -1232,6 +1259,29 @@ int main(int argc, char* argv[]) {
     return EXIT_FAILURE;
   }
 
+  if (!index_output.empty()) {
+    unsigned char* index_buf = NULL;
+    long long index_size = 0;
+    if (segment->BuildIndex(index_buf, index_size) < 0) {
+      fprintf(stderr, "Segment::BuildIndex() failed.\n");
+      return EXIT_FAILURE;
+    }
+    std::unique_ptr<unsigned char[]> index(index_buf);
+
+    FILE* const index_file = fopen(index_output.c_str(), "wb");
+    if (index_file == NULL) {
+      fprintf(stderr, "Error opening index file:%s\n", index_output.c_str());
+      return EXIT_FAILURE;
+    }
+    const size_t written =
+        fwrite(index.get(), 1, static_cast<size_t>(index_size), index_file);
+    fclose(index_file);
+    if (written != static_cast<size_t>(index_size)) {
+      fprintf(stderr, "Error writing index file:%s\n", index_output.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
   if (options.output_segment) {
     OutputSegment(*(segment.get()), options, out);
     indent.Adjust(libwebm::kIncreaseIndent);
@@ -1279,7 +1329,7 @@ int main(int argc, char* argv[]) {
   vp9_parser::Vp9LevelStats level_stats;
   const mkvparser::Cluster* cluster = segment->GetFirst();
   while (cluster != NULL && !cluster->EOS()) {
-    if (!OutputCluster(*cluster, *tracks, options, out, reader.get(), &indent,
+    if (!OutputCluster(*cluster, *tracks, options, out, input_reader, &indent,
                        &clusters_size, &stats, &parser, &level_stats))
       return EXIT_FAILURE;
     cluster = segment->GetNext(cluster);
@@ -1332,5 +1382,20 @@ int main(int argc, char* argv[]) {
         level_stats.GetMaxColumnTiles(), level_stats.GetMinimumAltrefDistance(),
         level_stats.GetMaxReferenceFrames());
   }
+
+  if (options.output_memory_stats) {
+    mkvparser::Segment::MemoryUsage usage;
+    segment->GetMemoryUsage(usage);
+    fprintf(out, "Parser memory (bytes):%lld\n", usage.total);
+    fprintf(out, "  segment:%lld clusters:%lld block entries:%lld\n",
+            usage.segment, usage.clusters, usage.block_entries);
+    fprintf(out, "  tracks:%lld cues:%lld chapters:%lld tags:%lld other:%lld\n",
+            usage.tracks, usage.cues, usage.chapters, usage.tags, usage.other);
+  }
+
+  if (cached_reader) {
+    fprintf(out, "Reader cache hits:%lld misses:%lld\n",
+            cached_reader->GetHitCount(), cached_reader->GetMissCount());
+  }
   return EXIT_SUCCESS;
 }